@@ -0,0 +1,122 @@
+// Heap allocations per request phase of the server, checked against a budget.
+//
+// Built with the library compiled with NICEHTTP_ALLOC_STATS (the alloc_budget CMake target).
+// Starts a server on localhost, sends keep-alive GETs with small headers and prints the
+// allocations and bytes of every phase per request. Exits with 1 when a request allocates
+// more than the budget, so allocation regressions fail ctest, where it is the alloc_budget test.
+//
+// cmake --build build --target alloc_budget && ./build/alloc_budget [-b allocations] [-n requests]
+// ctest --test-dir build -R alloc_budget
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "nicehttp.h"
+
+#ifndef NICEHTTP_ALLOC_STATS
+#error "alloc_budget needs the library built with NICEHTTP_ALLOC_STATS"
+#endif
+
+using namespace std;
+
+#define ALLOC_BUDGET 10 // allocations per request, lower it when the request path allocates less
+#define PORT 18093
+
+http::Response handle_small(const http::Request&) {
+    return http::Response(200, "OK", PROTO_HTTP1, {}, true, 16, "{\"status\": \"OK\"}");
+}
+
+static int connect_server() {
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// one request on the kept alive connection fd, reconnecting when it is closed
+static bool get(int& fd, const string& request) {
+    if ((fd == -1) && ((fd = connect_server()) == -1)) {
+        return false;
+    }
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+    char buff[PKT_BLOCK_SIZE];
+    string response;
+    size_t end = string::npos;
+    for (ssize_t n; (n = recv(fd, buff, sizeof(buff), 0)) > 0;) {
+        response.append(buff, n);
+        if ((end == string::npos) && ((end = response.find("\r\n\r\n")) != string::npos)) {
+            end += 4 + strtoul(net::header_value(response, "content-length").c_str(), nullptr, 10);
+        }
+        if ((end != string::npos) && (response.size() >= end)) {
+            break;
+        }
+    }
+    if ((end == string::npos) || (response.size() < end) || (net::header_value(response, "connection") == "close")) {
+        close(fd);
+        fd = -1;
+    }
+    return response.starts_with("HTTP/1.1 200");
+}
+
+int main(int argc, char** argv) {
+    uint64_t budget = ALLOC_BUDGET;
+    int requests = 10000;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (string(argv[i]) == "-b") budget = strtoull(argv[i + 1], nullptr, 10);
+        else if (string(argv[i]) == "-n") requests = max(1, atoi(argv[i + 1]));
+    }
+    NiceHTTP server;
+    server.getRouter().add(Route("GET", "/small/[0-9]+", handle_small));
+    thread([&server] { server.start("127.0.0.1", PORT); }).detach();
+
+    const string request = "GET /small/1 HTTP/1.1\r\nHost: localhost\r\nUser-Agent: alloc_budget\r\n"
+                           "Accept: */*\r\nConnection: keep-alive\r\n\r\n";
+    // warm up: thread creation, first use of the per-thread metrics and logger blocks
+    int fd = -1;
+    int ready = 0;
+    for (int i = 0; (i < 2000) && (ready < 100); i++) {
+        if (get(fd, request)) ready++;
+        else this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    if (ready < 100) {
+        fprintf(stderr, "The server on port %d is not answering\n", PORT);
+        _Exit(2);
+    }
+    this_thread::sleep_for(chrono::milliseconds(100)); // the last warm up requests are finishing
+
+    const size_t phases = static_cast<size_t>(trace::Phase::Count);
+    alloc_stats::Usage before[phases], after[phases];
+    for (size_t p = 0; p < phases; p++) before[p] = alloc_stats::total(p);
+    for (int i = 0; i < requests; i++) {
+        if (!get(fd, request)) {
+            fprintf(stderr, "Request %d failed\n", i);
+            _Exit(2);
+        }
+    }
+    this_thread::sleep_for(chrono::milliseconds(100));
+    for (size_t p = 0; p < phases; p++) after[p] = alloc_stats::total(p);
+
+    printf("%-12s %14s %14s\n", "phase", "allocs/req", "bytes/req");
+    double count = 0, bytes = 0;
+    for (size_t p = 0; p < phases; p++) {
+        double c = static_cast<double>(after[p].count - before[p].count) / requests;
+        double b = static_cast<double>(after[p].bytes - before[p].bytes) / requests;
+        if ((c == 0) && (b == 0)) continue;
+        printf("%-12s %14.2f %14.1f\n", trace::phaseName(static_cast<trace::Phase>(p)), c, b);
+        count += c;
+        bytes += b;
+    }
+    printf("%-12s %14.2f %14.1f\n", "total", count, bytes);
+    bool over = count > budget;
+    printf("budget %llu allocations per request: %s\n", static_cast<unsigned long long>(budget), over ? "EXCEEDED" : "ok");
+    fflush(stdout);
+    _Exit(over ? 1 : 0); // the server thread is still running
+}
@@ -0,0 +1,221 @@
+// HTTP load generator built on the NiceHTTP client.
+//
+// Closed loop (default): every connection sends its next request as soon as the previous
+// response arrives. Open loop (-R): requests are scheduled at a constant arrival rate and their
+// latency is measured from the time they should have been sent, so a stalled server is not
+// hidden by the generator waiting for it (coordinated omission). In closed loop the same
+// correction is applied afterwards, adding the samples the stalled connection did not send
+// at the mean service interval (HdrHistogram style).
+//
+// cmake --build build --target loadgen
+// ./build/loadgen -c 8 -d 10 -r "GET /test/1" -H "Authorization: apptoken123" 127.0.0.1:8090
+// ./build/loadgen -c 8 -R 20000 -d 10 -f requests.txt 127.0.0.1:8090
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nicehttp.h"
+
+using namespace std;
+using load_clock = chrono::steady_clock;
+
+struct Options {
+    string host;
+    short port = 0;
+    unsigned int connections = 1;
+    double rate = 0;    // requests/s over all the connections, 0 for closed loop
+    double duration = 10;
+    double warmup = 1;  // seconds not accounted
+    int timeout = 5000; // ms
+    bool keep_alive = true;
+    vector<http::Request> templates;
+};
+
+struct Worker {
+    vector<uint64_t> corrected;   // ns, from the intended send time (open loop)
+    vector<uint64_t> uncorrected; // ns, from the actual send time
+    map<int, uint64_t> statuses;
+    uint64_t errors = 0;
+};
+
+static void usage() {
+    fprintf(stderr,
+        "usage: loadgen [options] host:port\n"
+        "  -c N         connections, each one on its own thread (1)\n"
+        "  -R N         open loop at N requests/s, closed loop if omitted\n"
+        "  -d S         duration in seconds (10)\n"
+        "  -w S         warmup in seconds, not accounted (1)\n"
+        "  -t MS        request timeout (5000)\n"
+        "  -r \"M URI\"   request template, can be repeated (GET /)\n"
+        "  -f FILE      request templates, one \"METHOD URI [BODY]\" per line\n"
+        "  -H \"K: V\"    header added to every template, can be repeated\n"
+        "  -k           close the connection after every request\n");
+    exit(2);
+}
+
+static http::Request parse_template(const string& line) {
+    // METHOD URI [BODY]
+    size_t sp = line.find(' ');
+    if (sp == string::npos) usage();
+    size_t sp2 = line.find(' ', sp + 1);
+    string method = line.substr(0, sp);
+    string uri = line.substr(sp + 1, sp2 == string::npos ? string::npos : sp2 - sp - 1);
+    string body = sp2 == string::npos ? "" : line.substr(sp2 + 1);
+    return http::Request(method, uri, PROTO_HTTP1, {}, false, body.size(), body);
+}
+
+static Options parse_args(int argc, char** argv) {
+    Options o;
+    vector<string> headers;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        auto value = [&]() -> string {
+            if (i + 1 >= argc) usage();
+            return argv[++i];
+        };
+        if (arg == "-c") o.connections = max(1, atoi(value().c_str()));
+        else if (arg == "-R") o.rate = atof(value().c_str());
+        else if (arg == "-d") o.duration = atof(value().c_str());
+        else if (arg == "-w") o.warmup = atof(value().c_str());
+        else if (arg == "-t") o.timeout = atoi(value().c_str());
+        else if (arg == "-r") o.templates.push_back(parse_template(value()));
+        else if (arg == "-H") headers.push_back(value());
+        else if (arg == "-k") o.keep_alive = false;
+        else if (arg == "-f") {
+            ifstream file(value());
+            if (!file) usage();
+            for (string line; getline(file, line);) {
+                if (!line.empty() && line[0] != '#') o.templates.push_back(parse_template(line));
+            }
+        } else if (arg[0] != '-' && o.host.empty()) {
+            size_t colon = arg.rfind(':');
+            if (colon == string::npos) usage();
+            o.host = arg.substr(0, colon);
+            o.port = static_cast<short>(atoi(arg.c_str() + colon + 1));
+        } else usage();
+    }
+    if (o.host.empty()) usage();
+    if (o.templates.empty()) o.templates.push_back(parse_template("GET /"));
+    for (http::Request& t : o.templates) {
+        t.headers.emplace("Host", o.host + ":" + to_string(o.port));
+        for (const string& h : headers) {
+            size_t colon = h.find(':');
+            if (colon == string::npos) usage();
+            size_t start = h.find_first_not_of(' ', colon + 1);
+            t.headers.emplace(h.substr(0, colon), start == string::npos ? "" : h.substr(start));
+        }
+    }
+    return o;
+}
+
+static void run_connection(NiceHTTP& client, const Options& o, unsigned int id, load_clock::time_point begin, Worker& w) {
+    RequestOptions opts;
+    opts.connect_timeout = o.timeout;
+    opts.total_timeout = o.timeout;
+    opts.keep_alive = o.keep_alive;
+    auto accounted = begin + chrono::duration_cast<load_clock::duration>(chrono::duration<double>(o.warmup));
+    auto end = accounted + chrono::duration_cast<load_clock::duration>(chrono::duration<double>(o.duration));
+    // open loop: this connection sends one request every interval, shifted from the others
+    auto interval = o.rate > 0 ? chrono::duration_cast<load_clock::duration>(chrono::duration<double>(o.connections / o.rate))
+                               : load_clock::duration::zero();
+    auto intended = begin + interval * id / o.connections;
+    for (size_t i = id; ; i++) {
+        if (o.rate > 0) {
+            this_thread::sleep_until(intended); // returns at once when late
+        } else {
+            intended = load_clock::now();
+        }
+        if (intended >= end) break;
+        auto sent = load_clock::now();
+        int status = 0;
+        try {
+            status = client.request(o.templates[i % o.templates.size()], o.host, o.port, opts).code;
+        } catch (const runtime_error&) {
+        }
+        auto done = load_clock::now();
+        if (intended >= accounted) {
+            if (status > 0) {
+                w.statuses[status]++;
+            } else {
+                w.errors++;
+            }
+            w.corrected.push_back(chrono::duration_cast<chrono::nanoseconds>(done - intended).count());
+            w.uncorrected.push_back(chrono::duration_cast<chrono::nanoseconds>(done - sent).count());
+        }
+        intended += interval;
+    }
+}
+
+static void correct_closed_loop(vector<uint64_t>& samples) {
+    // add the requests a connection would have sent while it waited for a slow response
+    if (samples.empty()) return;
+    uint64_t sum = 0;
+    for (uint64_t s : samples) sum += s;
+    uint64_t expected = max<uint64_t>(1, sum / samples.size());
+    size_t n = samples.size();
+    for (size_t i = 0; i < n; i++) {
+        for (uint64_t missed = samples[i]; missed >= 2 * expected;) {
+            missed -= expected;
+            samples.push_back(missed);
+        }
+    }
+}
+
+static double percentile(const vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = static_cast<size_t>(p * sorted.size());
+    return sorted[min(i, sorted.size() - 1)] / 1e3;
+}
+
+int main(int argc, char** argv) {
+    Options o = parse_args(argc, argv);
+    NiceHTTP client;
+    vector<Worker> workers(o.connections);
+    size_t expected = static_cast<size_t>((o.rate > 0 ? o.rate : 50000.0 / o.connections) * o.duration) + 16;
+    for (Worker& w : workers) {
+        w.corrected.reserve(o.rate > 0 ? expected / o.connections : expected);
+        w.uncorrected.reserve(o.rate > 0 ? expected / o.connections : expected);
+    }
+    auto begin = load_clock::now();
+    {
+        vector<jthread> threads;
+        for (unsigned int c = 0; c < o.connections; c++) {
+            threads.emplace_back([&, c] { run_connection(client, o, c, begin, workers[c]); });
+        }
+    }
+
+    Worker total;
+    for (Worker& w : workers) {
+        total.corrected.insert(total.corrected.end(), w.corrected.begin(), w.corrected.end());
+        total.uncorrected.insert(total.uncorrected.end(), w.uncorrected.begin(), w.uncorrected.end());
+        for (auto [status, count] : w.statuses) total.statuses[status] += count;
+        total.errors += w.errors;
+    }
+    size_t requests = total.uncorrected.size();
+    if (o.rate <= 0) correct_closed_loop(total.corrected);
+    sort(total.corrected.begin(), total.corrected.end());
+    sort(total.uncorrected.begin(), total.uncorrected.end());
+
+    printf("%s loop, %u connections, %.1fs (+%.1fs warmup)%s\n", o.rate > 0 ? "open" : "closed", o.connections,
+           o.duration, o.warmup, o.keep_alive ? "" : ", no keep-alive");
+    if (o.rate > 0) printf("target rate  %.1f req/s\n", o.rate);
+    printf("throughput   %.1f req/s\n", requests / o.duration);
+    printf("requests     %zu\n", requests);
+    printf("errors       %llu\n", static_cast<unsigned long long>(total.errors));
+    for (auto [status, count] : total.statuses) printf("status %d   %llu\n", status, static_cast<unsigned long long>(count));
+    printf("%-12s %14s %14s\n", "latency (us)", "corrected", "uncorrected");
+    for (auto [name, p] : {pair{"p50", 0.5}, pair{"p90", 0.9}, pair{"p99", 0.99}, pair{"p99.9", 0.999}}) {
+        printf("%-12s %14.1f %14.1f\n", name, percentile(total.corrected, p), percentile(total.uncorrected, p));
+    }
+    printf("%-12s %14.1f %14.1f\n", "max", total.corrected.empty() ? 0 : total.corrected.back() / 1e3,
+           total.uncorrected.empty() ? 0 : total.uncorrected.back() / 1e3);
+    return total.errors > 0 ? 1 : 0;
+}
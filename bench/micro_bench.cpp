@@ -0,0 +1,351 @@
+// Microbenchmarks of the request path: parser, router, serializer and thread pool.
+// Every benchmark reports the time and the heap allocations per operation.
+//
+// cmake -S . -B build && cmake --build build && ./build/micro_bench [filter] [-c capture]
+// With -c the requests recorded by NiceHTTP::enableCapture are parsed too.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "nicehttp.h"
+
+using namespace std;
+using bench_clock = chrono::steady_clock;
+
+#define MIN_TIME 0.2 // seconds each benchmark runs at least
+
+// every allocation of the process goes through here
+static atomic<uint64_t> allocations{0};
+
+static void* counted_alloc(size_t size, size_t align) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    size = size ? size : 1;
+    // std::pmr::new_delete_resource allocates through the aligned versions
+    void* p = (align > alignof(max_align_t)) ? aligned_alloc(align, (size + align - 1) & ~(align - 1)) : malloc(size);
+    if (!p) throw bad_alloc();
+    return p;
+}
+// all the deletes release through one function: GCC flags free() written in a replaced
+// operator delete as mismatched with operator new (-Wmismatched-new-delete)
+static void counted_free(void* p) noexcept { free(p); }
+
+void* operator new(size_t size) { return counted_alloc(size, 0); }
+void* operator new[](size_t size) { return counted_alloc(size, 0); }
+void* operator new(size_t size, align_val_t align) { return counted_alloc(size, static_cast<size_t>(align)); }
+void* operator new[](size_t size, align_val_t align) { return counted_alloc(size, static_cast<size_t>(align)); }
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    try { return counted_alloc(size, 0); } catch (...) { return nullptr; }
+}
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+    try { return counted_alloc(size, 0); } catch (...) { return nullptr; }
+}
+void operator delete(void* p) noexcept { counted_free(p); }
+void operator delete[](void* p) noexcept { counted_free(p); }
+void operator delete(void* p, size_t) noexcept { counted_free(p); }
+void operator delete[](void* p, size_t) noexcept { counted_free(p); }
+void operator delete(void* p, align_val_t) noexcept { counted_free(p); }
+void operator delete[](void* p, align_val_t) noexcept { counted_free(p); }
+void operator delete(void* p, size_t, align_val_t) noexcept { counted_free(p); }
+void operator delete[](void* p, size_t, align_val_t) noexcept { counted_free(p); }
+
+// keep the compiler from optimizing the result away
+template <typename T>
+void keep(T&& value) {
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+static const char* filter = nullptr;
+
+// run f(iterations) with more iterations until it takes MIN_TIME
+template <typename F>
+void run(const char* name, F f) {
+    if (filter && !strstr(name, filter)) return;
+    size_t n = 1;
+    while (true) {
+        uint64_t before = allocations.load(memory_order_relaxed);
+        auto start = bench_clock::now();
+        f(n);
+        double elapsed = chrono::duration<double>(bench_clock::now() - start).count();
+        if (elapsed >= MIN_TIME) {
+            uint64_t allocs = allocations.load(memory_order_relaxed) - before;
+            printf("%-36s %12zu %14.1f %12.2f\n", name, n, elapsed * 1e9 / n, static_cast<double>(allocs) / n);
+            return;
+        }
+        n = elapsed > 0.01 ? static_cast<size_t>(n * MIN_TIME * 1.2 / elapsed) + 1 : n * 10;
+    }
+}
+
+static const string request_head =
+    "GET /api/v1/users/42?fields=name,email HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36\r\n"
+    "Accept: application/json\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Authorization: apptoken123\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 27\r\n\r\n";
+static const string request_body = "{\"name\":\"nice\",\"id\":12345}\n";
+
+http::Response handler(const http::Request&) {
+    return http::Response(200, "OK", PROTO_HTTP1, {}, true, 16, "{\"status\": \"OK\"}");
+}
+
+// Router with n routes, requests spread over all of them
+struct RouterBench {
+    vector<string> uris; // the routes keep views of them
+    Router router;
+    vector<http::Request> requests;
+    explicit RouterBench(size_t routes) {
+        for (size_t i = 0; i < routes; i++) {
+            this->uris.push_back("/api/v1/resource" + to_string(i) + "/[0-9]+");
+            this->requests.emplace_back("GET", "/api/v1/resource" + to_string(i) + "/7", PROTO_HTTP1, map<string, string>{}, false, 0);
+        }
+        for (const string& uri : this->uris) {
+            this->router.add(Route("GET", uri, handler));
+        }
+    }
+    void operator()(size_t iterations) {
+        for (size_t i = 0; i < iterations; i++) {
+            keep(this->router.handle(this->requests[i % this->requests.size()]));
+        }
+    }
+};
+
+// tasks submitted from outside the pool
+template <typename Pool>
+void pool_enqueue(size_t tasks) {
+    atomic<size_t> done{0};
+    Pool pool(2);
+    for (size_t i = 0; i < tasks; i++) {
+        pool.enqueue_detach([&done] { done.fetch_add(1, memory_order_relaxed); });
+    }
+    while (done.load() < tasks) this_thread::yield();
+}
+
+// tasks submitted by the workers, the other worker steals them
+template <typename Pool>
+void pool_nested(size_t tasks) {
+    atomic<size_t> done{0};
+    const size_t fanout = 100;
+    Pool pool(2);
+    for (size_t i = 0; i < (tasks + fanout - 1) / fanout; i++) {
+        pool.enqueue_detach([&pool, &done] {
+            for (size_t j = 0; j < fanout; j++) {
+                pool.enqueue_detach([&done] { done.fetch_add(1, memory_order_relaxed); });
+            }
+        });
+    }
+    while (done.load() < (tasks + fanout - 1) / fanout * fanout) this_thread::yield();
+}
+
+int main(int argc, char** argv) {
+    string capture;
+    for (int i = 1; i < argc; i++) {
+        if ((string(argv[i]) == "-c") && (i + 1 < argc)) {
+            capture = argv[++i];
+        } else {
+            filter = argv[i];
+        }
+    }
+    printf("%-36s %12s %14s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op");
+
+    run("request parse", [](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            string head = request_head, body = request_body;
+            http::Request r(head, body);
+            keep(r);
+        }
+    });
+    run("request parse (arena)", [](size_t n) {
+        // as the server does: the connection arena is released before every request
+        alignas(max_align_t) static byte buffer[NICEHTTP_ARENA_SIZE];
+        pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+        for (size_t i = 0; i < n; i++) {
+            arena.release();
+            http::Request r(&arena);
+            r.parseHead(request_head);
+            r.setBody(request_body);
+            keep(r);
+        }
+    });
+    run("request parseHead", [](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            http::Request r;
+            r.parseHead(request_head);
+            keep(r);
+        }
+    });
+    string headers = request_head.substr(request_head.find("\r\n") + 2);
+    if (!capture.empty()) {
+        // the recorded mix of routes, headers and bodies
+        vector<pair<string, string>> recorded;
+        for (Capture::Record& r : Capture::load(capture)) {
+            size_t end = r.data.find("\r\n\r\n");
+            end = (end == string::npos) ? r.data.size() : end + 4;
+            recorded.emplace_back(r.data.substr(0, end), r.data.substr(end));
+        }
+        run("captured request parse", [&recorded](size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                auto [head, body] = recorded[i % recorded.size()];
+                http::Request r(head, body);
+                keep(r);
+            }
+        });
+    }
+    run("message parseHeaders", [&headers](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            http::Message m;
+            m.parseHeaders(headers);
+            keep(m);
+        }
+    });
+    for (size_t routes : {10, 100, 1000}) {
+        RouterBench bench(routes);
+        run(("router handle " + to_string(routes) + " routes").c_str(), ref(bench));
+    }
+    http::Response resp(200, "OK", PROTO_HTTP1, {{"Server", "NiceHTTP"}, {"Connection", "close"}, {"Content-Type", "application/json"}},
+                        true, 16, "{\"status\": \"OK\"}");
+    run("response toString", [&resp](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            keep(resp.toString());
+        }
+    });
+    run("response serialize (arena)", [&resp](size_t n) {
+        alignas(max_align_t) static byte buffer[NICEHTTP_ARENA_SIZE];
+        pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+        for (size_t i = 0; i < n; i++) {
+            arena.release();
+            pmr::string out(&arena);
+            resp.serialize(out);
+            keep(out);
+        }
+    });
+    ResponseCache cache;
+    {
+        auto entry = make_shared<ResponseCache::Entry>();
+        resp.serialize(entry->raw);
+        entry->expires = bench_clock::now() + chrono::hours(1);
+        for (int i = 0; i < 1000; i++) cache.put("GET /api/v1/users/" + to_string(i), entry);
+    }
+    vector<string> keys;
+    for (int i = 0; i < 1000; i++) keys.push_back("GET /api/v1/users/" + to_string(i));
+    run("response cache get", [&cache, &keys](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            keep(cache.get(keys[i % keys.size()]));
+        }
+    });
+    string document = "[";
+    for (int i = 0; i < 500; i++) document += "{\"id\":" + to_string(i) + ",\"name\":\"item\"},";
+    document.back() = ']';
+    run("json parse 500 items", [&document](size_t n) {
+        alignas(max_align_t) static byte buffer[256 << 10];
+        pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+        for (size_t i = 0; i < n; i++) {
+            arena.release();
+            json::Document doc(&arena);
+            doc.parse(document);
+            keep(doc);
+        }
+    });
+    run("json parse and read 500 items", [&document](size_t n) {
+        alignas(max_align_t) static byte buffer[256 << 10];
+        pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+        for (size_t i = 0; i < n; i++) {
+            arena.release();
+            json::Document doc(&arena);
+            doc.parse(document);
+            int64_t sum = 0;
+            for (json::Value item : doc.root()) {
+                sum += item["id"].getInt() + static_cast<int64_t>(item["name"].getString().size());
+            }
+            keep(sum);
+        }
+    });
+    run("json write 500 items", [](size_t n) {
+        alignas(max_align_t) static byte buffer[256 << 10];
+        pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+        for (size_t i = 0; i < n; i++) {
+            arena.release();
+            http::Response resp(&arena);
+            json::Writer w = resp.writeJson();
+            w.beginArray();
+            for (int id = 0; id < 500; id++) {
+                w.beginObject().key("id").value(id).key("name").value("item").endObject();
+            }
+            w.endArray();
+            keep(resp);
+        }
+    });
+    // the same items in CBOR, 7.9KB
+    pmr::string binary;
+    {
+        cbor::Writer w(binary);
+        w.beginArray();
+        for (int id = 0; id < 500; id++) {
+            w.beginObject().key("id").value(id).key("name").value("item").endObject();
+        }
+        w.endArray();
+    }
+    run("cbor parse and read 500 items", [&binary](size_t n) {
+        alignas(max_align_t) static byte buffer[4 << 10];
+        pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+        for (size_t i = 0; i < n; i++) {
+            arena.release();
+            cbor::Document doc(&arena);
+            doc.parse(binary);
+            int64_t sum = 0;
+            for (cbor::Value item : doc.root()) {
+                sum += item["id"].getInt() + static_cast<int64_t>(item["name"].getString().size());
+            }
+            keep(sum);
+        }
+    });
+    run("cbor write 500 items", [](size_t n) {
+        alignas(max_align_t) static byte buffer[64 << 10];
+        pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+        for (size_t i = 0; i < n; i++) {
+            arena.release();
+            http::Response resp(&arena);
+            cbor::Writer w = resp.writeCbor();
+            w.beginArray();
+            for (int id = 0; id < 500; id++) {
+                w.beginObject().key("id").value(id).key("name").value("item").endObject();
+            }
+            w.endArray();
+            keep(resp);
+        }
+    });
+#ifdef NICEHTTP_COMPRESSION
+    run("gzip 12KB json", [&document](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            pmr::string out;
+            compression::compress(document, compression::Encoding::Gzip, out);
+            keep(out);
+        }
+    });
+    compression::Cache compressed;
+    run("gzip 12KB json (cached)", [&document, &compressed](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            pmr::string out;
+            compressed.compress(document, compression::Encoding::Gzip, out);
+            keep(out);
+        }
+    });
+#endif
+    using task = function<void()>;
+    run("thread_pool enqueue (mutex)", pool_enqueue<dp::thread_pool<task>>);
+    run("thread_pool enqueue (lock-free)", pool_enqueue<dp::lock_free_thread_pool<task>>);
+    run("thread_pool nested (mutex)", pool_nested<dp::thread_pool<task>>);
+    run("thread_pool nested (lock-free)", pool_nested<dp::lock_free_thread_pool<task>>);
+    return 0;
+}
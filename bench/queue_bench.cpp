@@ -0,0 +1,109 @@
+// Thread pool queue benchmark: mutex protected dp::thread_safe_queue against the
+// lock-free dp::work_stealing_queue (Chase-Lev deque + lock-free inbox).
+//
+// g++ -std=c++23 -O2 -pthread -o queue_bench bench/queue_bench.cpp && ./queue_bench
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <latch>
+#include <thread>
+#include <vector>
+
+#include "../lib/thread_pool.h"
+
+using namespace std;
+using bench_clock = chrono::steady_clock;
+
+#define TASKS 1000000
+#define PRODUCERS 4
+
+// PRODUCERS threads enqueue TASKS tiny tasks, time until all of them ran
+template <typename Pool>
+double external_submit(unsigned int threads) {
+    atomic<int> done{0};
+    auto start = bench_clock::now();
+    {
+        Pool pool(threads);
+        vector<jthread> producers;
+        for (int p = 0; p < PRODUCERS; p++) {
+            producers.emplace_back([&] {
+                for (int i = 0; i < TASKS / PRODUCERS; i++) {
+                    pool.enqueue_detach([&done] { done.fetch_add(1, memory_order_relaxed); });
+                }
+            });
+        }
+        producers.clear();
+        while (done.load() < TASKS) this_thread::yield();
+    }
+    return chrono::duration<double, nano>(bench_clock::now() - start).count() / TASKS;
+}
+
+// tasks spawning tasks (fork/join style), the case the owner deque is made for
+template <typename Pool>
+double nested_submit(unsigned int threads) {
+    atomic<int> done{0};
+    const int fanout = 1000;
+    auto start = bench_clock::now();
+    {
+        Pool pool(threads);
+        for (int i = 0; i < TASKS / fanout; i++) {
+            pool.enqueue_detach([&pool, &done] {
+                for (int j = 0; j < fanout; j++) {
+                    pool.enqueue_detach([&done] { done.fetch_add(1, memory_order_relaxed); });
+                }
+            });
+        }
+        while (done.load() < TASKS) this_thread::yield();
+    }
+    return chrono::duration<double, nano>(bench_clock::now() - start).count() / TASKS;
+}
+
+// raw queue: one owner pushing and popping, the other threads stealing
+template <typename Queue>
+double raw_queue(unsigned int thieves) {
+    Queue queue;
+    atomic<int> taken{0};
+    latch ready(thieves + 1);
+    auto start = bench_clock::now();
+    vector<jthread> threads;
+    for (unsigned int t = 0; t < thieves; t++) {
+        threads.emplace_back([&] {
+            ready.arrive_and_wait();
+            while (taken.load(memory_order_relaxed) < TASKS) {
+                if (queue.steal()) taken.fetch_add(1, memory_order_relaxed);
+            }
+        });
+    }
+    if constexpr (requires { queue.bind_owner(); }) queue.bind_owner();
+    ready.arrive_and_wait();
+    for (int i = 0; i < TASKS; i++) {
+        queue.push_back([] {});
+        if (i % 2 && queue.pop_front()) taken.fetch_add(1, memory_order_relaxed);
+    }
+    while (taken.load(memory_order_relaxed) < TASKS) {
+        if (queue.pop_front()) taken.fetch_add(1, memory_order_relaxed);
+    }
+    threads.clear();
+    return chrono::duration<double, nano>(bench_clock::now() - start).count() / TASKS;
+}
+
+int main() {
+    using task = function<void()>;
+    using mutex_pool = dp::thread_pool<task>;
+    using lock_free_pool = dp::lock_free_thread_pool<task>;
+    unsigned int cores = max(2u, thread::hardware_concurrency());
+
+    printf("%-28s %8s %14s %14s\n", "benchmark", "threads", "mutex ns/op", "lock-free ns/op");
+    for (unsigned int threads : {2u, cores / 2, cores}) {
+        printf("%-28s %8u %14.1f %14.1f\n", "external submit", threads,
+               external_submit<mutex_pool>(threads), external_submit<lock_free_pool>(threads));
+        printf("%-28s %8u %14.1f %14.1f\n", "nested submit", threads,
+               nested_submit<mutex_pool>(threads), nested_submit<lock_free_pool>(threads));
+        printf("%-28s %8u %14.1f %14.1f\n", "push/pop/steal", threads,
+               raw_queue<dp::thread_safe_queue<task>>(threads - 1),
+               raw_queue<dp::work_stealing_queue<task>>(threads - 1));
+    }
+    return 0;
+}
@@ -0,0 +1,180 @@
+// Replays the requests recorded by NiceHTTP::enableCapture against a server.
+//
+// Requests are sent byte for byte, each on its own connection, at their original pace (-s 1),
+// faster or slower (-s 4, -s 0.5) or as fast as possible (-a). Latencies are measured from the
+// time a request is due, so a server falling behind the recorded pace shows in the percentiles.
+//
+// cmake --build build --target replay
+// ./build/replay -s 2 -c 32 capture.bin 127.0.0.1:8090
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nicehttp.h"
+
+using namespace std;
+using replay_clock = chrono::steady_clock;
+
+struct Worker {
+    vector<uint64_t> latencies; // ns
+    map<int, uint64_t> statuses;
+    uint64_t errors = 0;
+};
+
+static void usage() {
+    fprintf(stderr,
+        "usage: replay [options] capture host:port\n"
+        "  -s X    speed factor over the recorded pace (1)\n"
+        "  -a      as fast as possible, ignoring the recorded pace\n"
+        "  -c N    concurrent connections (16)\n"
+        "  -n N    replay the capture N times (1)\n"
+        "  -t MS   request timeout (5000)\n");
+    exit(2);
+}
+
+// send a raw request on a new connection, returns the status code or 0
+static int exchange(const sockaddr_storage& addr, socklen_t addrlen, const string& request, int timeout) {
+    int fd = socket(addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) return 0;
+    timeval tv {timeout / 1000, (timeout % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int status = 0;
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), addrlen) == 0) {
+        size_t sent = 0;
+        while (sent < request.size()) {
+            ssize_t n = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += n;
+        }
+        // read the whole response: up to the declared length, or until the server closes
+        string response;
+        char buff[PKT_BLOCK_SIZE];
+        size_t expected = string::npos;
+        while ((sent == request.size()) && (response.size() < expected)) {
+            ssize_t n = recv(fd, buff, sizeof(buff), 0);
+            if (n <= 0) break;
+            response.append(buff, n);
+            size_t end = response.find("\r\n\r\n");
+            if ((expected == string::npos) && (end != string::npos)) {
+                string length = net::header_value(string_view(response).substr(0, end + 2), "content-length");
+                if (!length.empty()) expected = end + 4 + strtoull(length.c_str(), nullptr, 10);
+            }
+        }
+        if (response.starts_with("HTTP/") && (response.size() > 12)) {
+            status = atoi(response.c_str() + 9);
+        }
+    }
+    close(fd);
+    return status;
+}
+
+static double percentile(const vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    return sorted[min(static_cast<size_t>(p * sorted.size()), sorted.size() - 1)] / 1e3;
+}
+
+int main(int argc, char** argv) {
+    double speed = 1;
+    bool asap = false;
+    unsigned int connections = 16;
+    int loops = 1, timeout = 5000;
+    vector<string> positional;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        auto value = [&]() -> string {
+            if (i + 1 >= argc) usage();
+            return argv[++i];
+        };
+        if (arg == "-s") speed = atof(value().c_str());
+        else if (arg == "-a") asap = true;
+        else if (arg == "-c") connections = max(1, atoi(value().c_str()));
+        else if (arg == "-n") loops = max(1, atoi(value().c_str()));
+        else if (arg == "-t") timeout = atoi(value().c_str());
+        else if (arg[0] != '-') positional.push_back(arg);
+        else usage();
+    }
+    if ((positional.size() != 2) || (speed <= 0)) usage();
+    vector<Capture::Record> records;
+    try {
+        records = Capture::load(positional[0]);
+    } catch (const runtime_error& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 2;
+    }
+    if (records.empty()) {
+        fprintf(stderr, "%s has no requests\n", positional[0].c_str());
+        return 2;
+    }
+    size_t colon = positional[1].rfind(':');
+    if (colon == string::npos) usage();
+    string host = positional[1].substr(0, colon), port = positional[1].substr(colon + 1);
+    addrinfo hints {}, *res = nullptr;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) || (res == nullptr)) {
+        fprintf(stderr, "Cannot resolve %s\n", host.c_str());
+        return 2;
+    }
+    sockaddr_storage addr {};
+    socklen_t addrlen = res->ai_addrlen;
+    memcpy(&addr, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+
+    // the requests of every loop, due at the recorded offset divided by the speed
+    uint64_t span = records.back().offset + 1;
+    size_t total = records.size() * loops;
+    vector<Worker> workers(connections);
+    auto begin = replay_clock::now();
+    {
+        vector<jthread> threads;
+        for (unsigned int c = 0; c < connections; c++) {
+            threads.emplace_back([&, c] {
+                Worker& w = workers[c];
+                for (size_t i = c; i < total; i += connections) {
+                    const Capture::Record& r = records[i % records.size()];
+                    auto due = replay_clock::now();
+                    if (!asap) {
+                        double at = (static_cast<double>(i / records.size()) * span + r.offset) / speed;
+                        due = begin + chrono::duration_cast<replay_clock::duration>(chrono::duration<double, nano>(at));
+                        this_thread::sleep_until(due);
+                    }
+                    int status = exchange(addr, addrlen, r.data, timeout);
+                    w.latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(replay_clock::now() - due).count());
+                    if (status > 0) {
+                        w.statuses[status]++;
+                    } else {
+                        w.errors++;
+                    }
+                }
+            });
+        }
+    }
+    double elapsed = chrono::duration<double>(replay_clock::now() - begin).count();
+
+    Worker all;
+    for (Worker& w : workers) {
+        all.latencies.insert(all.latencies.end(), w.latencies.begin(), w.latencies.end());
+        for (auto [status, count] : w.statuses) all.statuses[status] += count;
+        all.errors += w.errors;
+    }
+    sort(all.latencies.begin(), all.latencies.end());
+    printf("replayed     %zu requests (%zu recorded x %d), %u connections, ", total, records.size(), loops, connections);
+    if (asap) printf("as fast as possible\n");
+    else printf("speed x%.2f\n", speed);
+    printf("recorded     %.1f req/s\n", records.size() / (span / 1e9));
+    printf("throughput   %.1f req/s\n", total / elapsed);
+    printf("errors       %llu\n", static_cast<unsigned long long>(all.errors));
+    for (auto [status, count] : all.statuses) printf("status %d   %llu\n", status, static_cast<unsigned long long>(count));
+    printf("latency (us)\n");
+    for (auto [name, p] : {pair{"p50", 0.5}, pair{"p90", 0.9}, pair{"p99", 0.99}, pair{"p99.9", 0.999}}) {
+        printf("%-12s %14.1f\n", name, percentile(all.latencies, p));
+    }
+    printf("%-12s %14.1f\n", "max", all.latencies.back() / 1e3);
+    return all.errors > 0 ? 1 : 0;
+}
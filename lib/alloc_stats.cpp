@@ -0,0 +1,88 @@
+#include "alloc_stats.h"
+
+#ifdef NICEHTTP_ALLOC_STATS
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static thread_local alloc_stats::Usage thread_usage; // trivial type: no dynamic initialization inside operator new
+
+struct AllocPhaseTotal {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> bytes{0};
+};
+static std::array<AllocPhaseTotal, NICEHTTP_ALLOC_PHASES> phase_totals;
+
+static void* counted_alloc(size_t size, size_t alignment) {
+    thread_usage.count++;
+    thread_usage.bytes += size;
+    if (size == 0) {
+        size = 1;
+    }
+    void* p;
+    if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        p = std::malloc(size);
+    } else {
+        #ifdef _WIN32
+        p = _aligned_malloc(size, alignment);
+        #else
+        p = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+        #endif
+    }
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+static void counted_free(void* p, size_t alignment) {
+    #ifdef _WIN32
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        _aligned_free(p);
+        return;
+    }
+    #else
+    (void)alignment;
+    #endif
+    std::free(p);
+}
+
+alloc_stats::Usage alloc_stats::current() {
+    return thread_usage;
+}
+
+void alloc_stats::account(size_t phase, const Usage& before, const Usage& after) {
+    if (phase < NICEHTTP_ALLOC_PHASES) {
+        phase_totals[phase].count.fetch_add(after.count - before.count, std::memory_order_relaxed);
+        phase_totals[phase].bytes.fetch_add(after.bytes - before.bytes, std::memory_order_relaxed);
+    }
+}
+
+alloc_stats::Usage alloc_stats::total(size_t phase) {
+    if (phase >= NICEHTTP_ALLOC_PHASES) {
+        return {};
+    }
+    return {phase_totals[phase].count.load(std::memory_order_relaxed), phase_totals[phase].bytes.load(std::memory_order_relaxed)};
+}
+
+void* operator new(size_t size) { return counted_alloc(size, 0); }
+void* operator new[](size_t size) { return counted_alloc(size, 0); }
+void* operator new(size_t size, std::align_val_t al) { return counted_alloc(size, static_cast<size_t>(al)); }
+void* operator new[](size_t size, std::align_val_t al) { return counted_alloc(size, static_cast<size_t>(al)); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try { return counted_alloc(size, 0); } catch (...) { return nullptr; }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    try { return counted_alloc(size, 0); } catch (...) { return nullptr; }
+}
+void operator delete(void* p) noexcept { counted_free(p, 0); }
+void operator delete[](void* p) noexcept { counted_free(p, 0); }
+void operator delete(void* p, size_t) noexcept { counted_free(p, 0); }
+void operator delete[](void* p, size_t) noexcept { counted_free(p, 0); }
+void operator delete(void* p, std::align_val_t al) noexcept { counted_free(p, static_cast<size_t>(al)); }
+void operator delete[](void* p, std::align_val_t al) noexcept { counted_free(p, static_cast<size_t>(al)); }
+void operator delete(void* p, size_t, std::align_val_t al) noexcept { counted_free(p, static_cast<size_t>(al)); }
+void operator delete[](void* p, size_t, std::align_val_t al) noexcept { counted_free(p, static_cast<size_t>(al)); }
+
+#endif
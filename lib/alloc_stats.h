@@ -0,0 +1,49 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#define NICEHTTP_ALLOC_PHASES 16 // phases that can be accounted (trace::Phase::Count at most)
+
+namespace alloc_stats {
+
+/* Heap allocation accounting, compiled in with -D NICEHTTP_ALLOC_STATS.
+ * The global operator new and delete are replaced to count the allocations
+ * of each thread, and trace::RequestTrace adds the allocations made during
+ * each phase of a request to process wide totals, exported by Metrics.
+ * Replacing the global allocator is a whole program decision: build the
+ * library with the flag only in the binaries being measured.
+ */
+struct Usage {
+    uint64_t count = 0; // allocations
+    uint64_t bytes = 0; // bytes requested
+};
+
+#ifdef NICEHTTP_ALLOC_STATS
+Usage current(); // allocations made by this thread so far
+void account(size_t phase, const Usage& before, const Usage& after); // add the difference to the total of phase
+Usage total(size_t phase); // of all the requests so far
+#endif
+
+} // namespace alloc_stats
@@ -0,0 +1,90 @@
+#include "capture.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+Capture::~Capture() {
+    this->close();
+}
+
+bool Capture::open(const std::string& path, uint64_t max_bytes) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->file != nullptr) {
+        fclose(this->file);
+    }
+    this->file = fopen(path.c_str(), "wb");
+    if (this->file == nullptr) {
+        return false;
+    }
+    setvbuf(this->file, nullptr, _IOFBF, NICEHTTP_CAPTURE_BUFFER);
+    this->start = std::chrono::steady_clock::now();
+    this->flushed = this->start;
+    int64_t epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    fwrite(NICEHTTP_CAPTURE_MAGIC, 1, 8, this->file);
+    fwrite(&epoch, sizeof(epoch), 1, this->file);
+    this->written = 16;
+    this->max_bytes = max_bytes;
+    this->capturing.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+void Capture::record(std::chrono::steady_clock::time_point arrival, std::string_view head, std::string_view body) {
+    uint32_t length = static_cast<uint32_t>(head.size() + body.size());
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->file == nullptr) {
+        return;
+    }
+    if ((this->max_bytes > 0) && (this->written + 12 + length > this->max_bytes)) {
+        // full, stop capturing
+        fclose(this->file);
+        this->file = nullptr;
+        this->capturing.store(false, std::memory_order_relaxed);
+        return;
+    }
+    uint64_t offset = std::chrono::duration_cast<std::chrono::nanoseconds>(arrival - this->start).count();
+    fwrite(&offset, sizeof(offset), 1, this->file);
+    fwrite(&length, sizeof(length), 1, this->file);
+    fwrite(head.data(), 1, head.size(), this->file);
+    fwrite(body.data(), 1, body.size(), this->file);
+    this->written += 12 + length;
+    if (arrival - this->flushed >= std::chrono::milliseconds(NICEHTTP_CAPTURE_FLUSH)) {
+        // a server killed loses at most the last second
+        fflush(this->file);
+        this->flushed = arrival;
+    }
+}
+
+void Capture::close() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->file != nullptr) {
+        fclose(this->file);
+        this->file = nullptr;
+    }
+    this->capturing.store(false, std::memory_order_relaxed);
+}
+
+std::vector<Capture::Record> Capture::load(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == nullptr) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    char magic[8];
+    int64_t epoch;
+    if ((fread(magic, 1, 8, f) != 8) || (memcmp(magic, NICEHTTP_CAPTURE_MAGIC, 8) != 0) || (fread(&epoch, sizeof(epoch), 1, f) != 1)) {
+        fclose(f);
+        throw std::runtime_error(path + " is not a capture file");
+    }
+    std::vector<Record> records;
+    uint64_t offset;
+    uint32_t length;
+    while ((fread(&offset, sizeof(offset), 1, f) == 1) && (fread(&length, sizeof(length), 1, f) == 1)) {
+        Record r {offset, std::string(length, '\0')};
+        if (fread(r.data.data(), 1, length, f) != length) {
+            break; // truncated by a server that didn't stop cleanly
+        }
+        records.push_back(std::move(r));
+    }
+    fclose(f);
+    std::stable_sort(records.begin(), records.end(), [](const Record& a, const Record& b) { return a.offset < b.offset; });
+    return records;
+}
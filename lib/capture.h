@@ -0,0 +1,66 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define NICEHTTP_CAPTURE_MAGIC "NHCAP001" // first 8 bytes of a capture file
+#define NICEHTTP_CAPTURE_BUFFER (1 << 20) // bytes buffered before writing to the file
+#define NICEHTTP_CAPTURE_FLUSH 1000 // ms between flushes of the buffered records to the file
+
+class Capture {
+    /* Records the raw requests received by the server with their arrival time,
+     * to replay the production traffic against a server (bench/replay) or to
+     * benchmark the parser on it.
+     * File format (host byte order): the magic, the capture start time
+     * (system clock ns) and one record per request: arrival offset from the
+     * start (ns, uint64), length (uint32) and the raw request bytes.
+     * Records are appended in completion order, load() sorts them by arrival.
+     */
+public:
+    struct Record {
+        uint64_t offset; // ns since the capture start
+        std::string data; // request head and body as received
+    };
+    Capture() {}
+    ~Capture();
+    bool open(const std::string& path, uint64_t max_bytes = 0); // max_bytes 0: no limit
+    bool active() const { return this->capturing.load(std::memory_order_relaxed); }
+    void record(std::chrono::steady_clock::time_point arrival, std::string_view head, std::string_view body);
+    void close();
+    static std::vector<Record> load(const std::string& path); // throws std::runtime_error if not a capture
+private:
+    std::mutex mutex;
+    FILE* file = nullptr;
+    std::atomic<bool> capturing{false};
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point flushed;
+    uint64_t written = 0;
+    uint64_t max_bytes = 0;
+};
@@ -0,0 +1,545 @@
+#include "cbor.h"
+#include <bit>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+// initial byte and argument of an item
+struct CborHead {
+    uint8_t major;
+    uint8_t info; // 31: indefinite length (or break)
+    uint64_t value; // integer, length, count, tag, simple value or float bits
+    uint32_t size; // bytes of the head
+};
+
+static bool cbor_head(std::string_view data, size_t offset, CborHead& h) {
+    // false if truncated or malformed
+    if (offset >= data.size()) {
+        return false;
+    }
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data()) + offset;
+    h.major = p[0] >> 5;
+    h.info = p[0] & 0x1f;
+    if (h.info < 24) {
+        h.value = h.info;
+        h.size = 1;
+        return true;
+    } else if (h.info == 31) {
+        h.value = 0;
+        h.size = 1;
+        return (h.major >= 2) && (h.major != 6); // indefinite strings, arrays, maps and the break
+    } else if (h.info > 27) {
+        return false;
+    }
+    uint32_t bytes = 1u << (h.info - 24);
+    if (data.size() - offset - 1 < bytes) {
+        return false;
+    }
+    h.value = 0;
+    for (uint32_t i = 1; i <= bytes; i++) {
+        h.value = (h.value << 8) | p[i];
+    }
+    h.size = 1 + bytes;
+    return true;
+}
+
+static CborHead cbor_read_head(std::string_view data, size_t offset) {
+    // in a parsed document, well formed: no checks
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data()) + offset;
+    CborHead h {static_cast<uint8_t>(p[0] >> 5), static_cast<uint8_t>(p[0] & 0x1f), 0, 1};
+    switch (h.info) {
+        case 24: h.value = p[1]; h.size = 2; break;
+        case 25: h.value = (uint64_t(p[1]) << 8) | p[2]; h.size = 3; break;
+        case 26: {
+            uint32_t v;
+            std::memcpy(&v, p + 1, 4);
+            h.value = (std::endian::native == std::endian::little) ? std::byteswap(v) : v;
+            h.size = 5;
+            break;
+        }
+        case 27:
+            std::memcpy(&h.value, p + 1, 8);
+            h.value = (std::endian::native == std::endian::little) ? std::byteswap(h.value) : h.value;
+            h.size = 9;
+            break;
+        default:
+            h.value = (h.info < 24) ? h.info : 0;
+            break;
+    }
+    return h;
+}
+
+static double cbor_half(uint16_t half) {
+    int exponent = (half >> 10) & 0x1f;
+    double mantissa = half & 0x3ff;
+    double value;
+    if (exponent == 0) {
+        value = std::ldexp(mantissa, -24);
+    } else if (exponent != 31) {
+        value = std::ldexp(mantissa + 1024, exponent - 25);
+    } else {
+        value = (mantissa == 0) ? INFINITY : NAN;
+    }
+    return (half & 0x8000) ? -value : value;
+}
+
+void cbor::Document::parse(std::string_view data) {
+    // walk the whole item once to check it is well formed, so that reading it doesn't need to
+    this->data = {};
+    this->strings.clear();
+    if (data.size() >= UINT32_MAX) {
+        throw Error("Item too large");
+    }
+    struct Frame {
+        uint64_t expected; // items of a definite array or map
+        uint64_t count;
+        bool indefinite;
+        bool map;
+        int chunks; // major type of the chunks of an indefinite string, -1 for arrays and maps
+    };
+    std::pmr::vector<Frame> stack(this->strings.get_allocator());
+    size_t offset = 0;
+    bool tagged = false;
+    bool complete = false;
+    auto item_done = [&stack, &complete] {
+        // the item completes its container, that completes its own, and so on
+        while (!stack.empty()) {
+            Frame& f = stack.back();
+            f.count++;
+            if (f.indefinite || (f.count < f.expected)) {
+                return;
+            }
+            stack.pop_back();
+        }
+        complete = true;
+    };
+    while (!complete) {
+        CborHead h;
+        if (!cbor_head(data, offset, h)) {
+            throw Error((offset >= data.size() ? "Truncated item at " : "Malformed item at ") + std::to_string(offset));
+        }
+        if ((h.major == 7) && (h.info == 31)) {
+            if (stack.empty() || !stack.back().indefinite || tagged) {
+                throw Error("Unexpected break at " + std::to_string(offset));
+            }
+            if (stack.back().map && (stack.back().count % 2 != 0)) {
+                throw Error("Map without the last value at " + std::to_string(offset));
+            }
+            stack.pop_back();
+            offset += h.size;
+            item_done();
+            continue;
+        }
+        if (!stack.empty() && (stack.back().chunks >= 0) && ((h.major != stack.back().chunks) || (h.info == 31))) {
+            throw Error("Invalid chunk of a string at " + std::to_string(offset));
+        }
+        offset += h.size;
+        tagged = h.major == 6;
+        switch (h.major) {
+            case 2:
+            case 3:
+                if (h.info == 31) {
+                    stack.push_back({0, 0, true, false, h.major});
+                    break;
+                }
+                if (h.value > data.size() - offset) {
+                    throw Error("Truncated string at " + std::to_string(offset));
+                }
+                offset += h.value;
+                item_done();
+                break;
+            case 4:
+            case 5:
+                if ((h.info != 31) && (h.value > data.size() - offset)) {
+                    // every item takes one byte at least
+                    throw Error("Truncated container at " + std::to_string(offset));
+                }
+                if (h.info == 31) {
+                    stack.push_back({0, 0, true, h.major == 5, -1});
+                } else if (h.value > 0) {
+                    stack.push_back({(h.major == 5) ? h.value * 2 : h.value, 0, false, h.major == 5, -1});
+                } else {
+                    item_done();
+                }
+                break;
+            case 6:
+                break; // the tagged item follows
+            case 7:
+                if ((h.info == 24) && (h.value < 32)) {
+                    throw Error("Invalid simple value at " + std::to_string(offset));
+                }
+                item_done();
+                break;
+            default:
+                item_done();
+                break;
+        }
+        if (stack.size() > NICEHTTP_CBOR_MAX_DEPTH) {
+            throw Error("Item too deep");
+        }
+    }
+    if (offset != data.size()) {
+        throw Error("Unexpected data after the item at " + std::to_string(offset));
+    }
+    this->data = data;
+}
+
+cbor::Value cbor::Document::root() const {
+    return Value(this, this->untag(0));
+}
+
+uint32_t cbor::Document::untag(uint32_t offset) const {
+    for (CborHead h = cbor_read_head(this->data, offset); h.major == 6; h = cbor_read_head(this->data, offset)) {
+        offset += h.size;
+    }
+    return offset;
+}
+
+uint32_t cbor::Document::skip(uint32_t offset) const {
+    offset = this->untag(offset);
+    CborHead h = cbor_read_head(this->data, offset);
+    offset += h.size;
+    switch (h.major) {
+        case 2:
+        case 3:
+            if (h.info != 31) {
+                return offset + static_cast<uint32_t>(h.value);
+            }
+            [[fallthrough]];
+        case 4:
+        case 5:
+            for (uint64_t i = 0; (h.info == 31) || (i < ((h.major == 5) ? h.value * 2 : h.value)); i++) {
+                unsigned char c = static_cast<unsigned char>(this->data[offset]);
+                if (c == 0xff) {
+                    return offset + 1; // break of an indefinite length item
+                } else if (((c & 0x1f) < 24) && ((c < 0x40) || (c >= 0xe0))) {
+                    offset++; // small integers, false, true, null
+                } else {
+                    offset = this->skip(offset);
+                }
+            }
+            return offset;
+        default:
+            return offset; // floats are in the head
+    }
+}
+
+static const char* cbor_type_name(cbor::Type t) {
+    switch (t) {
+        case cbor::Type::Null: return "null";
+        case cbor::Type::Bool: return "bool";
+        case cbor::Type::Number: return "number";
+        case cbor::Type::String: return "string";
+        case cbor::Type::Array: return "array";
+        case cbor::Type::Object: return "map";
+        default: return "missing";
+    }
+}
+
+cbor::Type cbor::Value::type() const {
+    if (this->doc == nullptr) {
+        return Type::Missing;
+    }
+    CborHead h = cbor_read_head(this->doc->data, this->offset);
+    switch (h.major) {
+        case 0: case 1: return Type::Number;
+        case 2: case 3: return Type::String;
+        case 4: return Type::Array;
+        case 5: return Type::Object;
+        default:
+            // 7: false, true, null, undefined, floats, other simple values (null)
+            if ((h.info == 20) || (h.info == 21)) {
+                return Type::Bool;
+            }
+            return ((h.info >= 25) && (h.info <= 27)) ? Type::Number : Type::Null;
+    }
+}
+
+void cbor::Value::expect(Type t) const {
+    Type actual = this->type();
+    if (actual != t) {
+        throw Error(std::string("Expected ") + cbor_type_name(t) + ", the item is " + cbor_type_name(actual));
+    }
+}
+
+bool cbor::Value::isInt() const {
+    if (this->doc == nullptr) {
+        return false;
+    }
+    CborHead h = cbor_read_head(this->doc->data, this->offset);
+    return (h.major <= 1) && (h.value <= static_cast<uint64_t>(INT64_MAX));
+}
+
+bool cbor::Value::getBool() const {
+    this->expect(Type::Bool);
+    return cbor_read_head(this->doc->data, this->offset).info == 21;
+}
+
+int64_t cbor::Value::getInt() const {
+    this->expect(Type::Number);
+    CborHead h = cbor_read_head(this->doc->data, this->offset);
+    if ((h.major > 1) || (h.value > static_cast<uint64_t>(INT64_MAX))) {
+        throw Error("Not an integer that fits int64_t");
+    }
+    return (h.major == 0) ? static_cast<int64_t>(h.value) : -1 - static_cast<int64_t>(h.value);
+}
+
+double cbor::Value::getDouble() const {
+    this->expect(Type::Number);
+    CborHead h = cbor_read_head(this->doc->data, this->offset);
+    switch (h.major) {
+        case 0: return static_cast<double>(h.value);
+        case 1: return -1.0 - static_cast<double>(h.value);
+        default:
+            if (h.info == 25) {
+                return cbor_half(static_cast<uint16_t>(h.value));
+            } else if (h.info == 26) {
+                return std::bit_cast<float>(static_cast<uint32_t>(h.value));
+            }
+            return std::bit_cast<double>(h.value);
+    }
+}
+
+std::string_view cbor::Value::getString() const {
+    this->expect(Type::String);
+    CborHead h = cbor_read_head(this->doc->data, this->offset);
+    uint32_t offset = this->offset + h.size;
+    if (h.info != 31) {
+        return this->doc->data.substr(offset, h.value); // in place
+    }
+    std::pmr::string& out = this->doc->strings.emplace_back();
+    while (static_cast<unsigned char>(this->doc->data[offset]) != 0xff) {
+        CborHead chunk = cbor_read_head(this->doc->data, offset);
+        out.append(this->doc->data.substr(offset + chunk.size, chunk.value));
+        offset += chunk.size + static_cast<uint32_t>(chunk.value);
+    }
+    return out;
+}
+
+std::string_view cbor::Value::key() const {
+    if ((this->doc == nullptr) || (this->key_offset == UINT32_MAX)) {
+        throw Error("Not a member of a map");
+    }
+    Value k(this->doc, this->key_offset);
+    if (cbor_read_head(this->doc->data, this->key_offset).major != 3) {
+        throw Error("The key is not a text string");
+    }
+    return k.getString();
+}
+
+std::string_view cbor::Value::raw() const {
+    if (this->doc == nullptr) {
+        throw Error("Missing value");
+    }
+    return this->doc->data.substr(this->offset, this->doc->skip(this->offset) - this->offset);
+}
+
+cbor::Value cbor::Value::operator[](std::string_view key) const {
+    if (this->doc == nullptr) {
+        return Value(); // so that lookups can be chained
+    }
+    this->expect(Type::Object);
+    const Document* d = this->doc;
+    CborHead h = cbor_read_head(d->data, this->offset);
+    uint32_t offset = this->offset + h.size;
+    // members until the count of a definite map or the break (0xff can't start an item)
+    for (uint64_t i = 0; ((h.info == 31) || (i < h.value)) && (static_cast<unsigned char>(d->data[offset]) != 0xff); i++) {
+        uint32_t k = d->untag(offset);
+        CborHead kh = cbor_read_head(d->data, k);
+        uint32_t v = d->skip(k);
+        if ((kh.major == 3) && ((kh.info != 31) ? (d->data.substr(k + kh.size, kh.value) == key) : (Value(d, k).getString() == key))) {
+            return Value(d, d->untag(v), k);
+        }
+        offset = d->skip(v);
+    }
+    return Value();
+}
+
+cbor::Value cbor::Value::operator[](size_t i) const {
+    if (this->doc == nullptr) {
+        return Value();
+    }
+    this->expect(Type::Array);
+    for (Value element : *this) {
+        if (i-- == 0) {
+            return element;
+        }
+    }
+    return Value();
+}
+
+size_t cbor::Value::size() const {
+    if (this->doc != nullptr) {
+        CborHead h = cbor_read_head(this->doc->data, this->offset);
+        if (((h.major == 4) || (h.major == 5)) && (h.info != 31)) {
+            return h.value;
+        }
+    }
+    return std::distance(this->begin(), this->end());
+}
+
+cbor::Value::Iterator cbor::Value::begin() const {
+    Type t = this->type();
+    if ((t != Type::Array) && (t != Type::Object)) {
+        throw Error(std::string("Expected array or map, the item is ") + cbor_type_name(t));
+    }
+    CborHead h = cbor_read_head(this->doc->data, this->offset);
+    return Iterator(this->doc, this->offset + h.size, (h.info == 31) ? UINT64_MAX : h.value, t == Type::Object);
+}
+
+cbor::Value::Iterator cbor::Value::end() const {
+    Type t = this->type();
+    if ((t != Type::Array) && (t != Type::Object)) {
+        throw Error(std::string("Expected array or map, the item is ") + cbor_type_name(t));
+    }
+    return Iterator(this->doc, 0, 0, t == Type::Object);
+}
+
+bool cbor::Value::Iterator::atEnd() const {
+    return (this->remaining == 0) || ((this->remaining == UINT64_MAX) && (static_cast<unsigned char>(this->doc->data[this->offset]) == 0xff));
+}
+
+bool cbor::Value::Iterator::operator==(const Iterator& other) const {
+    bool end = this->atEnd();
+    return (end == other.atEnd()) && (end || (this->offset == other.offset));
+}
+
+cbor::Value cbor::Value::Iterator::operator*() const {
+    if (this->map) {
+        return Value(this->doc, this->doc->untag(this->doc->skip(this->offset)), this->doc->untag(this->offset));
+    }
+    return Value(this->doc, this->doc->untag(this->offset));
+}
+
+cbor::Value::Iterator& cbor::Value::Iterator::operator++() {
+    this->offset = this->doc->skip(this->offset);
+    if (this->map) {
+        this->offset = this->doc->skip(this->offset);
+    }
+    if (this->remaining != UINT64_MAX) {
+        this->remaining--;
+    }
+    return *this;
+}
+
+void cbor::Writer::head(uint8_t major, uint64_t value) {
+    // shortest form of the argument, big endian
+    char bytes[9];
+    uint32_t n;
+    if (value < 24) {
+        bytes[0] = static_cast<char>((major << 5) | value);
+        n = 0;
+    } else if (value <= 0xff) {
+        bytes[0] = static_cast<char>((major << 5) | 24);
+        n = 1;
+    } else if (value <= 0xffff) {
+        bytes[0] = static_cast<char>((major << 5) | 25);
+        n = 2;
+    } else if (value <= 0xffffffff) {
+        bytes[0] = static_cast<char>((major << 5) | 26);
+        n = 4;
+    } else {
+        bytes[0] = static_cast<char>((major << 5) | 27);
+        n = 8;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        bytes[n - i] = static_cast<char>(value >> (8 * i));
+    }
+    this->out.append(bytes, n + 1);
+}
+
+void cbor::Writer::done() {
+    if ((this->depth == 0) && (this->length != nullptr)) {
+        *this->length = this->out.size();
+    }
+}
+
+cbor::Writer& cbor::Writer::beginObject() {
+    this->out.push_back(static_cast<char>(0xbf));
+    this->depth++;
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::endObject() {
+    if (this->depth == 0) {
+        throw Error("endObject without beginObject");
+    }
+    this->out.push_back(static_cast<char>(0xff));
+    this->depth--;
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::beginArray() {
+    this->out.push_back(static_cast<char>(0x9f));
+    this->depth++;
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::endArray() {
+    if (this->depth == 0) {
+        throw Error("endArray without beginArray");
+    }
+    this->out.push_back(static_cast<char>(0xff));
+    this->depth--;
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::key(std::string_view name) {
+    this->head(3, name.size());
+    this->out.append(name);
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::null() {
+    this->out.push_back(static_cast<char>(0xf6));
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::value(bool b) {
+    this->out.push_back(static_cast<char>(b ? 0xf5 : 0xf4));
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::value(double d) {
+    if (std::isnan(d)) {
+        this->out.append("\xf9\x7e\x00", 3); // half precision NaN
+    } else if ((std::isinf(d) || (std::fabs(d) <= FLT_MAX)) && (static_cast<double>(static_cast<float>(d)) == d)) {
+        uint32_t bits = std::bit_cast<uint32_t>(static_cast<float>(d));
+        char bytes[5] = {static_cast<char>(0xfa), static_cast<char>(bits >> 24), static_cast<char>(bits >> 16), static_cast<char>(bits >> 8), static_cast<char>(bits)};
+        this->out.append(bytes, sizeof(bytes));
+    } else {
+        uint64_t bits = std::bit_cast<uint64_t>(d);
+        char bytes[9] = {static_cast<char>(0xfb)};
+        for (int i = 0; i < 8; i++) {
+            bytes[8 - i] = static_cast<char>(bits >> (8 * i));
+        }
+        this->out.append(bytes, sizeof(bytes));
+    }
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::value(std::string_view s) {
+    this->head(3, s.size());
+    this->out.append(s);
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::bytes(std::string_view data) {
+    this->head(2, data.size());
+    this->out.append(data);
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::raw(std::string_view item) {
+    this->out.append(item);
+    this->done();
+    return *this;
+}
@@ -0,0 +1,203 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#include <concepts>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <memory_resource>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include "json.h"
+
+#define NICEHTTP_CBOR_MAX_DEPTH 1024 // nesting of arrays, maps and strings in chunks accepted by the parser
+
+namespace cbor {
+
+/* CBOR (RFC 8949) bodies, application/cbor: the binary counterpart of the json
+ * namespace, with the same interface, so that a handler can read and write both
+ * formats with the same code (see http::BodyWriter). Values are read in place:
+ * strings and byte strings are views of the body, nothing is decoded until asked.
+ * The whole item is checked to be well formed when parsing; text strings are not
+ * checked to be valid UTF-8.
+ */
+class Error : public std::runtime_error {
+public:
+    explicit Error(const std::string& message) : std::runtime_error(message) {}
+};
+
+using Type = json::Type; // byte strings are strings too, tags are skipped
+
+class Document;
+
+class Value {
+    /* An item of a Document, cheap to copy, valid as long as the document and its data.
+     * As json::Value: Missing when a key is not there, the getters throw cbor::Error
+     * when the item has another type.
+     */
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Value;
+        using difference_type = std::ptrdiff_t;
+        Iterator() = default;
+        Iterator(const Document* doc, uint32_t offset, uint64_t remaining, bool map) : doc(doc), offset(offset), remaining(remaining), map(map) {}
+        Value operator*() const;
+        Iterator& operator++();
+        Iterator operator++(int) { Iterator it = *this; ++*this; return it; }
+        bool operator==(const Iterator& other) const;
+    private:
+        const Document* doc = nullptr;
+        uint32_t offset = 0; // of the element (the key in maps)
+        uint64_t remaining = 0; // elements, UINT64_MAX in indefinite containers (up to the break)
+        bool map = false;
+        bool atEnd() const;
+    };
+    Value() = default;
+    Value(const Document* doc, uint32_t offset, uint32_t key_offset = UINT32_MAX) : doc(doc), offset(offset), key_offset(key_offset) {}
+    Type type() const;
+    explicit operator bool() const { return this->type() != Type::Missing; }
+    bool isNull() const { return this->type() == Type::Null; }
+    bool isInt() const; // an integer that fits int64_t
+    bool getBool() const;
+    int64_t getInt() const; // throws for floats and integers that don't fit
+    double getDouble() const;
+    std::string_view getString() const; // text or byte string, copied in the document only if sent in chunks
+    std::string_view key() const; // of a member of a map, text keys only
+    std::string_view raw() const; // encoded item, e.g. to copy it in a Writer
+    Value operator[](std::string_view key) const; // member of a map (linear search), Missing if not there
+    Value operator[](size_t i) const; // element of an array (linear search), Missing if not there
+    size_t size() const; // elements of an array or members of a map
+    Iterator begin() const; // elements of an array or members of a map (see key())
+    Iterator end() const;
+private:
+    const Document* doc = nullptr;
+    uint32_t offset = 0; // of the item, after its tags
+    uint32_t key_offset = UINT32_MAX;
+    void expect(Type t) const;
+};
+
+class Document {
+    /* A CBOR item in a buffer (the body), not copied: the buffer must outlive the
+     * document. Strings sent in chunks are joined in memory from the allocator.
+     */
+public:
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+    explicit Document(allocator_type alloc = {}) : strings(alloc) {}
+    void parse(std::string_view data); // throws cbor::Error if data is not one well formed item
+    Value root() const;
+    std::string_view source() const { return this->data; }
+private:
+    friend class Value;
+    std::string_view data;
+    mutable std::pmr::deque<std::pmr::string> strings; // strings in chunks, joined
+    uint32_t skip(uint32_t offset) const; // offset following the item at offset
+    uint32_t untag(uint32_t offset) const; // offset of the item after the tags
+};
+
+class Writer {
+    /* Streaming encoder appending to a string (the body of a message, see
+     * Message::writeCbor), same interface as json::Writer. Arrays and maps are written
+     * with indefinite length, so nothing has to be counted or moved; integers and
+     * lengths take the shortest form, doubles are written as floats when exact.
+     */
+public:
+    explicit Writer(std::pmr::string& out, size_t* length = nullptr) : out(out), length(length) {}
+    Writer& beginObject();
+    Writer& endObject();
+    Writer& beginArray();
+    Writer& endArray();
+    Writer& key(std::string_view name);
+    Writer& null();
+    Writer& value(bool b);
+    Writer& value(double d);
+    Writer& value(std::string_view s); // text string
+    Writer& value(const char* s) { return this->value(std::string_view(s)); }
+    Writer& value(const Value& v) { return this->raw(v.raw()); }
+    template <std::integral T> requires (!std::same_as<T, bool>)
+    Writer& value(T n);
+    Writer& bytes(std::string_view data); // byte string
+    Writer& raw(std::string_view item); // already encoded item, written as it is
+private:
+    std::pmr::string& out;
+    size_t* length;
+    uint32_t depth = 0;
+    void head(uint8_t major, uint64_t value);
+    void done(); // an item was written
+};
+
+template <std::integral T> requires (!std::same_as<T, bool>)
+Writer& Writer::value(T n) {
+    if constexpr (std::is_signed_v<T>) {
+        // negative integers are -1 - n
+        this->head((n < 0) ? 1 : 0, (n < 0) ? ~static_cast<uint64_t>(static_cast<int64_t>(n)) : static_cast<uint64_t>(n));
+    } else {
+        this->head(0, n);
+    }
+    this->done();
+    return *this;
+}
+
+// Write a json::Value or a cbor::Value with a json::Writer or a cbor::Writer, converting the format
+template <typename Writer, typename Value>
+void transcode(Writer& w, const Value& v) {
+    switch (v.type()) {
+        case Type::Object:
+            w.beginObject();
+            for (Value member : v) {
+                w.key(member.key());
+                transcode(w, member);
+            }
+            w.endObject();
+            break;
+        case Type::Array:
+            w.beginArray();
+            for (Value element : v) {
+                transcode(w, element);
+            }
+            w.endArray();
+            break;
+        case Type::String:
+            w.value(v.getString());
+            break;
+        case Type::Bool:
+            w.value(v.getBool());
+            break;
+        case Type::Number:
+            if (v.isInt()) {
+                w.value(v.getInt());
+            } else {
+                w.value(v.getDouble());
+            }
+            break;
+        case Type::Null:
+            w.null();
+            break;
+        case Type::Missing:
+            throw Error("Missing value");
+    }
+}
+
+} // namespace cbor
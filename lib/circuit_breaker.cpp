@@ -0,0 +1,90 @@
+#include "circuit_breaker.h"
+
+CircuitBreaker::CircuitBreaker(const BreakerOptions& opts) {
+    this->opts = opts;
+    this->window_start.store(now(), std::memory_order_relaxed);
+}
+
+int64_t CircuitBreaker::now() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CircuitBreaker::trip(int64_t t) {
+    this->opened_at.store(t, std::memory_order_relaxed);
+    this->current.store(Open, std::memory_order_release);
+}
+
+CircuitBreaker::State CircuitBreaker::state() const {
+    return static_cast<State>(this->current.load(std::memory_order_acquire));
+}
+
+bool CircuitBreaker::isOpen() const {
+    return (this->state() == Open) && (now() < this->opened_at.load(std::memory_order_relaxed) + this->opts.open_time);
+}
+
+CircuitBreaker::Permit CircuitBreaker::allow() {
+    int s = this->current.load(std::memory_order_acquire);
+    if (s == Closed) {
+        return {true, 0};
+    }
+    if (s == Open) {
+        if (now() < this->opened_at.load(std::memory_order_relaxed) + this->opts.open_time) {
+            return {};
+        }
+        // open time elapsed: the first thread starts a half open round
+        if (this->current.compare_exchange_strong(s, HalfOpen, std::memory_order_acq_rel)) {
+            this->probe_successes.store(0, std::memory_order_relaxed);
+            this->round.fetch_add(1, std::memory_order_acq_rel);
+        } else if (s != HalfOpen) {
+            return {s == Closed, 0};
+        }
+    }
+    // half open: limited number of probes in flight (probes of an earlier round still hold their slot)
+    if (this->probes.fetch_add(1, std::memory_order_acq_rel) < this->opts.probes) {
+        uint32_t r = this->round.load(std::memory_order_acquire);
+        return {true, (r == 0) ? 1 : r}; // 0 while the first round is starting, probes are never 0
+    }
+    this->probes.fetch_sub(1, std::memory_order_relaxed);
+    return {};
+}
+
+void CircuitBreaker::record(const Permit& permit, bool success, std::chrono::microseconds latency) {
+    if (!permit) {
+        return;
+    }
+    if ((this->opts.slow_call > 0) && (latency.count() > int64_t(this->opts.slow_call) * 1000)) {
+        success = false;
+    }
+    int64_t t = now();
+    int s = this->current.load(std::memory_order_acquire);
+    if (permit.probe != 0) {
+        this->probes.fetch_sub(1, std::memory_order_relaxed);
+        if ((s != HalfOpen) || (permit.probe != this->round.load(std::memory_order_acquire))) {
+            return; // probe of an earlier round
+        }
+        if (!success) {
+            this->trip(t);
+        } else if (this->probe_successes.fetch_add(1, std::memory_order_acq_rel) + 1 >= this->opts.probes) {
+            this->counts.store(0, std::memory_order_relaxed);
+            this->window_start.store(t, std::memory_order_relaxed);
+            this->current.store(Closed, std::memory_order_release);
+        }
+        return;
+    }
+    if (s != Closed) {
+        return; // allowed before the breaker opened
+    }
+    int64_t start = this->window_start.load(std::memory_order_relaxed);
+    if ((t - start > this->opts.window) && this->window_start.compare_exchange_strong(start, t, std::memory_order_relaxed)) {
+        // new window (a few concurrent updates may land in the old one)
+        this->counts.store(0, std::memory_order_relaxed);
+    }
+    uint64_t c = this->counts.fetch_add((uint64_t(1) << 32) | (success ? 0 : 1), std::memory_order_relaxed) + ((uint64_t(1) << 32) | (success ? 0 : 1));
+    uint64_t requests = c >> 32;
+    uint64_t failures = c & 0xffffffff;
+    if (!success && (requests >= uint64_t(this->opts.min_requests)) && (failures * 100 >= requests * this->opts.error_rate)) {
+        int expected = Closed;
+        this->opened_at.store(t, std::memory_order_relaxed);
+        this->current.compare_exchange_strong(expected, Open, std::memory_order_acq_rel);
+    }
+}
@@ -0,0 +1,84 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+
+#define NICEHTTP_BREAKER_WINDOW 10000    // ms of the window used to compute the error rate
+#define NICEHTTP_BREAKER_MIN_REQUESTS 20 // requests in the window before the breaker can open
+#define NICEHTTP_BREAKER_ERROR_RATE 50   // % of failed requests that opens the breaker
+#define NICEHTTP_BREAKER_OPEN_TIME 5000  // ms the breaker stays open before letting probes through
+#define NICEHTTP_BREAKER_PROBES 3        // probe requests allowed while half open
+
+struct BreakerOptions {
+    int window = NICEHTTP_BREAKER_WINDOW;
+    int min_requests = NICEHTTP_BREAKER_MIN_REQUESTS;
+    int error_rate = NICEHTTP_BREAKER_ERROR_RATE;
+    int slow_call = 0; // ms, slower requests count as failures (0 = disabled)
+    int open_time = NICEHTTP_BREAKER_OPEN_TIME;
+    int probes = NICEHTTP_BREAKER_PROBES;
+};
+
+// Thrown by NiceHTTP::request when the circuit breaker of the endpoint is open
+class CircuitOpenError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class CircuitBreaker {
+    /* Per endpoint circuit breaker.
+     * Closed: requests flow, failures and slow calls are counted over a window;
+     * when the error rate passes the threshold the breaker opens.
+     * Open: requests fail immediately, without touching the network.
+     * Half open: after open_time, a few probe requests go through; if they all
+     * succeed the breaker closes, a single failure opens it again.
+     * allow() returns a Permit that is given back to record(): only the outcomes
+     * of the probes of the current half open round count while half open, the
+     * requests allowed before the breaker opened are ignored when they finish.
+     * Only atomics are used, calling allow()/record() on every request is cheap.
+     */
+public:
+    enum State { Closed, Open, HalfOpen };
+    struct Permit {
+        bool allowed = false;
+        uint32_t probe = 0; // half open round of a probe request, 0 for other requests
+        explicit operator bool() const { return this->allowed; }
+    };
+    CircuitBreaker(const BreakerOptions& opts = {});
+    Permit allow(); // false if the request must fail fast
+    void record(const Permit& permit, bool success, std::chrono::microseconds latency); // outcome of an allowed request
+    State state() const;
+    bool isOpen() const; // open and not yet ready to probe
+private:
+    BreakerOptions opts;
+    std::atomic<int> current{Closed};
+    std::atomic<int64_t> opened_at{0};    // steady clock ms
+    std::atomic<int64_t> window_start{0}; // steady clock ms
+    std::atomic<uint64_t> counts{0};      // requests in the high 32 bits, failures in the low ones
+    std::atomic<int> probes{0};           // probes in flight, of any round
+    std::atomic<int> probe_successes{0};  // in the current round
+    std::atomic<uint32_t> round{0};       // half open periods so far
+    static int64_t now();
+    void trip(int64_t t);
+};
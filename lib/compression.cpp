@@ -0,0 +1,248 @@
+#include "compression.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <ranges>
+#ifdef NICEHTTP_COMPRESSION
+#include <zlib.h>
+#endif
+
+static std::string_view encoding_token(std::string_view s) {
+    // without the spaces around it
+    while (!s.empty() && ((s.front() == ' ') || (s.front() == '\t'))) s.remove_prefix(1);
+    while (!s.empty() && ((s.back() == ' ') || (s.back() == '\t'))) s.remove_suffix(1);
+    return s;
+}
+
+static bool token_is(std::string_view token, std::string_view name) {
+    return std::ranges::equal(token, name, [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; });
+}
+
+compression::Encoding compression::parse(std::string_view content_encoding) {
+    std::string_view token = encoding_token(content_encoding);
+    if (token.empty() || token_is(token, "identity")) {
+        return Encoding::Identity;
+    } else if (token_is(token, "gzip") || token_is(token, "x-gzip")) {
+        return Encoding::Gzip;
+    } else if (token_is(token, "deflate")) {
+        return Encoding::Deflate;
+    }
+    return Encoding::Unsupported; // br, zstd, several encodings in a row...
+}
+
+compression::Encoding compression::negotiate(std::string_view accept_encoding) {
+    // Accept-Encoding: gzip;q=0.8, deflate, *;q=0 -> the highest q, gzip when equal
+    double gzip = -1, deflate = -1, any = -1;
+    for (const auto part : std::views::split(accept_encoding, ',')) {
+        std::string_view item(part);
+        size_t semicolon = item.find(';');
+        std::string_view token = encoding_token(item.substr(0, semicolon));
+        double q = 1;
+        if (semicolon != std::string::npos) {
+            size_t i = item.find("q=", semicolon);
+            if (i != std::string::npos) {
+                std::from_chars(item.data() + i + 2, item.data() + item.size(), q);
+            }
+        }
+        if (token_is(token, "gzip") || token_is(token, "x-gzip")) {
+            gzip = q;
+        } else if (token_is(token, "deflate")) {
+            deflate = q;
+        } else if (token == "*") {
+            any = q;
+        }
+    }
+    gzip = (gzip < 0) ? any : gzip;
+    deflate = (deflate < 0) ? any : deflate;
+    if ((gzip > 0) && (gzip >= deflate)) {
+        return Encoding::Gzip;
+    } else if (deflate > 0) {
+        return Encoding::Deflate;
+    }
+    return Encoding::Identity;
+}
+
+const char* compression::name(Encoding encoding) {
+    switch (encoding) {
+        case Encoding::Identity: return "identity";
+        case Encoding::Gzip: return "gzip";
+        case Encoding::Deflate: return "deflate";
+        default: return "unsupported";
+    }
+}
+
+#ifdef NICEHTTP_COMPRESSION
+
+struct ZStreams {
+    /* zlib streams of a thread, reset after every body instead of allocated
+     * (a deflate stream is a few hundred KB).
+     */
+    z_stream deflaters[2] = {}; // gzip, zlib format
+    int levels[2] = {-1, -1};   // -1 not initialized
+    z_stream inflaters[2] = {}; // gzip or zlib header (detected), raw deflate
+    bool inflating[2] = {false, false};
+    ~ZStreams() {
+        for (int i = 0; i < 2; i++) {
+            if (this->levels[i] != -1) deflateEnd(&this->deflaters[i]);
+            if (this->inflating[i]) inflateEnd(&this->inflaters[i]);
+        }
+    }
+    z_stream& deflater(compression::Encoding encoding, int level) {
+        int i = (encoding == compression::Encoding::Gzip) ? 0 : 1;
+        if (this->levels[i] == -1) {
+            if (deflateInit2(&this->deflaters[i], level, Z_DEFLATED, (i == 0) ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw compression::Error("Cannot initialize zlib");
+            }
+        } else if (this->levels[i] != level) {
+            deflateParams(&this->deflaters[i], level, Z_DEFAULT_STRATEGY);
+        }
+        this->levels[i] = level;
+        return this->deflaters[i];
+    }
+    z_stream& inflater(bool raw) {
+        int i = raw ? 1 : 0;
+        if (!this->inflating[i]) {
+            if (inflateInit2(&this->inflaters[i], raw ? -15 : 15 + 32) != Z_OK) {
+                throw compression::Error("Cannot initialize zlib");
+            }
+            this->inflating[i] = true;
+        }
+        return this->inflaters[i];
+    }
+};
+
+static thread_local ZStreams zstreams;
+
+void compression::compress(std::string_view data, Encoding encoding, std::pmr::string& out, int level) {
+    if ((encoding != Encoding::Gzip) && (encoding != Encoding::Deflate)) {
+        throw Error(std::string("Cannot compress to ") + name(encoding));
+    }
+    z_stream& z = zstreams.deflater(encoding, level);
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    z.avail_in = static_cast<uInt>(data.size());
+    size_t from = out.size();
+    size_t bound = deflateBound(&z, data.size());
+    int rc = Z_OK;
+    // no zero filling of the output, zlib writes it
+    out.resize_and_overwrite(from + bound, [&](char* p, size_t n) {
+        z.next_out = reinterpret_cast<Bytef*>(p + from);
+        z.avail_out = static_cast<uInt>(bound);
+        rc = deflate(&z, Z_FINISH);
+        return (rc == Z_STREAM_END) ? n - z.avail_out : from;
+    });
+    deflateReset(&z);
+    if (rc != Z_STREAM_END) {
+        throw Error("deflate failed");
+    }
+}
+
+static int inflate_into(z_stream& z, std::string_view data, std::pmr::string& out, size_t max_size, bool& too_large) {
+    // inflate data appending it to out, returns the last zlib result
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    z.avail_in = static_cast<uInt>(data.size());
+    size_t from = out.size();
+    size_t chunk = std::max<size_t>(data.size() * 4, 4096);
+    int rc = Z_OK;
+    while (rc == Z_OK) {
+        size_t used = out.size() - from;
+        if (used >= max_size) {
+            too_large = true;
+            break;
+        }
+        size_t grow = std::min(chunk, max_size - used);
+        out.resize_and_overwrite(out.size() + grow, [&](char* p, size_t n) {
+            z.next_out = reinterpret_cast<Bytef*>(p + n - grow);
+            z.avail_out = static_cast<uInt>(grow);
+            rc = inflate(&z, Z_NO_FLUSH);
+            return n - z.avail_out;
+        });
+        chunk *= 2;
+    }
+    if ((rc == Z_STREAM_END) && (z.avail_in != 0)) {
+        rc = Z_DATA_ERROR; // trailing garbage
+    }
+    inflateReset(&z);
+    return rc;
+}
+
+bool compression::decompress(std::string_view data, Encoding encoding, std::pmr::string& out, size_t max_size) {
+    if (encoding == Encoding::Identity) {
+        if (data.size() > max_size) {
+            return false;
+        }
+        out.append(data);
+        return true;
+    }
+    if ((encoding != Encoding::Gzip) && (encoding != Encoding::Deflate)) {
+        throw Error(std::string("Cannot decompress ") + name(encoding));
+    }
+    size_t from = out.size();
+    bool too_large = false;
+    int rc = inflate_into(zstreams.inflater(false), data, out, max_size, too_large);
+    if ((rc == Z_DATA_ERROR) && (encoding == Encoding::Deflate) && !too_large) {
+        // some clients send deflate without the zlib header
+        out.resize(from);
+        rc = inflate_into(zstreams.inflater(true), data, out, max_size, too_large);
+    }
+    if (too_large) {
+        out.resize(from);
+        return false;
+    }
+    if (rc != Z_STREAM_END) {
+        out.resize(from);
+        throw Error(std::string("Corrupt ") + name(encoding) + " data");
+    }
+    return true;
+}
+
+static uint64_t body_check(std::string_view data) {
+    // second hash of a cached body (FNV-1a over 8 byte words), independent of std::hash
+    uint64_t hash = 14695981039346656037ull ^ data.size();
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word;
+        memcpy(&word, data.data() + i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; i < data.size(); i++) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    }
+    return hash ^ (hash >> 29);
+}
+
+void compression::Cache::compress(std::string_view data, Encoding encoding, std::pmr::string& out) {
+    Key key {std::hash<std::string_view>{}(data), body_check(data), encoding};
+    std::shared_ptr<const std::pmr::string> entry;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto it = this->entries.find(key);
+        if (it != this->entries.end()) {
+            entry = it->second;
+        }
+    }
+    if (!entry) {
+        // compressed out of the lock, two threads may do it for the same body at worst
+        auto compressed = std::make_shared<std::pmr::string>();
+        compression::compress(data, encoding, *compressed, NICEHTTP_COMPRESSION_CACHED_LEVEL);
+        entry = compressed;
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if ((entry->size() <= this->max_bytes) && this->entries.emplace(key, entry).second) {
+            this->order.push_back(key);
+            this->size += entry->size();
+            while (this->size > this->max_bytes) {
+                auto oldest = this->entries.find(this->order.front());
+                this->size -= oldest->second->size();
+                this->entries.erase(oldest);
+                this->order.pop_front();
+            }
+        }
+    }
+    out.append(*entry);
+}
+
+size_t compression::Cache::bytes() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->size;
+}
+
+#endif
@@ -0,0 +1,91 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#define NICEHTTP_COMPRESSION_MIN 1024 // bytes, smaller response bodies are sent as they are
+#define NICEHTTP_COMPRESSION_LEVEL 5 // zlib level of the responses compressed at every request
+#define NICEHTTP_COMPRESSION_CACHED_LEVEL 9 // zlib level of the bodies kept in the cache, compressed once
+#define NICEHTTP_COMPRESSION_CACHE (16 << 20) // bytes of compressed bodies cached by NiceHTTP
+#define NICEHTTP_MAX_INFLATED (16 << 20) // bytes a compressed request body can inflate to
+
+namespace compression {
+
+/* gzip and deflate (zlib format) bodies, Content-Encoding and Accept-Encoding.
+ * The functions are there with NICEHTTP_COMPRESSION only (link with zlib), the
+ * encodings are parsed in any case.
+ */
+enum class Encoding { Identity, Gzip, Deflate, Unsupported };
+
+class Error : public std::runtime_error {
+public:
+    explicit Error(const std::string& message) : std::runtime_error(message) {}
+};
+
+Encoding parse(std::string_view content_encoding); // value of a Content-Encoding header
+Encoding negotiate(std::string_view accept_encoding); // best encoding accepted, gzip first
+const char* name(Encoding encoding); // token for Content-Encoding
+
+#ifdef NICEHTTP_COMPRESSION
+// append data compressed to out, throws compression::Error
+void compress(std::string_view data, Encoding encoding, std::pmr::string& out, int level = NICEHTTP_COMPRESSION_LEVEL);
+// append data inflated to out, false if it is longer than max_size; throws compression::Error if data is corrupt
+bool decompress(std::string_view data, Encoding encoding, std::pmr::string& out, size_t max_size = NICEHTTP_MAX_INFLATED);
+
+class Cache {
+    /* Compressed versions of the bodies that repeat (static files, cached documents),
+     * so they are compressed once, at the best level, and then only copied.
+     * Keyed by two independent 64 bit hashes of the body and the encoding; when over
+     * max_bytes the oldest entries are evicted.
+     */
+public:
+    explicit Cache(size_t max_bytes = NICEHTTP_COMPRESSION_CACHE) : max_bytes(max_bytes) {}
+    void compress(std::string_view data, Encoding encoding, std::pmr::string& out); // append to out
+    size_t bytes();
+private:
+    struct Key {
+        uint64_t hash;
+        uint64_t check;
+        Encoding encoding;
+        bool operator==(const Key&) const = default;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const { return key.hash ^ static_cast<size_t>(key.encoding); }
+    };
+    std::mutex mutex;
+    std::unordered_map<Key, std::shared_ptr<const std::pmr::string>, KeyHash> entries;
+    std::deque<Key> order; // insertion order, for the eviction
+    size_t size = 0;
+    size_t max_bytes;
+};
+#endif
+
+} // namespace compression
@@ -0,0 +1,66 @@
+#include "connection_pool.h"
+
+ConnectionPool::~ConnectionPool() {
+    this->clear();
+}
+
+std::string ConnectionPool::key(const std::string& host, short port) {
+    return host + ":" + std::to_string(port);
+}
+
+void ConnectionPool::close_fd(int fd) {
+    #ifdef _WIN32
+    closesocket(fd);
+    #else
+    close(fd);
+    #endif
+}
+
+int ConnectionPool::get(const std::string& host, short port) {
+    auto expired = std::chrono::steady_clock::now() - std::chrono::seconds(NICEHTTP_POOL_IDLE_TIMEOUT);
+    while (true) {
+        Idle conn;
+        {
+            std::scoped_lock lock(this->mutex);
+            auto it = this->idle.find(key(host, port));
+            if ((it == this->idle.end()) || it->second.empty()) {
+                return -1;
+            }
+            conn = it->second.back();
+            it->second.pop_back();
+        }
+        // An idle socket must have nothing to read: data or EOF means the peer closed it
+        struct pollfd pfd = {conn.fd, POLLIN, 0};
+        #ifdef _WIN32
+        int rc = WSAPoll(&pfd, 1, 0);
+        #else
+        int rc = poll(&pfd, 1, 0);
+        #endif
+        if ((rc == 0) && (conn.since > expired)) {
+            return conn.fd;
+        }
+        close_fd(conn.fd);
+    }
+}
+
+void ConnectionPool::put(const std::string& host, short port, int fd) {
+    {
+        std::scoped_lock lock(this->mutex);
+        std::vector<Idle>& conns = this->idle[key(host, port)];
+        if (conns.size() < NICEHTTP_POOL_MAX_IDLE) {
+            conns.push_back({fd, std::chrono::steady_clock::now()});
+            return;
+        }
+    }
+    close_fd(fd);
+}
+
+void ConnectionPool::clear() {
+    std::scoped_lock lock(this->mutex);
+    for (auto& entry : this->idle) {
+        for (const Idle& conn : entry.second) {
+            close_fd(conn.fd);
+        }
+    }
+    this->idle.clear();
+}
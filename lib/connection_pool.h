@@ -0,0 +1,58 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <sys/poll.h>
+#endif
+
+#define NICEHTTP_POOL_MAX_IDLE 32     // idle connections kept for each host:port
+#define NICEHTTP_POOL_IDLE_TIMEOUT 30 // seconds an idle connection is kept open
+
+class ConnectionPool {
+    /* Idle keep-alive client connections grouped by host:port.
+     * Connections are reused LIFO (the most recently used socket is the most
+     * likely to still be open and warm) and checked before being handed out:
+     * a socket that became readable while idle was closed by the peer.
+     */
+public:
+    ~ConnectionPool();
+    int get(const std::string& host, short port); // -1 if there is no usable idle connection
+    void put(const std::string& host, short port, int fd);
+    void clear(); // close every idle connection
+private:
+    struct Idle {
+        int fd;
+        std::chrono::steady_clock::time_point since;
+    };
+    std::mutex mutex;
+    std::unordered_map<std::string, std::vector<Idle>> idle;
+    static std::string key(const std::string& host, short port);
+    static void close_fd(int fd);
+};
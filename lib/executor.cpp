@@ -0,0 +1,32 @@
+#include "executor.h"
+
+Executor::Executor(unsigned int threads, unsigned int max_queue) : pool(threads) {
+    this->limit = threads + max_queue;
+}
+
+bool Executor::submit(std::function<void()> task) {
+    if (this->inflight.fetch_add(1, std::memory_order_acq_rel) >= static_cast<int>(this->limit)) {
+        this->inflight.fetch_sub(1, std::memory_order_release);
+        return false;
+    }
+    this->pool.enqueue_detach([this, task = std::move(task)]() {
+        try {
+            task();
+        } catch (...) {
+        }
+        this->inflight.fetch_sub(1, std::memory_order_release);
+    });
+    return true;
+}
+
+int Executor::load() const {
+    return this->inflight.load(std::memory_order_relaxed);
+}
+
+unsigned int Executor::capacity() const {
+    return this->limit;
+}
+
+dp::pool_statistics Executor::stats() const {
+    return this->pool.stats();
+}
@@ -0,0 +1,45 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#include <atomic>
+#include <functional>
+#include "thread_pool.h"
+
+class Executor {
+    /* Bulkhead for the routes assigned to it (Route::executor).
+     * The server hands their requests off to this thread pool, so slow routes
+     * can only use up their own workers and never the ones of the other routes.
+     * At most threads requests run and max_queue wait: when the executor is
+     * full submit() fails and the server answers 503 at once.
+     */
+public:
+    Executor(unsigned int threads, unsigned int max_queue = 0);
+    bool submit(std::function<void()> task); // false if the executor is full
+    int load() const; // requests running or waiting
+    unsigned int capacity() const;
+    dp::pool_statistics stats() const; // worker counters and queueing delay of the pool
+private:
+    std::atomic<int> inflight{0};
+    unsigned int limit;
+    dp::thread_pool<> pool; // last member: its workers stop before the counters go away
+};
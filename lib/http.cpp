@@ -1,6 +1,7 @@
 #include "http.h"
+#include "logger.h"
 
-void http::Message::parseHeaders(const std::string& headerstr) {
+void http::Message::parseHeaders(std::string_view headerstr) {
     for (const auto h : std::views::split(headerstr, '\n')) {
         std::string_view header(h);
         size_t i = header.find(": ");
@@ -8,34 +9,111 @@ void http::Message::parseHeaders(const std::string& headerstr) {
             //invalid header, skip it..
             continue;
         }
-        std::string key(header.substr(0, i));
-        std::string val(header.substr(i+2, header.length()-i-3));
+        std::pmr::string key(header.substr(0, i), this->get_allocator());
+        std::string_view val(header.substr(i+2, header.length()-i-3));
         std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c){ return std::tolower(c); });
         if (key == "content-length") {
             //The request has a payload
-            this->content_length = strtoul(std::string(val).c_str(), nullptr, 0);
+            std::from_chars(val.data(), val.data() + val.size(), this->content_length);
         } else if (( key == "content-type") && (val == "application/json")) {
             this->is_json = true;
+        } else if (( key == "content-type") && (val == "application/cbor")) {
+            this->is_cbor = true;
         } else {
-            this->headers.insert({key, val});
+            this->headers.emplace(std::move(key), val);
         }
     }
 }
 
+json::Value http::Message::json() const {
+    // the document refers to the body, parse it again if the body moved or changed size
+    if (!this->json_document || (this->json_document->source().data() != this->body.data()) || (this->json_document->source().size() != this->body.size())) {
+        if (!this->json_document) {
+            this->json_document.emplace(this->get_allocator());
+        }
+        this->json_document->parse(this->body);
+    }
+    return this->json_document->root();
+}
+
+json::Writer http::Message::writeJson() {
+    this->body.clear();
+    this->content_length = 0;
+    this->is_json = true;
+    this->is_cbor = false;
+    return ::json::Writer(this->body, &this->content_length);
+}
+
+cbor::Value http::Message::cbor() const {
+    if (!this->cbor_document || (this->cbor_document->source().data() != this->body.data()) || (this->cbor_document->source().size() != this->body.size())) {
+        if (!this->cbor_document) {
+            this->cbor_document.emplace(this->get_allocator());
+        }
+        this->cbor_document->parse(this->body);
+    }
+    return this->cbor_document->root();
+}
+
+cbor::Writer http::Message::writeCbor() {
+    this->body.clear();
+    this->content_length = 0;
+    this->is_json = false;
+    this->is_cbor = true;
+    return ::cbor::Writer(this->body, &this->content_length);
+}
+
+static bool media_is(std::string_view type, std::string_view name) {
+    return std::ranges::equal(type, name, [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; });
+}
+
+http::Format http::negotiateFormat(std::string_view accept) {
+    // Accept: application/cbor, application/json;q=0.5 -> CBOR; */* alone or no Accept -> JSON
+    double cbor = 0, json = -1, any = -1;
+    for (const auto part : std::views::split(accept, ',')) {
+        std::string_view item(part);
+        size_t semicolon = item.find(';');
+        std::string_view type = item.substr(0, semicolon);
+        while (!type.empty() && ((type.front() == ' ') || (type.front() == '\t'))) type.remove_prefix(1);
+        while (!type.empty() && ((type.back() == ' ') || (type.back() == '\t'))) type.remove_suffix(1);
+        double q = 1;
+        if (semicolon != std::string::npos) {
+            size_t i = item.find("q=", semicolon);
+            if (i != std::string::npos) {
+                std::from_chars(item.data() + i + 2, item.data() + item.size(), q);
+            }
+        }
+        if (media_is(type, "application/cbor")) {
+            cbor = q;
+        } else if (media_is(type, "application/json")) {
+            json = q;
+        } else if ((type == "*/*") || media_is(type, "application/*")) {
+            any = std::max(any, q);
+        }
+    }
+    json = (json < 0) ? any : json;
+    return ((cbor > 0) && (cbor >= json)) ? Format::Cbor : Format::Json;
+}
+
 http::Request::Request(std::string method, std::string uri, std::string proto, std::map<std::string,std::string> headers, bool is_json, size_t content_length, std::string body) {
     this->method = method;
     this->uri = uri;
     this->proto = proto;
     this->content_length = content_length;
     this->body = body;
-    this->headers = headers;
+    this->headers.insert(headers.begin(), headers.end());
     this->is_json = is_json;
 }
 
-http::Request::Request(std::string &head, std::string& body) {
+http::Request::Request(std::string_view head, std::string_view body) {
+    this->parseHead(head);
+    this->setBody(body);
+}
+
+void http::Request::parseHead(std::string_view head) {
+    // Parse the request line and the headers
     size_t i = head.find("\r\n");
     if (i != std::string::npos) {
-        std::string line = head.substr(0, i);
+        std::string_view line = head.substr(0, i);
         short j = 0;
         for (const auto word : std::views::split(line, ' ')) {
             switch (j) {
@@ -54,21 +132,23 @@ http::Request::Request(std::string &head, std::string& body) {
             j++;
         }
         if (this->proto != PROTO_HTTP1) {
-            std::cerr << "Protocol not supported" << std::endl;
-        }
-        std::string headerstr = head.substr(i+2);
-        this->parseHeaders(headerstr);
-        if ((this->content_length > 0) && (body.length() != this->content_length)){
-            std::cout << "Error in body parsing! Content length " << this->content_length << " != body length " << body.length() << std::endl;
-        } else {
-            this->body = body;
+            Logger::getInstance().error("Protocol not supported");
         }
+        this->parseHeaders(head.substr(i+2));
+    } else {
+        Logger::getInstance().error("Malformed request");
+    }
+}
+
+void http::Request::setBody(std::string_view body) {
+    if ((this->content_length > 0) && (body.length() != this->content_length)){
+        Logger::getInstance().error("Error in body parsing! Content length " + std::to_string(this->content_length) + " != body length " + std::to_string(body.length()));
     } else {
-        std::cerr << "Malformed request" << std::endl;
+        this->body = body;
     }
 }
 
-http::Request::Request(const Request& hr) {
+http::Request::Request(const Request& hr) : Message() {
     method = hr.method;
     uri = hr.uri;
     proto = hr.proto;
@@ -76,25 +156,36 @@ http::Request::Request(const Request& hr) {
     body = hr.body;
     headers = hr.headers;
     is_json = hr.is_json;
+    is_cbor = hr.is_cbor;
 }
 
-std::string http::Request::toString(bool carriage_return) {
-    std::string endline;
-    carriage_return ? endline = "\r\n" : endline = "\n";
-    std::string req { std::format("{} {} {}{}", this->method, this->uri, this->proto, endline) };
-    for (const auto& h : this->headers) {
-        req += std::format("{}: {}{}", h.first, h.second, endline);
+template <typename String>
+static void append_message(String& out, std::string_view first, std::string_view second, std::string_view third, const http::Message& m, bool length, std::string_view endline) {
+    // start line, headers, Content-Length and Content-Type, body
+    out.append(first).append(" ").append(second).append(" ").append(third).append(endline);
+    for (const auto& h : m.headers) {
+        out.append(h.first).append(": ").append(h.second).append(endline);
     }
-    if (this->content_length != 0) {
-        req += std::format("Content-Length: {}{}", this->content_length, endline);
-        if (this->is_json) {
-            req += "Content-Type: application/json" + endline;
+    if (length) {
+        char digits[24];
+        auto end = std::to_chars(digits, digits + sizeof(digits), m.content_length).ptr;
+        out.append("Content-Length: ").append(std::string_view(digits, end - digits)).append(endline);
+        if (m.is_json && (m.content_length != 0)) {
+            out.append("Content-Type: application/json").append(endline);
+        } else if (m.is_cbor && (m.content_length != 0)) {
+            out.append("Content-Type: application/cbor").append(endline);
         }
-        req += endline;
-        req += this->body;
-    } else {
-        req += endline;
     }
+    out.append(endline);
+    if (m.content_length != 0) {
+        out.append(m.body);
+    }
+}
+
+std::string http::Request::toString(bool carriage_return) {
+    std::string req;
+    req.reserve(this->method.size() + this->uri.size() + 64 + this->headers.size() * 32 + this->body.size());
+    append_message(req, this->method, this->uri, this->proto, *this, this->content_length != 0, carriage_return ? "\r\n" : "\n");
     return req;
 }
 
@@ -104,14 +195,14 @@ http::Response::Response(short code, std::string message, std::string proto, std
     this->proto = proto;
     this->content_length = content_length;
     this->body = body;
-    this->headers = headers;
+    this->headers.insert(headers.begin(), headers.end());
     this->is_json = is_json;
 }
 
-http::Response::Response(std::string &head, std::string &body) {
+http::Response::Response(std::string_view head, std::string_view body) {
     size_t i = head.find("\r\n");
     if (i != std::string::npos) {
-        std::string line = head.substr(0, i);
+        std::string_view line = head.substr(0, i);
         short j = 0;
         int digits = 0;
         for (const auto word : std::views::split(line, ' ')) {
@@ -132,21 +223,20 @@ http::Response::Response(std::string &head, std::string &body) {
         // All the rest of the line is the message
         this->message = line.substr(this->proto.length()+digits+2);
         if (this->proto != PROTO_HTTP1) {
-            std::cerr << "Protocol not supported" << std::endl;
+            Logger::getInstance().error("Protocol not supported");
         }
-        std::string headerstr = head.substr(i+2);
-        this->parseHeaders(headerstr);
+        this->parseHeaders(head.substr(i+2));
         if ((this->content_length > 0) && (body.length() != this->content_length)){
-            std::cout << "Error in body parsing! Content length " << this->content_length << " != body length " << body.length() << std::endl;
+            Logger::getInstance().error("Error in body parsing! Content length " + std::to_string(this->content_length) + " != body length " + std::to_string(body.length()));
         } else {
             this->body = body;
         }
     } else {
-        std::cerr << "Malformed request" << std::endl;
+        Logger::getInstance().error("Malformed request");
     }
 }
 
-http::Response::Response(const Response& r) {
+http::Response::Response(const Response& r) : Message() {
     message = r.message;
     code = r.code;
     proto = r.proto;
@@ -154,28 +244,40 @@ http::Response::Response(const Response& r) {
     body = r.body;
     headers = r.headers;
     is_json = r.is_json;
+    is_cbor = r.is_cbor;
+}
+
+static bool has_body(short code) {
+    // responses that can't have a body, so no Content-Length either
+    return (code >= 200) && (code != 204) && (code != 304);
 }
 
 std::string http::Response::toString(bool carriage_return) {
-    std::string endline;
-    carriage_return ? endline = "\r\n" : endline = "\n";
-    std::string res { std::format("{} {} {}{}", this->proto, this->code, this->message, endline) };
-    for (const auto& h : this->headers) {
-        res += std::format("{}: {}{}", h.first, h.second, endline);
-    }
-    if (this->content_length != 0) {
-        res += std::format("Content-Length: {}{}", this->content_length, endline);
-        if (this->is_json) {
-            res += "Content-Type: application/json" + endline;
-        }
-        res += endline;
-        res += this->body;
-    } else {
-        res += endline;
-    }
+    std::string res;
+    res.reserve(this->message.size() + 64 + this->headers.size() * 32 + this->body.size());
+    char digits[8];
+    auto end = std::to_chars(digits, digits + sizeof(digits), this->code).ptr;
+    // Content-Length is always sent, even when 0, so the response is delimited on a kept alive connection
+    append_message(res, this->proto, std::string_view(digits, end - digits), this->message, *this, has_body(this->code), carriage_return ? "\r\n" : "\n");
     return res;
 }
 
+http::BodyWriter http::Response::writeBody(const Request& req) {
+    this->headers.emplace("Vary", "Accept");
+    auto accept = req.headers.find("accept");
+    if ((accept != req.headers.end()) && (negotiateFormat(accept->second) == Format::Cbor)) {
+        return BodyWriter(this->writeCbor());
+    }
+    return BodyWriter(this->writeJson());
+}
+
+void http::Response::serialize(std::pmr::string& out) const {
+    out.reserve(out.size() + this->message.size() + 64 + this->headers.size() * 32 + this->body.size());
+    char digits[8];
+    auto end = std::to_chars(digits, digits + sizeof(digits), this->code).ptr;
+    append_message(out, this->proto, std::string_view(digits, end - digits), this->message, *this, has_body(this->code), "\r\n");
+}
+
 http::Request& http::Request::operator=(const Request& other) {
     // Guard self assignment
     if (this == &other)
@@ -188,6 +290,9 @@ http::Request& http::Request::operator=(const Request& other) {
     this->body = other.body;
     this->headers = other.headers;
     this->is_json = other.is_json;
+    this->is_cbor = other.is_cbor;
+    this->json_document.reset();
+    this->cbor_document.reset();
 
     return *this;
 }
@@ -204,6 +309,9 @@ http::Response& http::Response::operator=(const Response& other) {
     this->body = other.body;
     this->headers = other.headers;
     this->is_json = other.is_json;
+    this->is_cbor = other.is_cbor;
+    this->json_document.reset();
+    this->cbor_document.reset();
 
     return *this;
 }
\ No newline at end of file
@@ -22,50 +22,120 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #pragma once
 #include <string_view>
 #include <map>
-#include <format>
+#include <memory_resource>
+#include <charconv>
 #include <ranges>
 #include <string>
 #include <iostream>
 #include <algorithm>
+#include <optional>
+#include <variant>
+#include "json.h"
+#include "cbor.h"
 #define PROTO_HTTP1 "HTTP/1.1"
 
 namespace http {
 
 // Common http message (could be request or response)
+// Strings and headers are allocator-aware: a message built with a memory resource
+// (e.g. the arena of a server connection) keeps all its data there, default
+// constructed messages use the heap. Copies always go to the heap.
 class Message { // base class
 public:
-    std::string proto;
-    std::map<std::string,std::string> headers;
-    std::string body;
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+    std::pmr::string proto;
+    std::pmr::map<std::pmr::string,std::pmr::string> headers;
+    std::pmr::string body;
     bool is_json = false;
+    bool is_cbor = false; // Content-Type: application/cbor
     size_t content_length = 0;
     Message() {}
-    void parseHeaders(const std::string& headerstr);
+    explicit Message(allocator_type alloc) : proto(alloc), headers(alloc), body(alloc) {}
+    allocator_type get_allocator() const { return this->body.get_allocator(); }
+    void parseHeaders(std::string_view headerstr);
+    // The body as JSON, parsed on the first call (again if the body is replaced), throws json::Error
+    ::json::Value json() const;
+    // Clears the body and returns a writer serializing into it, Content-Length follows the writer
+    ::json::Writer writeJson();
+    // The body as CBOR, read in place, parsed on the first call as json(), throws cbor::Error
+    ::cbor::Value cbor() const;
+    // Clears the body and returns a CBOR encoder writing into it, as writeJson()
+    ::cbor::Writer writeCbor();
+protected:
+    // bodies parsed by json() and cbor(), in the message allocator
+    mutable std::optional<::json::Document> json_document;
+    mutable std::optional<::cbor::Document> cbor_document;
+};
+
+enum class Format { Json, Cbor };
+
+// CBOR if the Accept header lists application/cbor with a q not lower than JSON's, otherwise JSON
+Format negotiateFormat(std::string_view accept);
+
+class BodyWriter {
+    /* The json::Writer or cbor::Writer chosen by Response::writeBody, with their
+     * interface: a handler writes its value once and the client gets the format it
+     * accepts. Values read from a body of the other format are converted.
+     */
+public:
+    explicit BodyWriter(::json::Writer w) : writer(std::in_place_type<::json::Writer>, w) {}
+    explicit BodyWriter(::cbor::Writer w) : writer(std::in_place_type<::cbor::Writer>, w) {}
+    Format format() const { return (this->writer.index() == 0) ? Format::Json : Format::Cbor; }
+    BodyWriter& beginObject() { std::visit([](auto& w) { w.beginObject(); }, this->writer); return *this; }
+    BodyWriter& endObject() { std::visit([](auto& w) { w.endObject(); }, this->writer); return *this; }
+    BodyWriter& beginArray() { std::visit([](auto& w) { w.beginArray(); }, this->writer); return *this; }
+    BodyWriter& endArray() { std::visit([](auto& w) { w.endArray(); }, this->writer); return *this; }
+    BodyWriter& key(std::string_view name) { std::visit([name](auto& w) { w.key(name); }, this->writer); return *this; }
+    BodyWriter& null() { std::visit([](auto& w) { w.null(); }, this->writer); return *this; }
+    template <typename T>
+    BodyWriter& value(const T& v) {
+        std::visit([&v](auto& w) {
+            if constexpr (requires { w.value(v); }) {
+                w.value(v);
+            } else {
+                ::cbor::transcode(w, v); // a json::Value in CBOR or the other way round
+            }
+        }, this->writer);
+        return *this;
+    }
+private:
+    std::variant<::json::Writer, ::cbor::Writer> writer;
 };
 
 
 class Request : public Message {
 public:
-    std::string method;
-    std::string uri;
+    std::pmr::string method;
+    std::pmr::string uri;
     Request() {}
-    Request(std::string &head, std::string &body);
+    explicit Request(allocator_type alloc) : Message(alloc), method(alloc), uri(alloc) {}
+    Request(std::string_view head, std::string_view body);
     Request(std::string method, std::string uri, std::string proto, std::map<std::string,std::string> headers, bool is_json, size_t content_length, std::string body = "");
     Request(const Request& hr);
+    Request(Request&& hr) = default;
+    void parseHead(std::string_view head); // request line and headers, without the body
+    void setBody(std::string_view body); // body matching the parsed Content-Length
     std::string toString(bool carriage_return = true);
     Request& operator=(const Request& other);
+    Request& operator=(Request&& other) = default;
 };
 
 class Response : public Message {
 public:
     short code;
-    std::string message;
+    std::pmr::string message;
     Response() {}
-    Response(std::string &head, std::string &body);
+    explicit Response(allocator_type alloc) : Message(alloc), message(alloc) {}
+    Response(std::string_view head, std::string_view body);
     Response(short code, std::string message, std::string proto, std::map<std::string,std::string> headers, bool is_json, size_t content_length, std::string body = "");
     Response(const Response& r);
+    Response(Response&& r) = default;
     std::string toString(bool carriage_return = true);
+    void serialize(std::pmr::string& out) const; // append the raw response to out
+    // Clears the body and returns a writer in the format negotiated with the Accept header of req
+    BodyWriter writeBody(const Request& req);
     Response& operator=(const Response& other);
+    Response& operator=(Response&& other) = default;
 };
 
 };
\ No newline at end of file
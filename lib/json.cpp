@@ -0,0 +1,754 @@
+#include "json.h"
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#if !defined(NICEHTTP_JSON_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#include <immintrin.h>
+#endif
+
+// characters of a 64 byte block, one bit each
+struct JsonBlock {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op; // {}[]:,
+    uint64_t space;
+    uint64_t high; // bytes >= 0x80, parts of UTF-8 sequences
+};
+
+static JsonBlock json_classify(const char* p) {
+    JsonBlock b;
+#if !defined(NICEHTTP_JSON_NO_SIMD) && defined(__AVX2__)
+    auto mask = [](__m256i v) { return static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(v))); };
+    __m256i chunks[2] = {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32))};
+    b = {0, 0, 0, 0, 0};
+    for (int i = 0; i < 2; i++) {
+        __m256i c = chunks[i];
+        b.high |= mask(c) << (32 * i);
+        __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20)); // [ -> {, ] -> }
+        b.quote |= mask(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('"'))) << (32 * i);
+        b.backslash |= mask(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\\'))) << (32 * i);
+        b.op |= mask(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))),
+                                     _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(':')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8(','))))) << (32 * i);
+        b.space |= mask(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\t'))),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\r'))))) << (32 * i);
+    }
+#elif !defined(NICEHTTP_JSON_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+    auto mask = [](__m128i v) { return static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(v))); };
+    b = {0, 0, 0, 0, 0};
+    for (int i = 0; i < 4; i++) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i));
+        b.high |= mask(c) << (16 * i);
+        __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+        b.quote |= mask(_mm_cmpeq_epi8(c, _mm_set1_epi8('"'))) << (16 * i);
+        b.backslash |= mask(_mm_cmpeq_epi8(c, _mm_set1_epi8('\\'))) << (16 * i);
+        b.op |= mask(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')), _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+                                  _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(':')), _mm_cmpeq_epi8(c, _mm_set1_epi8(','))))) << (16 * i);
+        b.space |= mask(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\t'))),
+                                     _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\r'))))) << (16 * i);
+    }
+#else
+    b = {0, 0, 0, 0, 0};
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = uint64_t(1) << i;
+        if (static_cast<unsigned char>(p[i]) >= 0x80) {
+            b.high |= bit;
+        }
+        switch (p[i]) {
+            case '"': b.quote |= bit; break;
+            case '\\': b.backslash |= bit; break;
+            case '{': case '}': case '[': case ']': case ':': case ',': b.op |= bit; break;
+            case ' ': case '\t': case '\n': case '\r': b.space |= bit; break;
+            default: break;
+        }
+    }
+#endif
+    return b;
+}
+
+static uint64_t json_prefix_xor(uint64_t x) {
+    // bit i = xor of the bits 0..i: 1 from an opening quote to the character before the closing one
+#if !defined(NICEHTTP_JSON_NO_SIMD) && defined(__PCLMUL__)
+    return static_cast<uint64_t>(_mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_set_epi64x(0, static_cast<int64_t>(x)), _mm_set1_epi8(-1), 0)));
+#else
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+#endif
+}
+
+static uint64_t json_escaped(uint64_t backslash, uint64_t& carry) {
+    // characters after an odd number of backslashes, carry: the previous block ended with one
+    const uint64_t even = 0x5555555555555555ULL, odd = ~even;
+    uint64_t starts = backslash & ~(backslash << 1);
+    uint64_t even_start_mask = even ^ carry;
+    uint64_t even_starts = starts & even_start_mask;
+    uint64_t odd_starts = starts & ~even_start_mask;
+    uint64_t even_carries = backslash + even_starts;
+    uint64_t odd_carries = backslash + odd_starts;
+    bool overflow = odd_carries < backslash;
+    odd_carries |= carry;
+    carry = overflow ? 1 : 0;
+    uint64_t even_carry_ends = even_carries & ~backslash;
+    uint64_t odd_carry_ends = odd_carries & ~backslash;
+    return (even_carry_ends & odd) | (odd_carry_ends & even);
+}
+
+// UTF-8 sequence carried from a block to the next one
+struct JsonUtf8 {
+    unsigned need = 0; // continuation bytes still expected
+    unsigned char low = 0x80, high = 0xbf; // range of the next one (no overlongs, surrogates or code points > 10FFFF)
+};
+
+static int json_utf8(const char* p, JsonUtf8& s) {
+    // validate the UTF-8 of a 64 byte block, returns the offset of the first invalid byte or -1
+    for (int i = 0; i < 64; i++) {
+        unsigned char c = static_cast<unsigned char>(p[i]);
+        if (s.need > 0) {
+            if ((c < s.low) || (c > s.high)) {
+                return i;
+            }
+            s.low = 0x80;
+            s.high = 0xbf;
+            s.need--;
+        } else if (c >= 0x80) {
+            if ((c >= 0xc2) && (c <= 0xdf)) {
+                s.need = 1;
+            } else if ((c >= 0xe0) && (c <= 0xef)) {
+                s.need = 2;
+                s.low = (c == 0xe0) ? 0xa0 : 0x80;
+                s.high = (c == 0xed) ? 0x9f : 0xbf;
+            } else if ((c >= 0xf0) && (c <= 0xf4)) {
+                s.need = 3;
+                s.low = (c == 0xf0) ? 0x90 : 0x80;
+                s.high = (c == 0xf4) ? 0x8f : 0xbf;
+            } else {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+static void json_index(std::string_view text, std::pmr::vector<uint32_t>& out) {
+    // stage 1: positions of the structural characters, the opening quotes and the first character of the other values,
+    // and UTF-8 validation of the blocks that aren't ASCII
+    uint64_t escape_carry = 0, in_string_carry = 0, scalar_carry = 0;
+    JsonUtf8 utf8;
+    char tail[64];
+    size_t n = out.size();
+    for (size_t base = 0; base < text.size(); base += 64) {
+        const char* p = text.data() + base;
+        if (text.size() - base < 64) {
+            std::memset(tail, ' ', sizeof(tail));
+            std::memcpy(tail, p, text.size() - base);
+            p = tail;
+        }
+        JsonBlock b = json_classify(p);
+        if ((b.high != 0) || (utf8.need != 0)) {
+            // the padding of the last block is ASCII, a sequence truncated at the end fails there
+            if (int invalid = json_utf8(p, utf8); invalid >= 0) {
+                throw json::Error("Invalid UTF-8 at " + std::to_string(std::min(base + invalid, text.size())));
+            }
+        }
+        uint64_t quotes = b.quote & ~json_escaped(b.backslash, escape_carry);
+        uint64_t in_string = json_prefix_xor(quotes) ^ in_string_carry;
+        in_string_carry = static_cast<uint64_t>(static_cast<int64_t>(in_string) >> 63);
+        uint64_t scalar = ~(b.op | b.space | quotes | in_string);
+        uint64_t starts = scalar & ~((scalar << 1) | scalar_carry);
+        scalar_carry = scalar >> 63;
+        uint64_t structural = (b.op & ~in_string) | (quotes & in_string) | starts;
+        // room for a whole block, the positions are written 8 at a time (as simdjson does) and the size fixed afterwards
+        if (out.size() < n + 64) {
+            out.resize(std::max(out.size() * 2, n + 64));
+        }
+        uint32_t* w = out.data() + n;
+        n += std::popcount(structural);
+        while (structural != 0) {
+            for (int i = 0; i < 8; i++) {
+                w[i] = static_cast<uint32_t>(base + std::countr_zero(structural));
+                structural &= structural - 1;
+            }
+            w += 8;
+        }
+    }
+    out.resize(n);
+    if (utf8.need != 0) {
+        throw json::Error("Invalid UTF-8 at " + std::to_string(text.size())); // truncated at the end of a 64 byte block
+    }
+    if (in_string_carry != 0) {
+        throw json::Error("Unterminated string");
+    }
+}
+
+static bool json_scalar_char(char c) {
+    switch (c) {
+        case '{': case '}': case '[': case ']': case ':': case ',': case '"':
+        case ' ': case '\t': case '\n': case '\r':
+            return false;
+        default:
+            return true;
+    }
+}
+
+static std::string_view json_scalar(std::string_view text, uint32_t pos) {
+    // the literal or number starting at pos
+    size_t end = pos;
+    while ((end < text.size()) && json_scalar_char(text[end])) end++;
+    return text.substr(pos, end - pos);
+}
+
+static size_t json_number(std::string_view s) {
+    // length of -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)? at the start of s, 0 if there is no number
+    size_t i = 0;
+    auto digits = [&s, &i] {
+        size_t start = i;
+        while ((i < s.size()) && (s[i] >= '0') && (s[i] <= '9')) i++;
+        return i > start;
+    };
+    if ((i < s.size()) && (s[i] == '-')) i++;
+    if ((i < s.size()) && (s[i] == '0')) {
+        i++;
+    } else if (!digits()) {
+        return 0;
+    }
+    if ((i < s.size()) && (s[i] == '.')) {
+        i++;
+        if (!digits()) return 0;
+    }
+    if ((i < s.size()) && ((s[i] == 'e') || (s[i] == 'E'))) {
+        i++;
+        if ((i < s.size()) && ((s[i] == '+') || (s[i] == '-'))) i++;
+        if (!digits()) return 0;
+    }
+    return i;
+}
+
+static bool json_valid_scalar(std::string_view text, uint32_t pos) {
+    // a literal or a number, followed by a structural character, a space or the end
+    std::string_view s = text.substr(pos);
+    size_t length;
+    switch (s[0]) {
+        case 't': length = s.starts_with("true") ? 4 : 0; break;
+        case 'f': length = s.starts_with("false") ? 5 : 0; break;
+        case 'n': length = s.starts_with("null") ? 4 : 0; break;
+        default: length = json_number(s); break;
+    }
+    return (length > 0) && ((length == s.size()) || !json_scalar_char(s[length]));
+}
+
+static size_t json_special(const char* p, size_t n) {
+    // first ", \ or control character, n if there is none
+    size_t i = 0;
+#if !defined(NICEHTTP_JSON_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+    for (; i + 16 <= n; i += 16) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('"')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\\'))),
+                                       _mm_cmpeq_epi8(_mm_max_epu8(c, _mm_set1_epi8(0x1f)), _mm_set1_epi8(0x1f)));
+        if (int mask = _mm_movemask_epi8(special)) {
+            return i + std::countr_zero(static_cast<unsigned>(mask));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned char c = static_cast<unsigned char>(p[i]);
+        if ((c == '"') || (c == '\\') || (c < 0x20)) return i;
+    }
+    return n;
+}
+
+void json::Document::parse(std::string_view text) {
+    // stage 2: check the grammar on the structural positions and link the brackets
+    this->text = {};
+    this->structurals.clear();
+    this->strings.clear();
+    if (text.size() >= UINT32_MAX) {
+        throw Error("Document too large");
+    }
+    json_index(text, this->structurals);
+    const std::pmr::vector<uint32_t>& s = this->structurals;
+    if (s.empty()) {
+        throw Error("Empty document");
+    }
+    this->jumps.assign(s.size(), 0);
+    std::pmr::vector<uint32_t> open(this->structurals.get_allocator());
+    enum class State { Value, FirstElement, FirstKey, Key, Colon, AfterValue } state = State::Value;
+    for (uint32_t i = 0; i < s.size(); i++) {
+        char c = text[s[i]];
+        bool close = false;
+        switch (state) {
+            case State::FirstElement:
+                if (c == ']') {
+                    close = true;
+                    break;
+                }
+                [[fallthrough]];
+            case State::Value:
+                if ((c == '{') || (c == '[')) {
+                    if (open.size() >= NICEHTTP_JSON_MAX_DEPTH) {
+                        throw Error("Document too deep");
+                    }
+                    open.push_back(i);
+                    state = (c == '{') ? State::FirstKey : State::FirstElement;
+                } else if (c == '"') {
+                    state = State::AfterValue;
+                } else {
+                    if (!json_valid_scalar(text, s[i])) {
+                        std::string_view scalar = json_scalar(text, s[i]);
+                        throw Error("Unexpected '" + std::string(scalar.empty() ? std::string_view(&text[s[i]], 1) : scalar.substr(0, 16)) + "' at " + std::to_string(s[i]));
+                    }
+                    state = State::AfterValue;
+                }
+                break;
+            case State::FirstKey:
+                if (c == '}') {
+                    close = true;
+                    break;
+                }
+                [[fallthrough]];
+            case State::Key:
+                if (c != '"') {
+                    throw Error("Expected a key at " + std::to_string(s[i]));
+                }
+                state = State::Colon;
+                break;
+            case State::Colon:
+                if (c != ':') {
+                    throw Error("Expected ':' at " + std::to_string(s[i]));
+                }
+                state = State::Value;
+                break;
+            case State::AfterValue:
+                if (open.empty()) {
+                    throw Error("Unexpected text after the value at " + std::to_string(s[i]));
+                }
+                if (c == ',') {
+                    state = (text[s[open.back()]] == '{') ? State::Key : State::Value;
+                } else if ((c == '}' || c == ']') && (text[s[open.back()]] == c - 2)) { // {} and [] are 2 apart
+                    close = true;
+                } else {
+                    throw Error("Expected ',' or a closing bracket at " + std::to_string(s[i]));
+                }
+                break;
+        }
+        if (close) {
+            this->jumps[open.back()] = i;
+            open.pop_back();
+            state = State::AfterValue;
+        }
+    }
+    if ((state != State::AfterValue) || !open.empty()) {
+        throw Error("Unexpected end of the document");
+    }
+    this->text = text;
+}
+
+uint32_t json::Document::skip(uint32_t index) const {
+    char c = this->text[this->structurals[index]];
+    return ((c == '{') || (c == '[')) ? this->jumps[index] + 1 : index + 1;
+}
+
+static const char* json_type_name(json::Type t) {
+    switch (t) {
+        case json::Type::Null: return "null";
+        case json::Type::Bool: return "bool";
+        case json::Type::Number: return "number";
+        case json::Type::String: return "string";
+        case json::Type::Array: return "array";
+        case json::Type::Object: return "object";
+        default: return "missing";
+    }
+}
+
+json::Type json::Value::type() const {
+    if ((this->doc == nullptr) || (this->index == UINT32_MAX)) {
+        return Type::Missing;
+    }
+    switch (this->doc->text[this->position()]) {
+        case '{': return Type::Object;
+        case '[': return Type::Array;
+        case '"': return Type::String;
+        case 't': case 'f': return Type::Bool;
+        case 'n': return Type::Null;
+        default: return Type::Number;
+    }
+}
+
+uint32_t json::Value::position() const {
+    return this->doc->structurals[this->index];
+}
+
+void json::Value::expect(Type t) const {
+    Type actual = this->type();
+    if (actual != t) {
+        throw Error(std::string("Expected ") + json_type_name(t) + ", the value is " + json_type_name(actual));
+    }
+}
+
+bool json::Value::getBool() const {
+    this->expect(Type::Bool);
+    return this->doc->text[this->position()] == 't';
+}
+
+bool json::Value::isInt() const {
+    if (this->type() != Type::Number) {
+        return false;
+    }
+    std::string_view s = json_scalar(this->doc->text, this->position());
+    int64_t n = 0;
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+    return (ec == std::errc()) && (end == s.data() + s.size());
+}
+
+int64_t json::Value::getInt() const {
+    this->expect(Type::Number);
+    std::string_view s = json_scalar(this->doc->text, this->position());
+    int64_t n = 0;
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+    if ((ec != std::errc()) || (end != s.data() + s.size())) {
+        throw Error("Not an integer: " + std::string(s));
+    }
+    return n;
+}
+
+double json::Value::getDouble() const {
+    this->expect(Type::Number);
+    std::string_view s = json_scalar(this->doc->text, this->position());
+    double d = 0;
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), d);
+    if (ec == std::errc::result_out_of_range) {
+        return (s[0] == '-') ? -HUGE_VAL : HUGE_VAL; // too small numbers are 0 already
+    }
+    return d;
+}
+
+static unsigned json_hex4(const char*& p, const char* end) {
+    unsigned v = 0;
+    if (end - p < 4) {
+        throw json::Error("Truncated \\u escape");
+    }
+    auto [next, ec] = std::from_chars(p, p + 4, v, 16);
+    if ((ec != std::errc()) || (next != p + 4)) {
+        throw json::Error("Invalid \\u escape");
+    }
+    p += 4;
+    return v;
+}
+
+static void json_append_utf8(std::pmr::string& out, unsigned cp) {
+    if (cp < 0x80) {
+        out.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+        out.push_back(static_cast<char>(0xc0 | (cp >> 6)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+        out.push_back(static_cast<char>(0xe0 | (cp >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    } else {
+        out.push_back(static_cast<char>(0xf0 | (cp >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    }
+}
+
+std::string_view json::Value::getString() const {
+    this->expect(Type::String);
+    const char* p = this->doc->text.data() + this->position() + 1;
+    const char* end = this->doc->text.data() + this->doc->text.size();
+    size_t n = json_special(p, end - p);
+    if ((p + n < end) && (p[n] == '"')) {
+        return std::string_view(p, n); // no escapes
+    }
+    std::pmr::string& out = this->doc->strings.emplace_back();
+    while (true) {
+        n = json_special(p, end - p);
+        out.append(p, n);
+        p += n;
+        if ((p == end) || (static_cast<unsigned char>(*p) < 0x20)) {
+            throw Error("Control character in a string");
+        }
+        if (*p == '"') {
+            return out;
+        }
+        if (++p == end) {
+            throw Error("Truncated escape");
+        }
+        switch (*p++) {
+            case '"': out.push_back('"'); break;
+            case '\\': out.push_back('\\'); break;
+            case '/': out.push_back('/'); break;
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'u': {
+                unsigned cp = json_hex4(p, end);
+                if ((cp >= 0xd800) && (cp < 0xdc00)) {
+                    // high surrogate, the low one must follow
+                    if ((end - p < 2) || (p[0] != '\\') || (p[1] != 'u')) {
+                        throw Error("Unpaired surrogate in a string");
+                    }
+                    p += 2;
+                    unsigned low = json_hex4(p, end);
+                    if ((low < 0xdc00) || (low >= 0xe000)) {
+                        throw Error("Unpaired surrogate in a string");
+                    }
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                } else if ((cp >= 0xdc00) && (cp < 0xe000)) {
+                    throw Error("Unpaired surrogate in a string");
+                }
+                json_append_utf8(out, cp);
+                break;
+            }
+            default:
+                throw Error("Invalid escape in a string");
+        }
+    }
+}
+
+std::string_view json::Value::key() const {
+    const Document* d = this->doc;
+    if ((this->type() == Type::Missing) || (this->index < 2) || (d->text[d->structurals[this->index - 1]] != ':')) {
+        throw Error("Not a member of an object");
+    }
+    return Value(d, this->index - 2).getString();
+}
+
+std::string_view json::Value::raw() const {
+    Type t = this->type();
+    if (t == Type::Missing) {
+        throw Error("Missing value");
+    }
+    std::string_view text = this->doc->text;
+    uint32_t pos = this->position();
+    if ((t == Type::Object) || (t == Type::Array)) {
+        return text.substr(pos, this->doc->structurals[this->doc->jumps[this->index]] + 1 - pos);
+    } else if (t == Type::String) {
+        size_t i = pos + 1;
+        while (true) {
+            i += json_special(text.data() + i, text.size() - i);
+            if (text[i] == '"') break; // stage 1 found the closing quote
+            i += (text[i] == '\\') ? 2 : 1;
+        }
+        return text.substr(pos, i + 1 - pos);
+    }
+    return json_scalar(text, pos);
+}
+
+json::Value json::Value::operator[](std::string_view key) const {
+    if (this->type() == Type::Missing) {
+        return Value(); // so that lookups can be chained
+    }
+    this->expect(Type::Object);
+    const Document* d = this->doc;
+    for (uint32_t i = this->index + 1; i < d->jumps[this->index]; i = d->skip(i + 2) + 1) { // "key" : value ,
+        if (Value(d, i).getString() == key) {
+            return Value(d, i + 2);
+        }
+    }
+    return Value();
+}
+
+json::Value json::Value::operator[](size_t i) const {
+    if (this->type() == Type::Missing) {
+        return Value();
+    }
+    this->expect(Type::Array);
+    for (Value element : *this) {
+        if (i-- == 0) {
+            return element;
+        }
+    }
+    return Value();
+}
+
+size_t json::Value::size() const {
+    return std::distance(this->begin(), this->end());
+}
+
+json::Value::Iterator json::Value::begin() const {
+    Type t = this->type();
+    if ((t != Type::Array) && (t != Type::Object)) {
+        throw Error(std::string("Expected array or object, the value is ") + json_type_name(t));
+    }
+    return Iterator(this->doc, this->index + 1);
+}
+
+json::Value::Iterator json::Value::end() const {
+    Type t = this->type();
+    if ((t != Type::Array) && (t != Type::Object)) {
+        throw Error(std::string("Expected array or object, the value is ") + json_type_name(t));
+    }
+    return Iterator(this->doc, this->doc->jumps[this->index]);
+}
+
+json::Value json::Value::Iterator::operator*() const {
+    // members of objects are "key" : value
+    bool member = this->doc->text[this->doc->structurals[this->index + 1]] == ':';
+    return Value(this->doc, member ? this->index + 2 : this->index);
+}
+
+json::Value::Iterator& json::Value::Iterator::operator++() {
+    uint32_t next = this->doc->skip((**this).index);
+    // a comma or the closing bracket (the end)
+    this->index = (this->doc->text[this->doc->structurals[next]] == ',') ? next + 1 : next;
+    return *this;
+}
+
+void json::Writer::separate() {
+    if (this->after_key) {
+        this->after_key = false;
+        return;
+    }
+    uint64_t bit = uint64_t(1) << (this->depth % 64);
+    uint64_t& word = this->nonempty[this->depth / 64];
+    if (word & bit) {
+        this->out.push_back(',');
+    } else {
+        word |= bit;
+    }
+}
+
+void json::Writer::done() {
+    if ((this->depth == 0) && (this->length != nullptr)) {
+        *this->length = this->out.size();
+    }
+}
+
+json::Writer& json::Writer::beginObject() {
+    this->separate();
+    if (this->depth + 1 >= NICEHTTP_JSON_MAX_DEPTH) {
+        throw Error("Document too deep");
+    }
+    this->out.push_back('{');
+    this->depth++;
+    this->nonempty[this->depth / 64] &= ~(uint64_t(1) << (this->depth % 64));
+    return *this;
+}
+
+json::Writer& json::Writer::endObject() {
+    if (this->depth == 0) {
+        throw Error("endObject without beginObject");
+    }
+    this->out.push_back('}');
+    this->depth--;
+    this->done();
+    return *this;
+}
+
+json::Writer& json::Writer::beginArray() {
+    this->separate();
+    if (this->depth + 1 >= NICEHTTP_JSON_MAX_DEPTH) {
+        throw Error("Document too deep");
+    }
+    this->out.push_back('[');
+    this->depth++;
+    this->nonempty[this->depth / 64] &= ~(uint64_t(1) << (this->depth % 64));
+    return *this;
+}
+
+json::Writer& json::Writer::endArray() {
+    if (this->depth == 0) {
+        throw Error("endArray without beginArray");
+    }
+    this->out.push_back(']');
+    this->depth--;
+    this->done();
+    return *this;
+}
+
+static void json_append_string(std::pmr::string& out, std::string_view s) {
+    static const char hex[] = "0123456789abcdef";
+    out.reserve(out.size() + s.size() + 2);
+    out.push_back('"');
+    while (true) {
+        size_t n = json_special(s.data(), s.size());
+        out.append(s.data(), n);
+        if (n == s.size()) break;
+        unsigned char c = static_cast<unsigned char>(s[n]);
+        switch (c) {
+            case '"': out.append("\\\""); break;
+            case '\\': out.append("\\\\"); break;
+            case '\n': out.append("\\n"); break;
+            case '\r': out.append("\\r"); break;
+            case '\t': out.append("\\t"); break;
+            case '\b': out.append("\\b"); break;
+            case '\f': out.append("\\f"); break;
+            default: {
+                char u[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                out.append(u, sizeof(u));
+            }
+        }
+        s.remove_prefix(n + 1);
+    }
+    out.push_back('"');
+}
+
+json::Writer& json::Writer::key(std::string_view name) {
+    this->separate();
+    json_append_string(this->out, name);
+    this->out.push_back(':');
+    this->after_key = true;
+    return *this;
+}
+
+json::Writer& json::Writer::null() {
+    this->separate();
+    this->out.append("null");
+    this->done();
+    return *this;
+}
+
+json::Writer& json::Writer::value(bool b) {
+    this->separate();
+    this->out.append(b ? "true" : "false");
+    this->done();
+    return *this;
+}
+
+json::Writer& json::Writer::value(double d) {
+    this->separate();
+    if (std::isfinite(d)) {
+        char digits[32];
+        auto end = std::to_chars(digits, digits + sizeof(digits), d).ptr; // shortest round trip
+        this->out.append(digits, end - digits);
+    } else {
+        this->out.append("null");
+    }
+    this->done();
+    return *this;
+}
+
+json::Writer& json::Writer::value(std::string_view s) {
+    this->separate();
+    json_append_string(this->out, s);
+    this->done();
+    return *this;
+}
+
+json::Writer& json::Writer::raw(std::string_view json) {
+    this->separate();
+    this->out.append(json);
+    this->done();
+    return *this;
+}
+
+void json::Writer::appendInt(int64_t n) {
+    char digits[24];
+    auto end = std::to_chars(digits, digits + sizeof(digits), n).ptr;
+    this->out.append(digits, end - digits);
+}
+
+void json::Writer::appendUint(uint64_t n) {
+    char digits[24];
+    auto end = std::to_chars(digits, digits + sizeof(digits), n).ptr;
+    this->out.append(digits, end - digits);
+}
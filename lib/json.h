@@ -0,0 +1,170 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#include <array>
+#include <concepts>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <memory_resource>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define NICEHTTP_JSON_MAX_DEPTH 1024 // nesting of arrays and objects accepted by the parser and the writer
+// -D NICEHTTP_JSON_NO_SIMD indexes the documents one byte at a time (no SSE2/AVX2)
+
+namespace json {
+
+/* JSON bodies without an external library.
+ * Document::parse runs in two passes, as simdjson does: the first one finds the
+ * positions of all the structural characters ({}[]:, the opening quotes and the
+ * first character of the other values) 64 bytes at a time with SSE2/AVX2, the
+ * second one checks the grammar on the positions only and links every [ and { to
+ * its closing bracket. Values are then read on demand from the positions, without
+ * building a tree: strings without escapes and numbers are views of the text.
+ * The structure, the literals, the numbers and the UTF-8 encoding of the text are
+ * validated when parsing (the blocks with non-ASCII bytes only), escapes in strings
+ * when they are read.
+ */
+class Error : public std::runtime_error {
+public:
+    explicit Error(const std::string& message) : std::runtime_error(message) {}
+};
+
+enum class Type { Null, Bool, Number, String, Array, Object, Missing };
+
+class Document;
+
+class Value {
+    /* A value of a Document, cheap to copy, valid as long as the document and its text.
+     * Looking up a key that is not there gives a Missing value (false when tested),
+     * the getters throw json::Error when the value has another type.
+     */
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Value;
+        using difference_type = std::ptrdiff_t;
+        Iterator() = default;
+        Iterator(const Document* doc, uint32_t index) : doc(doc), index(index) {}
+        Value operator*() const;
+        Iterator& operator++();
+        Iterator operator++(int) { Iterator it = *this; ++*this; return it; }
+        bool operator==(const Iterator& other) const { return this->index == other.index; }
+    private:
+        const Document* doc = nullptr;
+        uint32_t index = 0; // structural of the element (the key in objects)
+    };
+    Value() = default;
+    Value(const Document* doc, uint32_t index) : doc(doc), index(index) {}
+    Type type() const;
+    explicit operator bool() const { return this->type() != Type::Missing; }
+    bool isNull() const { return this->type() == Type::Null; }
+    bool isInt() const; // a number without fraction and exponent that fits int64_t
+    bool getBool() const;
+    int64_t getInt() const; // throws if the number has a fraction or doesn't fit
+    double getDouble() const;
+    std::string_view getString() const; // unescaped, kept in the document when it had escapes
+    std::string_view key() const; // name of a member of an object
+    std::string_view raw() const; // text of the value, e.g. to copy it in a Writer
+    Value operator[](std::string_view key) const; // member of an object (linear search), Missing if not there
+    Value operator[](size_t i) const; // element of an array (linear search), Missing if not there
+    size_t size() const; // elements of an array or members of an object
+    Iterator begin() const; // elements of an array or members of an object (see key())
+    Iterator end() const;
+private:
+    const Document* doc = nullptr;
+    uint32_t index = UINT32_MAX; // position in the structural index
+    uint32_t position() const; // in the text
+    void expect(Type t) const;
+};
+
+class Document {
+    /* Structural index of a JSON text. The text is not copied and must outlive the
+     * document; memory comes from the allocator (the request arena on the server).
+     */
+public:
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+    explicit Document(allocator_type alloc = {}) : structurals(alloc), jumps(alloc), strings(alloc) {}
+    void parse(std::string_view text); // throws json::Error if text is not valid JSON
+    Value root() const { return Value(this, 0); }
+    std::string_view source() const { return this->text; }
+private:
+    friend class Value;
+    std::string_view text;
+    std::pmr::vector<uint32_t> structurals; // positions in text
+    std::pmr::vector<uint32_t> jumps; // for every [ and {, the structural of its closing bracket
+    mutable std::pmr::deque<std::pmr::string> strings; // unescaped strings
+    uint32_t skip(uint32_t index) const; // structural following the value at index
+};
+
+class Writer {
+    /* Streaming serializer appending to a string (the body of a message, see
+     * Message::writeJson), without an intermediate tree: commas and colons are added
+     * as needed, strings escaped. When length is given, it is set to the size of out
+     * every time the top level value is complete.
+     */
+public:
+    explicit Writer(std::pmr::string& out, size_t* length = nullptr) : out(out), length(length) {}
+    Writer& beginObject();
+    Writer& endObject();
+    Writer& beginArray();
+    Writer& endArray();
+    Writer& key(std::string_view name);
+    Writer& null();
+    Writer& value(bool b);
+    Writer& value(double d); // null for NaN and infinities
+    Writer& value(std::string_view s);
+    Writer& value(const char* s) { return this->value(std::string_view(s)); }
+    Writer& value(const Value& v) { return this->raw(v.raw()); }
+    template <std::integral T> requires (!std::same_as<T, bool>)
+    Writer& value(T n);
+    Writer& raw(std::string_view json); // already serialized value, written as it is
+private:
+    std::pmr::string& out;
+    size_t* length;
+    uint32_t depth = 0;
+    bool after_key = false;
+    std::array<uint64_t, NICEHTTP_JSON_MAX_DEPTH / 64> nonempty {}; // a value was written at this depth
+    void separate(); // comma before the next value
+    void done(); // a value was written
+    void appendInt(int64_t n);
+    void appendUint(uint64_t n);
+};
+
+template <std::integral T> requires (!std::same_as<T, bool>)
+Writer& Writer::value(T n) {
+    this->separate();
+    if constexpr (std::is_signed_v<T>) {
+        this->appendInt(n);
+    } else {
+        this->appendUint(n);
+    }
+    this->done();
+    return *this;
+}
+
+} // namespace json
@@ -0,0 +1,237 @@
+#include "logger.h"
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+
+Logger& Logger::getInstance() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() {
+    this->writer = std::jthread([this](std::stop_token stop) {
+        std::mutex m;
+        std::condition_variable_any cv;
+        while (!stop.stop_requested()) {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait_for(lock, stop, std::chrono::milliseconds(NICEHTTP_LOG_FLUSH), [] { return false; });
+            lock.unlock();
+            this->drain();
+        }
+    });
+}
+
+Logger::~Logger() {
+    this->writer.request_stop();
+    this->writer.join();
+    this->drain();
+    if (this->access_out != stdout) fclose(this->access_out);
+    if (this->error_out != stderr) fclose(this->error_out);
+}
+
+bool Logger::openAccessLog(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "a");
+    if (f == nullptr) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(this->drain_mutex);
+    if (this->access_out != stdout) fclose(this->access_out);
+    this->access_out = f;
+    return true;
+}
+
+bool Logger::openErrorLog(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "a");
+    if (f == nullptr) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(this->drain_mutex);
+    if (this->error_out != stderr) fclose(this->error_out);
+    this->error_out = f;
+    return true;
+}
+
+void Logger::setAccessLog(bool enabled) {
+    this->access_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+std::ostringstream& Logger::stream() {
+    thread_local std::ostringstream s;
+    s.str("");
+    return s;
+}
+
+Logger::Handle::~Handle() {
+    if (this->ring != nullptr) {
+        Logger& logger = Logger::getInstance();
+        std::lock_guard<std::mutex> lock(logger.registry);
+        logger.free_rings.push_back(this->ring);
+    }
+}
+
+Logger::Ring& Logger::local() {
+    thread_local Handle handle;
+    if (handle.ring == nullptr) {
+        std::lock_guard<std::mutex> lock(this->registry);
+        if (!this->free_rings.empty()) {
+            handle.ring = this->free_rings.back();
+            this->free_rings.pop_back();
+        } else {
+            this->rings.push_back(std::make_unique<Ring>());
+            handle.ring = this->rings.back().get();
+        }
+    }
+    return *handle.ring;
+}
+
+static void ring_copy(char* ring, uint64_t pos, const char* src, size_t len) {
+    // copy into the ring buffer, wrapping at the end
+    size_t at = pos % NICEHTTP_LOG_BUFFER;
+    size_t first = std::min(len, static_cast<size_t>(NICEHTTP_LOG_BUFFER) - at);
+    memcpy(ring + at, src, first);
+    memcpy(ring, src + first, len - first);
+}
+
+static void ring_read(const char* ring, uint64_t pos, char* dst, size_t len) {
+    size_t at = pos % NICEHTTP_LOG_BUFFER;
+    size_t first = std::min(len, static_cast<size_t>(NICEHTTP_LOG_BUFFER) - at);
+    memcpy(dst, ring + at, first);
+    memcpy(dst + first, ring, len - first);
+}
+
+void Logger::push(const Header& header, std::initializer_list<std::string_view> parts) {
+    Ring& ring = this->local();
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    uint64_t tail = ring.tail.load(std::memory_order_acquire);
+    if (head - tail + sizeof(Header) + header.size > NICEHTTP_LOG_BUFFER) {
+        this->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    ring_copy(ring.data.get(), head, reinterpret_cast<const char*>(&header), sizeof(Header));
+    uint64_t pos = head + sizeof(Header);
+    for (std::string_view part : parts) {
+        ring_copy(ring.data.get(), pos, part.data(), part.size());
+        pos += part.size();
+    }
+    ring.head.store(pos, std::memory_order_release);
+}
+
+void Logger::access(std::string_view peer, std::string_view method, std::string_view uri, std::string_view proto, int status, size_t bytes, std::chrono::steady_clock::duration latency) {
+    auto clip = [](std::string_view s) { return s.substr(0, 1024); };
+    peer = clip(peer);
+    method = clip(method);
+    uri = clip(uri);
+    proto = clip(proto);
+    Header header {};
+    header.kind = Access;
+    header.status = static_cast<uint16_t>(status);
+    header.time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    header.bytes = bytes;
+    header.latency = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    header.lengths[0] = static_cast<uint16_t>(peer.size());
+    header.lengths[1] = static_cast<uint16_t>(method.size());
+    header.lengths[2] = static_cast<uint16_t>(uri.size());
+    header.lengths[3] = static_cast<uint16_t>(proto.size());
+    header.size = static_cast<uint32_t>(peer.size() + method.size() + uri.size() + proto.size());
+    this->push(header, {peer, method, uri, proto});
+}
+
+void Logger::log(Level level, std::string_view message) {
+    if (level == Error) {
+        // at most NICEHTTP_LOG_ERRORS_PER_SEC per second
+        int64_t second = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t current = this->error_second.load(std::memory_order_relaxed);
+        if ((current != second) && this->error_second.compare_exchange_strong(current, second, std::memory_order_relaxed)) {
+            this->error_count.store(0, std::memory_order_relaxed);
+        }
+        if (this->error_count.fetch_add(1, std::memory_order_relaxed) >= NICEHTTP_LOG_ERRORS_PER_SEC) {
+            this->suppressed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    message = message.substr(0, NICEHTTP_LOG_BUFFER / 4);
+    Header header {};
+    header.kind = Text;
+    header.level = level;
+    header.time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    header.size = static_cast<uint32_t>(message.size());
+    this->push(header, {message});
+}
+
+void Logger::flush() {
+    this->drain();
+}
+
+static void format_time(std::string& out, int64_t ns, bool access) {
+    // [18/Oct/2026:10:20:30 +0000] for the access log, 2026-10-18T10:20:30.123Z for the error log
+    time_t seconds = static_cast<time_t>(ns / 1000000000);
+    tm t;
+    #ifdef _WIN32
+    gmtime_s(&t, &seconds);
+    #else
+    gmtime_r(&seconds, &t);
+    #endif
+    char buf[64];
+    if (access) {
+        strftime(buf, sizeof(buf), "[%d/%b/%Y:%H:%M:%S +0000]", &t);
+        out += buf;
+    } else {
+        strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &t);
+        out += buf;
+        snprintf(buf, sizeof(buf), ".%03dZ", static_cast<int>((ns / 1000000) % 1000));
+        out += buf;
+    }
+}
+
+void Logger::drain() {
+    std::lock_guard<std::mutex> drain_lock(this->drain_mutex);
+    std::string access_batch, error_batch;
+    std::vector<char> payload;
+    {
+        std::lock_guard<std::mutex> lock(this->registry);
+        for (const auto& ring : this->rings) {
+            uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            while (tail < head) {
+                Header header;
+                ring_read(ring->data.get(), tail, reinterpret_cast<char*>(&header), sizeof(Header));
+                payload.resize(header.size);
+                ring_read(ring->data.get(), tail + sizeof(Header), payload.data(), header.size);
+                tail += sizeof(Header) + header.size;
+                std::string_view text(payload.data(), payload.size());
+                if (header.kind == Access) {
+                    std::string_view peer = text.substr(0, header.lengths[0]);
+                    std::string_view method = text.substr(header.lengths[0], header.lengths[1]);
+                    std::string_view uri = text.substr(header.lengths[0] + header.lengths[1], header.lengths[2]);
+                    std::string_view proto = text.substr(header.lengths[0] + header.lengths[1] + header.lengths[2], header.lengths[3]);
+                    access_batch += peer.empty() ? "-" : std::string(peer);
+                    access_batch += " - - ";
+                    format_time(access_batch, header.time, true);
+                    access_batch += " \"" + std::string(method) + " " + std::string(uri) + " " + std::string(proto) + "\" ";
+                    access_batch += std::to_string(header.status) + " " + std::to_string(header.bytes) + " ";
+                    access_batch += std::to_string(header.latency) + "us\n";
+                } else {
+                    format_time(error_batch, header.time, false);
+                    error_batch += (header.level == Error) ? " ERROR " : " DEBUG ";
+                    error_batch += text;
+                    error_batch += "\n";
+                }
+            }
+            ring->tail.store(tail, std::memory_order_release);
+        }
+    }
+    if (uint64_t n = this->suppressed.exchange(0, std::memory_order_relaxed)) {
+        error_batch += std::to_string(n) + " error messages suppressed by the rate limit\n";
+    }
+    if (uint64_t n = this->dropped.exchange(0, std::memory_order_relaxed)) {
+        error_batch += std::to_string(n) + " log records dropped, buffer full\n";
+    }
+    if (!access_batch.empty()) {
+        fwrite(access_batch.data(), 1, access_batch.size(), this->access_out);
+        fflush(this->access_out);
+    }
+    if (!error_batch.empty()) {
+        fwrite(error_batch.data(), 1, error_batch.size(), this->error_out);
+        fflush(this->error_out);
+    }
+}
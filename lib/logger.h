@@ -0,0 +1,101 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define NICEHTTP_LOG_BUFFER 65536       // bytes of the log buffer of each thread (records are dropped when full)
+#define NICEHTTP_LOG_FLUSH 10           // ms between two writes of the background thread
+#define NICEHTTP_LOG_ERRORS_PER_SEC 20  // error messages logged per second, the others are counted and dropped
+
+class Logger {
+    /* Asynchronous logger.
+     * The calling threads append binary records to their own lock-free ring
+     * (single producer, single consumer) and never wait: when a ring is full
+     * the record is dropped and counted. A background thread drains the rings
+     * every NICEHTTP_LOG_FLUSH ms, formats the records and writes them in
+     * batches: access log lines to the access log (stdout by default),
+     * debug and error messages to the error log (stderr by default).
+     * Error messages are limited to NICEHTTP_LOG_ERRORS_PER_SEC.
+     */
+public:
+    enum Level : uint8_t { Debug, Error };
+    static Logger& getInstance();
+    ~Logger();
+    bool openAccessLog(const std::string& path); // append to a file instead of stdout
+    bool openErrorLog(const std::string& path);  // append to a file instead of stderr
+    void setAccessLog(bool enabled);
+    bool accessLogEnabled() const { return this->access_enabled.load(std::memory_order_relaxed); }
+    // request line, status, response body bytes and duration, written in the combined log format
+    void access(std::string_view peer, std::string_view method, std::string_view uri, std::string_view proto, int status, size_t bytes, std::chrono::steady_clock::duration latency);
+    void log(Level level, std::string_view message);
+    void error(std::string_view message) { this->log(Error, message); }
+    void flush(); // write everything logged so far
+    static std::ostringstream& stream(); // cleared per thread stream used by NLOG
+private:
+    enum Kind : uint8_t { Text, Access };
+    struct Header {
+        uint32_t size; // payload bytes
+        Kind kind;
+        Level level;
+        uint16_t status;
+        int64_t time;  // system clock ns
+        uint64_t bytes;
+        uint64_t latency; // us
+        uint16_t lengths[4]; // of the access log strings: peer, method, uri, proto
+    };
+    struct Ring {
+        std::unique_ptr<char[]> data{new char[NICEHTTP_LOG_BUFFER]};
+        std::atomic<uint64_t> head{0}; // written by the producer
+        std::atomic<uint64_t> tail{0}; // written by the consumer
+    };
+    struct Handle {
+        Ring* ring = nullptr;
+        ~Handle();
+    };
+    Logger();
+    std::mutex registry; // thread start and exit, and draining
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::vector<Ring*> free_rings;
+    std::mutex drain_mutex;
+    FILE* access_out = stdout;
+    FILE* error_out = stderr;
+    std::atomic<bool> access_enabled{false};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<int64_t> error_second{0};
+    std::atomic<int> error_count{0};
+    std::atomic<uint64_t> suppressed{0};
+    std::jthread writer;
+    Ring& local();
+    void push(const Header& header, std::initializer_list<std::string_view> parts);
+    void drain();
+};
@@ -0,0 +1,239 @@
+#include "metrics.h"
+#include "router.h"
+#include "trace.h"
+#include <bit>
+#include <map>
+#include <tuple>
+
+void LatencyHistogram::record(uint64_t us) {
+    auto& counter = this->buckets[bucket(us)];
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count(size_t bucket) const {
+    return this->buckets[bucket].load(std::memory_order_relaxed);
+}
+
+size_t LatencyHistogram::bucket(uint64_t us) {
+    if (us < 16) {
+        return us;
+    }
+    // keep the 5 most significant bits: the first one gives the power of two, the other 4 the sub bucket
+    size_t shift = std::bit_width(us) - 5;
+    size_t i = 16 + shift * 16 + ((us >> shift) - 16);
+    return std::min(i, static_cast<size_t>(NICEHTTP_HISTOGRAM_BUCKETS - 1));
+}
+
+uint64_t LatencyHistogram::upper(size_t bucket) {
+    if (bucket < 16) {
+        return bucket;
+    }
+    size_t shift = (bucket - 16) / 16;
+    return ((17 + (bucket - 16) % 16) << shift) - 1;
+}
+
+Metrics& Metrics::getInstance() {
+    static Metrics metrics;
+    return metrics;
+}
+
+void Metrics::bump(std::atomic<uint64_t>& counter, uint64_t n) {
+    // only the owner thread writes, a plain load and store is enough
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+Metrics::Handle::~Handle() {
+    if (this->block != nullptr) {
+        Metrics& metrics = Metrics::getInstance();
+        std::lock_guard<std::mutex> lock(metrics.registry);
+        metrics.free_blocks.push_back(this->block);
+    }
+}
+
+Metrics::ThreadMetrics& Metrics::local() {
+    thread_local Handle handle;
+    if (handle.block == nullptr) {
+        std::lock_guard<std::mutex> lock(this->registry);
+        if (!this->free_blocks.empty()) {
+            handle.block = this->free_blocks.back();
+            this->free_blocks.pop_back();
+        } else {
+            this->blocks.push_back(std::make_unique<ThreadMetrics>());
+            handle.block = this->blocks.back().get();
+        }
+    }
+    return *handle.block;
+}
+
+Metrics::Series& Metrics::series(ThreadMetrics& block, const Route* route, int status) {
+    // open addressing on (route, status), slots are only filled by the owner thread
+    size_t h = (reinterpret_cast<uintptr_t>(route) >> 4) * 31 + static_cast<size_t>(status);
+    for (size_t probe = 0; probe < NICEHTTP_METRICS_SERIES; probe++) {
+        auto& slot = block.series[(h + probe) % NICEHTTP_METRICS_SERIES];
+        Series* s = slot.load(std::memory_order_relaxed);
+        if (s == nullptr) {
+            std::string method = (route != nullptr) ? std::string(route->method) : "";
+            std::string uri = (route != nullptr) ? std::string(route->uri) : "";
+            block.owned.push_back(std::make_unique<Series>(route, std::move(method), std::move(uri), status));
+            s = block.owned.back().get();
+            slot.store(s, std::memory_order_release);
+            return *s;
+        }
+        // a route allocated where a deleted one was doesn't take its series, unless it has the same labels
+        if ((s->route == route) && (s->status == status) && ((route == nullptr) || ((s->method == route->method) && (s->uri == route->uri)))) {
+            return *s;
+        }
+    }
+    return block.other;
+}
+
+void Metrics::request(const Route* route, int status, size_t bytes_in, size_t bytes_out, std::chrono::steady_clock::duration latency) {
+    ThreadMetrics& block = this->local();
+    Series& s = this->series(block, route, status);
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    bump(s.requests);
+    bump(s.bytes_in, bytes_in);
+    bump(s.bytes_out, bytes_out);
+    bump(s.latency_sum, us);
+    s.latency.record(us);
+}
+
+void Metrics::accepted() {
+    bump(this->local().accepted);
+}
+
+void Metrics::closed() {
+    bump(this->local().closed);
+}
+
+void Metrics::parseError() {
+    bump(this->local().parse_errors);
+}
+
+void Metrics::unauthorized() {
+    bump(this->local().unauthorized);
+}
+
+void Metrics::notFound() {
+    bump(this->local().not_found);
+}
+
+static std::string prometheus_label(std::string_view value) {
+    // escape a Prometheus label value
+    std::string out;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+std::string Metrics::render() {
+    // upper bounds (us) of the exported buckets, the fine buckets are merged into them
+    static const std::array<uint64_t, 16> bounds = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+                                                    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+    struct Total {
+        uint64_t requests = 0, bytes_in = 0, bytes_out = 0, latency_sum = 0;
+        std::array<uint64_t, 16> buckets{};
+    };
+    std::map<std::tuple<std::string, std::string, int>, Total> totals;
+    uint64_t accepted = 0, closed = 0, parse_errors = 0, unauthorized = 0, not_found = 0;
+    {
+        std::lock_guard<std::mutex> lock(this->registry);
+        for (const auto& block : this->blocks) {
+            accepted += block->accepted.load(std::memory_order_relaxed);
+            closed += block->closed.load(std::memory_order_relaxed);
+            parse_errors += block->parse_errors.load(std::memory_order_relaxed);
+            unauthorized += block->unauthorized.load(std::memory_order_relaxed);
+            not_found += block->not_found.load(std::memory_order_relaxed);
+            auto add = [&totals](const Series& s) {
+                uint64_t requests = s.requests.load(std::memory_order_relaxed);
+                if (requests == 0) {
+                    return;
+                }
+                std::string route = (s.route != nullptr) ? s.uri : ((s.status == 0) ? "other" : "none");
+                Total& t = totals[{s.method, route, s.status}];
+                t.requests += requests;
+                t.bytes_in += s.bytes_in.load(std::memory_order_relaxed);
+                t.bytes_out += s.bytes_out.load(std::memory_order_relaxed);
+                t.latency_sum += s.latency_sum.load(std::memory_order_relaxed);
+                for (size_t i = 0; i < NICEHTTP_HISTOGRAM_BUCKETS; i++) {
+                    uint64_t count = s.latency.count(i);
+                    if (count == 0) {
+                        continue;
+                    }
+                    auto b = std::ranges::lower_bound(bounds, LatencyHistogram::upper(i));
+                    if (b != bounds.end()) {
+                        t.buckets[b - bounds.begin()] += count;
+                    }
+                }
+            };
+            for (const auto& slot : block->series) {
+                if (const Series* s = slot.load(std::memory_order_acquire)) {
+                    add(*s);
+                }
+            }
+            add(block->other);
+        }
+    }
+
+    std::string out;
+    auto family = [&out](const char* name, const char* type, const char* help) {
+        out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+    };
+    auto labels = [](const auto& key) {
+        return "method=\"" + prometheus_label(std::get<0>(key)) + "\",route=\"" + prometheus_label(std::get<1>(key)) +
+               "\",code=\"" + std::to_string(std::get<2>(key)) + "\"";
+    };
+    family("nicehttp_requests_total", "counter", "Requests handled, by route and status code.");
+    for (const auto& [key, t] : totals) {
+        out += "nicehttp_requests_total{" + labels(key) + "} " + std::to_string(t.requests) + "\n";
+    }
+    family("nicehttp_request_bytes_total", "counter", "Bytes received in requests.");
+    for (const auto& [key, t] : totals) {
+        out += "nicehttp_request_bytes_total{" + labels(key) + "} " + std::to_string(t.bytes_in) + "\n";
+    }
+    family("nicehttp_response_bytes_total", "counter", "Bytes sent in responses (heads only for proxied responses).");
+    for (const auto& [key, t] : totals) {
+        out += "nicehttp_response_bytes_total{" + labels(key) + "} " + std::to_string(t.bytes_out) + "\n";
+    }
+    family("nicehttp_request_duration_seconds", "histogram", "Time from the request head to the end of the response.");
+    for (const auto& [key, t] : totals) {
+        std::string l = labels(key);
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < bounds.size(); i++) {
+            cumulative += t.buckets[i];
+            out += "nicehttp_request_duration_seconds_bucket{" + l + ",le=\"" + std::to_string(bounds[i] / 1e6) + "\"} " + std::to_string(cumulative) + "\n";
+        }
+        out += "nicehttp_request_duration_seconds_bucket{" + l + ",le=\"+Inf\"} " + std::to_string(t.requests) + "\n";
+        out += "nicehttp_request_duration_seconds_sum{" + l + "} " + std::to_string(t.latency_sum / 1e6) + "\n";
+        out += "nicehttp_request_duration_seconds_count{" + l + "} " + std::to_string(t.requests) + "\n";
+    }
+    family("nicehttp_connections_active", "gauge", "Connections accepted and not yet closed.");
+    out += "nicehttp_connections_active " + std::to_string(static_cast<int64_t>(accepted - closed)) + "\n";
+    family("nicehttp_connections_accepted_total", "counter", "Connections accepted.");
+    out += "nicehttp_connections_accepted_total " + std::to_string(accepted) + "\n";
+    family("nicehttp_parse_errors_total", "counter", "Malformed requests.");
+    out += "nicehttp_parse_errors_total " + std::to_string(parse_errors) + "\n";
+    family("nicehttp_unauthorized_total", "counter", "Requests rejected by the route authentication.");
+    out += "nicehttp_unauthorized_total " + std::to_string(unauthorized) + "\n";
+    family("nicehttp_not_found_total", "counter", "Requests matching no route.");
+    out += "nicehttp_not_found_total " + std::to_string(not_found) + "\n";
+    #ifdef NICEHTTP_ALLOC_STATS
+    family("nicehttp_phase_allocations_total", "counter", "Heap allocations made in each phase of the requests.");
+    for (size_t p = 0; p < static_cast<size_t>(trace::Phase::Count); p++) {
+        out += std::string("nicehttp_phase_allocations_total{phase=\"") + trace::phaseName(static_cast<trace::Phase>(p)) + "\"} " + std::to_string(alloc_stats::total(p).count) + "\n";
+    }
+    family("nicehttp_phase_allocated_bytes_total", "counter", "Heap bytes allocated in each phase of the requests.");
+    for (size_t p = 0; p < static_cast<size_t>(trace::Phase::Count); p++) {
+        out += std::string("nicehttp_phase_allocated_bytes_total{phase=\"") + trace::phaseName(static_cast<trace::Phase>(p)) + "\"} " + std::to_string(alloc_stats::total(p).bytes) + "\n";
+    }
+    #endif
+    return out;
+}
@@ -0,0 +1,102 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define NICEHTTP_METRICS_SERIES 256    // route/status series per thread, the next ones are counted as route "other"
+#define NICEHTTP_HISTOGRAM_BUCKETS 544 // exact up to 16us, then 16 buckets per power of two up to 2^37us
+
+class Route;
+
+class LatencyHistogram {
+    /* HDR style log-linear histogram of microseconds: values below 16 have their
+     * own bucket, larger ones fall in one of the 16 buckets of their power of two,
+     * so the relative error is below 6.25% at any magnitude.
+     * Single writer: record() is only called by the thread owning the histogram,
+     * count() can be read from any thread at any time.
+     */
+public:
+    void record(uint64_t us);
+    uint64_t count(size_t bucket) const;
+    static size_t bucket(uint64_t us);
+    static uint64_t upper(size_t bucket); // largest value of the bucket
+private:
+    std::array<std::atomic<uint64_t>, NICEHTTP_HISTOGRAM_BUCKETS> buckets{};
+};
+
+class Metrics {
+    /* Process wide server metrics, exported in Prometheus text format.
+     * Every thread writes to its own block of counters and histograms, one
+     * series per route and status code, so the request path takes no lock and
+     * no contended atomic: render() merges the blocks at scrape time.
+     * Blocks of exited threads are reused by the next threads, counts included.
+     */
+public:
+    static Metrics& getInstance();
+    void request(const Route* route, int status, size_t bytes_in, size_t bytes_out, std::chrono::steady_clock::duration latency);
+    void accepted();   // connection accepted
+    void closed();     // connection closed
+    void parseError(); // malformed request
+    void unauthorized();
+    void notFound();
+    std::string render(); // Prometheus text format
+private:
+    struct Series {
+        const Route* route; // only compared, the route may be deleted before the next scrape
+        std::string method; // labels copied from the route when the series is created
+        std::string uri;
+        int status;
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> bytes_in{0};
+        std::atomic<uint64_t> bytes_out{0};
+        std::atomic<uint64_t> latency_sum{0}; // us
+        LatencyHistogram latency{};
+    };
+    struct ThreadMetrics {
+        std::array<std::atomic<Series*>, NICEHTTP_METRICS_SERIES> series{};
+        std::vector<std::unique_ptr<Series>> owned; // owner thread only
+        Series other{nullptr, "", "", 0};           // used when the table is full
+        std::atomic<uint64_t> accepted{0};
+        std::atomic<uint64_t> closed{0};
+        std::atomic<uint64_t> parse_errors{0};
+        std::atomic<uint64_t> unauthorized{0};
+        std::atomic<uint64_t> not_found{0};
+    };
+    struct Handle {
+        ThreadMetrics* block = nullptr;
+        ~Handle();
+    };
+    std::mutex registry; // taken when a thread starts or stops, and by render()
+    std::vector<std::unique_ptr<ThreadMetrics>> blocks;
+    std::vector<ThreadMetrics*> free_blocks;
+    ThreadMetrics& local();
+    Series& series(ThreadMetrics& block, const Route* route, int status);
+    static void bump(std::atomic<uint64_t>& counter, uint64_t n = 1);
+};
@@ -0,0 +1,277 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+#include <string>
+#include <string_view>
+#include <chrono>
+#include <ranges>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdlib>
+#include <cerrno>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#endif
+
+#define NICEHTTP_SPLICE_SIZE 65536 // bytes moved by each splice() call (default pipe capacity)
+
+// Thrown by the client when a deadline expires
+class TimeoutError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Portable socket helpers shared by the client, the server and the proxy
+namespace net {
+
+    inline void close_socket(int fd) {
+        #ifdef _WIN32
+        closesocket(fd);
+        #else
+        close(fd);
+        #endif
+    }
+
+    inline int poll_socket(struct pollfd *fds, int n, int timeout) {
+        #ifdef _WIN32
+        return WSAPoll(fds, n, timeout);
+        #else
+        // poll is never restarted after a signal handler (e.g. the profiler SIGPROF): wait for the time left
+        auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        while (true) {
+            int rc = poll(fds, n, timeout);
+            if ((rc >= 0) || (errno != EINTR)) {
+                return rc;
+            }
+            if (timeout > 0) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now());
+                timeout = std::max(0, static_cast<int>(left.count()));
+            }
+        }
+        #endif
+    }
+
+    inline void set_nonblocking(int fd) {
+        #ifdef _WIN32
+        u_long mode = 1;
+        ioctlsocket(fd, FIONBIO, &mode);
+        #else
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        #endif
+    }
+
+    inline bool connect_in_progress() {
+        #ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+        #else
+        return errno == EINPROGRESS;
+        #endif
+    }
+
+    inline bool would_block() {
+        #ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+        #else
+        return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+        #endif
+    }
+
+    inline int timeout_left(std::chrono::steady_clock::time_point deadline) {
+        // milliseconds until deadline in the format expected by poll (-1 = infinite)
+        if (deadline == std::chrono::steady_clock::time_point::max()) {
+            return -1;
+        }
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        return (left > 0) ? static_cast<int>(left) : 0;
+    }
+
+    inline std::chrono::steady_clock::time_point deadline_after(int ms, std::chrono::steady_clock::time_point limit) {
+        if (ms <= 0) {
+            return limit;
+        }
+        return std::min(limit, std::chrono::steady_clock::now() + std::chrono::milliseconds(ms));
+    }
+
+    inline void send_all(int fd, const std::string& data, std::chrono::steady_clock::time_point deadline) {
+        // send all data, on non blocking sockets waits for buffer space until the deadline
+        size_t sent = 0;
+        while (sent < data.length()) {
+            #ifdef MSG_NOSIGNAL
+            int n = send(fd, data.c_str() + sent, data.length() - sent, MSG_NOSIGNAL);
+            #else
+            int n = send(fd, data.c_str() + sent, data.length() - sent, 0);
+            #endif
+            if (n > 0) {
+                sent += n;
+                continue;
+            }
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            int rc = poll_socket(&pfd, 1, timeout_left(deadline));
+            if (rc == 0) {
+                throw TimeoutError("Timeout sending the request");
+            } else if ((rc < 0) || (pfd.revents & (POLLERR | POLLHUP))) {
+                throw std::runtime_error("Connection closed while sending the request");
+            }
+        }
+    }
+
+    inline std::string header_value(std::string_view head, std::string_view name) {
+        // Value of the header name (lowercase) in a raw http head, empty if missing
+        for (const auto line : std::views::split(head, std::string_view("\r\n"))) {
+            std::string_view l(line);
+            size_t i = l.find(':');
+            if ((i != name.length()) || !std::ranges::equal(l.substr(0, i), name, [](char a, char b) { return std::tolower((unsigned char)a) == b; })) {
+                continue;
+            }
+            std::string_view v = l.substr(i + 1);
+            while (!v.empty() && (v.front() == ' ')) v.remove_prefix(1);
+            while (!v.empty() && (v.back() == ' ')) v.remove_suffix(1);
+            return std::string(v);
+        }
+        return "";
+    }
+
+    inline bool decode_chunked(std::string_view data, std::string& out) {
+        // Decode a chunked body, returns false if the last chunk wasn't received yet
+        out = "";
+        size_t pos = 0;
+        while (true) {
+            size_t eol = data.find("\r\n", pos);
+            if (eol == std::string::npos) {
+                return false;
+            }
+            size_t len = strtoul(std::string(data.substr(pos, eol - pos)).c_str(), nullptr, 16);
+            pos = eol + 2;
+            if (len == 0) {
+                // skip the trailers up to the final empty line
+                while ((eol = data.find("\r\n", pos)) != std::string::npos) {
+                    if (eol == pos) {
+                        return true;
+                    }
+                    pos = eol + 2;
+                }
+                return false;
+            }
+            if (data.length() < pos + len + 2) {
+                return false;
+            }
+            out += data.substr(pos, len);
+            pos += len + 2;
+        }
+    }
+
+
+    inline bool wait_socket(int fd, short events, std::chrono::steady_clock::time_point deadline) {
+        // wait until fd is ready for events, false on timeout or error
+        struct pollfd pfd = {fd, events, 0};
+        return (poll_socket(&pfd, 1, timeout_left(deadline)) > 0) && !(pfd.revents & POLLNVAL);
+    }
+
+    #ifdef __linux__
+    struct Pipe {
+        // Per thread pipe used as kernel buffer by relay()
+        int fds[2] = {-1, -1};
+        Pipe() { this->open(); }
+        ~Pipe() { this->close(); }
+        void open() {
+            if (pipe2(this->fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+                this->fds[0] = this->fds[1] = -1;
+            }
+        }
+        void close() {
+            for (int& fd : this->fds) {
+                if (fd != -1) ::close(fd);
+                fd = -1;
+            }
+        }
+        void reset() { // drop data left in the pipe after an error
+            this->close();
+            this->open();
+        }
+    };
+    #endif
+
+    inline bool relay(int from, int to, size_t len, std::chrono::steady_clock::time_point deadline) {
+        /* Move len bytes (std::string::npos = until EOF) from socket from to socket to.
+        * On Linux the data goes through a pipe with splice(), never reaching user space.
+        * Returns false on errors or timeout.
+        */
+        #ifdef __linux__
+        thread_local Pipe pipe;
+        if (pipe.fds[0] != -1) {
+            while (len > 0) {
+                ssize_t n = splice(from, nullptr, pipe.fds[1], nullptr, std::min<size_t>(len, NICEHTTP_SPLICE_SIZE), SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+                if ((n < 0) && (errno == EAGAIN)) {
+                    // the pipe is empty here, so the socket has no data yet
+                    if (!wait_socket(from, POLLIN, deadline)) return false;
+                    continue;
+                }
+                if (n <= 0) {
+                    return (n == 0) && (len == std::string::npos);
+                }
+                if (len != std::string::npos) {
+                    len -= n;
+                }
+                while (n > 0) {
+                    ssize_t m = splice(pipe.fds[0], nullptr, to, nullptr, n, SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+                    if ((m < 0) && (errno == EAGAIN) && wait_socket(to, POLLOUT, deadline)) {
+                        continue;
+                    }
+                    if (m <= 0) {
+                        pipe.reset();
+                        return false;
+                    }
+                    n -= m;
+                }
+            }
+            return true;
+        }
+        #endif
+        // copy through user space
+        char buff[NICEHTTP_SPLICE_SIZE / 4];
+        while (len > 0) {
+            int n = recv(from, buff, std::min<size_t>(len, sizeof(buff)), 0);
+            if ((n < 0) && would_block()) {
+                if (!wait_socket(from, POLLIN, deadline)) return false;
+                continue;
+            }
+            if (n <= 0) {
+                return (n == 0) && (len == std::string::npos);
+            }
+            if (len != std::string::npos) {
+                len -= n;
+            }
+            try {
+                send_all(to, std::string(buff, n), deadline);
+            } catch (const std::runtime_error&) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+}
@@ -1,5 +1,22 @@
 #include "nicehttp.h"
 
+void RetryBudget::deposit() {
+    int t = tokens.load(std::memory_order_relaxed);
+    while ((t < NICEHTTP_RETRY_BURST * 100) &&
+           !tokens.compare_exchange_weak(t, std::min(t + NICEHTTP_RETRY_RATIO, NICEHTTP_RETRY_BURST * 100), std::memory_order_relaxed)) {
+    }
+}
+
+bool RetryBudget::withdraw() {
+    int t = tokens.load(std::memory_order_relaxed);
+    while (t >= 100) {
+        if (tokens.compare_exchange_weak(t, t - 100, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 NiceHTTP::NiceHTTP() {
 }
 
@@ -13,15 +30,15 @@ void NiceHTTP::cleanup() {
         #endif
         this->server_socket = -1;
     }
-    if (this->client_socket != -1) {
-        #ifdef _WIN32
-        WSACleanup();
-        closesocket(this->client_socket);
-        #else
-        close(this->client_socket);
-        #endif
-        this->client_socket = -1;
+    #ifndef _WIN32
+    this->close_idle();
+    for (int& fd : this->wake) {
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
+        }
     }
+    #endif
 }
 
 NiceHTTP::~NiceHTTP() {
@@ -32,58 +49,675 @@ Router& NiceHTTP::getRouter() {
     return this->router;
 }
 
-void NiceHTTP::recv_http(const int& socket, std::string& head, std::string& body) {
+ResponseCache& NiceHTTP::getCache() {
+    return this->cache;
+}
+
+void NiceHTTP::addExecutor(const std::string& name, unsigned int threads, unsigned int max_queue) {
+    this->executors[name] = std::make_unique<Executor>(threads, max_queue);
+}
+
+template <typename String>
+bool NiceHTTP::recv_head(const int& socket, String& head, String& rest, std::chrono::steady_clock::time_point deadline) {
+    /* Read up to the end of the headers (\r\n\r\n).
+    * rest holds the bytes received after the head (start of the body); bytes
+    * already in rest when called are parsed before reading from the socket.
+    * Returns false if the connection was closed before a complete head.
+    * On non blocking sockets waits for data until the deadline, then throws TimeoutError
+    * Strings keep their allocator (std::pmr::string: the arena of the connection).
+    */
+    head.clear();
+    String data(std::move(rest));
+    rest.clear();
+    int n;
+    char buff[PKT_BLOCK_SIZE];
+    size_t header_end = data.find("\r\n\r\n");
+    if (header_end != std::string::npos) {
+        head.assign(data, 0, header_end + 4);
+        rest.assign(data, header_end + 4);
+        return true;
+    }
+    while (true)
+    {
+        n = recv(socket, buff, sizeof(buff), 0);
+        if ((n < 0) && net::would_block()) {
+            struct pollfd pfd = {socket, POLLIN, 0};
+            if (net::poll_socket(&pfd, 1, net::timeout_left(deadline)) == 0) {
+                throw TimeoutError("Timeout receiving the response");
+            }
+            continue;
+        }
+        if (n <= 0) {
+            head = std::move(data);
+            return false;
+        }
+        size_t from = (data.length() > 3) ? data.length() - 3 : 0;
+        data.append(buff, n);
+        header_end = data.find("\r\n\r\n", from);
+        if (header_end != std::string::npos) {
+            head.assign(data, 0, header_end + 4);
+            rest.assign(data, header_end + 4);
+            return true;
+        }
+    }
+}
+
+template <typename String>
+bool NiceHTTP::recv_body(const int& socket, std::string_view head, String& body, std::chrono::steady_clock::time_point deadline, String* excess) {
+    /* Read the rest of the body of the message with the given head.
+    * body must contain the bytes already received after the head.
+    * The body is delimited by Content-Length or by chunked encoding, responses
+    * without them are read until the connection is closed.
+    * Bytes received after a Content-Length body go to excess, if given (next pipelined request).
+    * Returns true if the message was delimited, i.e. the connection can be reused.
+    */
+    size_t length = std::string::npos;
+    bool chunked = false;
+    std::string cl = net::header_value(head, "content-length");
+    if (cl != "") {
+        length = strtoul(cl.c_str(), nullptr, 10);
+    } else if (net::header_value(head, "transfer-encoding").find("chunked") != std::string::npos) {
+        chunked = true;
+    } else if (!head.starts_with("HTTP/") || head.starts_with("HTTP/1.1 204") || head.starts_with("HTTP/1.1 304")) {
+        length = 0; // requests and these responses have no body
+    }
+    String data(std::move(body));
+    body.clear();
+    int n;
+    char buff[PKT_BLOCK_SIZE];
+    std::string decoded;
+    while (true)
+    {
+        if (chunked && net::decode_chunked(data, decoded)) {
+            body.assign(decoded);
+            return true;
+        }
+        if ((length != std::string::npos) && (data.length() >= length)) {
+            if (excess != nullptr) {
+                excess->assign(data, length);
+            }
+            data.resize(length);
+            body = std::move(data);
+            return true;
+        }
+        n = recv(socket, buff, sizeof(buff), 0);
+        if ((n < 0) && net::would_block()) {
+            struct pollfd pfd = {socket, POLLIN, 0};
+            if (net::poll_socket(&pfd, 1, net::timeout_left(deadline)) == 0) {
+                throw TimeoutError("Timeout receiving the response");
+            }
+            continue;
+        }
+        if (n <= 0) {
+            // connection closed by the peer
+            if (!chunked) {
+                body = std::move(data);
+            }
+            return false;
+        }
+        data.append(buff, n);
+    }
+}
+
+template <typename String>
+bool NiceHTTP::recv_http(const int& socket, String& head, String& body, std::chrono::steady_clock::time_point deadline) {
     /* Parse basic http structure
     *  <header>\r\n\r\n<body>
     * head , body of request are the return values
+    * Returns true if the message was delimited, i.e. the connection can be reused.
     */
-    head = "";
-    body = "";
-    int n;
-    char buff[PKT_BLOCK_SIZE] = {0,};
-    while ((n = recv(socket, buff, sizeof(buff), 0)))
-    {
-        std::string_view b(buff);
-        // if we were processing body, continute to put data into body
-        if (body != "") {
-            body += b;
-        } else { //else we process the headers
-            size_t header_end = b.find("\r\n\r\n");
-            if (header_end != std::string::npos) {
-                head += b.substr(0, header_end+4);
-                body += b.substr(header_end+4);
-            } else {
-                head += b;
+    if (!this->recv_head(socket, head, body, deadline)) {
+        return false;
+    }
+    return this->recv_body(socket, head, body, deadline);
+}
+
+static bool keep_alive(const http::Request& r) {
+    // HTTP/1.1 keeps the connection unless the client asks to close it, HTTP/1.0 only if asked to keep it
+    #ifdef _WIN32
+    return false; // no wake up pipe for the idle connections
+    #else
+    auto conn = r.headers.find("connection");
+    auto is = [&conn](std::string_view value) {
+        return std::ranges::equal(conn->second, value, [](char a, char b) { return std::tolower(a) == b; });
+    };
+    if (r.proto == "HTTP/1.0") {
+        return (conn != r.headers.end()) && is("keep-alive");
+    }
+    return (r.proto == PROTO_HTTP1) && ((conn == r.headers.end()) || !is("close"));
+    #endif
+}
+
+static bool header_is(std::string_view name, std::string_view lowercase) {
+    return std::ranges::equal(name, lowercase, [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; });
+}
+
+static std::string_view header_token(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ')) s.remove_suffix(1);
+    return s;
+}
+
+static void cache_key(const http::Request& r, const Route& route, std::pmr::string& key) {
+    // method, uri, Authorization (routes with auth), negotiated encoding and the values of the cache_vary headers
+    key.append(r.method).append(" ").append(r.uri);
+    if (!route.auth.empty()) {
+        auto authorization = r.headers.find("authorization");
+        key.append("\n").append((authorization == r.headers.end()) ? "" : authorization->second);
+    }
+    #ifdef NICEHTTP_COMPRESSION
+    if (route.compress) {
+        auto accept = r.headers.find("accept-encoding");
+        key.append("\n").append(compression::name((accept == r.headers.end()) ? compression::Encoding::Identity : compression::negotiate(accept->second)));
+    }
+    #endif
+    std::pmr::string name(key.get_allocator());
+    for (const auto part : std::views::split(route.cache_vary, ',')) {
+        name = header_token(std::string_view(part));
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+        auto value = r.headers.find(name);
+        key.append("\n").append((value == r.headers.end()) ? "" : value->second);
+    }
+}
+
+static bool storable(const http::Response& resp) {
+    // 200 responses without cookies or directives against caching
+    if (resp.code != 200) {
+        return false;
+    }
+    for (const auto& [name, value] : resp.headers) {
+        if (header_is(name, "set-cookie") || (header_is(name, "cache-control") &&
+            ((value.find("no-store") != std::string::npos) || (value.find("private") != std::string::npos) || (value.find("no-cache") != std::string::npos)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool shareable(const http::Response& resp) {
+    // a successful response that can go to other clients sending the same request
+    if ((resp.code < 200) || (resp.code >= 300)) {
+        return false;
+    }
+    for (const auto& [name, value] : resp.headers) {
+        if (header_is(name, "set-cookie") || (header_is(name, "cache-control") && (value.find("private") != std::string::npos))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::shared_ptr<const ResponseCache::Entry> cache_entry(http::Response& resp, int ttl) {
+    // Serialize resp (without Connection) for the cache, with an ETag of the body (200) if the handler didn't set one
+    auto entry = std::make_shared<ResponseCache::Entry>();
+    entry->code = resp.code;
+    auto etag = std::ranges::find_if(resp.headers, [](const auto& h) { return header_is(h.first, "etag"); });
+    if ((etag == resp.headers.end()) && (resp.code == 200)) {
+        char tag[24];
+        snprintf(tag, sizeof(tag), "\"%016llx\"", static_cast<unsigned long long>(std::hash<std::string_view>{}(resp.body)));
+        etag = resp.headers.emplace("ETag", tag).first;
+    }
+    if (etag != resp.headers.end()) {
+        entry->etag = etag->second;
+    }
+    resp.serialize(entry->raw);
+    entry->split = entry->raw.find("\r\n\r\n") + 2;
+    entry->body_size = entry->raw.size() - entry->split - 2;
+    entry->not_modified = "HTTP/1.1 304 Not Modified\r\n";
+    for (const auto& [name, value] : resp.headers) {
+        for (std::string_view validator : {"etag", "vary", "cache-control", "expires", "date", "server"}) {
+            if (header_is(name, validator)) {
+                entry->not_modified.append(name).append(": ").append(value).append("\r\n");
             }
         }
-        // if the end of buff is null we assume to have read all data (not true for binary data)
-        if (buff[PKT_BLOCK_SIZE-1] == 0) {
-            break;
+    }
+    entry->expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(ttl);
+    return entry;
+}
+
+static bool etag_matches(std::string_view if_none_match, std::string_view etag) {
+    // If-None-Match: "a", W/"b" or *, weak comparison
+    for (const auto part : std::views::split(if_none_match, ',')) {
+        std::string_view tag = header_token(std::string_view(part));
+        if (tag.starts_with("W/")) {
+            tag.remove_prefix(2);
+        }
+        if ((tag == "*") || (tag == (etag.starts_with("W/") ? etag.substr(2) : etag))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+short NiceHTTP::send_cached(Connection* conn, const http::Request& r, const ResponseCache::Entry& entry, bool keep) {
+    // Send a cached response, or 304 if the client has it already, returns the status sent
+    std::string_view connection = keep ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    std::pmr::string raw(&conn->arena);
+    short code = entry.code;
+    auto inm = r.headers.find("if-none-match");
+    if ((code == 200) && (inm != r.headers.end()) && !entry.etag.empty() && etag_matches(inm->second, entry.etag)) {
+        raw.append(entry.not_modified).append(connection).append("\r\n");
+        code = 304;
+    } else {
+        raw.reserve(entry.raw.size() + connection.size());
+        raw.append(entry.raw, 0, entry.split).append(connection).append(entry.raw, entry.split);
+    }
+    send(conn->fd, raw.c_str(), raw.length(), 0);
+    return code;
+}
+
+#ifdef NICEHTTP_COMPRESSION
+
+static bool compressible(std::string_view type) {
+    // media types not compressed already
+    if (type.starts_with("image/")) {
+        return type.starts_with("image/svg");
+    }
+    return !type.starts_with("video/") && !type.starts_with("audio/") && !type.starts_with("application/zip") &&
+           !type.starts_with("application/gzip") && !type.starts_with("application/octet-stream");
+}
+
+static short inflate_body(http::Message& m) {
+    // Replace a gzip/deflate body (parsed message) with the inflated one, returns 0 or the status of the error
+    auto encoding = m.headers.find(std::pmr::string("content-encoding", m.get_allocator())); // too long for the SSO, in the arena
+    if (encoding == m.headers.end()) {
+        return 0;
+    }
+    compression::Encoding e = compression::parse(encoding->second);
+    if (e == compression::Encoding::Unsupported) {
+        return 415;
+    }
+    if (e != compression::Encoding::Identity) {
+        std::pmr::string body(m.get_allocator());
+        try {
+            if (!compression::decompress(m.body, e, body)) {
+                return 413;
+            }
+        } catch (const compression::Error& err) {
+            Logger::getInstance().error(err.what());
+            return 400;
+        }
+        m.body = std::move(body);
+        m.content_length = m.body.size();
+    }
+    m.headers.erase(encoding);
+    return 0;
+}
+
+void NiceHTTP::compress(const http::Request& r, http::Response& resp, const Route* route) {
+    // Compress the body as accepted by the client, unless small, already encoded or of a compressed media type
+    if ((route == nullptr) || !route->compress || (resp.body.size() < NICEHTTP_COMPRESSION_MIN) ||
+        (resp.code < 200) || (resp.code == 204) || (resp.code == 304)) {
+        return;
+    }
+    for (const auto& [name, value] : resp.headers) {
+        if (header_is(name, "content-encoding") || (header_is(name, "content-type") && !compressible(value))) {
+            return;
+        }
+    }
+    resp.headers.emplace("Vary", "Accept-Encoding");
+    auto accept = r.headers.find("accept-encoding");
+    compression::Encoding e = (accept == r.headers.end()) ? compression::Encoding::Identity : compression::negotiate(accept->second);
+    if (e == compression::Encoding::Identity) {
+        return;
+    }
+    std::pmr::string body(resp.get_allocator());
+    try {
+        if (route->cache_compressed) {
+            this->compressed.compress(resp.body, e, body);
+        } else {
+            compression::compress(resp.body, e, body);
+        }
+    } catch (const compression::Error& err) {
+        Logger::getInstance().error(err.what());
+        return;
+    }
+    if (body.size() >= resp.body.size()) {
+        return; // not compressible
+    }
+    resp.body = std::move(body);
+    resp.content_length = resp.body.size();
+    resp.headers.emplace("Content-Encoding", compression::name(e));
+}
+#endif
+
+void NiceHTTP::serve(Connection* conn, trace::RequestTrace trace) {
+    /* Serve the requests of a connection on this thread while the next one is already
+    * there, then park the connection in the idle set polled by start().
+    */
+    while (this->parsereq(conn, trace)) {
+        if (conn->fd == -1) {
+            delete conn;
+            return;
+        }
+        if ((conn->pending.find("\r\n\r\n") == std::string::npos) && !net::wait_socket(conn->fd, POLLIN, std::chrono::steady_clock::now())) {
+            return this->park(conn);
         }
-        memset(buff, 0, sizeof(buff));
+        trace = trace::RequestTrace();
     }
+    // handed to an executor
 }
 
-void NiceHTTP::parsereq(const int& client_fd) {
+void NiceHTTP::park(Connection* conn) {
+    conn->idle_since = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(this->idle_mutex);
+        this->idle.push_back(conn);
+    }
+    char c = 0;
+    if (write(this->wake[1], &c, 1) < 0) {
+        // the pipe is full, start() is going to poll the idle set anyway
+    }
+}
+
+void NiceHTTP::close_idle() {
+    std::lock_guard<std::mutex> lock(this->idle_mutex);
+    for (Connection* conn : this->idle) {
+        net::close_socket(conn->fd);
+        Metrics::getInstance().closed();
+        delete conn;
+    }
+    this->idle.clear();
+}
+
+bool NiceHTTP::parsereq(Connection* conn, trace::RequestTrace& trace) {
+    /* Read, parse and serve one request of conn.
+    * Returns false if the request was handed to an executor, which owns conn from now on.
+    * Otherwise conn->fd is -1 if the connection was closed.
+    */
     NLOG("Current Thread ID " << std::this_thread::get_id())
-    // Receive request from client
-    std::string req, body;
-    this->recv_http(client_fd, req, body);
-    http::Request r(req, body);
+    trace.mark(trace::Phase::Queue);
+    // nothing of the previous request is alive anymore
+    conn->arena.release();
+    // Receive request head from client
+    std::pmr::string req(&conn->arena), body(conn->pending, &conn->arena);
+    conn->pending.clear();
+    bool complete = this->recv_head(conn->fd, req, body);
+    trace.mark(trace::Phase::Recv);
+    if (!complete && req.empty()) {
+        net::close_socket(conn->fd);
+        conn->fd = -1;
+        Metrics::getInstance().closed();
+        return true;
+    }
+    auto start = std::chrono::steady_clock::now();
+    http::Request r(&conn->arena);
+    r.parseHead(req);
+    trace.mark(trace::Phase::Parse);
     NLOG(r.method << " " << r.uri)
-    http::Response resp = this->router.handle(r);
-    resp.headers.insert({"Server", "NiceHTTP"});
-    resp.headers.insert({"Connection", "close"});
-    std::string raw_resp = resp.toString();
+    if (r.method.empty() || r.uri.empty() || !r.proto.starts_with("HTTP/")) {
+        Metrics::getInstance().parseError();
+        if (this->capture.active()) {
+            this->capture.record(start, req, body);
+        }
+        return this->finish(conn, r, nullptr, this->reply(conn->fd, 400, "Bad Request"), 0, 0, start, trace), true;
+    }
+    const Route* route = this->router.match(r);
+    trace.mark(trace::Phase::Route);
+    if ((route != nullptr) && (route->executor != NICEHTTP_INLINE_EXECUTOR)) {
+        auto executor = this->executors.find(route->executor);
+        if (executor == this->executors.end()) {
+            Logger::getInstance().error("Unknown executor " + std::string(route->executor));
+            return this->finish(conn, r, route, this->reply(conn->fd, 500, "Internal Server Error"), 0, 0, start, trace), true;
+        }
+        // hand the rest of the request to the route bulkhead, this thread goes back to new connections
+        auto task = [this, conn, r = std::move(r), req = std::move(req), body = std::move(body), complete, route, start, trace]() mutable {
+            trace.mark(trace::Phase::Executor);
+            bool keep;
+            {
+                // the arena strings must be gone before the connection is reused or deleted
+                http::Request request = std::move(r);
+                std::pmr::string head = std::move(req), rest = std::move(body);
+                keep = this->respond(conn, request, head, rest, complete, route, start, trace);
+            }
+            if (keep) {
+                this->park(conn);
+            } else {
+                delete conn;
+            }
+        };
+        if (!executor->second->submit(std::move(task))) {
+            NLOG("Executor " << route->executor << " full")
+            // the request moved into the rejected task
+            this->finish(conn, http::Request(), route, this->reply(conn->fd, 503, "Service Unavailable"), 0, 0, start, trace);
+            delete conn;
+        }
+        return false;
+    }
+    this->respond(conn, r, req, body, complete, route, start, trace);
+    return true;
+}
+
+bool NiceHTTP::respond(Connection* conn, http::Request& r, std::string_view head, std::pmr::string& rest, bool complete, const Route* route, std::chrono::steady_clock::time_point start, trace::RequestTrace& trace) {
+    // Handle a request whose head has been read, rest is the start of the body. Returns true if the connection is kept
+    if ((route != nullptr) && route->isProxy()) {
+        // stream the request to the upstream, body included
+        std::string_view body(rest);
+        bool keep = complete && keep_alive(r) && (++conn->requests < NICEHTTP_KEEPALIVE_REQUESTS);
+        if (body.size() > r.content_length) {
+            // pipelined requests stay on the client connection, they must not reach the upstream one
+            if (keep) {
+                conn->pending.assign(body.substr(r.content_length));
+            }
+            body = body.substr(0, r.content_length);
+        }
+        if (this->capture.active()) {
+            this->capture.record(start, head, body); // the body received with the head only
+        }
+        short code = this->proxyreq(conn->fd, r, head, body, *route, keep);
+        trace.mark(trace::Phase::Proxy);
+        if (!keep) {
+            conn->pending.clear();
+        }
+        NLOG("Exiting thread")
+        return this->finish(conn, r, route, code, r.content_length, 0, start, trace, keep);
+    }
+    std::pmr::string excess(&conn->arena);
+    if (complete) {
+        complete = this->recv_body(conn->fd, head, rest, std::chrono::steady_clock::time_point::max(), &excess);
+    }
+    if (this->capture.active()) {
+        this->capture.record(start, head, rest);
+    }
+    r.setBody(rest);
+    #ifdef NICEHTTP_COMPRESSION
+    if (short error = inflate_body(r)) {
+        const char* message = (error == 415) ? "Unsupported Media Type" : (error == 413) ? "Payload Too Large" : "Bad Request";
+        return this->finish(conn, r, route, this->reply(conn->fd, error, message), r.body.size(), 0, start, trace);
+    }
+    #endif
+    trace.mark(trace::Phase::Body);
+    bool keep = complete && keep_alive(r) && (++conn->requests < NICEHTTP_KEEPALIVE_REQUESTS);
+    if (keep) {
+        conn->pending.assign(excess);
+    }
+    // the cache and the flights are used after the auth check of the route, unauthorized requests get their 401 from the router
+    bool cacheable = (route != nullptr) && (route->cache_ttl > 0) && (r.method == "GET") && route->authorized(r);
+    bool coalesce = (route != nullptr) && route->coalesce && (r.method == "GET") && route->authorized(r);
+    std::pmr::string key(&conn->arena);
+    std::optional<SingleFlight::Leader> leader;
+    if (cacheable || coalesce) {
+        cache_key(r, *route, key);
+        std::shared_ptr<const ResponseCache::Entry> entry = cacheable ? this->cache.get(key) : nullptr;
+        if (!entry && coalesce) {
+            auto flight = this->flights.join(key);
+            if (auto* call = std::get_if<std::shared_ptr<SingleFlight::Call>>(&flight)) {
+                // an identical request is running the handler, wait for its response
+                entry = this->flights.wait(**call);
+            } else {
+                leader.emplace(std::move(std::get<SingleFlight::Leader>(flight)));
+            }
+        }
+        if (entry) {
+            short code = this->send_cached(conn, r, *entry, keep);
+            trace.mark(trace::Phase::Send);
+            return this->finish(conn, r, route, code, r.body.size(), (code == 304) ? 0 : entry->body_size, start, trace, keep);
+        }
+    }
+    http::Response resp = this->router.handle(r, route);
+    trace.mark(trace::Phase::Handler);
+    #ifdef NICEHTTP_COMPRESSION
+    this->compress(r, resp, route);
+    trace.mark(trace::Phase::Compress);
+    #endif
+    resp.headers.emplace("Server", "NiceHTTP");
+    if ((cacheable && storable(resp)) || (leader && shareable(resp))) {
+        auto entry = cache_entry(resp, route->cache_ttl);
+        if (cacheable && storable(resp)) {
+            this->cache.put(key, entry);
+        }
+        if (leader) {
+            leader->complete(entry);
+        }
+        trace.mark(trace::Phase::Serialize);
+        short code = this->send_cached(conn, r, *entry, keep);
+        trace.mark(trace::Phase::Send);
+        return this->finish(conn, r, route, code, r.body.size(), (code == 304) ? 0 : entry->body_size, start, trace, keep);
+    }
+    leader.reset(); // the identical requests waiting run their own handler
+    resp.headers.emplace("Connection", keep ? "keep-alive" : "close");
+    std::pmr::string raw_resp(&conn->arena);
+    resp.serialize(raw_resp);
+    trace.mark(trace::Phase::Serialize);
     NLOG(resp.proto << " " << resp.code << " " << resp.message)
     //Send response to client
-    send(client_fd, raw_resp.c_str(), raw_resp.length(), 0);
+    send(conn->fd, raw_resp.c_str(), raw_resp.length(), 0);
+    trace.mark(trace::Phase::Send);
     NLOG("Exiting thread")
-    #ifdef _WIN32
-    closesocket(client_fd);
-    #else
-    close(client_fd);
-    #endif
+    return this->finish(conn, r, route, resp.code, r.body.size(), resp.body.size(), start, trace, keep);
+}
+
+bool NiceHTTP::finish(Connection* conn, const http::Request& r, const Route* route, short code, size_t bytes_in, size_t bytes_out, std::chrono::steady_clock::time_point start, trace::RequestTrace& trace, bool keep) {
+    // Account the request and close the connection unless kept alive (conn->fd is then -1, the owner deletes conn)
+    Logger& logger = Logger::getInstance();
+    char peer[INET6_ADDRSTRLEN] = "";
+    if (logger.accessLogEnabled()) {
+        sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        if (getpeername(conn->fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0) {
+            if (addr.ss_family == AF_INET) {
+                inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(&addr)->sin_addr, peer, sizeof(peer));
+            } else if (addr.ss_family == AF_INET6) {
+                inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6*>(&addr)->sin6_addr, peer, sizeof(peer));
+            }
+        }
+    }
+    if (!keep) {
+        net::close_socket(conn->fd);
+        conn->fd = -1;
+    }
+    auto latency = std::chrono::steady_clock::now() - start;
+    Metrics& metrics = Metrics::getInstance();
+    metrics.request(route, code, bytes_in, bytes_out, latency);
+    if (!keep) {
+        metrics.closed();
+    }
+    trace::Tracer::getInstance().record(trace, r.method, r.uri);
+    if (logger.accessLogEnabled()) {
+        logger.access(peer, r.method, r.uri, r.proto, code, bytes_out, latency);
+    }
+    return keep;
+}
+
+bool NiceHTTP::enableCapture(const std::string& path, uint64_t max_bytes) {
+    if (!this->capture.open(path, max_bytes)) {
+        Logger::getInstance().error("Cannot open the capture file " + path);
+        return false;
+    }
+    return true;
+}
+
+void NiceHTTP::enableAccessLog(const std::string& path) {
+    Logger& logger = Logger::getInstance();
+    if (!path.empty() && !logger.openAccessLog(path)) {
+        logger.error("Cannot open the access log " + path);
+        return;
+    }
+    logger.setAccessLog(true);
+}
+
+void NiceHTTP::enableTracing(std::string_view uri) {
+    Route route {"GET", uri, [](const http::Request&) {
+        std::string body = trace::Tracer::getInstance().chromeTrace();
+        std::map<std::string,std::string> headers;
+        return http::Response(200, "OK", PROTO_HTTP1, headers, true, body.length(), body);
+    }};
+    this->router.add(route);
+}
+
+void NiceHTTP::enableProfiling(std::string_view uri) {
+    this->profile_uri = std::string(uri) + "(\\?.*)?";
+    Route route {"GET", this->profile_uri, [](const http::Request& req) {
+        // /debug/profile?seconds=N, 10 seconds by default
+        int seconds = 10;
+        size_t param = req.uri.find("seconds=");
+        if (param != std::string::npos) {
+            seconds = atoi(req.uri.c_str() + param + 8);
+        }
+        std::map<std::string,std::string> headers {{"Content-Type", "text/plain"}};
+        try {
+            std::string body = Profiler::getInstance().profile(std::chrono::seconds(seconds));
+            return http::Response(200, "OK", PROTO_HTTP1, headers, false, body.length(), body);
+        } catch (const ProfilerBusy& e) {
+            std::string body = std::string(e.what()) + "\n";
+            return http::Response(409, "Conflict", PROTO_HTTP1, headers, false, body.length(), body);
+        } catch (const std::runtime_error& e) {
+            std::string body = std::string(e.what()) + "\n";
+            return http::Response(501, "Not Implemented", PROTO_HTTP1, headers, false, body.length(), body);
+        }
+    }};
+    this->router.add(route);
+}
+
+void NiceHTTP::enableMetrics(std::string_view uri) {
+    Route route {"GET", uri, [this](const http::Request&) {
+        std::string body = Metrics::getInstance().render() + this->poolMetrics() + this->cache.metrics() + this->flights.metrics();
+        std::map<std::string,std::string> headers {{"Content-Type", "text/plain; version=0.0.4"}};
+        return http::Response(200, "OK", PROTO_HTTP1, headers, false, body.length(), body);
+    }};
+    this->router.add(route);
+}
+
+std::string NiceHTTP::poolMetrics() {
+    // Prometheus families of the server pool and of the executors
+    std::vector<std::pair<std::string, dp::pool_statistics>> pools;
+    if (dp::thread_pool<>* pool = this->server_pool.load(std::memory_order_acquire)) {
+        pools.emplace_back("server", pool->stats());
+    }
+    for (const auto& [name, executor] : this->executors) {
+        pools.emplace_back(name, executor->stats());
+    }
+    std::string out;
+    auto family = [&out, &pools](const std::string& name, const std::string& type, const std::string& help, auto value) {
+        out += "# HELP " + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+        for (const auto& [pool, stats] : pools) {
+            uint64_t total = 0;
+            for (const auto& worker : stats.workers) {
+                total += value(stats, worker);
+            }
+            out += name + "{pool=\"" + pool + "\"} " + std::to_string(total) + "\n";
+        }
+    };
+    using Stats = const dp::pool_statistics&;
+    using Worker = const dp::worker_statistics&;
+    family("nicehttp_pool_workers", "gauge", "Running workers.", [](Stats, Worker w) -> uint64_t { return w.active; });
+    family("nicehttp_pool_pending_tasks", "gauge", "Tasks waiting for a worker.",
+           [](Stats s, Worker w) -> uint64_t { return (&w == &s.workers.front()) ? std::max<int64_t>(s.pending, 0) : 0; });
+    family("nicehttp_pool_tasks_total", "counter", "Tasks executed.", [](Stats, Worker w) { return w.executed; });
+    family("nicehttp_pool_steals_total", "counter", "Tasks stolen from another worker.", [](Stats, Worker w) { return w.stolen; });
+    family("nicehttp_pool_failed_steals_total", "counter", "Steal attempts that found nothing.", [](Stats, Worker w) { return w.failed_steals; });
+    family("nicehttp_pool_parks_total", "counter", "Times an idle worker went to sleep.", [](Stats, Worker w) { return w.parks; });
+    family("nicehttp_pool_busy_microseconds_total", "counter", "Time the workers spent running tasks.",
+           [](Stats, Worker w) { return w.busy_ns / 1000; });
+    out += "# HELP nicehttp_pool_queue_wait_seconds Sampled delay between enqueue and start of a task (upper bound).\n";
+    out += "# TYPE nicehttp_pool_queue_wait_seconds gauge\n";
+    for (const auto& [pool, stats] : pools) {
+        for (const auto& [q, label] : {std::pair{50.0, "0.5"}, std::pair{99.0, "0.99"}}) {
+            out += "nicehttp_pool_queue_wait_seconds{pool=\"" + pool + "\",quantile=\"" + label +
+                   "\"} " + std::to_string(stats.wait_percentile(q) / 1e9) + "\n";
+        }
+    }
+    return out;
 }
 
 bool NiceHTTP::server_setup(const std::string& iface, const short& port) {
@@ -97,7 +731,7 @@ bool NiceHTTP::server_setup(const std::string& iface, const short& port) {
     this->server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (this->server_socket == -1)
     {
-        std::cerr << "Error creating the socket" << std::endl;
+        Logger::getInstance().error("Error creating the socket");
         return false;
     }
 
@@ -116,7 +750,7 @@ bool NiceHTTP::server_setup(const std::string& iface, const short& port) {
 
     if (bind(this->server_socket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1)
     {
-        std::cerr << "Error binding the socket" << std::endl;
+        Logger::getInstance().error("Error binding the socket");
         this->cleanup();
         return false;
     }
@@ -130,13 +764,34 @@ void NiceHTTP::start(std::string iface, short port) {
         return;
     }
 
-    if (listen(this->server_socket, 1) == -1) {
-        std::cerr << "listen(): Error listening on socket" << std::endl;
+    if (listen(this->server_socket, SOMAXCONN) == -1) {
+        Logger::getInstance().error("listen(): Error listening on socket");
         this->cleanup();
         return;
     }
 
-    dp::thread_pool pool(NICEHTTP_THREADS);
+    #ifndef _WIN32
+    // a client closing the connection must not kill the server while we write to it
+    signal(SIGPIPE, SIG_IGN);
+    if (pipe(this->wake) == -1) {
+        Logger::getInstance().error("Error creating the wake up pipe");
+        this->cleanup();
+        return;
+    }
+    fcntl(this->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(this->wake[1], F_SETFL, O_NONBLOCK);
+    #endif
+
+    const dp::wait_strategy wait {std::chrono::microseconds(NICEHTTP_SPIN_TIME),
+                                  std::chrono::microseconds(NICEHTTP_SPIN_TIME)};
+    // elastic when it may grow over the base size
+    auto pool = NICEHTTP_MAX_THREADS > NICEHTTP_THREADS
+        ? std::make_unique<dp::thread_pool<>>(dp::elastic_size{NICEHTTP_THREADS, NICEHTTP_MAX_THREADS,
+                                                               std::chrono::milliseconds(NICEHTTP_GROW_AFTER),
+                                                               std::chrono::milliseconds(NICEHTTP_IDLE_TIMEOUT)},
+                                              NICEHTTP_AFFINITY, wait)
+        : std::make_unique<dp::thread_pool<>>(NICEHTTP_THREADS, NICEHTTP_AFFINITY, wait);
+    this->server_pool.store(pool.get(), std::memory_order_release);
     int timeout = 1 * 60 * 1000; // wait 1 minute
     struct pollfd fds[1] = {0};
     fds[0].fd = this->server_socket;
@@ -150,112 +805,375 @@ void NiceHTTP::start(std::string iface, short port) {
             client_socket = accept(this->server_socket, NULL, NULL);
             if (client_socket > 0) {
                 //Client accepted
-                pool.enqueue_detach([this, &client_socket]() { this->parsereq(client_socket); });
+                Metrics::getInstance().accepted();
+                trace::RequestTrace trace;
+                pool->enqueue_detach([this, conn = new Connection(client_socket), trace]() mutable { this->serve(conn, trace); });
             } else {
-                std::cerr << "Failed to accept incoming connection" << std::endl;
+                Logger::getInstance().error("Failed to accept incoming connection");
             }
         } else if (rc < 0) {
-            return;
+            break;
         }
     }
     #else
-    while(int rc = poll(fds, 1, timeout)) { // query socket status
-        if (rc > 0) { //accept the incoming connection
+    // polled: the server socket, the wake up pipe and the idle keep-alive connections
+    std::vector<struct pollfd> pfds;
+    std::vector<Connection*> watched;
+    while (true) {
+        pfds.assign(fds, fds + 1);
+        pfds.push_back({this->wake[0], POLLIN, 0});
+        auto now = std::chrono::steady_clock::now();
+        auto expiry = std::chrono::steady_clock::time_point::max();
+        {
+            std::lock_guard<std::mutex> lock(this->idle_mutex);
+            watched = this->idle;
+        }
+        for (Connection* conn : watched) {
+            pfds.push_back({conn->fd, POLLIN, 0});
+            expiry = std::min(expiry, conn->idle_since + std::chrono::milliseconds(NICEHTTP_KEEPALIVE_TIMEOUT));
+        }
+        int wait_ms = watched.empty() ? timeout : std::max<int>(0, std::chrono::ceil<std::chrono::milliseconds>(expiry - now).count());
+        int rc = net::poll_socket(pfds.data(), pfds.size(), wait_ms);
+        if ((rc < 0) || ((rc == 0) && watched.empty())) {
+            break;
+        }
+        if (pfds[0].revents & POLLIN) { //accept the incoming connection
             client_socket = accept(this->server_socket, NULL, NULL);
             if (client_socket > 0) {
                 //Client accepted
-                pool.enqueue_detach([this, &client_socket]() { this->parsereq(client_socket); });
+                Metrics::getInstance().accepted();
+                trace::RequestTrace trace;
+                pool->enqueue_detach([this, conn = new Connection(client_socket), trace]() mutable { this->serve(conn, trace); });
             } else {
-                std::cerr << "Failed to accept incoming connection" << std::endl;
+                Logger::getInstance().error("Failed to accept incoming connection");
             }
-        } else if (rc < 0) {
-            return;
+        }
+        if (pfds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(this->wake[0], drain, sizeof(drain)) > 0) {}
+        }
+        // serve the idle connections with a new request, close the expired ones
+        now = std::chrono::steady_clock::now();
+        std::vector<Connection*> ready, expired;
+        for (size_t i = 0; i < watched.size(); i++) {
+            if (pfds[i + 2].revents != 0) {
+                ready.push_back(watched[i]);
+            } else if (now - watched[i]->idle_since >= std::chrono::milliseconds(NICEHTTP_KEEPALIVE_TIMEOUT)) {
+                expired.push_back(watched[i]);
+            }
+        }
+        if (ready.empty() && expired.empty()) {
+            continue;
+        }
+        {
+            // out of the idle set before a worker can park them again
+            std::ranges::sort(ready);
+            std::ranges::sort(expired);
+            std::lock_guard<std::mutex> lock(this->idle_mutex);
+            std::erase_if(this->idle, [&](Connection* conn) {
+                return std::ranges::binary_search(ready, conn) || std::ranges::binary_search(expired, conn);
+            });
+        }
+        for (Connection* conn : ready) {
+            trace::RequestTrace trace;
+            pool->enqueue_detach([this, conn, trace]() mutable { this->serve(conn, trace); });
+        }
+        for (Connection* conn : expired) {
+            net::close_socket(conn->fd);
+            Metrics::getInstance().closed();
+            delete conn;
         }
     }
     #endif
-
+    this->server_pool.store(nullptr, std::memory_order_release);
+    pool.reset(); // the running requests may still park their connection
+    this->close_idle();
 }
 
-bool NiceHTTP::client_setup(const std::string& host, const short& port) {
+int NiceHTTP::client_connect(const std::string& host, const short& port, int timeout, std::chrono::steady_clock::time_point deadline, size_t first_address) {
+    /* Connect to host:port trying every resolved address, starting from first_address.
+    * Returns a non blocking socket, throws if no address accepts the connection.
+    */
     #ifdef _WIN32
     // Initialize WSA variables
     WSADATA wsaData;
     int wsaerr;
     WORD wVersionRequested = MAKEWORD(2, 2);
     wsaerr = WSAStartup(wVersionRequested, &wsaData);
-    #endif  
-    this->client_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (this->client_socket == -1)
-    {
-        std::cerr << "Error creating the socket" << std::endl;
-        return false;
+    #endif
+    // Solve domain name to ip (cached)
+    std::vector<Address> addresses = Resolver::getInstance().resolve(host, port);
+    if (addresses.empty()) {
+        throw std::runtime_error("Cannot resolve domain to address");
     }
 
-    std::string ip;
-
-    if (!is_ipaddr(host)) {
-        // Solve domain name to ip
-        try { 
-            hostent *h = gethostbyname(host.c_str());
-            if (h && (h->h_addrtype == AF_INET)) {
-                unsigned char *addr = reinterpret_cast<unsigned char *>(h->h_addr_list[0]);
-                std::stringstream ss;
-                std::copy(addr, addr+4, std::ostream_iterator<unsigned int>(ss, "."));
-                ip = ss.str();
-                ip.erase(ip.length()-1);
-            } else {
-                std::cerr << "Cannot resolve domain to address" << std::endl;
-                return false;
+    bool timed_out = false;
+    for (size_t i = 0; i < addresses.size(); i++) {
+        const Address& addr = addresses[(first_address + i) % addresses.size()];
+        int fd = socket(addr.family, SOCK_STREAM, IPPROTO_TCP);
+        if (fd == -1)
+        {
+            throw std::runtime_error("Error creating the socket");
+        }
+        net::set_nonblocking(fd);
+        if (connect(fd, reinterpret_cast<const sockaddr*>(&addr.addr), addr.len) == 0) {
+            return fd;
+        }
+        if (net::connect_in_progress()) {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            int rc = net::poll_socket(&pfd, 1, net::timeout_left(net::deadline_after(timeout, deadline)));
+            if (rc > 0) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&err, &len);
+                if (err == 0) {
+                    return fd;
+                }
+            } else if (rc == 0) {
+                timed_out = true;
             }
         }
-        catch (std::exception const &exc) {
-            std::cerr << exc.what() << "\n";
-            return false;
+        NLOG("Cannot connect to " << addr.toString())
+        net::close_socket(fd);
+    }
+
+    if (timed_out) {
+        throw TimeoutError("Timeout connecting to server");
+    }
+    throw std::runtime_error("Cannot connect to server");
+}
+
+void NiceHTTP::record_latency(int ms) {
+    size_t i = this->latency_count.fetch_add(1, std::memory_order_relaxed);
+    this->latencies[i % NICEHTTP_LATENCY_SAMPLES].store(ms, std::memory_order_relaxed);
+}
+
+int NiceHTTP::hedge_delay(const RequestOptions& opts) {
+    // Returns the delay (ms) before sending the hedged request, -1 to not hedge
+    if (opts.hedge_delay > 0) {
+        return opts.hedge_delay;
+    }
+    size_t n = std::min<size_t>(this->latency_count.load(std::memory_order_relaxed), NICEHTTP_LATENCY_SAMPLES);
+    if (n < 20) {
+        return -1; // not enough history to know what "slow" means
+    }
+    std::vector<int> samples(n);
+    for (size_t i = 0; i < n; i++) {
+        samples[i] = this->latencies[i].load(std::memory_order_relaxed);
+    }
+    auto p95 = samples.begin() + (n * 95) / 100;
+    std::nth_element(samples.begin(), p95, samples.end());
+    return std::max(*p95, 1);
+}
+
+http::Response NiceHTTP::client_attempt(const std::string& raw_req, const std::string& host, const short& port, const RequestOptions& opts, std::chrono::steady_clock::time_point deadline, bool idempotent, bool reuse, bool& sent) {
+    /* Single try of a request. With hedging, a second connection (to the next
+    * address of the host, if any) sends the same request once the first one
+    * is slower than the hedging delay, and the first to answer wins.
+    */
+    auto start = std::chrono::steady_clock::now();
+    int fds[2] = {-1, -1};
+    bool reused = false;
+    if (reuse) {
+        fds[0] = this->connections.get(host, port);
+        reused = (fds[0] != -1);
+    }
+    if (!reused) {
+        fds[0] = this->client_connect(host, port, opts.connect_timeout, deadline);
+    }
+    try {
+        sent = true;
+        net::send_all(fds[0], raw_req, deadline);
+    } catch (const std::runtime_error& e) {
+        net::close_socket(fds[0]);
+        if (reused) {
+            // the server closed the idle connection, nothing was processed
+            return this->client_attempt(raw_req, host, port, opts, deadline, idempotent, false, sent);
         }
-    } else {
-        ip = host;
+        throw;
     }
 
-    sockaddr_in serverAddr;
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = inet_addr(ip.c_str());
-    serverAddr.sin_port = htons(port);
+    auto first_byte = net::deadline_after(opts.first_byte_timeout, deadline);
+    struct pollfd pfds[2] = {{fds[0], POLLIN, 0}, {-1, POLLIN, 0}};
+    int n = 1;
+    int delay = (opts.hedge && idempotent) ? this->hedge_delay(opts) : -1;
+    if (delay >= 0) {
+        int wait = net::timeout_left(first_byte);
+        if (net::poll_socket(pfds, 1, (wait < 0) ? delay : std::min(wait, delay)) == 0) {
+            try {
+                fds[1] = this->client_connect(host, port, opts.connect_timeout, first_byte, 1);
+                net::send_all(fds[1], raw_req, first_byte);
+                pfds[1].fd = fds[1];
+                n = 2;
+            } catch (const std::runtime_error& e) {
+                // keep waiting for the primary request
+                NLOG("Hedged request failed: " << e.what())
+                if (fds[1] != -1) {
+                    net::close_socket(fds[1]);
+                    fds[1] = -1;
+                }
+            }
+        }
+    }
 
-    if (connect(this->client_socket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1)
-    {
-        std::cerr << "Error binding the socket" << std::endl;
-        this->cleanup();
-        return false;
+    int winner = -1;
+    while (winner == -1) {
+        int rc = net::poll_socket(pfds, n, net::timeout_left(first_byte));
+        if (rc <= 0) {
+            for (int fd : fds) {
+                if (fd != -1) net::close_socket(fd);
+            }
+            if (rc == 0) {
+                throw TimeoutError("Timeout waiting for the response");
+            }
+            throw std::runtime_error("Error waiting for the response");
+        }
+        for (int i = 0; i < n; i++) {
+            if (pfds[i].revents != 0) {
+                winner = i;
+                break;
+            }
+        }
+    }
+    if (fds[1 - winner] != -1) {
+        net::close_socket(fds[1 - winner]);
     }
 
-    return true;
+    std::string body;
+    std::string resp;
+    bool delimited = false;
+    try {
+        delimited = this->recv_http(fds[winner], resp, body, deadline);
+    } catch (...) {
+        net::close_socket(fds[winner]);
+        throw;
+    }
+    if (resp.empty()) {
+        net::close_socket(fds[winner]);
+        if (reused && (winner == 0) && idempotent) {
+            // stale pooled connection closed before reading our request
+            return this->client_attempt(raw_req, host, port, opts, deadline, idempotent, false, sent);
+        }
+        throw std::runtime_error("Connection closed by server");
+    }
+    http::Response r(resp, body);
+    #ifdef NICEHTTP_COMPRESSION
+    if (opts.compressed && (inflate_body(r) != 0)) {
+        net::close_socket(fds[winner]);
+        throw std::runtime_error("Cannot decode the response body");
+    }
+    #endif
+    auto conn = r.headers.find("connection");
+    if (opts.keep_alive && delimited && ((conn == r.headers.end()) || (conn->second != "close"))) {
+        this->connections.put(host, port, fds[winner]);
+    } else {
+        net::close_socket(fds[winner]);
+    }
+    this->record_latency(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+    return r;
 }
 
-bool NiceHTTP::is_ipaddr(const std::string& host) {
-    for (char c : host) {
-        if (!(isdigit(c) || (c == '.'))) {
-            return false;
-        }
+static bool is_idempotent(std::string_view method) {
+    return (method == "GET") || (method == "HEAD") || (method == "OPTIONS") || (method == "PUT") || (method == "DELETE");
+}
+
+void NiceHTTP::backoff(int attempt, const RequestOptions& opts, std::chrono::steady_clock::time_point deadline) {
+    // full jitter backoff: random wait in [0, min(max_backoff, backoff * 2^attempt)]
+    thread_local std::mt19937 rng(std::random_device{}());
+    int cap = std::min(opts.max_backoff, opts.backoff << std::min(attempt, 16));
+    std::uniform_int_distribution<int> dist(0, std::max(cap, 0));
+    auto wake = std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(dist(rng)));
+    std::this_thread::sleep_until(wake);
+    if (std::chrono::steady_clock::now() >= deadline) {
+        throw TimeoutError("Request deadline expired");
     }
-    return true;
 }
 
-http::Response NiceHTTP::request(http::Request req, std::string host, short port) {
+http::Response NiceHTTP::request(http::Request req, std::string host, short port, const RequestOptions& opts) {
     /* Perform generic request req to host:port */
-    if (!this->client_setup(host, port) || (this->client_socket == -1)) {
-        throw std::runtime_error("Cannot connect to server");
-    } 
-
+    auto deadline = net::deadline_after(opts.total_timeout, std::chrono::steady_clock::time_point::max());
+    // Only idempotent requests can be hedged or retried once they reached the server
+    bool idempotent = is_idempotent(req.method);
+    #ifdef NICEHTTP_COMPRESSION
+    if (opts.compressed) {
+        req.headers.emplace("Accept-Encoding", "gzip, deflate");
+    }
+    #endif
     std::string raw_req = req.toString();
-    //Send request
-    send(this->client_socket, raw_req.c_str(), raw_req.length(), 0);
+    RetryBudget::deposit();
 
-    std::string body;
-    std::string resp;
-    this->recv_http(this->client_socket, resp, body);
+    for (int attempt = 0; ; attempt++) {
+        bool sent = false;
+        CircuitBreaker::Permit permit;
+        if ((opts.breaker != nullptr) && !(permit = opts.breaker->allow())) {
+            throw CircuitOpenError("Circuit open for " + host + ":" + std::to_string(port));
+        }
+        auto start = std::chrono::steady_clock::now();
+        try {
+            http::Response r = this->client_attempt(raw_req, host, port, opts, deadline, idempotent, opts.keep_alive, sent);
+            if (opts.breaker != nullptr) {
+                opts.breaker->record(permit, r.code < 500, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+            }
+            return r;
+        } catch (const std::runtime_error& e) {
+            if (opts.breaker != nullptr) {
+                opts.breaker->record(permit, false, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+            }
+            if ((attempt >= opts.max_retries) || (sent && !idempotent) || !RetryBudget::withdraw()) {
+                throw;
+            }
+            NLOG("Request failed (" << e.what() << "), retrying")
+        }
+        this->backoff(attempt, opts, deadline);
+    }
+}
 
-    http::Response r(resp, body);
-    close(this->client_socket);
+http::Response NiceHTTP::request(http::Request req, UpstreamGroup& upstream, const RequestOptions& opts, std::string_view key) {
+    /* Perform request req to an endpoint of upstream chosen by its balancing policy.
+    * Retries go through the balancer again, so they usually reach another replica.
+    * Connection errors, timeouts and 5xx responses count as endpoint failures.
+    * Endpoints whose breaker refuses the request are skipped; throws CircuitOpenError
+    * without sending anything when every endpoint refuses it.
+    */
+    auto deadline = net::deadline_after(opts.total_timeout, std::chrono::steady_clock::time_point::max());
+    bool idempotent = is_idempotent(req.method);
+    #ifdef NICEHTTP_COMPRESSION
+    if (opts.compressed) {
+        req.headers.emplace("Accept-Encoding", "gzip, deflate");
+    }
+    #endif
+    std::string raw_req = req.toString();
+    RetryBudget::deposit();
 
-    return r;
-}
\ No newline at end of file
+    for (int attempt = 0; ; attempt++) {
+        bool sent = false;
+        CircuitBreaker::Permit permit;
+        size_t i = upstream.pick(key, permit);
+        const Endpoint& ep = upstream.endpoint(i);
+        if (!permit) {
+            // every endpoint is open or has its probes in flight
+            throw CircuitOpenError("Circuit open for " + ep.host + ":" + std::to_string(ep.port));
+        }
+        auto start = std::chrono::steady_clock::now();
+        upstream.begin(i);
+        try {
+            http::Response r = this->client_attempt(raw_req, ep.host, ep.port, opts, deadline, idempotent, opts.keep_alive, sent);
+            upstream.end(i, permit, r.code < 500, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+            return r;
+        } catch (const std::runtime_error& e) {
+            upstream.end(i, permit, false, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+            if ((attempt >= opts.max_retries) || (sent && !idempotent) || !RetryBudget::withdraw()) {
+                throw;
+            }
+            NLOG("Request to " << ep.host << ":" << ep.port << " failed (" << e.what() << "), retrying")
+        }
+        this->backoff(attempt, opts, deadline);
+    }
+}
+
+// recv_* are used with heap strings (client, proxy) and arena strings (server)
+template bool NiceHTTP::recv_head<std::string>(const int&, std::string&, std::string&, std::chrono::steady_clock::time_point);
+template bool NiceHTTP::recv_body<std::string>(const int&, std::string_view, std::string&, std::chrono::steady_clock::time_point, std::string*);
+template bool NiceHTTP::recv_http<std::string>(const int&, std::string&, std::string&, std::chrono::steady_clock::time_point);
+template bool NiceHTTP::recv_head<std::pmr::string>(const int&, std::pmr::string&, std::pmr::string&, std::chrono::steady_clock::time_point);
+template bool NiceHTTP::recv_body<std::pmr::string>(const int&, std::string_view, std::pmr::string&, std::chrono::steady_clock::time_point, std::pmr::string*);
@@ -29,10 +29,20 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <exception>
 #include <iterator>
 #include <sstream>
+#include <chrono>
+#include <atomic>
+#include <array>
+#include <random>
+#include <stdexcept>
+#include <set>
+#include <mutex>
+#include <optional>
+#include <memory_resource>
 #ifdef _WIN32
 #include <winsock2.h>
 #else
 #include <iomanip>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -41,38 +51,148 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #endif
 #include <signal.h>
 #include "thread_pool.h"
+#include "net.h"
 #include "router.h"
+#include "resolver.h"
+#include "connection_pool.h"
+#include "upstream.h"
+#include "executor.h"
+#include "logger.h"
+#include "capture.h"
+#include "compression.h"
+#include "response_cache.h"
+#include "single_flight.h"
+#include "profiler.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define NICEHTTP_THREADS 10 // thread pool size
+#define NICEHTTP_MAX_THREADS 10 // the pool grows up to this size when requests wait (elastic if > NICEHTTP_THREADS)
+#define NICEHTTP_GROW_AFTER 100 // ms a request can wait in the queue before a worker is added
+#define NICEHTTP_IDLE_TIMEOUT 30000 // ms after which an idle worker over NICEHTTP_THREADS stops
+#define NICEHTTP_AFFINITY dp::worker_affinity::none // pin the server workers to cpus: none, compact or scatter (NUMA nodes)
+#define NICEHTTP_SPIN_TIME 0 // µs an idle server worker spins, then as long yields, before sleeping
 #define PKT_BLOCK_SIZE 4096 // Block size (in byte) read from tcp socket
+#define NICEHTTP_RETRY_RATIO 10 // retries allowed every 100 client requests (retry budget)
+#define NICEHTTP_RETRY_BURST 10 // retries that can be spent at once when the budget is full
+#define NICEHTTP_LATENCY_SAMPLES 128 // client latencies kept to compute the hedging delay
+#define NICEHTTP_PROXY_TIMEOUT 30000 // ms to forward a request to the upstream and its response back
+#define NICEHTTP_KEEPALIVE_TIMEOUT 5000 // ms an idle keep-alive connection is kept open by the server
+#define NICEHTTP_KEEPALIVE_REQUESTS 1000 // requests served on a connection before closing it
+#define NICEHTTP_ARENA_SIZE 8192 // bytes of the per connection arena allocated with the connection
 
 #ifdef NICEHTTP_VERBOSE
-#define NLOG(x)  std::cout << x << std::endl;
+#define NLOG(x)  { std::ostringstream& nlog = Logger::stream(); nlog << x; Logger::getInstance().log(Logger::Debug, nlog.str()); }
 #else
 #define NLOG(X)
 #endif
 
+struct RequestOptions {
+    /* Client limits of a single NiceHTTP::request call.
+     * Timeouts are in milliseconds, 0 means no limit.
+     */
+    int connect_timeout = 0;    // TCP handshake, for each address of the host
+    int first_byte_timeout = 0; // from request sent to the first byte of the response
+    int total_timeout = 0;      // whole call, retries and backoff included
+    int max_retries = 0;        // attempts after the first one, bounded by the retry budget
+    int backoff = 50;           // base backoff, doubled at each attempt and fully jittered
+    int max_backoff = 1000;
+    bool hedge = false;         // send a second copy of an idempotent request when the first one is slow
+    int hedge_delay = 0;        // wait before hedging, 0 uses the p95 latency of previous requests
+    bool keep_alive = false;    // reuse pooled connections instead of closing them after the response
+    bool compressed = false;    // ask for a gzip/deflate response and inflate it (NICEHTTP_COMPRESSION)
+    CircuitBreaker *breaker = nullptr; // breaker of the destination host (upstream groups have their own)
+};
+
+class RetryBudget {
+    /* Process wide token bucket shared by all the clients.
+     * Every request deposits NICEHTTP_RETRY_RATIO hundredths of a token and every
+     * retry withdraws a whole token, so when a backend goes down the retries
+     * can't multiply the load sent to it.
+     */
+public:
+    static void deposit();
+    static bool withdraw(); // true if a retry is allowed
+private:
+    inline static std::atomic<int> tokens{NICEHTTP_RETRY_BURST * 100};
+};
+
 class NiceHTTP {
     /* Implements HTTP REST API server and client.
-     * Connections are closed after each response.
-     * Implemented mainly to exchange json messages,
-     * you must parse the json payload using external libraries.
+     * The server keeps HTTP/1.1 connections alive (Linux) and parses every request into
+     * the arena of its connection, released before the next request.
+     * Implemented mainly to exchange json messages: handlers read the payload with
+     * Message::json() or Message::cbor() and answer with Response::writeBody(),
+     * which writes JSON or CBOR as the client accepts.
      * The server is multi-threaded.
      */
 public:
     NiceHTTP();
     ~NiceHTTP();
     void start(std::string iface, short port); //Start the server
-    http::Response request(http::Request req, std::string host, short port); //Start the client
+    http::Response request(http::Request req, std::string host, short port, const RequestOptions& opts = {}); //Start the client
+    http::Response request(http::Request req, UpstreamGroup& upstream, const RequestOptions& opts = {}, std::string_view key = ""); //Client balancing over replicas
     Router& getRouter();
+    ResponseCache& getCache(); // responses of the routes with Route::cache_ttl, clear() to invalidate them
+    void addExecutor(const std::string& name, unsigned int threads, unsigned int max_queue = 0); //Bulkhead for the routes with Route::executor = name (call before start)
+    void enableMetrics(std::string_view uri = "/metrics"); //Prometheus metrics route
+    void enableTracing(std::string_view uri = "/debug/trace"); //Chrome trace of the last requests (needs NICEHTTP_TRACE)
+    void enableAccessLog(const std::string& path = ""); //Log every request to path (stdout if empty)
+    void enableProfiling(std::string_view uri = "/debug/profile"); //CPU profile of ?seconds=N as folded stacks (Linux)
+    bool enableCapture(const std::string& path, uint64_t max_bytes = 0); //Record the received requests for bench/replay (max_bytes 0: no limit)
 private:
     Router router;
     int server_socket = -1;
-    int client_socket = -1;
+    ConnectionPool connections; // idle keep-alive client connections
+    Capture capture; // received requests, when enabled
+    ResponseCache cache;
+    SingleFlight flights; // requests of the routes with Route::coalesce running the handler
+    #ifdef NICEHTTP_COMPRESSION
+    compression::Cache compressed; // bodies of the routes with Route::cache_compressed
+    void compress(const http::Request& r, http::Response& resp, const Route* route);
+    #endif
+    std::string profile_uri; // pattern of the profiling route, query string included
+    std::array<std::atomic<int>, NICEHTTP_LATENCY_SAMPLES> latencies{}; // last client latencies (ms)
+    std::atomic<size_t> latency_count{0};
+    std::atomic<dp::thread_pool<>*> server_pool{nullptr}; // while the server runs, for the metrics
+    struct Connection {
+        /* Accepted client connection, owned by the thread serving it or by the idle set.
+         * Requests and responses are allocated in the arena, the first NICEHTTP_ARENA_SIZE
+         * bytes with the connection itself, and the arena is released before the next request.
+         */
+        int fd;
+        std::string pending; // bytes received after the last request (pipelining)
+        unsigned int requests = 0;
+        std::chrono::steady_clock::time_point idle_since;
+        alignas(std::max_align_t) std::byte buffer[NICEHTTP_ARENA_SIZE];
+        std::pmr::monotonic_buffer_resource arena{this->buffer, sizeof(this->buffer)};
+        explicit Connection(int fd) : fd(fd) {}
+    };
+    std::mutex idle_mutex;
+    std::vector<Connection*> idle; // keep-alive connections waiting for the next request, polled by start()
+    int wake[2] = {-1, -1}; // pipe waking up start() when a connection becomes idle
     bool server_setup(const std::string& iface, const short& port);
-    bool client_setup(const std::string& host, const short& port);
-    void recv_http(const int& socket, std::string& head, std::string& body);
-    bool is_ipaddr(const std::string& host);
-    void parsereq(const int& client_fd);
+    int client_connect(const std::string& host, const short& port, int timeout, std::chrono::steady_clock::time_point deadline, size_t first_address = 0);
+    http::Response client_attempt(const std::string& raw_req, const std::string& host, const short& port, const RequestOptions& opts, std::chrono::steady_clock::time_point deadline, bool idempotent, bool reuse, bool& sent);
+    void backoff(int attempt, const RequestOptions& opts, std::chrono::steady_clock::time_point deadline);
+    template <typename String>
+    bool recv_head(const int& socket, String& head, String& rest, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+    template <typename String>
+    bool recv_body(const int& socket, std::string_view head, String& body, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max(), String* excess = nullptr);
+    template <typename String>
+    bool recv_http(const int& socket, String& head, String& body, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+    void record_latency(int ms);
+    int hedge_delay(const RequestOptions& opts);
+    void serve(Connection* conn, trace::RequestTrace trace);
+    bool parsereq(Connection* conn, trace::RequestTrace& trace);
+    bool respond(Connection* conn, http::Request& r, std::string_view head, std::pmr::string& rest, bool complete, const Route* route, std::chrono::steady_clock::time_point start, trace::RequestTrace& trace);
+    bool finish(Connection* conn, const http::Request& r, const Route* route, short code, size_t bytes_in, size_t bytes_out, std::chrono::steady_clock::time_point start, trace::RequestTrace& trace, bool keep = false);
+    void park(Connection* conn);
+    short send_cached(Connection* conn, const http::Request& r, const ResponseCache::Entry& entry, bool keep);
+    void close_idle();
+    short proxyreq(const int& client_fd, const http::Request& req, std::string_view head, std::string_view body, const Route& route, bool& keep);
+    short reply(const int& client_fd, short code, const std::string& message);
+    std::string poolMetrics();
     void cleanup();
+    std::map<std::string, std::unique_ptr<Executor>, std::less<>> executors; // last member: stopped first
 };
\ No newline at end of file
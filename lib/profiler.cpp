@@ -0,0 +1,147 @@
+#include "profiler.h"
+#include <algorithm>
+#include <cerrno>
+#include <map>
+#include <thread>
+
+#if defined(__linux__)
+#include <csignal>
+#include <cstdio>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/time.h>
+#endif
+
+Profiler& Profiler::getInstance() {
+    static Profiler profiler;
+    return profiler;
+}
+
+#if defined(__linux__)
+
+void Profiler::onSignal(int) {
+    // async signal safe: atomics, backtrace (already loaded) and the preallocated buffer only
+    Profiler& p = Profiler::getInstance();
+    int saved_errno = errno;
+    // store then load, as in profile(): seq_cst so that profile() can't see in_handler == 0
+    // while this handler still sees sampling == true
+    p.in_handler.fetch_add(1, std::memory_order_seq_cst);
+    if (p.sampling.load(std::memory_order_seq_cst)) {
+        size_t i = p.next.fetch_add(1, std::memory_order_relaxed);
+        if (i < NICEHTTP_PROFILE_SAMPLES) {
+            Sample& s = p.samples[i];
+            s.depth = backtrace(s.frames, NICEHTTP_PROFILE_DEPTH);
+        } else {
+            p.dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    p.in_handler.fetch_sub(1, std::memory_order_release);
+    errno = saved_errno;
+}
+
+std::string Profiler::profile(std::chrono::seconds duration, int hz) {
+    if (this->running.exchange(true)) {
+        throw ProfilerBusy("A profile is already running");
+    }
+    duration = std::clamp(duration, std::chrono::seconds(1), std::chrono::seconds(NICEHTTP_PROFILE_MAX));
+    hz = std::clamp(hz, 1, 1000);
+    if (!this->samples) {
+        this->samples.reset(new Sample[NICEHTTP_PROFILE_SAMPLES]);
+    }
+    this->next.store(0, std::memory_order_relaxed);
+    this->dropped.store(0, std::memory_order_relaxed);
+    void* warmup[1];
+    backtrace(warmup, 1); // the first call loads libgcc, which is not signal safe
+
+    // the handler stays installed: a SIGPROF still pending when the timer is
+    // stopped would kill the process with the default action
+    struct sigaction action = {};
+    action.sa_handler = Profiler::onSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+    this->sampling.store(true, std::memory_order_release);
+    itimerval timer = {}, stopped = {};
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+
+    std::this_thread::sleep_for(duration);
+
+    setitimer(ITIMER_PROF, &stopped, nullptr);
+    // seq_cst store then load, paired with onSignal(): once in_handler is 0 no handler writes a sample
+    this->sampling.store(false, std::memory_order_seq_cst);
+    while (this->in_handler.load(std::memory_order_seq_cst) > 0) {
+        std::this_thread::yield();
+    }
+    size_t count = std::min<size_t>(this->next.load(std::memory_order_acquire), NICEHTTP_PROFILE_SAMPLES);
+    std::string folded = this->fold(count, this->dropped.load(std::memory_order_relaxed));
+    this->running.store(false);
+    return folded;
+}
+
+static std::string profiler_symbol(void* address, std::map<void*, std::string>& cache) {
+    // function name of a return address, demangled, or module+offset without symbols
+    auto cached = cache.find(address);
+    if (cached != cache.end()) {
+        return cached->second;
+    }
+    std::string name;
+    Dl_info info{};
+    bool found = dladdr(address, &info) != 0;
+    if (found && (info.dli_sname != nullptr)) {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        name = (status == 0) ? demangled : info.dli_sname;
+        free(demangled);
+    } else if (found && (info.dli_fname != nullptr)) {
+        std::string module = info.dli_fname;
+        char offset[32];
+        snprintf(offset, sizeof(offset), "+0x%zx", static_cast<size_t>(static_cast<char*>(address) - static_cast<char*>(info.dli_fbase)));
+        name = module.substr(module.rfind('/') + 1) + offset;
+    } else {
+        char raw[32];
+        snprintf(raw, sizeof(raw), "%p", address);
+        name = raw;
+    }
+    // ';' separates the frames and ' ' the count in the folded format
+    for (char& c : name) {
+        if ((c == ';') || (c == '\n')) c = ':';
+    }
+    cache.emplace(address, name);
+    return name;
+}
+
+std::string Profiler::fold(size_t count, uint64_t dropped) {
+    std::map<void*, std::string> symbols;
+    std::map<std::string, uint64_t> stacks;
+    for (size_t i = 0; i < count; i++) {
+        const Sample& s = this->samples[i];
+        std::string stack;
+        // frames[0] is the handler, frames[1] the signal trampoline
+        for (int f = s.depth - 1; f >= 2; f--) {
+            if (!stack.empty()) stack += ';';
+            stack += profiler_symbol(s.frames[f], symbols);
+        }
+        if (!stack.empty()) {
+            stacks[stack]++;
+        }
+    }
+    std::string out;
+    for (const auto& [stack, n] : stacks) {
+        out += stack + " " + std::to_string(n) + "\n";
+    }
+    if (dropped > 0) {
+        out += "[dropped] " + std::to_string(dropped) + "\n";
+    }
+    return out;
+}
+
+#else
+
+std::string Profiler::profile(std::chrono::seconds, int) {
+    throw std::runtime_error("The profiler is supported on Linux only");
+}
+
+#endif
@@ -0,0 +1,71 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#define NICEHTTP_PROFILE_HZ 99          // samples per second of CPU time (not a multiple of the usual timer ticks)
+#define NICEHTTP_PROFILE_MAX 60         // longest profile, in seconds
+#define NICEHTTP_PROFILE_SAMPLES 16384  // samples kept per profile, the others are counted as dropped
+#define NICEHTTP_PROFILE_DEPTH 64       // frames kept per sample
+
+class ProfilerBusy : public std::runtime_error {
+public:
+    explicit ProfilerBusy(const std::string& what) : std::runtime_error(what) {}
+};
+
+class Profiler {
+    /* Sampling CPU profiler (Linux).
+     * While profiling, an ITIMER_PROF timer sends SIGPROF every 1/hz seconds of
+     * CPU time consumed by the process, to the thread that was running: busy
+     * threads get sampled in proportion to the CPU they use. The handler only
+     * unwinds the stack (backtrace, loaded before the timer starts) into a
+     * buffer allocated beforehand, no locks and no allocations.
+     * When the profile ends the stacks are symbolized (dladdr, so link the
+     * executable with -rdynamic to see its own functions) and returned as
+     * folded stacks, "root;caller;leaf count" per line, the input of
+     * flamegraph.pl, speedscope and most flame graph tools.
+     * When not profiling no timer is armed and nothing runs.
+     */
+public:
+    static Profiler& getInstance();
+    // Blocks for duration, throws ProfilerBusy if a profile is already running
+    std::string profile(std::chrono::seconds duration, int hz = NICEHTTP_PROFILE_HZ);
+private:
+    struct Sample {
+        int depth;
+        void* frames[NICEHTTP_PROFILE_DEPTH];
+    };
+    Profiler() {}
+    static void onSignal(int);
+    std::string fold(size_t samples, uint64_t dropped);
+    std::atomic<bool> running{false};
+    std::unique_ptr<Sample[]> samples;
+    std::atomic<size_t> next{0};     // next free sample
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<int> in_handler{0};  // handlers still writing when the timer is stopped
+    std::atomic<bool> sampling{false};
+};
@@ -0,0 +1,227 @@
+#include "nicehttp.h"
+
+static std::string lowercase(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c){ return std::tolower(c); });
+    return s;
+}
+
+static std::string rewrite_head(std::string_view head, const std::string& extra, std::initializer_list<std::string> also_drop = {}) {
+    /* Copy a raw http head without the hop-by-hop headers (RFC 7230 6.1):
+    * the standard ones, the ones listed in Connection and also_drop.
+    * Transfer-Encoding is kept because bodies are forwarded as they are.
+    * extra headers are appended at the end.
+    */
+    std::set<std::string> drop = {"connection", "keep-alive", "proxy-connection", "te", "trailer", "upgrade", "proxy-authorization", "proxy-authenticate"};
+    drop.insert(also_drop);
+    for (const auto token : std::views::split(lowercase(net::header_value(head, "connection")), ',')) {
+        std::string name{std::string_view(token)};
+        name.erase(0, name.find_first_not_of(' '));
+        name.erase(name.find_last_not_of(' ') + 1);
+        drop.insert(name);
+    }
+    std::string out;
+    size_t pos = head.find("\r\n");
+    out += head.substr(0, pos + 2); // request or status line
+    pos += 2;
+    size_t eol;
+    while (((eol = head.find("\r\n", pos)) != std::string::npos) && (eol != pos)) {
+        std::string_view line(head.data() + pos, eol - pos);
+        size_t i = line.find(':');
+        if ((i == std::string::npos) || !drop.contains(lowercase(std::string(line.substr(0, i))))) {
+            out += line;
+            out += "\r\n";
+        }
+        pos = eol + 2;
+    }
+    out += extra;
+    out += "\r\n";
+    return out;
+}
+
+static bool relay_chunked(int from, int to, std::string& data, std::chrono::steady_clock::time_point deadline) {
+    /* Forward a chunked body as it is, parsing the chunk sizes only to find its end.
+    * data holds the bytes already received. Returns false on errors.
+    */
+    enum { Size, Data, DataEnd, Trailer } state = Size;
+    size_t left = 0;   // bytes of the current chunk
+    std::string line;  // current size or trailer line
+    char buff[PKT_BLOCK_SIZE];
+    while (true) {
+        for (size_t i = 0; i < data.length(); i++) {
+            char c = data[i];
+            if (state == Data) {
+                size_t n = std::min(left, data.length() - i);
+                left -= n;
+                i += n - 1;
+                if (left == 0) state = DataEnd;
+            } else if (c == '\n') {
+                if (state == Size) {
+                    left = strtoul(line.c_str(), nullptr, 16);
+                    state = (left == 0) ? Trailer : Data;
+                } else if (state == DataEnd) {
+                    state = Size;
+                } else if (line.empty() || (line == "\r")) {
+                    // empty line after the last chunk: end of the body
+                    net::send_all(to, data.substr(0, i + 1), deadline);
+                    return true;
+                }
+                line = "";
+            } else if (state != DataEnd) {
+                line += c;
+            }
+        }
+        net::send_all(to, data, deadline);
+        int n = recv(from, buff, sizeof(buff), 0);
+        if ((n < 0) && net::would_block() && net::wait_socket(from, POLLIN, deadline)) {
+            data = "";
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data.assign(buff, n);
+    }
+}
+
+short NiceHTTP::reply(const int& client_fd, short code, const std::string& message) {
+    // Send a response without body, return its code
+    std::map<std::string,std::string> headers;
+    http::Response resp(code, message, PROTO_HTTP1, headers, false, 0);
+    resp.headers.insert({"Server", "NiceHTTP"});
+    resp.headers.insert({"Connection", "close"});
+    std::string raw_resp = resp.toString();
+    send(client_fd, raw_resp.c_str(), raw_resp.length(), 0);
+    return code;
+}
+
+short NiceHTTP::proxyreq(const int& client_fd, const http::Request& req, std::string_view head, std::string_view body, const Route& route, bool& keep) {
+    /* Forward the request to an endpoint of the route upstream group and stream
+    * the response back. Only the heads are parsed and rewritten, bodies are
+    * moved socket to socket by net::relay (splice on Linux).
+    * body is the start of the request body, never more than Content-Length bytes.
+    * Upstream connections are kept alive in the connection pool.
+    * keep tells if the client connection can be kept alive, it is cleared unless
+    * the whole response was relayed with a known length.
+    * Returns the status code sent to the client.
+    */
+    bool keep_client = keep;
+    keep = false;
+    if (!route.authorized(req)) {
+        Metrics::getInstance().unauthorized();
+        return this->reply(client_fd, 401, "Unauthorized");
+    }
+    if (net::header_value(head, "transfer-encoding") != "") {
+        return this->reply(client_fd, 411, "Length Required");
+    }
+    UpstreamGroup& upstream = *route.upstream;
+    CircuitBreaker::Permit permit;
+    size_t i = upstream.pick(req.uri, permit);
+    const Endpoint& ep = upstream.endpoint(i);
+    if (!permit) {
+        return this->reply(client_fd, 503, "Service Unavailable");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::milliseconds(NICEHTTP_PROXY_TIMEOUT);
+    std::string extra = "Via: 1.1 NiceHTTP\r\n";
+    Address peer;
+    peer.len = sizeof(peer.addr);
+    if (getpeername(client_fd, reinterpret_cast<sockaddr*>(&peer.addr), &peer.len) == 0) {
+        peer.family = peer.addr.ss_family;
+        std::string xff = net::header_value(head, "x-forwarded-for");
+        extra += "X-Forwarded-For: " + (xff.empty() ? "" : xff + ", ") + peer.toString() + "\r\n";
+    }
+    // Expect is answered here, the upstream receives the whole request at once
+    std::string fwd = rewrite_head(head, extra, {"expect"});
+    size_t body_left = (req.content_length > body.length()) ? req.content_length - body.length() : 0;
+    bool expect_continue = lowercase(net::header_value(head, "expect")) == "100-continue";
+
+    upstream.begin(i);
+    int up = -1;
+    bool replied = false; // the response head was sent to the client
+    bool success = false;
+    short status = 0;
+    try {
+        std::string rhead, rrest;
+        for (int tries = 0; ; tries++) {
+            up = this->connections.get(ep.host, ep.port);
+            bool reused = (up != -1);
+            if (!reused) {
+                up = this->client_connect(ep.host, ep.port, 0, deadline);
+            }
+            net::send_all(up, fwd + std::string(body), deadline);
+            if (expect_continue && (body_left > 0)) {
+                net::send_all(client_fd, "HTTP/1.1 100 Continue\r\n\r\n", deadline);
+                expect_continue = false;
+            }
+            if ((body_left > 0) && !net::relay(client_fd, up, body_left, deadline)) {
+                throw std::runtime_error("Error forwarding the request body");
+            }
+            if (this->recv_head(up, rhead, rrest, deadline)) {
+                break;
+            }
+            net::close_socket(up);
+            up = -1;
+            if (!reused || (body_left > 0) || (tries > 0)) {
+                throw std::runtime_error("Connection closed by upstream");
+            }
+            // stale pooled connection, the request wasn't processed: try a new one
+        }
+
+        short code = static_cast<short>(atoi(rhead.c_str() + rhead.find(' ') + 1));
+        while ((code >= 100) && (code < 200) && (code != 101)) {
+            // skip interim responses (100 Continue, 103 Early Hints)
+            if (!this->recv_head(up, rhead, rrest, deadline)) {
+                throw std::runtime_error("Connection closed by upstream");
+            }
+            code = static_cast<short>(atoi(rhead.c_str() + rhead.find(' ') + 1));
+        }
+        std::string cl = net::header_value(rhead, "content-length");
+        bool chunked = net::header_value(rhead, "transfer-encoding").find("chunked") != std::string::npos;
+        bool no_body = (req.method == "HEAD") || (code == 204) || (code == 304) || ((code >= 100) && (code < 200));
+        bool keep_upstream = lowercase(net::header_value(rhead, "connection")) != "close";
+        // the client connection survives responses whose end is known, not upgrades or bodies up to the close
+        keep_client = keep_client && (code != 101) && (no_body || (cl != "") || chunked);
+        std::string out = rewrite_head(rhead, keep_client ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+        replied = true;
+        status = code;
+        net::send_all(client_fd, out, deadline);
+        if (no_body) {
+            // nothing to forward
+        } else if (cl != "") {
+            size_t length = strtoul(cl.c_str(), nullptr, 10);
+            net::send_all(client_fd, rrest.substr(0, length), deadline);
+            if ((length > rrest.length()) && !net::relay(up, client_fd, length - rrest.length(), deadline)) {
+                throw std::runtime_error("Error forwarding the response body");
+            }
+        } else if (chunked) {
+            if (!relay_chunked(up, client_fd, rrest, deadline)) {
+                throw std::runtime_error("Error forwarding the response body");
+            }
+        } else {
+            // body delimited by the end of the connection
+            keep_upstream = false;
+            net::send_all(client_fd, rrest, deadline);
+            net::relay(up, client_fd, std::string::npos, deadline);
+        }
+        success = code < 500;
+        keep = keep_client;
+        if (keep_upstream) {
+            this->connections.put(ep.host, ep.port, up);
+        } else {
+            net::close_socket(up);
+        }
+        up = -1;
+    } catch (const TimeoutError& e) {
+        NLOG("Proxy to " << ep.host << ":" << ep.port << " timed out: " << e.what())
+        if (!replied) status = this->reply(client_fd, 504, "Gateway Timeout");
+    } catch (const std::runtime_error& e) {
+        NLOG("Proxy to " << ep.host << ":" << ep.port << " failed: " << e.what())
+        if (!replied) status = this->reply(client_fd, 502, "Bad Gateway");
+    }
+    if (up != -1) {
+        net::close_socket(up);
+    }
+    upstream.end(i, permit, success, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+    return status;
+}
@@ -0,0 +1,101 @@
+#include "resolver.h"
+
+void Address::setPort(short port) {
+    if (this->family == AF_INET6) {
+        reinterpret_cast<sockaddr_in6*>(&this->addr)->sin6_port = htons(port);
+    } else {
+        reinterpret_cast<sockaddr_in*>(&this->addr)->sin_port = htons(port);
+    }
+}
+
+std::string Address::toString() const {
+    char host[NI_MAXHOST] = {0,};
+    if (getnameinfo(reinterpret_cast<const sockaddr*>(&this->addr), this->len, host, sizeof(host), nullptr, 0, NI_NUMERICHOST) != 0) {
+        return "";
+    }
+    return host;
+}
+
+Resolver& Resolver::getInstance() {
+    static Resolver resolver;
+    return resolver;
+}
+
+Resolver::Shard& Resolver::getShard(const std::string& host) {
+    return this->shards[std::hash<std::string>{}(host) % NICEHTTP_DNS_SHARDS];
+}
+
+std::vector<Address> Resolver::lookup(const std::string& host) {
+    // Blocking query, must be called without holding any shard lock
+    std::vector<Address> addresses;
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_ADDRCONFIG;
+    addrinfo *res = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &res) != 0) {
+        return addresses;
+    }
+    for (addrinfo *ai = res; ai != nullptr; ai = ai->ai_next) {
+        if ((ai->ai_family != AF_INET) && (ai->ai_family != AF_INET6)) {
+            continue;
+        }
+        Address a;
+        memset(&a.addr, 0, sizeof(a.addr));
+        memcpy(&a.addr, ai->ai_addr, ai->ai_addrlen);
+        a.len = static_cast<socklen_t>(ai->ai_addrlen);
+        a.family = ai->ai_family;
+        addresses.push_back(a);
+    }
+    freeaddrinfo(res);
+    return addresses;
+}
+
+std::vector<Address> Resolver::resolve(const std::string& host, short port) {
+    std::vector<Address> addresses;
+    bool cached = false;
+    Shard& shard = this->getShard(host);
+    {
+        std::scoped_lock lock(shard.mutex);
+        auto it = shard.entries.find(host);
+        if (it != shard.entries.end()) {
+            Entry& e = it->second;
+            if ((std::chrono::steady_clock::now() < e.expires) || (e.refreshing && !e.addresses.empty())) {
+                // valid entry (positive or negative), or another thread is already refreshing it
+                addresses = e.addresses;
+                cached = true;
+            } else {
+                e.refreshing = true;
+            }
+        }
+    }
+    if (!cached) {
+        addresses = this->lookup(host);
+        Entry e;
+        e.addresses = addresses;
+        e.expires = std::chrono::steady_clock::now() + std::chrono::seconds(addresses.empty() ? NICEHTTP_DNS_NEGATIVE_TTL : NICEHTTP_DNS_TTL);
+        std::scoped_lock lock(shard.mutex);
+        auto it = shard.entries.find(host);
+        if (addresses.empty() && (it != shard.entries.end()) && !it->second.addresses.empty()) {
+            // resolver failure on refresh: keep the last known addresses for a while
+            it->second.expires = e.expires;
+            it->second.refreshing = false;
+            addresses = it->second.addresses;
+        } else {
+            shard.entries.insert_or_assign(host, e);
+        }
+    }
+    for (Address& a : addresses) {
+        a.setPort(port);
+    }
+    return addresses;
+}
+
+void Resolver::clear() {
+    for (Shard& shard : this->shards) {
+        std::scoped_lock lock(shard.mutex);
+        shard.entries.clear();
+    }
+}
@@ -0,0 +1,79 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+#include <string>
+#include <vector>
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
+#include <cstring>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+#define NICEHTTP_DNS_TTL 60         // seconds a resolved host stays cached
+#define NICEHTTP_DNS_NEGATIVE_TTL 5 // seconds a failed lookup stays cached
+#define NICEHTTP_DNS_SHARDS 16      // number of independently locked cache buckets
+
+// A resolved socket address (IPv4 or IPv6) ready to be passed to connect()
+struct Address {
+    sockaddr_storage addr;
+    socklen_t len = 0;
+    int family = AF_UNSPEC;
+    void setPort(short port);
+    std::string toString() const;
+};
+
+class Resolver {
+    /* Thread-safe name resolution based on getaddrinfo.
+     * Every A/AAAA record of a host is returned, so callers can fall back
+     * to the next address when connect() fails.
+     * Lookups are cached for NICEHTTP_DNS_TTL seconds, failures for
+     * NICEHTTP_DNS_NEGATIVE_TTL seconds. When an entry expires a single
+     * thread refreshes it while the others keep using the stale addresses,
+     * so a slow resolver doesn't stall every request.
+     * The cache is striped over NICEHTTP_DNS_SHARDS mutexes.
+     */
+public:
+    static Resolver& getInstance(); // process wide cache shared by all NiceHTTP instances
+    std::vector<Address> resolve(const std::string& host, short port);
+    void clear(); // drop every cached entry
+private:
+    struct Entry {
+        std::vector<Address> addresses; // empty means negative entry
+        std::chrono::steady_clock::time_point expires;
+        bool refreshing = false;
+    };
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+    };
+    std::array<Shard, NICEHTTP_DNS_SHARDS> shards;
+    Shard& getShard(const std::string& host);
+    std::vector<Address> lookup(const std::string& host);
+};
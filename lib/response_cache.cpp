@@ -0,0 +1,138 @@
+#include "response_cache.h"
+#include <functional>
+
+size_t ResponseCache::Sketch::slot(uint64_t hash, int row) {
+    // a different 64 bit mix of the hash for every row
+    uint64_t h = (hash + row) * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 32;
+    return h % NICEHTTP_CACHE_SKETCH;
+}
+
+void ResponseCache::Sketch::increment(uint64_t hash) {
+    for (int row = 0; row < 4; row++) {
+        uint8_t& counter = this->rows[row][slot(hash, row)];
+        if (counter < 15) {
+            counter++;
+        }
+    }
+    if (++this->additions >= 10 * NICEHTTP_CACHE_SKETCH) {
+        // aging
+        for (auto& row : this->rows) {
+            for (uint8_t& counter : row) {
+                counter >>= 1;
+            }
+        }
+        this->additions /= 2;
+    }
+}
+
+uint8_t ResponseCache::Sketch::estimate(uint64_t hash) const {
+    uint8_t min = 15;
+    for (int row = 0; row < 4; row++) {
+        min = std::min(min, this->rows[row][slot(hash, row)]);
+    }
+    return min;
+}
+
+ResponseCache::ResponseCache(size_t max_bytes) {
+    this->shard_bytes = max_bytes / NICEHTTP_CACHE_SHARDS;
+}
+
+size_t ResponseCache::cost(const Node& node) {
+    // bytes accounted for an entry, bookkeeping included
+    return node.key.size() + node.entry->raw.size() + node.entry->etag.size() + node.entry->not_modified.size() + 128;
+}
+
+void ResponseCache::erase(Shard& shard, std::list<Node>::iterator node) {
+    shard.bytes -= cost(*node);
+    shard.index.erase(node->key);
+    shard.lru.erase(node);
+}
+
+std::shared_ptr<const ResponseCache::Entry> ResponseCache::get(std::string_view key) {
+    uint64_t hash = std::hash<std::string_view>{}(key);
+    Shard& shard = this->shards[hash % NICEHTTP_CACHE_SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.sketch.increment(hash);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+        this->misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    if (it->second->entry->expires <= std::chrono::steady_clock::now()) {
+        this->erase(shard, it->second);
+        this->misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    this->hits.fetch_add(1, std::memory_order_relaxed);
+    return it->second->entry;
+}
+
+void ResponseCache::put(std::string_view key, std::shared_ptr<const Entry> entry) {
+    uint64_t hash = std::hash<std::string_view>{}(key);
+    Shard& shard = this->shards[hash % NICEHTTP_CACHE_SHARDS];
+    Node node {std::string(key), hash, std::move(entry)};
+    size_t size = cost(node);
+    if (size > this->shard_bytes / 8) {
+        this->rejections.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto old = shard.index.find(key);
+    if (old != shard.index.end()) {
+        this->erase(shard, old->second);
+    }
+    // TinyLFU admission: the victims must be requested less often than the new key
+    uint8_t frequency = shard.sketch.estimate(hash);
+    size_t freed = 0;
+    auto victim = shard.lru.end();
+    while ((shard.bytes - freed + size > this->shard_bytes) && (victim != shard.lru.begin())) {
+        --victim;
+        if (shard.sketch.estimate(victim->hash) > frequency) {
+            this->rejections.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        freed += cost(*victim);
+    }
+    while (shard.bytes + size > this->shard_bytes) {
+        this->erase(shard, std::prev(shard.lru.end()));
+        this->evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    shard.lru.push_front(std::move(node));
+    shard.index.emplace(shard.lru.front().key, shard.lru.begin());
+    shard.bytes += size;
+}
+
+void ResponseCache::clear() {
+    for (Shard& shard : this->shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.index.clear();
+        shard.lru.clear();
+        shard.bytes = 0;
+    }
+}
+
+size_t ResponseCache::bytes() {
+    size_t total = 0;
+    for (Shard& shard : this->shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        total += shard.bytes;
+    }
+    return total;
+}
+
+std::string ResponseCache::metrics() {
+    std::string out;
+    auto family = [&out](const char* name, const char* type, const char* help, uint64_t value) {
+        out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n" +
+               name + " " + std::to_string(value) + "\n";
+    };
+    family("nicehttp_response_cache_hits_total", "counter", "Responses sent from the cache.", this->hits.load(std::memory_order_relaxed));
+    family("nicehttp_response_cache_misses_total", "counter", "Cacheable requests that ran the handler.", this->misses.load(std::memory_order_relaxed));
+    family("nicehttp_response_cache_evictions_total", "counter", "Responses evicted to make room.", this->evictions.load(std::memory_order_relaxed));
+    family("nicehttp_response_cache_rejections_total", "counter", "Responses not admitted (rarer than the victims or too big).",
+           this->rejections.load(std::memory_order_relaxed));
+    family("nicehttp_response_cache_bytes", "gauge", "Bytes of cached responses.", this->bytes());
+    return out;
+}
@@ -0,0 +1,98 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#define NICEHTTP_CACHE_SIZE (64 << 20) // bytes of responses kept by the server response cache
+#define NICEHTTP_CACHE_SHARDS 16 // independently locked parts of the cache, each with 1/16 of the bytes
+#define NICEHTTP_CACHE_SKETCH 4096 // counters per row of the frequency sketch of a shard
+
+class ResponseCache {
+    /* Serialized responses of the routes with Route::cache_ttl, keyed by method, uri,
+     * negotiated encoding and the request headers named in Route::cache_vary.
+     * Sharded by the hash of the key, every shard has its own lock, LRU list and byte budget.
+     * Admission is TinyLFU: a count-min sketch estimates how often every key is
+     * requested and, when the shard is full, a new response replaces the least recently
+     * used one only if its key is requested at least as often, so one-off requests
+     * (crawlers, scans) don't flush the popular responses.
+     */
+public:
+    struct Entry {
+        std::pmr::string raw; // response as sent, without the Connection header
+        size_t split = 0; // offset of the empty line ending the head, the Connection header goes there
+        size_t body_size = 0;
+        short code = 200; // status of the response
+        std::string etag; // quoted, as in the ETag header
+        std::string not_modified; // head of the 304 answer, without the Connection header and the empty line
+        std::chrono::steady_clock::time_point expires;
+    };
+    explicit ResponseCache(size_t max_bytes = NICEHTTP_CACHE_SIZE);
+    std::shared_ptr<const Entry> get(std::string_view key); // nullptr if missing or expired
+    void put(std::string_view key, std::shared_ptr<const Entry> entry);
+    void clear();
+    size_t bytes();
+    std::string metrics(); // Prometheus text
+private:
+    class Sketch {
+        /* 4 rows of 4 bit counters (one per byte, saturating at 15), halved every
+         * 10 * NICEHTTP_CACHE_SKETCH increments so old popularity fades away.
+         */
+    public:
+        void increment(uint64_t hash);
+        uint8_t estimate(uint64_t hash) const;
+    private:
+        std::array<std::array<uint8_t, NICEHTTP_CACHE_SKETCH>, 4> rows{};
+        uint32_t additions = 0;
+        static size_t slot(uint64_t hash, int row);
+    };
+    struct Node {
+        std::string key;
+        uint64_t hash;
+        std::shared_ptr<const Entry> entry;
+    };
+    struct Shard {
+        std::mutex mutex;
+        std::list<Node> lru; // most recently used first
+        std::unordered_map<std::string_view, std::list<Node>::iterator> index; // views of Node::key
+        Sketch sketch;
+        size_t bytes = 0;
+    };
+    static size_t cost(const Node& node);
+    void erase(Shard& shard, std::list<Node>::iterator node);
+    std::array<Shard, NICEHTTP_CACHE_SHARDS> shards;
+    size_t shard_bytes;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> rejections{0}; // not admitted by the sketch or too big
+};
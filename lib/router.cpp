@@ -1,4 +1,5 @@
 #include "router.h"
+#include "metrics.h"
 
 void Router::add(const Route &route) {
     this->routes.insert(route);
@@ -8,38 +9,59 @@ void Router::del(const Route &route) {
     this->routes.erase(route);
 }
 
+const Route* Router::match(const http::Request &req) const {
+    // find the right route for the request
+    auto match = [&req](const Route &r){ return r.matches(req); };
+    std::set<Route>::const_iterator result = std::ranges::find_if(this->routes, match);
+    if (result != this->routes.end()) {
+        return &(*result);
+    }
+    return nullptr;
+}
+
 http::Response Router::handle(const http::Request &req) {
     // handle the request finding the right route
-    auto match = [&req](const Route &r){ //match condition to find the right route
-        std::smatch m;
-        std::regex rgx(r.uri.data());
-        return ((req.method == r.method) &&
-                (std::regex_match(req.uri.begin(), req.uri.end(), m, rgx)));
-    };
-    std::set<Route>::iterator result = std::ranges::find_if(this->routes, match);
-    if (result != this->routes.end()) {
-        Route r = *result;
-        return r.handle(req);
+    return this->handle(req, this->match(req));
+}
+
+http::Response Router::handle(const http::Request &req, const Route *route) {
+    if (route != nullptr) {
+        return route->handle(req);
     }
+    Metrics::getInstance().notFound();
     std::map<std::string,std::string> headers;
     http::Response resp(404, "Not Found", PROTO_HTTP1, headers, false, 0);
     return resp;
 }
 
-http::Response Route::handle(const http::Request &req) {
-    if (auth != "") { // Authentication is set for this route
-        bool denied = true;
-        for (const auto& h : req.headers) {
-            if ((h.first == "authorization") && (h.second == auth)) {
-                denied = false;
-                break;
-            }
-        }
-        if (denied) {
-            std::map<std::string,std::string> headers;
-            http::Response resp(401, "Unauthorized", PROTO_HTTP1, headers, false, 0);
-            return resp;
+bool Route::matches(const http::Request &req) const {
+    return (req.method == this->method) && std::regex_match(req.uri.begin(), req.uri.end(), this->pattern);
+}
+
+bool Route::authorized(const http::Request &req) const {
+    if (auth == "") { // Authentication is not set for this route
+        return true;
+    }
+    for (const auto& h : req.headers) {
+        if ((h.first == "authorization") && (h.second == auth)) {
+            return true;
         }
     }
+    return false;
+}
+
+http::Response Route::handle(const http::Request &req) const {
+    if (!this->authorized(req)) {
+        Metrics::getInstance().unauthorized();
+        std::map<std::string,std::string> headers;
+        http::Response resp(401, "Unauthorized", PROTO_HTTP1, headers, false, 0);
+        return resp;
+    }
+    if (this->isProxy()) {
+        // proxy routes are streamed by NiceHTTP, they have no callback
+        std::map<std::string,std::string> headers;
+        http::Response resp(500, "Internal Server Error", PROTO_HTTP1, headers, false, 0);
+        return resp;
+    }
     return this->func(req);
-}
\ No newline at end of file
+}
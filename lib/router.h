@@ -27,34 +27,79 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <regex>
 #include "http.h"
 
+#define NICEHTTP_INLINE_EXECUTOR "inline" // routes handled on the thread that read the request, no handoff
+
+class UpstreamGroup;
+
 class Route {
     /*
     * This class handle a single request calling the specified callback function.
     * Supports authentication token passed through "Authentication" header.
     * Doesn't support parameter parsing.
+    * A proxy route has no callback: NiceHTTP streams the request to an
+    * endpoint of the upstream group and the response back to the client.
+    * executor names the NiceHTTP executor (bulkhead) running the route, see
+    * NiceHTTP::addExecutor; by default the route runs inline.
+    * With NICEHTTP_COMPRESSION the responses are compressed as the client accepts,
+    * unless compress is false; cache_compressed keeps the compressed bodies for
+    * routes that send the same bodies again (static files, cached documents).
+    * GET responses (200) of a route with cache_ttl (ms) are kept in the server
+    * response cache, varying on the request headers listed in cache_vary
+    * (comma separated, e.g. "authorization, accept-language"); the auth token is
+    * checked before the cache is, and is part of the key.
+    * With coalesce, identical concurrent authorized GETs (same key as the cache)
+    * wait for the first one and share its 2xx response instead of calling the
+    * handler again.
     */
 private:
     std::function<http::Response(const http::Request &req)> func;
+    std::regex pattern; // uri compiled once, not at every match
 public:
     std::string_view method;
     std::string_view uri;
     std::string_view auth;
+    UpstreamGroup *upstream = nullptr;
+    std::string_view executor = NICEHTTP_INLINE_EXECUTOR;
+    bool compress = true;
+    bool cache_compressed = false;
+    int cache_ttl = 0;
+    std::string_view cache_vary;
+    bool coalesce = false;
     Route(const std::string_view &method, const std::string_view &uri, const std::function<http::Response(const http::Request &req)> &func, std::string_view auth = "") {
         this->method = method;
         this->uri = uri;
+        this->pattern = std::regex(uri.begin(), uri.end());
         this->func = func;
         this->auth = auth;
     }
+    Route(const std::string_view &method, const std::string_view &uri, UpstreamGroup &upstream, std::string_view auth = "") {
+        this->method = method;
+        this->uri = uri;
+        this->pattern = std::regex(uri.begin(), uri.end());
+        this->upstream = &upstream;
+        this->auth = auth;
+    }
     Route(const Route& route) {
         method = route.method;
         uri = route.uri;
         func = route.func;
+        pattern = route.pattern;
         auth = route.auth;
+        upstream = route.upstream;
+        executor = route.executor;
+        compress = route.compress;
+        cache_compressed = route.cache_compressed;
+        cache_ttl = route.cache_ttl;
+        cache_vary = route.cache_vary;
+        coalesce = route.coalesce;
     }
     friend bool operator<(const Route& l, const Route& r) {
         return std::tie(l.method, l.uri) < std::tie(r.method, r.uri);
     }
-    http::Response handle(const http::Request &req);
+    bool isProxy() const { return this->upstream != nullptr; }
+    bool matches(const http::Request &req) const; // method and uri
+    bool authorized(const http::Request &req) const;
+    http::Response handle(const http::Request &req) const;
 };
 
 class Router {
@@ -64,6 +109,8 @@ private:
 public:
     void add(const Route &route); // add route
     void del(const Route &route); // delete route
+    const Route* match(const http::Request &req) const; // find the Route, nullptr if none
     http::Response handle(const http::Request &req); // find the Route and call the callback function
+    http::Response handle(const http::Request &req, const Route *route); // call the callback of a matched Route (404 if nullptr)
     Router() {}
 };
\ No newline at end of file
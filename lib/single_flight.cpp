@@ -0,0 +1,51 @@
+#include "single_flight.h"
+
+std::variant<SingleFlight::Leader, std::shared_ptr<SingleFlight::Call>> SingleFlight::join(std::string_view key) {
+    Shard& shard = this->shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto running = shard.calls.find(key);
+    if (running != shard.calls.end()) {
+        return running->second;
+    }
+    auto call = std::make_shared<Call>();
+    shard.calls.emplace(key, call);
+    this->leaders.fetch_add(1, std::memory_order_relaxed);
+    return Leader(this, key, std::move(call));
+}
+
+void SingleFlight::Leader::complete(std::shared_ptr<const ResponseCache::Entry> result) {
+    if (!this->call) {
+        return; // completed already, or moved
+    }
+    {
+        // requests arriving from now on run their own handler (or find the response cached)
+        Shard& shard = this->flights->shard(this->key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.calls.erase(this->key);
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->call->mutex);
+        this->call->result = std::move(result);
+        this->call->done = true;
+    }
+    this->call->done_cv.notify_all();
+    this->call.reset();
+}
+
+std::shared_ptr<const ResponseCache::Entry> SingleFlight::wait(Call& call, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(call.mutex);
+    if (!call.done_cv.wait_for(lock, timeout, [&call] { return call.done; }) || !call.result) {
+        return nullptr;
+    }
+    this->coalesced.fetch_add(1, std::memory_order_relaxed);
+    return call.result;
+}
+
+std::string SingleFlight::metrics() {
+    return "# HELP nicehttp_coalesce_leaders_total Requests that ran the handler for identical concurrent requests.\n"
+           "# TYPE nicehttp_coalesce_leaders_total counter\n"
+           "nicehttp_coalesce_leaders_total " + std::to_string(this->leaders.load(std::memory_order_relaxed)) + "\n"
+           "# HELP nicehttp_coalesced_requests_total Requests answered with the response of an identical one.\n"
+           "# TYPE nicehttp_coalesced_requests_total counter\n"
+           "nicehttp_coalesced_requests_total " + std::to_string(this->coalesced.load(std::memory_order_relaxed)) + "\n";
+}
@@ -0,0 +1,86 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include "response_cache.h"
+
+#define NICEHTTP_COALESCE_SHARDS 16 // independently locked parts of the in flight requests
+#define NICEHTTP_COALESCE_TIMEOUT 10000 // ms a request waits for an identical one, then runs the handler itself
+
+class SingleFlight {
+    /* Identical concurrent requests of the routes with Route::coalesce: the first one
+     * (leader) runs the handler, the others wait for its serialized response and send
+     * it too, so a burst of requests for the same key costs one handler call.
+     * Keys are the same as the response cache ones.
+     */
+public:
+    class Call {
+        friend class SingleFlight;
+        std::mutex mutex;
+        std::condition_variable done_cv;
+        bool done = false;
+        std::shared_ptr<const ResponseCache::Entry> result;
+    };
+    class Leader {
+        /* Returned by join() to the request that must run the handler, the waiting
+         * requests are released by complete() or, if the handler throws, by the destructor.
+         */
+    public:
+        Leader(SingleFlight* flights, std::string_view key, std::shared_ptr<Call> call) : flights(flights), key(key), call(std::move(call)) {}
+        Leader(Leader&& other) = default;
+        ~Leader() { this->complete(nullptr); }
+        void complete(std::shared_ptr<const ResponseCache::Entry> result); // nullptr: the others run the handler
+    private:
+        SingleFlight* flights;
+        std::string key;
+        std::shared_ptr<Call> call;
+    };
+    // a Leader if no identical request is running, otherwise the call to wait for
+    std::variant<Leader, std::shared_ptr<Call>> join(std::string_view key);
+    // the response of the leader, nullptr if it couldn't be shared or after the timeout
+    std::shared_ptr<const ResponseCache::Entry> wait(Call& call, std::chrono::milliseconds timeout = std::chrono::milliseconds(NICEHTTP_COALESCE_TIMEOUT));
+    std::string metrics(); // Prometheus text
+private:
+    struct KeyHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view key) const { return std::hash<std::string_view>{}(key); }
+    };
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<Call>, KeyHash, std::equal_to<>> calls;
+    };
+    Shard& shard(std::string_view key) { return this->shards[KeyHash{}(key) % NICEHTTP_COALESCE_SHARDS]; }
+    std::array<Shard, NICEHTTP_COALESCE_SHARDS> shards;
+    std::atomic<uint64_t> leaders{0};
+    std::atomic<uint64_t> coalesced{0}; // requests answered with the response of a leader
+};
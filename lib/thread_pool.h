@@ -1,16 +1,31 @@
 // External dependency from: https://github.com/DeveloperPaul123/thread-pool/blob/0.6.2/
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <barrier>
+#include <bit>
+#include <chrono>
 #include <concepts>
+#include <condition_variable>
+#include <cstdint>
 #include <deque>
+#include <filesystem>
 #include <functional>
 #include <future>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <semaphore>
+#include <stdexcept>
+#include <string>
 #include <thread>
 #include <type_traits>
+#include <vector>
+#ifdef __linux__
+#    include <sched.h>
+#endif
 #ifdef __has_include
 #    if __has_include(<version>)
 #        include <version>
@@ -18,6 +33,7 @@
 #endif
 
 #include "thread_safe_queue.h"
+#include "work_stealing_queue.h"
 
 namespace dp {
     namespace details {
@@ -27,74 +43,245 @@ namespace dp {
 #else
         using default_function_type = std::function<void()>;
 #endif
+
+        /// cpus this process is allowed to run on
+        inline std::vector<unsigned int> allowed_cpus() {
+            std::vector<unsigned int> cpus;
+#ifdef __linux__
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+                for (unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                    if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+                }
+            }
+#endif
+            if (cpus.empty()) {
+                for (unsigned int cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency());
+                     ++cpu) {
+                    cpus.push_back(cpu);
+                }
+            }
+            return cpus;
+        }
+
+        /// NUMA node of a cpu (0 when the topology is unknown)
+        inline int numa_node(unsigned int cpu) {
+#ifdef __linux__
+            try {
+                // the node is exposed as a "nodeN" link in the cpu directory
+                for (const auto &entry : std::filesystem::directory_iterator(
+                         "/sys/devices/system/cpu/cpu" + std::to_string(cpu))) {
+                    const std::string name = entry.path().filename().string();
+                    if (name.size() > 4 && name.starts_with("node") &&
+                        name.find_first_not_of("0123456789", 4) == std::string::npos) {
+                        return std::stoi(name.substr(4));
+                    }
+                }
+            } catch (...) {
+            }
+#endif
+            return 0;
+        }
+
+        /// hint to the cpu that we are busy waiting
+        inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+            asm volatile("yield");
+#endif
+        }
+
+        /// one task every wait_sample_rate is timed from enqueue to start
+        inline constexpr unsigned int wait_sample_rate = 64;
+
+        /// pin the calling thread to a cpu, best effort
+        inline void pin_current_thread([[maybe_unused]] unsigned int cpu) {
+#ifdef __linux__
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            sched_setaffinity(0, sizeof(set), &set);
+#endif
+        }
     }  // namespace details
 
+    /**
+     * @brief Placement of the thread pool workers on the cpus.
+     * @details none leaves the scheduler free to move the workers; compact pins the workers
+     * filling one NUMA node after the other; scatter pins them round robin across the nodes.
+     * Pinning is only implemented on Linux and ignored elsewhere.
+     */
+    enum class worker_affinity { none, compact, scatter };
+
+    /**
+     * @brief How an idle worker waits for the next task.
+     * @details The worker spins (with the cpu pause instruction) for up to spin, then
+     * yields its time slice for up to yield, then parks on a semaphore. Spinning trades idle
+     * cpu time for the futex wake up and the context switch of a parked worker.
+     * The default parks immediately.
+     */
+    struct wait_strategy {
+        std::chrono::nanoseconds spin{0};
+        std::chrono::nanoseconds yield{0};
+    };
+
+    /// bounds of an elastic thread pool, see thread_pool::thread_pool(const elastic_size &)
+    struct elastic_size {
+        unsigned int min_threads = 1;
+        unsigned int max_threads = std::thread::hardware_concurrency();
+        std::chrono::milliseconds grow_after{100};     // age of a queued task that adds a worker
+        std::chrono::milliseconds idle_timeout{30000};  // idle time that stops a worker
+    };
+
+    /// how the workers found their tasks, see thread_pool::wait_stats()
+    struct wait_statistics {
+        std::uint64_t spin_hits = 0;   // woken while spinning
+        std::uint64_t yield_hits = 0;  // woken while yielding
+        std::uint64_t parks = 0;       // had to sleep
+    };
+
+    /// counters of a single worker, see thread_pool::stats()
+    struct worker_statistics {
+        bool active = false;  // a thread runs on this slot (always true unless elastic)
+        std::uint64_t executed = 0;       // tasks run, stolen ones included
+        std::uint64_t stolen = 0;         // tasks taken from other workers
+        std::uint64_t failed_steals = 0;  // steal attempts that found nothing
+        std::uint64_t spin_hits = 0;
+        std::uint64_t yield_hits = 0;
+        std::uint64_t parks = 0;
+        std::uint64_t unparks = 0;  // woken after sleeping
+        std::uint64_t busy_ns = 0;  // time spent from wake up to idle again
+    };
+
+    /**
+     * @brief Point in time view of a thread pool, see thread_pool::stats().
+     * @details Counters are read one by one while the pool runs: they are consistent
+     * individually, not with each other.
+     */
+    struct pool_statistics {
+        std::size_t size = 0;       // running workers
+        std::int64_t pending = 0;   // tasks enqueued and not started
+        std::vector<worker_statistics> workers;
+        /// sampled delays between enqueue and start, bucket i counts [2^i, 2^(i+1)) ns
+        std::array<std::uint64_t, 64> wait_histogram{};
+
+        /// upper bound (ns) of the sampled enqueue to start delay at percentile p (0-100)
+        [[nodiscard]] std::uint64_t wait_percentile(double p) const {
+            std::uint64_t total = 0;
+            for (const auto count : wait_histogram) total += count;
+            if (total == 0) return 0;
+            const auto rank = static_cast<std::uint64_t>(p / 100.0 * static_cast<double>(total));
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < wait_histogram.size(); ++i) {
+                seen += wait_histogram[i];
+                if (seen > rank || seen == total) return i >= 63 ? UINT64_MAX : (2ull << i) - 1;
+            }
+            return UINT64_MAX;
+        }
+    };
+
+    /**
+     * @brief Queue usable as per worker task queue of the thread pool.
+     * @details dp::thread_safe_queue (mutex) and dp::work_stealing_queue (lock-free) qualify.
+     */
+    template <typename Queue, typename T>
+    concept task_queue = std::default_initializable<Queue> && requires(Queue &queue, T &&task) {
+        queue.push_back(std::move(task));
+        { queue.pop_front() } -> std::same_as<std::optional<T>>;
+        { queue.steal() } -> std::same_as<std::optional<T>>;
+    };
+
     template <typename FunctionType = details::default_function_type,
-              typename ThreadType = std::jthread>
+              typename ThreadType = std::jthread,
+              typename QueueType = dp::thread_safe_queue<FunctionType>>
         requires std::invocable<FunctionType> &&
-                 std::is_same_v<void, std::invoke_result_t<FunctionType>>
+                 std::is_same_v<void, std::invoke_result_t<FunctionType>> &&
+                 task_queue<QueueType, FunctionType>
     class thread_pool {
       public:
         explicit thread_pool(
-            const unsigned int &number_of_threads = std::thread::hardware_concurrency())
-            : tasks_(number_of_threads) {
+            const unsigned int &number_of_threads = std::thread::hardware_concurrency(),
+            worker_affinity affinity = worker_affinity::none, wait_strategy wait = {})
+            : tasks_(number_of_threads), wait_(wait) {
+            placement_ = place_workers(number_of_threads, affinity);
+            affinity_ = affinity;
             std::size_t current_id = 0;
             for (std::size_t i = 0; i < number_of_threads; ++i) {
                 priority_queue_.push_back(size_t(current_id));
                 try {
-                    threads_.emplace_back([&, id = current_id](const std::stop_token &stop_tok) {
-                        do {
-                            // wait until signaled
-                            tasks_[id].signal.acquire();
-
-                            do {
-                                // invoke the task
-                                while (auto task = tasks_[id].tasks.pop_front()) {
-                                    try {
-                                        pending_tasks_.fetch_sub(1, std::memory_order_release);
-                                        std::invoke(std::move(task.value()));
-                                    } catch (...) {
-                                    }
-                                }
-
-                                // try to steal a task
-                                for (std::size_t j = 1; j < tasks_.size(); ++j) {
-                                    const std::size_t index = (id + j) % tasks_.size();
-                                    if (auto task = tasks_[index].tasks.steal()) {
-                                        // steal a task
-                                        pending_tasks_.fetch_sub(1, std::memory_order_release);
-                                        std::invoke(std::move(task.value()));
-                                        // stop stealing once we have invoked a stolen task
-                                        break;
-                                    }
-                                }
-
-                            } while (pending_tasks_.load(std::memory_order_acquire) > 0);
-
-                            priority_queue_.rotate_to_front(id);
-
-                        } while (!stop_tok.stop_requested());
-                    });
+                    threads_.push_back(make_worker(current_id));
                     // increment the thread id
                     ++current_id;
 
                 } catch (...) {
                     // catch all
 
-                    // remove one item from the tasks
-                    tasks_.pop_back();
-
                     // remove our thread from the priority queue
                     std::ignore = priority_queue_.pop_back();
                 }
             }
+            // remove the items of the threads that could not be created
+            tasks_.resize(threads_.size());
+            active_workers_.store(threads_.size(), std::memory_order_relaxed);
+            wait_until_ready(threads_.size());
+            set_steal_order();
+        }
+
+        /**
+         * @brief Create an elastic thread pool.
+         * @details The pool starts with size.min_threads workers. When a queued task waited
+         * longer than size.grow_after (for example because all the workers are blocked in
+         * their tasks) a worker is added, one per size.grow_after, up to size.max_threads.
+         * Workers idle for longer than size.idle_timeout stop, down to size.min_threads.
+         */
+        explicit thread_pool(const elastic_size &size,
+                             worker_affinity affinity = worker_affinity::none,
+                             wait_strategy wait = {})
+            : tasks_(std::max(1u, size.max_threads)),
+              wait_(wait),
+              elastic_(true),
+              min_threads_(std::clamp(size.min_threads, 1u, std::max(1u, size.max_threads))),
+              idle_timeout_(size.idle_timeout) {
+            placement_ = place_workers(tasks_.size(), affinity);
+            affinity_ = affinity;
+            threads_.resize(tasks_.size());
+            std::size_t started = 0;
+            for (std::size_t id = 0; id < tasks_.size(); ++id) {
+                if (id >= min_threads_) {
+                    // slot for a worker added later
+                    tasks_[id] = std::make_unique<task_item>();
+                    tasks_[id]->active.store(false, std::memory_order_relaxed);
+                    continue;
+                }
+                try {
+                    threads_[id] = make_worker(id);
+                    ++started;
+                } catch (...) {
+                    tasks_[id] = std::make_unique<task_item>();
+                    tasks_[id]->active.store(false, std::memory_order_relaxed);
+                }
+            }
+            active_workers_.store(started, std::memory_order_relaxed);
+            wait_until_ready(started);
+            set_steal_order();
+            supervisor_ = std::jthread(
+                [this, grow_after = size.grow_after](const std::stop_token &stop_tok) {
+                    supervise(grow_after, stop_tok);
+                });
         }
 
         ~thread_pool() {
+            if (supervisor_.joinable()) {
+                supervisor_.request_stop();
+                supervisor_.join();
+            }
             // stop all threads
             for (std::size_t i = 0; i < threads_.size(); ++i) {
+                if (!threads_[i].joinable()) continue;
                 threads_[i].request_stop();
-                tasks_[i].signal.release();
+                tasks_[i]->signal.release();
                 threads_[i].join();
             }
         }
@@ -134,7 +321,7 @@ namespace dp {
                     promise.set_exception(std::current_exception());
                 }
             };
-            enqueue_task(std::move(task));
+            enqueue_sampled(std::move(task));
             return future;
 #else
             /*
@@ -166,7 +353,7 @@ namespace dp {
             // get the future before enqueuing the task
             auto future = shared_promise->get_future();
             // enqueue the task
-            enqueue_task(std::move(task));
+            enqueue_sampled(std::move(task));
             return future;
 #endif
         }
@@ -182,7 +369,7 @@ namespace dp {
             requires std::invocable<Function, Args...> &&
                      std::is_same_v<void, std::invoke_result_t<Function &&, Args &&...>>
         void enqueue_detach(Function &&func, Args &&...args) {
-            enqueue_task(
+            enqueue_sampled(
                 std::move([f = std::forward<Function>(func),
                            ... largs = std::forward<Args>(args)]() mutable -> decltype(auto) {
                     // suppress exceptions
@@ -193,33 +380,450 @@ namespace dp {
                 }));
         }
 
-        [[nodiscard]] auto size() const { return threads_.size(); }
+        /// number of running workers
+        [[nodiscard]] auto size() const { return active_workers_.load(std::memory_order_relaxed); }
+
+        /// how often idle workers were woken while spinning, while yielding or parked
+        [[nodiscard]] wait_statistics wait_stats() const {
+            wait_statistics stats;
+            for (const auto &item : tasks_) {
+                stats.spin_hits += item->spin_hits.load(std::memory_order_relaxed);
+                stats.yield_hits += item->yield_hits.load(std::memory_order_relaxed);
+                stats.parks += item->parks.load(std::memory_order_relaxed);
+            }
+            return stats;
+        }
+
+        /// snapshot of the per worker counters, readable while the pool runs
+        [[nodiscard]] pool_statistics stats() const {
+            pool_statistics stats;
+            stats.size = size();
+            stats.pending = pending_tasks_.load(std::memory_order_relaxed);
+            for (const auto &item : tasks_) {
+                worker_statistics worker;
+                worker.active = item->active.load(std::memory_order_relaxed);
+                worker.executed = item->executed.load(std::memory_order_relaxed);
+                worker.stolen = item->stolen.load(std::memory_order_relaxed);
+                worker.failed_steals = item->failed_steals.load(std::memory_order_relaxed);
+                worker.spin_hits = item->spin_hits.load(std::memory_order_relaxed);
+                worker.yield_hits = item->yield_hits.load(std::memory_order_relaxed);
+                worker.parks = item->parks.load(std::memory_order_relaxed);
+                worker.unparks = item->unparks.load(std::memory_order_relaxed);
+                worker.busy_ns = item->busy_ns.load(std::memory_order_relaxed);
+                stats.workers.push_back(worker);
+                for (std::size_t i = 0; i < stats.wait_histogram.size(); ++i) {
+                    stats.wait_histogram[i] += item->wait_histogram[i].load(std::memory_order_relaxed);
+                }
+            }
+            return stats;
+        }
 
       private:
+        /// per worker state, on its own cache lines
+        struct alignas(details::cache_line_size) task_item {
+            QueueType tasks{};
+            std::binary_semaphore signal{0};
+            std::vector<std::size_t> victims;  // steal order
+            std::atomic_bool active{true};      // a worker runs on this slot (elastic pool)
+            std::atomic_size_t users{0};        // submitters pushing to this slot (elastic pool)
+            std::atomic_bool exited{false};     // the retired worker left work(), join() won't wait
+            // written by the owner only, see bump()
+            std::atomic_uint64_t executed{0};
+            std::atomic_uint64_t stolen{0};
+            std::atomic_uint64_t failed_steals{0};
+            std::atomic_uint64_t spin_hits{0};
+            std::atomic_uint64_t yield_hits{0};
+            std::atomic_uint64_t parks{0};
+            std::atomic_uint64_t unparks{0};
+            std::atomic_uint64_t busy_ns{0};
+            std::array<std::atomic_uint64_t, 64> wait_histogram{};
+        };
+
+        /// single writer counter increment: no read-modify-write needed
+        static void bump(std::atomic_uint64_t &counter, std::uint64_t n = 1) {
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        /// wrap one task every wait_sample_rate to time its enqueue to start delay
         template <typename Function>
-        void enqueue_task(Function &&f) {
-            auto i_opt = priority_queue_.copy_front_and_rotate_to_back();
-            if (!i_opt.has_value()) {
-                // would only be a problem if there are zero threads
+        void enqueue_sampled(Function &&f) {
+            thread_local unsigned int tick = 0;
+            if (++tick % details::wait_sample_rate != 0) {
+                enqueue_task(std::forward<Function>(f));
                 return;
             }
-            auto i = *(i_opt);
+            enqueue_task([this, f = std::forward<Function>(f),
+                          enqueued = std::chrono::steady_clock::now()]() mutable {
+                const auto delay = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                       std::chrono::steady_clock::now() - enqueued)
+                                       .count();
+                const auto bucket = std::bit_width(static_cast<std::uint64_t>(std::max<std::int64_t>(delay, 1))) - 1;
+                bump(tasks_[current_worker().second]->wait_histogram[bucket]);
+                std::invoke(f);
+            });
+        }
+
+        static constexpr bool lock_free_submission = requires { QueueType::is_lock_free; };
+
+        /// pool and index of the worker running on the calling thread, if any
+        static std::pair<const thread_pool *, std::size_t> &current_worker() {
+            thread_local std::pair<const thread_pool *, std::size_t> worker{nullptr, 0};
+            return worker;
+        }
+
+        template <typename Function>
+        void enqueue_task(Function &&f) {
+            if (elastic_) {
+                enqueue_elastic(std::forward<Function>(f));
+            } else if constexpr (lock_free_submission) {
+                if (tasks_.empty()) {
+                    return;
+                }
+                const std::size_t wake =
+                    next_worker_.fetch_add(1, std::memory_order_relaxed) % tasks_.size();
+                // tasks submitted by one of our workers stay in its own deque, the woken
+                // worker steals them from there
+                const std::size_t i =
+                    current_worker().first == this ? current_worker().second : wake;
+                pending_tasks_.fetch_add(1, std::memory_order_relaxed);
+                tasks_[i]->tasks.push_back(std::forward<Function>(f));
+                tasks_[wake]->signal.release();
+            } else {
+                auto i_opt = priority_queue_.copy_front_and_rotate_to_back();
+                if (!i_opt.has_value()) {
+                    // would only be a problem if there are zero threads
+                    return;
+                }
+                auto i = *(i_opt);
+                pending_tasks_.fetch_add(1, std::memory_order_relaxed);
+                tasks_[i]->tasks.push_back(std::forward<Function>(f));
+                tasks_[i]->signal.release();
+            }
+        }
+
+        /**
+         * @brief Round robin over the running workers of an elastic pool.
+         * @details A submitter announces itself on the slot (users) before checking that the
+         * worker is still active, a retiring worker clears active and then waits for the
+         * users to leave: a task is never pushed to a queue that nobody drains.
+         * Throws std::runtime_error if no worker runs (none could be started).
+         */
+        template <typename Function>
+        void enqueue_elastic(Function &&f) {
             pending_tasks_.fetch_add(1, std::memory_order_relaxed);
-            tasks_[i].tasks.push_back(std::forward<Function>(f));
-            tasks_[i].signal.release();
+            enqueued_tasks_.fetch_add(1, std::memory_order_relaxed);
+            const bool local = lock_free_submission && current_worker().first == this;
+            if (local) {
+                // submitted by a running worker, which cannot retire before running the task;
+                // still wake another worker to steal it
+                tasks_[current_worker().second]->tasks.push_back(std::forward<Function>(f));
+            }
+            for (std::size_t tried = 1;; ++tried) {
+                task_item &item =
+                    *tasks_[next_worker_.fetch_add(1, std::memory_order_relaxed) % tasks_.size()];
+                if (!item.active.load(std::memory_order_relaxed)) {
+                    // a worker sets active before it is counted, so no active slot and no
+                    // worker counted means there is nobody to run the task
+                    if ((tried % tasks_.size() == 0) &&
+                        (active_workers_.load(std::memory_order_acquire) == 0)) {
+                        pending_tasks_.fetch_sub(1, std::memory_order_relaxed);
+                        enqueued_tasks_.fetch_sub(1, std::memory_order_relaxed);
+                        throw std::runtime_error("thread_pool: no worker is running");
+                    }
+                    continue;
+                }
+                item.users.fetch_add(1, std::memory_order_seq_cst);
+                if (item.active.load(std::memory_order_seq_cst)) {
+                    if (!local) {
+                        item.tasks.push_back(std::forward<Function>(f));
+                    }
+                    item.signal.release();
+                    item.users.fetch_sub(1, std::memory_order_release);
+                    return;
+                }
+                item.users.fetch_sub(1, std::memory_order_release);
+            }
         }
 
-        struct task_item {
-            dp::thread_safe_queue<FunctionType> tasks{};
-            std::binary_semaphore signal{0};
-        };
+        ThreadType make_worker(std::size_t id) {
+            return ThreadType([this, id](const std::stop_token &stop_tok) { work(id, stop_tok); });
+        }
+
+        void work(const std::size_t id, const std::stop_token &stop_tok) {
+            if (affinity_ != worker_affinity::none) {
+                details::pin_current_thread(placement_[id].first);
+            }
+            if (tasks_[id] == nullptr) {
+                // allocated by the worker itself, so that the memory is local to its node
+                tasks_[id] = std::make_unique<task_item>();
+                ready_.fetch_add(1, std::memory_order_release);
+                ready_.notify_all();
+            }
+            task_item &item = *tasks_[id];
+
+            current_worker() = {this, id};
+            if constexpr (requires { item.tasks.bind_owner(); }) {
+                // tasks enqueued by this worker go to its own lock-free deque
+                item.tasks.bind_owner();
+            }
+            do {
+                // wait until signaled
+                if (!wait_for_task(item)) {
+                    // idle for too long
+                    if (retire(item)) {
+                        item.exited.store(true, std::memory_order_release);
+                        return;
+                    }
+                    continue;
+                }
+
+                const auto busy_since = std::chrono::steady_clock::now();
+                do {
+                    // invoke the task
+                    while (auto task = item.tasks.pop_front()) {
+                        try {
+                            pending_tasks_.fetch_sub(1, std::memory_order_release);
+                            bump(item.executed);
+                            std::invoke(std::move(task.value()));
+                        } catch (...) {
+                        }
+                    }
+
+                    // try to steal a task
+                    for (const std::size_t index : item.victims) {
+                        if (!tasks_[index]->active.load(std::memory_order_relaxed)) continue;
+                        if (auto task = tasks_[index]->tasks.steal()) {
+                            // steal a task
+                            pending_tasks_.fetch_sub(1, std::memory_order_release);
+                            bump(item.executed);
+                            bump(item.stolen);
+                            std::invoke(std::move(task.value()));
+                            // stop stealing once we have invoked a stolen task
+                            break;
+                        }
+                        bump(item.failed_steals);
+                    }
+
+                } while (pending_tasks_.load(std::memory_order_acquire) > 0);
+                bump(item.busy_ns, static_cast<std::uint64_t>(
+                                       std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                           std::chrono::steady_clock::now() - busy_since)
+                                           .count()));
+
+                if constexpr (!lock_free_submission) {
+                    if (!elastic_) {
+                        priority_queue_.rotate_to_front(id);
+                    }
+                }
+
+            } while (!stop_tok.stop_requested());
+        }
+
+        /// stop an idle worker of an elastic pool if there are more than the minimum
+        bool retire(task_item &item) {
+            auto active = active_workers_.load(std::memory_order_relaxed);
+            do {
+                if (active <= min_threads_) return false;
+            } while (!active_workers_.compare_exchange_weak(active, active - 1,
+                                                            std::memory_order_relaxed));
+            item.active.store(false, std::memory_order_seq_cst);
+            while (item.users.load(std::memory_order_seq_cst) > 0) {
+                details::cpu_relax();
+            }
+            // run what was pushed before we left
+            while (auto task = item.tasks.pop_front()) {
+                try {
+                    pending_tasks_.fetch_sub(1, std::memory_order_release);
+                    bump(item.executed);
+                    std::invoke(std::move(task.value()));
+                } catch (...) {
+                }
+            }
+            return true;
+        }
+
+        /**
+         * @brief Add workers to an elastic pool while queued tasks wait too long.
+         * @details Tasks are not time stamped: when the tasks started since a mark do not
+         * cover the tasks that were enqueued before it, one of those is older than the mark.
+         */
+        void supervise(std::chrono::milliseconds grow_after, const std::stop_token &stop_tok) {
+            using clock = std::chrono::steady_clock;
+            const auto tick = std::max(std::chrono::milliseconds(1), grow_after / 4);
+            std::mutex mutex;
+            std::condition_variable_any sleep;
+            auto mark_time = clock::now();
+            auto mark_enqueued = enqueued_tasks_.load(std::memory_order_relaxed);
+            while (!stop_tok.stop_requested()) {
+                {
+                    std::unique_lock lock(mutex);
+                    sleep.wait_for(lock, stop_tok, tick, [] { return false; });
+                }
+                const auto enqueued = enqueued_tasks_.load(std::memory_order_relaxed);
+                const auto started =
+                    enqueued - static_cast<std::uint64_t>(
+                                   std::max<std::int_fast64_t>(0, pending_tasks_.load()));
+                if (started >= mark_enqueued) {
+                    mark_time = clock::now();
+                    mark_enqueued = enqueued;
+                } else if (clock::now() - mark_time >= grow_after) {
+                    // one worker per grow_after: the new one needs time to drain the backlog
+                    if (grow()) {
+                        mark_time = clock::now();
+                    }
+                }
+            }
+        }
+
+        /// start a worker in a free slot of an elastic pool, false if none could be started
+        bool grow() {
+            for (std::size_t id = 0; id < tasks_.size(); ++id) {
+                task_item &item = *tasks_[id];
+                if (item.active.load(std::memory_order_acquire)) continue;
+                if (threads_[id].joinable()) {
+                    // retired: the slot is reused once the thread has drained its queue and
+                    // left, the supervisor never waits for the tasks it is running
+                    if (!item.exited.load(std::memory_order_acquire)) continue;
+                    threads_[id].join();
+                }
+                item.exited.store(false, std::memory_order_relaxed);
+                item.active.store(true, std::memory_order_seq_cst);
+                active_workers_.fetch_add(1, std::memory_order_relaxed);
+                try {
+                    threads_[id] = make_worker(id);
+                } catch (...) {
+                    item.active.store(false, std::memory_order_seq_cst);
+                    active_workers_.fetch_sub(1, std::memory_order_relaxed);
+                    return false;
+                }
+                // wake it at once: the waiting tasks are in the queues of the busy workers,
+                // it steals them instead of waiting for new submissions
+                item.signal.release();
+                return true;
+            }
+            return false;
+        }
+
+        void wait_until_ready(std::size_t workers) {
+            // wait for the workers to allocate their items
+            for (auto ready = ready_.load(std::memory_order_acquire); ready < workers;
+                 ready = ready_.load(std::memory_order_acquire)) {
+                ready_.wait(ready, std::memory_order_acquire);
+            }
+        }
+
+        void set_steal_order() {
+            // steal from the workers of the same NUMA node first
+            for (std::size_t id = 0; id < tasks_.size(); ++id) {
+                tasks_[id]->victims.clear();
+                for (int same_node = 1; same_node >= 0; --same_node) {
+                    for (std::size_t j = 1; j < tasks_.size(); ++j) {
+                        const std::size_t index = (id + j) % tasks_.size();
+                        if ((placement_[index].second == placement_[id].second) ==
+                            bool(same_node)) {
+                            tasks_[id]->victims.push_back(index);
+                        }
+                    }
+                }
+            }
+        }
+
+        /// cpu and NUMA node of every worker
+        static std::vector<std::pair<unsigned int, int>> place_workers(std::size_t count,
+                                                                        worker_affinity affinity) {
+            std::vector<std::pair<unsigned int, int>> placement(count, {0, 0});
+            if (affinity == worker_affinity::none || count == 0) {
+                return placement;
+            }
+            std::map<int, std::vector<unsigned int>> nodes;
+            for (const unsigned int cpu : details::allowed_cpus()) {
+                nodes[details::numa_node(cpu)].push_back(cpu);
+            }
+            std::vector<std::pair<unsigned int, int>> cpus;  // in placement order
+            if (affinity == worker_affinity::compact) {
+                for (const auto &[node, node_cpus] : nodes) {
+                    for (const unsigned int cpu : node_cpus) cpus.emplace_back(cpu, node);
+                }
+            } else {
+                for (std::size_t i = 0; cpus.size() < count; ++i) {
+                    for (const auto &[node, node_cpus] : nodes) {
+                        if (cpus.size() < count) {
+                            cpus.emplace_back(node_cpus[i % node_cpus.size()], node);
+                        }
+                    }
+                }
+            }
+            for (std::size_t i = 0; i < count; ++i) {
+                placement[i] = cpus[i % cpus.size()];
+            }
+            return placement;
+        }
+
+        /**
+         * @brief Spin, then yield, then park until the worker is signaled.
+         * @return false if a worker of an elastic pool stayed idle for the idle timeout.
+         */
+        bool wait_for_task(task_item &item) {
+            using clock = std::chrono::steady_clock;
+            const auto count = [](std::atomic_uint64_t &counter) { bump(counter); };
+            if (wait_.spin.count() > 0 || wait_.yield.count() > 0) {
+                const auto start = clock::now();
+                // reading the clock is slower than a pause, look at it every 64 rounds
+                for (unsigned int round = 1;; ++round) {
+                    if (item.signal.try_acquire()) {
+                        count(item.spin_hits);
+                        return true;
+                    }
+                    details::cpu_relax();
+                    if (round % 64 == 0 && clock::now() - start >= wait_.spin) break;
+                }
+                while (clock::now() - start < wait_.spin + wait_.yield) {
+                    if (item.signal.try_acquire()) {
+                        count(item.yield_hits);
+                        return true;
+                    }
+                    std::this_thread::yield();
+                }
+            }
+            count(item.parks);
+            if (elastic_) {
+                if (!item.signal.try_acquire_for(idle_timeout_)) return false;
+            } else {
+                item.signal.acquire();
+            }
+            count(item.unparks);
+            return true;
+        }
 
         std::vector<ThreadType> threads_;
-        std::deque<task_item> tasks_;
+        std::vector<std::unique_ptr<task_item>> tasks_;
         dp::thread_safe_queue<std::size_t> priority_queue_;
-        std::atomic_int_fast64_t pending_tasks_{};
+        std::atomic_size_t ready_{};  // workers that allocated their task item
+        wait_strategy wait_;
+        bool elastic_ = false;
+        std::size_t min_threads_ = 0;
+        std::chrono::milliseconds idle_timeout_{0};
+        std::vector<std::pair<unsigned int, int>> placement_;
+        worker_affinity affinity_ = worker_affinity::none;
+        std::atomic_size_t active_workers_{};
+        std::jthread supervisor_;  // grows the elastic pool
+        alignas(details::cache_line_size) std::atomic_uint64_t enqueued_tasks_{};
+        // round robin submission of the lock-free pool
+        alignas(details::cache_line_size) std::atomic_size_t next_worker_{};
+        alignas(details::cache_line_size) std::atomic_int_fast64_t pending_tasks_{};
     };
 
+    /**
+     * @brief Thread pool with lock-free task submission, execution and stealing.
+     * @details Workers own a Chase-Lev deque for the tasks they enqueue themselves and a
+     * bounded lock-free inbox for tasks coming from other threads, which are assigned
+     * round robin with an atomic counter.
+     */
+    template <typename FunctionType = details::default_function_type,
+              typename ThreadType = std::jthread>
+    using lock_free_thread_pool =
+        thread_pool<FunctionType, ThreadType, work_stealing_queue<FunctionType>>;
+
     /**
      * @example mandelbrot/source/main.cpp
      * Example showing how to use thread pool with tasks that return a value. Outputs a PPM image of
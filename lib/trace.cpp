@@ -0,0 +1,139 @@
+#include "trace.h"
+#include "logger.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <time.h>
+
+const char* trace::phaseName(Phase phase) {
+    static const char* names[] = {"queue", "recv", "parse", "route", "executor", "body",
+                                  "handler", "compress", "serialize", "send", "proxy", "request"};
+    return (phase < Phase::Count) ? names[static_cast<size_t>(phase)] : "unknown";
+}
+
+#ifdef NICEHTTP_TRACE
+
+trace::RequestTrace::RequestTrace() {
+    this->begin = Tracer::now();
+}
+
+void trace::RequestTrace::mark(Phase phase) {
+    this->allocations.mark(phase);
+    if (this->count < this->phases.size()) {
+        this->phases[this->count] = phase;
+        this->ends[this->count] = Tracer::now();
+        this->count++;
+    }
+}
+
+int64_t trace::RequestTrace::elapsed() const {
+    return Tracer::now() - this->begin;
+}
+
+trace::Tracer& trace::Tracer::getInstance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+int64_t trace::Tracer::now() {
+    #ifdef _WIN32
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    #else
+    // vDSO call, no system call
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    #endif
+}
+
+trace::Tracer::Handle::~Handle() {
+    if (this->ring != nullptr) {
+        Tracer& tracer = Tracer::getInstance();
+        std::lock_guard<std::mutex> lock(tracer.registry);
+        tracer.free_rings.push_back(this->ring);
+    }
+}
+
+trace::Tracer::Ring& trace::Tracer::local() {
+    thread_local Handle handle;
+    if (handle.ring == nullptr) {
+        std::lock_guard<std::mutex> lock(this->registry);
+        if (!this->free_rings.empty()) {
+            handle.ring = this->free_rings.back();
+            this->free_rings.pop_back();
+        } else {
+            this->rings.push_back(std::make_unique<Ring>());
+            handle.ring = this->rings.back().get();
+            handle.ring->index = this->rings.size();
+        }
+    }
+    return *handle.ring;
+}
+
+void trace::Tracer::write(Ring& ring, uint64_t request, Phase phase, int64_t begin, int64_t end) {
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    Event& e = ring.events[head % NICEHTTP_TRACE_EVENTS];
+    uint64_t seq = e.seq.load(std::memory_order_relaxed);
+    e.seq.store(seq + 1, std::memory_order_relaxed); // odd: being written
+    std::atomic_thread_fence(std::memory_order_release);
+    e.request.store(request, std::memory_order_relaxed);
+    e.phase.store(static_cast<uint64_t>(phase), std::memory_order_relaxed);
+    e.begin.store(begin, std::memory_order_relaxed);
+    e.end.store(end, std::memory_order_relaxed);
+    e.seq.store(seq + 2, std::memory_order_release);
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+void trace::Tracer::record(RequestTrace& trace, std::string_view method, std::string_view uri) {
+    int64_t end = now();
+    Ring& ring = this->local();
+    uint64_t request = (static_cast<uint64_t>(ring.index) << 40) | ++ring.requests;
+    int64_t begin = trace.begin;
+    for (uint8_t i = 0; i < trace.count; i++) {
+        this->write(ring, request, trace.phases[i], begin, trace.ends[i]);
+        begin = trace.ends[i];
+    }
+    this->write(ring, request, Phase::Request, trace.begin, end);
+    if (end - trace.begin >= static_cast<int64_t>(NICEHTTP_TRACE_SLOW) * 1000000) {
+        std::ostringstream line;
+        line << std::fixed << std::setprecision(3) << "Slow request " << method << " " << uri << " "
+             << (end - trace.begin) / 1e6 << "ms:";
+        begin = trace.begin;
+        for (uint8_t i = 0; i < trace.count; i++) {
+            line << " " << phaseName(trace.phases[i]) << "=" << (trace.ends[i] - begin) / 1e6;
+            begin = trace.ends[i];
+        }
+        Logger::getInstance().error(line.str());
+    }
+}
+
+std::string trace::Tracer::chromeTrace() {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+    bool first = true;
+    std::lock_guard<std::mutex> lock(this->registry);
+    for (const auto& ring : this->rings) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t from = (head > NICEHTTP_TRACE_EVENTS) ? head - NICEHTTP_TRACE_EVENTS : 0;
+        for (uint64_t i = from; i < head; i++) {
+            const Event& e = ring->events[i % NICEHTTP_TRACE_EVENTS];
+            uint64_t seq = e.seq.load(std::memory_order_acquire);
+            uint64_t request = e.request.load(std::memory_order_relaxed);
+            auto phase = static_cast<Phase>(e.phase.load(std::memory_order_relaxed));
+            int64_t begin = e.begin.load(std::memory_order_relaxed);
+            int64_t end = e.end.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if ((seq % 2 != 0) || (e.seq.load(std::memory_order_relaxed) != seq)) {
+                continue; // overwritten while we were reading it
+            }
+            out << (first ? "" : ",") << "{\"name\":\"" << phaseName(phase) << "\",\"cat\":\"http\",\"ph\":\"X\",\"ts\":"
+                << begin / 1e3 << ",\"dur\":" << (end - begin) / 1e3 << ",\"pid\":1,\"tid\":" << ring->index
+                << ",\"args\":{\"request\":" << request << "}}";
+            first = false;
+        }
+    }
+    out << "]}";
+    return out.str();
+}
+
+#endif
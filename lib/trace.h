@@ -0,0 +1,163 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "alloc_stats.h"
+
+#define NICEHTTP_TRACE_EVENTS 4096 // phase events kept per thread (ring buffer)
+#define NICEHTTP_TRACE_SLOW 100    // ms, slower requests are logged with their phase breakdown
+
+namespace trace {
+
+// Phases of a server request, each one ends when the next begins
+enum class Phase : uint8_t {
+    Queue,    // accepted, waiting for a worker
+    Recv,     // reading the request head
+    Parse,    // parsing request line and headers
+    Route,    // matching the route
+    Executor, // waiting in the route executor
+    Body,     // reading the request body
+    Handler,  // route callback
+    Compress, // compressing the response body (NICEHTTP_COMPRESSION)
+    Serialize,// Response::toString
+    Send,     // writing the response
+    Proxy,    // forwarding to the upstream and streaming the response back
+    Request,  // whole request, from accept to the end
+    Count
+};
+
+const char* phaseName(Phase phase);
+
+class AllocationMeter {
+    /* Heap allocations made in each phase of a request, accounted in
+     * alloc_stats when compiled with NICEHTTP_ALLOC_STATS, nothing otherwise.
+     * A phase ending on another thread than the previous one (executor
+     * handoff) is not accounted.
+     */
+#ifdef NICEHTTP_ALLOC_STATS
+public:
+    void mark(Phase phase) {
+        alloc_stats::Usage now = alloc_stats::current();
+        if (this->thread == std::this_thread::get_id()) {
+            alloc_stats::account(static_cast<size_t>(phase), this->last, now);
+        }
+        this->thread = std::this_thread::get_id();
+        this->last = alloc_stats::current(); // without the accounting itself
+    }
+private:
+    std::thread::id thread;
+    alloc_stats::Usage last;
+#else
+public:
+    void mark(Phase) {}
+#endif
+};
+
+#ifdef NICEHTTP_TRACE
+
+class RequestTrace {
+    /* Timestamps of the phases of one request, kept on the stack (or in the
+     * task handed to an executor) and written to the ring of the thread that
+     * finishes the request.
+     */
+public:
+    RequestTrace();
+    void mark(Phase phase); // phase ended now
+    int64_t start() const { return this->begin; }
+    int64_t elapsed() const; // ns since start
+private:
+    friend class Tracer;
+    int64_t begin;
+    uint8_t count = 0;
+    std::array<Phase, 12> phases;
+    std::array<int64_t, 12> ends;
+    [[no_unique_address]] AllocationMeter allocations;
+};
+
+class Tracer {
+    /* Per thread lock-free rings of the last NICEHTTP_TRACE_EVENTS phase events.
+     * Only the owner thread writes a ring; readers copy it at any time, using
+     * the per slot sequence number to skip the events being overwritten.
+     */
+public:
+    static Tracer& getInstance();
+    static int64_t now(); // CLOCK_MONOTONIC ns
+    void record(RequestTrace& trace, std::string_view method, std::string_view uri);
+    std::string chromeTrace(); // trace event JSON, load it in chrome://tracing or Perfetto
+private:
+    struct Event {
+        std::atomic<uint64_t> seq{0}; // odd while being written
+        std::atomic<uint64_t> request{0};
+        std::atomic<uint64_t> phase{0};
+        std::atomic<int64_t> begin{0};
+        std::atomic<int64_t> end{0};
+    };
+    struct Ring {
+        size_t index; // tid in the trace
+        std::atomic<uint64_t> head{0};
+        uint64_t requests = 0; // owner only
+        std::array<Event, NICEHTTP_TRACE_EVENTS> events;
+    };
+    struct Handle {
+        Ring* ring = nullptr;
+        ~Handle();
+    };
+    std::mutex registry;
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::vector<Ring*> free_rings;
+    Ring& local();
+    void write(Ring& ring, uint64_t request, Phase phase, int64_t begin, int64_t end);
+};
+
+#else
+
+// Tracing disabled: every call compiles to nothing (but the allocation accounting, if enabled)
+class RequestTrace {
+public:
+    void mark(Phase phase) { this->allocations.mark(phase); }
+private:
+    [[no_unique_address]] AllocationMeter allocations;
+};
+
+class Tracer {
+public:
+    static Tracer& getInstance() {
+        static Tracer tracer;
+        return tracer;
+    }
+    void record(RequestTrace&, std::string_view, std::string_view) {}
+    std::string chromeTrace() { return "{\"traceEvents\":[]}"; }
+};
+
+#endif
+
+} // namespace trace
@@ -0,0 +1,179 @@
+#include "upstream.h"
+
+UpstreamGroup::UpstreamGroup(const std::vector<Endpoint>& endpoints, Balancing policy, const BreakerOptions& breaker) {
+    this->policy = policy;
+    for (size_t i = 0; i < endpoints.size(); i++) {
+        this->states.push_back(std::make_unique<State>(breaker));
+        this->states.back()->endpoint = endpoints[i];
+        if (policy == Balancing::ConsistentHash) {
+            std::string name = endpoints[i].host + ":" + std::to_string(endpoints[i].port);
+            for (int v = 0; v < NICEHTTP_HASH_VNODES; v++) {
+                this->ring.push_back({hash(name + "#" + std::to_string(v)), i});
+            }
+        }
+    }
+    std::sort(this->ring.begin(), this->ring.end());
+}
+
+int64_t UpstreamGroup::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t UpstreamGroup::hash(std::string_view s) {
+    // FNV-1a followed by a murmur finalizer to spread the ring points
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : s) {
+        h = (h ^ c) * 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+bool UpstreamGroup::available(size_t i, int64_t now) const {
+    return (this->states[i]->ejected_until.load(std::memory_order_relaxed) <= now) && !this->states[i]->breaker.isOpen();
+}
+
+size_t UpstreamGroup::pick(std::string_view key) {
+    return this->choose(key, {});
+}
+
+size_t UpstreamGroup::pick(std::string_view key, CircuitBreaker::Permit& permit) {
+    std::vector<bool> refused; // sized at the first refusal, breakers rarely refuse
+    for (;;) {
+        size_t i = this->choose(key, refused);
+        if (!refused.empty() && refused[i]) {
+            permit = {}; // every endpoint left refused
+            return i;
+        }
+        if ((permit = this->states[i]->breaker.allow())) {
+            return i;
+        }
+        refused.resize(this->states.size());
+        refused[i] = true;
+    }
+}
+
+size_t UpstreamGroup::choose(std::string_view key, const std::vector<bool>& skipped) {
+    size_t n = this->states.size();
+    if (n == 0) {
+        throw std::runtime_error("Empty upstream group");
+    }
+    int64_t t = now();
+    auto usable = [&](size_t i) { return skipped.empty() || !skipped[i]; };
+    bool all_ejected = true;
+    for (size_t i = 0; i < n; i++) {
+        if (usable(i) && this->available(i, t)) {
+            all_ejected = false;
+            break;
+        }
+    }
+    auto ok = [&](size_t i) { return usable(i) && (all_ejected || this->available(i, t)); };
+
+    switch (this->policy) {
+        case Balancing::LeastOutstanding: {
+            // start from a rotating offset so ties are spread evenly
+            size_t start = this->next.fetch_add(1, std::memory_order_relaxed);
+            size_t best = n;
+            for (size_t k = 0; k < n; k++) {
+                size_t i = (start + k) % n;
+                if (ok(i) && ((best == n) || (this->outstanding(i) < this->outstanding(best)))) {
+                    best = i;
+                }
+            }
+            // no endpoint left if the breakers or ejections changed since all_ejected was computed
+            return (best == n) ? start % n : best;
+        }
+        case Balancing::PowerOfTwoChoices: {
+            if (n == 1) {
+                return 0;
+            }
+            thread_local std::minstd_rand rng(std::random_device{}());
+            size_t a = rng() % n;
+            size_t b = (a + 1 + rng() % (n - 1)) % n;
+            if (!ok(a) || !ok(b)) {
+                // some endpoint is ejected: first available one starting from a
+                for (size_t k = 0; k < n; k++) {
+                    if (ok((a + k) % n)) {
+                        return (a + k) % n;
+                    }
+                }
+            }
+            // expected wait: latency multiplied by the requests queued in front of us
+            auto cost = [this](size_t i) {
+                return (this->outstanding(i) + 1) * std::max<int64_t>(this->states[i]->ewma.load(std::memory_order_relaxed), 1);
+            };
+            return (cost(a) <= cost(b)) ? a : b;
+        }
+        case Balancing::ConsistentHash: {
+            auto it = std::lower_bound(this->ring.begin(), this->ring.end(), std::make_pair(hash(key), size_t(0)));
+            for (size_t k = 0; k < this->ring.size(); k++, it++) {
+                if (it == this->ring.end()) {
+                    it = this->ring.begin();
+                }
+                if (ok(it->second)) {
+                    return it->second;
+                }
+            }
+            return 0;
+        }
+        case Balancing::RoundRobin:
+        default:
+            for (size_t k = 0; k < n; k++) {
+                size_t i = this->next.fetch_add(1, std::memory_order_relaxed) % n;
+                if (ok(i)) {
+                    return i;
+                }
+            }
+            return 0;
+    }
+}
+
+void UpstreamGroup::begin(size_t i) {
+    this->states[i]->outstanding.fetch_add(1, std::memory_order_relaxed);
+}
+
+void UpstreamGroup::end(size_t i, const CircuitBreaker::Permit& permit, bool success, std::chrono::microseconds latency) {
+    State& s = *this->states[i];
+    s.outstanding.fetch_sub(1, std::memory_order_relaxed);
+    s.breaker.record(permit, success, latency);
+    if (success) {
+        // EWMA with alpha = 1/8, concurrent updates may drop a sample which is fine
+        int64_t old = s.ewma.load(std::memory_order_relaxed);
+        int64_t sample = latency.count();
+        s.ewma.store((old == 0) ? sample : old + (sample - old) / 8, std::memory_order_relaxed);
+        s.failures.store(0, std::memory_order_relaxed);
+        s.ejections.store(0, std::memory_order_relaxed);
+        return;
+    }
+    if (s.failures.fetch_add(1, std::memory_order_relaxed) + 1 >= NICEHTTP_EJECT_FAILURES) {
+        s.failures.store(0, std::memory_order_relaxed);
+        int ejections = std::min(s.ejections.fetch_add(1, std::memory_order_relaxed) + 1, 10);
+        s.ejected_until.store(now() + int64_t(NICEHTTP_EJECT_TIME) * ejections * 1000000, std::memory_order_relaxed);
+    }
+}
+
+const Endpoint& UpstreamGroup::endpoint(size_t i) const {
+    return this->states[i]->endpoint;
+}
+
+CircuitBreaker& UpstreamGroup::breaker(size_t i) {
+    return this->states[i]->breaker;
+}
+
+size_t UpstreamGroup::size() const {
+    return this->states.size();
+}
+
+int UpstreamGroup::outstanding(size_t i) const {
+    return this->states[i]->outstanding.load(std::memory_order_relaxed);
+}
+
+std::chrono::microseconds UpstreamGroup::latency(size_t i) const {
+    return std::chrono::microseconds(this->states[i]->ewma.load(std::memory_order_relaxed));
+}
+
+bool UpstreamGroup::isEjected(size_t i) const {
+    return !this->available(i, now());
+}
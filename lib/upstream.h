@@ -0,0 +1,95 @@
+/*
+Copyright 2024 echo-devim
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided
+that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this list of conditions and
+    the following disclaimer. Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and thefollowing disclaimer in the documentation and/or other materials provided
+    with the distribution. Neither the name of the copyright holder nor the names of its contributors may
+    be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdexcept>
+#include "circuit_breaker.h"
+
+#define NICEHTTP_EJECT_FAILURES 5 // consecutive failures that eject an endpoint
+#define NICEHTTP_EJECT_TIME 5000  // base ejection time (ms), multiplied by the number of ejections
+#define NICEHTTP_HASH_VNODES 100  // points of every endpoint on the consistent hashing ring
+
+struct Endpoint {
+    std::string host;
+    short port;
+};
+
+enum class Balancing {
+    RoundRobin,
+    LeastOutstanding,  // endpoint with the fewest requests in flight
+    PowerOfTwoChoices, // best of two random endpoints, by in flight requests and latency
+    ConsistentHash     // same request key goes to the same endpoint (cache affinity)
+};
+
+class UpstreamGroup {
+    /* Replicas of the same service, used by NiceHTTP::request to pick
+     * the destination of each call.
+     * For every endpoint it tracks the requests in flight, an EWMA of the latency
+     * and the consecutive failures: after NICEHTTP_EJECT_FAILURES failures in a row
+     * the endpoint is ejected for a while. If every endpoint is ejected they are
+     * all used again, better than failing everything.
+     * Each endpoint also has a CircuitBreaker: endpoints with an open breaker,
+     * or half open with every probe in flight, are skipped, and requests fail
+     * fast if no endpoint is left.
+     * The bookkeeping uses only atomics, a group can be shared by many threads.
+     */
+public:
+    UpstreamGroup(const std::vector<Endpoint>& endpoints, Balancing policy = Balancing::RoundRobin, const BreakerOptions& breaker = {});
+    size_t pick(std::string_view key = ""); // index of the endpoint for the next request
+    // As pick(), admitted by the breaker of the endpoint: endpoints refusing it are left out and
+    // another one is picked, permit is false only if every endpoint refused
+    size_t pick(std::string_view key, CircuitBreaker::Permit& permit);
+    void begin(size_t i); // a request is sent to endpoint i
+    void end(size_t i, const CircuitBreaker::Permit& permit, bool success, std::chrono::microseconds latency); // the request allowed by permit completed
+    const Endpoint& endpoint(size_t i) const;
+    CircuitBreaker& breaker(size_t i);
+    size_t size() const;
+    int outstanding(size_t i) const;
+    std::chrono::microseconds latency(size_t i) const;
+    bool isEjected(size_t i) const;
+private:
+    struct alignas(64) State { // one cache line each, endpoints are updated by different threads
+        State(const BreakerOptions& opts) : breaker(opts) {}
+        Endpoint endpoint;
+        CircuitBreaker breaker;
+        std::atomic<int> outstanding{0};
+        std::atomic<int64_t> ewma{0}; // microseconds
+        std::atomic<int> failures{0};
+        std::atomic<int> ejections{0};
+        std::atomic<int64_t> ejected_until{0}; // steady clock nanoseconds
+    };
+    Balancing policy;
+    std::vector<std::unique_ptr<State>> states;
+    std::vector<std::pair<uint64_t, size_t>> ring; // consistent hashing ring: (hash, endpoint index)
+    std::atomic<size_t> next{0};
+    bool available(size_t i, int64_t now) const;
+    size_t choose(std::string_view key, const std::vector<bool>& skipped); // pick() without the skipped endpoints
+    static int64_t now();
+    static uint64_t hash(std::string_view s);
+};
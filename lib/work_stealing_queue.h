@@ -0,0 +1,298 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <vector>
+
+namespace dp {
+    namespace details {
+        // fixed instead of std::hardware_destructive_interference_size, whose value may
+        // change between compiler flags and so is not ABI stable
+        inline constexpr std::size_t cache_line_size = 64;
+    }  // namespace details
+
+    /**
+     * @brief Chase-Lev work stealing deque.
+     * @details The owner thread pushes and pops at the bottom (LIFO), any other thread can
+     * steal from the top (FIFO). No locks are taken: owner operations are plain loads and
+     * stores plus one fence, only the race for the last element and steals use a CAS.
+     * Items are stored by pointer so thieves never copy a value that the owner could be
+     * overwriting. The buffer grows when full; old buffers are kept until destruction
+     * because a thief may still be reading them.
+     * See "Correct and Efficient Work-Stealing for Weak Memory Models", Lê et al., 2013.
+     * @tparam T The value type.
+     */
+    template <typename T>
+    class chase_lev_deque {
+      public:
+        explicit chase_lev_deque(std::size_t capacity = 1024) {
+            std::size_t size = 1;
+            while (size < capacity) size <<= 1;
+            buffers_.push_back(std::make_unique<ring_buffer>(size));
+            buffer_.store(buffers_.back().get(), std::memory_order_relaxed);
+        }
+
+        ~chase_lev_deque() {
+            while (pop()) {
+            }
+        }
+
+        chase_lev_deque(const chase_lev_deque &) = delete;
+        chase_lev_deque &operator=(const chase_lev_deque &) = delete;
+
+        /// owner only
+        void push(T &&value) {
+            std::int64_t b = bottom_.load(std::memory_order_relaxed);
+            std::int64_t t = top_.load(std::memory_order_acquire);
+            ring_buffer *buffer = buffer_.load(std::memory_order_relaxed);
+            if (b - t > static_cast<std::int64_t>(buffer->mask)) {
+                buffer = grow(buffer, t, b);
+            }
+            buffer->put(b, new T(std::move(value)));
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom_.store(b + 1, std::memory_order_relaxed);
+        }
+
+        /// owner only
+        [[nodiscard]] std::optional<T> pop() {
+            std::int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+            ring_buffer *buffer = buffer_.load(std::memory_order_relaxed);
+            bottom_.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::int64_t t = top_.load(std::memory_order_relaxed);
+            if (t > b) {
+                // empty
+                bottom_.store(b + 1, std::memory_order_relaxed);
+                return std::nullopt;
+            }
+            T *item = buffer->get(b);
+            if (t == b) {
+                // last item: race against the thieves
+                if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                  std::memory_order_relaxed)) {
+                    item = nullptr;
+                }
+                bottom_.store(b + 1, std::memory_order_relaxed);
+            }
+            return take(item);
+        }
+
+        /// any thread
+        [[nodiscard]] std::optional<T> steal() {
+            std::int64_t t = top_.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::int64_t b = bottom_.load(std::memory_order_acquire);
+            if (t >= b) {
+                return std::nullopt;
+            }
+            T *item = buffer_.load(std::memory_order_acquire)->get(t);
+            if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                              std::memory_order_relaxed)) {
+                // lost the race with the owner or another thief
+                return std::nullopt;
+            }
+            return take(item);
+        }
+
+        [[nodiscard]] bool empty() const {
+            return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+        }
+
+      private:
+        struct ring_buffer {
+            explicit ring_buffer(std::size_t size)
+                : mask(size - 1), items(std::make_unique<std::atomic<T *>[]>(size)) {}
+            void put(std::int64_t i, T *item) {
+                items[i & mask].store(item, std::memory_order_relaxed);
+            }
+            T *get(std::int64_t i) const { return items[i & mask].load(std::memory_order_relaxed); }
+            std::size_t mask;
+            std::unique_ptr<std::atomic<T *>[]> items;
+        };
+
+        ring_buffer *grow(ring_buffer *old, std::int64_t t, std::int64_t b) {
+            auto bigger = std::make_unique<ring_buffer>((old->mask + 1) * 2);
+            for (std::int64_t i = t; i < b; ++i) {
+                bigger->put(i, old->get(i));
+            }
+            ring_buffer *buffer = bigger.get();
+            buffers_.push_back(std::move(bigger));
+            buffer_.store(buffer, std::memory_order_release);
+            return buffer;
+        }
+
+        static std::optional<T> take(T *item) {
+            if (item == nullptr) return std::nullopt;
+            std::optional<T> value(std::move(*item));
+            delete item;
+            return value;
+        }
+
+        alignas(details::cache_line_size) std::atomic<std::int64_t> top_{0};
+        alignas(details::cache_line_size) std::atomic<std::int64_t> bottom_{0};
+        alignas(details::cache_line_size) std::atomic<ring_buffer *> buffer_{nullptr};
+        std::vector<std::unique_ptr<ring_buffer>> buffers_;  // owner only
+    };
+
+    /**
+     * @brief Bounded multi-producer multi-consumer queue (D. Vyukov).
+     * @details Every cell carries a sequence number telling producers and consumers whose
+     * turn it is, so a push or a pop is one CAS on the shared index and no locks.
+     * @tparam T The value type.
+     */
+    template <typename T>
+    class mpmc_queue {
+      public:
+        explicit mpmc_queue(std::size_t capacity = 1024) {
+            std::size_t size = 1;
+            while (size < capacity) size <<= 1;
+            mask_ = size - 1;
+            cells_ = std::make_unique<cell[]>(size);
+            for (std::size_t i = 0; i < size; ++i) {
+                cells_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        ~mpmc_queue() {
+            while (pop()) {
+            }
+        }
+
+        mpmc_queue(const mpmc_queue &) = delete;
+        mpmc_queue &operator=(const mpmc_queue &) = delete;
+
+        /// @return false if the queue is full (value is left untouched)
+        [[nodiscard]] bool push(T &&value) {
+            std::size_t pos = tail_.load(std::memory_order_relaxed);
+            while (true) {
+                cell &c = cells_[pos & mask_];
+                std::size_t seq = c.sequence.load(std::memory_order_acquire);
+                auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+                if (diff == 0) {
+                    if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        new (c.storage) T(std::move(value));
+                        c.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = tail_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        [[nodiscard]] std::optional<T> pop() {
+            std::size_t pos = head_.load(std::memory_order_relaxed);
+            while (true) {
+                cell &c = cells_[pos & mask_];
+                std::size_t seq = c.sequence.load(std::memory_order_acquire);
+                auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+                if (diff == 0) {
+                    if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        T *item = std::launder(reinterpret_cast<T *>(c.storage));
+                        std::optional<T> value(std::move(*item));
+                        item->~T();
+                        c.sequence.store(pos + mask_ + 1, std::memory_order_release);
+                        return value;
+                    }
+                } else if (diff < 0) {
+                    return std::nullopt;
+                } else {
+                    pos = head_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        [[nodiscard]] bool empty() const {
+            return head_.load(std::memory_order_relaxed) >= tail_.load(std::memory_order_relaxed);
+        }
+
+      private:
+        struct cell {
+            std::atomic<std::size_t> sequence;
+            alignas(T) unsigned char storage[sizeof(T)];
+        };
+        std::size_t mask_;
+        std::unique_ptr<cell[]> cells_;
+        alignas(details::cache_line_size) std::atomic<std::size_t> head_{0};
+        alignas(details::cache_line_size) std::atomic<std::size_t> tail_{0};
+    };
+
+    /**
+     * @brief Lock-free task queue of a thread pool worker, drop-in for thread_safe_queue.
+     * @details Tasks pushed by the worker that owns the queue (see bind_owner()) go to a
+     * Chase-Lev deque, tasks pushed by other threads go to a bounded lock-free inbox.
+     * The owner pops its own tasks LIFO (hot in cache) before the inbox, thieves take
+     * the oldest tasks. If the inbox is full the task goes to a mutex protected overflow
+     * list, which is only looked at while it is not empty.
+     * @tparam T The value type.
+     */
+    template <typename T>
+    class work_stealing_queue {
+      public:
+        static constexpr bool is_lock_free = true;
+
+        explicit work_stealing_queue(std::size_t capacity = 1024)
+            : local_(capacity), inbox_(capacity) {}
+
+        /// mark the calling thread as the owner of this queue
+        void bind_owner() { owner() = this; }
+
+        void push_back(T &&value) {
+            if (owner() == this) {
+                local_.push(std::move(value));
+            } else if (!inbox_.push(std::move(value))) {
+                std::scoped_lock lock(overflow_mutex_);
+                overflow_.push_back(std::move(value));
+                overflow_size_.fetch_add(1, std::memory_order_release);
+            }
+        }
+
+        [[nodiscard]] std::optional<T> pop_front() {
+            if (owner() == this) {
+                if (auto task = local_.pop()) return task;
+            }
+            return pop_shared();
+        }
+
+        [[nodiscard]] std::optional<T> steal() {
+            if (auto task = local_.steal()) return task;
+            return pop_shared();
+        }
+
+        [[nodiscard]] bool empty() const {
+            return local_.empty() && inbox_.empty() &&
+                   overflow_size_.load(std::memory_order_acquire) == 0;
+        }
+
+      private:
+        std::optional<T> pop_shared() {
+            if (auto task = inbox_.pop()) return task;
+            if (overflow_size_.load(std::memory_order_acquire) == 0) return std::nullopt;
+            std::scoped_lock lock(overflow_mutex_);
+            if (overflow_.empty()) return std::nullopt;
+            std::optional<T> task(std::move(overflow_.front()));
+            overflow_.pop_front();
+            overflow_size_.fetch_sub(1, std::memory_order_relaxed);
+            return task;
+        }
+
+        static const void *&owner() {
+            thread_local const void *queue = nullptr;
+            return queue;
+        }
+
+        chase_lev_deque<T> local_;
+        mpmc_queue<T> inbox_;
+        std::atomic<std::size_t> overflow_size_{0};
+        std::mutex overflow_mutex_;
+        std::deque<T> overflow_;
+    };
+}  // namespace dp
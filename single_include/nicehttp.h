@@ -122,17 +122,330 @@ namespace dp {
     };
 }  // namespace dp
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <vector>
+
+namespace dp {
+    namespace details {
+        // fixed instead of std::hardware_destructive_interference_size, whose value may
+        // change between compiler flags and so is not ABI stable
+        inline constexpr std::size_t cache_line_size = 64;
+    }  // namespace details
+
+    /**
+     * @brief Chase-Lev work stealing deque.
+     * @details The owner thread pushes and pops at the bottom (LIFO), any other thread can
+     * steal from the top (FIFO). No locks are taken: owner operations are plain loads and
+     * stores plus one fence, only the race for the last element and steals use a CAS.
+     * Items are stored by pointer so thieves never copy a value that the owner could be
+     * overwriting. The buffer grows when full; old buffers are kept until destruction
+     * because a thief may still be reading them.
+     * See "Correct and Efficient Work-Stealing for Weak Memory Models", Lê et al., 2013.
+     * @tparam T The value type.
+     */
+    template <typename T>
+    class chase_lev_deque {
+      public:
+        explicit chase_lev_deque(std::size_t capacity = 1024) {
+            std::size_t size = 1;
+            while (size < capacity) size <<= 1;
+            buffers_.push_back(std::make_unique<ring_buffer>(size));
+            buffer_.store(buffers_.back().get(), std::memory_order_relaxed);
+        }
+
+        ~chase_lev_deque() {
+            while (pop()) {
+            }
+        }
+
+        chase_lev_deque(const chase_lev_deque &) = delete;
+        chase_lev_deque &operator=(const chase_lev_deque &) = delete;
+
+        /// owner only
+        void push(T &&value) {
+            std::int64_t b = bottom_.load(std::memory_order_relaxed);
+            std::int64_t t = top_.load(std::memory_order_acquire);
+            ring_buffer *buffer = buffer_.load(std::memory_order_relaxed);
+            if (b - t > static_cast<std::int64_t>(buffer->mask)) {
+                buffer = grow(buffer, t, b);
+            }
+            buffer->put(b, new T(std::move(value)));
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom_.store(b + 1, std::memory_order_relaxed);
+        }
+
+        /// owner only
+        [[nodiscard]] std::optional<T> pop() {
+            std::int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+            ring_buffer *buffer = buffer_.load(std::memory_order_relaxed);
+            bottom_.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::int64_t t = top_.load(std::memory_order_relaxed);
+            if (t > b) {
+                // empty
+                bottom_.store(b + 1, std::memory_order_relaxed);
+                return std::nullopt;
+            }
+            T *item = buffer->get(b);
+            if (t == b) {
+                // last item: race against the thieves
+                if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                  std::memory_order_relaxed)) {
+                    item = nullptr;
+                }
+                bottom_.store(b + 1, std::memory_order_relaxed);
+            }
+            return take(item);
+        }
+
+        /// any thread
+        [[nodiscard]] std::optional<T> steal() {
+            std::int64_t t = top_.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::int64_t b = bottom_.load(std::memory_order_acquire);
+            if (t >= b) {
+                return std::nullopt;
+            }
+            T *item = buffer_.load(std::memory_order_acquire)->get(t);
+            if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                              std::memory_order_relaxed)) {
+                // lost the race with the owner or another thief
+                return std::nullopt;
+            }
+            return take(item);
+        }
+
+        [[nodiscard]] bool empty() const {
+            return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+        }
+
+      private:
+        struct ring_buffer {
+            explicit ring_buffer(std::size_t size)
+                : mask(size - 1), items(std::make_unique<std::atomic<T *>[]>(size)) {}
+            void put(std::int64_t i, T *item) {
+                items[i & mask].store(item, std::memory_order_relaxed);
+            }
+            T *get(std::int64_t i) const { return items[i & mask].load(std::memory_order_relaxed); }
+            std::size_t mask;
+            std::unique_ptr<std::atomic<T *>[]> items;
+        };
+
+        ring_buffer *grow(ring_buffer *old, std::int64_t t, std::int64_t b) {
+            auto bigger = std::make_unique<ring_buffer>((old->mask + 1) * 2);
+            for (std::int64_t i = t; i < b; ++i) {
+                bigger->put(i, old->get(i));
+            }
+            ring_buffer *buffer = bigger.get();
+            buffers_.push_back(std::move(bigger));
+            buffer_.store(buffer, std::memory_order_release);
+            return buffer;
+        }
+
+        static std::optional<T> take(T *item) {
+            if (item == nullptr) return std::nullopt;
+            std::optional<T> value(std::move(*item));
+            delete item;
+            return value;
+        }
+
+        alignas(details::cache_line_size) std::atomic<std::int64_t> top_{0};
+        alignas(details::cache_line_size) std::atomic<std::int64_t> bottom_{0};
+        alignas(details::cache_line_size) std::atomic<ring_buffer *> buffer_{nullptr};
+        std::vector<std::unique_ptr<ring_buffer>> buffers_;  // owner only
+    };
+
+    /**
+     * @brief Bounded multi-producer multi-consumer queue (D. Vyukov).
+     * @details Every cell carries a sequence number telling producers and consumers whose
+     * turn it is, so a push or a pop is one CAS on the shared index and no locks.
+     * @tparam T The value type.
+     */
+    template <typename T>
+    class mpmc_queue {
+      public:
+        explicit mpmc_queue(std::size_t capacity = 1024) {
+            std::size_t size = 1;
+            while (size < capacity) size <<= 1;
+            mask_ = size - 1;
+            cells_ = std::make_unique<cell[]>(size);
+            for (std::size_t i = 0; i < size; ++i) {
+                cells_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        ~mpmc_queue() {
+            while (pop()) {
+            }
+        }
+
+        mpmc_queue(const mpmc_queue &) = delete;
+        mpmc_queue &operator=(const mpmc_queue &) = delete;
+
+        /// @return false if the queue is full (value is left untouched)
+        [[nodiscard]] bool push(T &&value) {
+            std::size_t pos = tail_.load(std::memory_order_relaxed);
+            while (true) {
+                cell &c = cells_[pos & mask_];
+                std::size_t seq = c.sequence.load(std::memory_order_acquire);
+                auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+                if (diff == 0) {
+                    if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        new (c.storage) T(std::move(value));
+                        c.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = tail_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        [[nodiscard]] std::optional<T> pop() {
+            std::size_t pos = head_.load(std::memory_order_relaxed);
+            while (true) {
+                cell &c = cells_[pos & mask_];
+                std::size_t seq = c.sequence.load(std::memory_order_acquire);
+                auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+                if (diff == 0) {
+                    if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        T *item = std::launder(reinterpret_cast<T *>(c.storage));
+                        std::optional<T> value(std::move(*item));
+                        item->~T();
+                        c.sequence.store(pos + mask_ + 1, std::memory_order_release);
+                        return value;
+                    }
+                } else if (diff < 0) {
+                    return std::nullopt;
+                } else {
+                    pos = head_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        [[nodiscard]] bool empty() const {
+            return head_.load(std::memory_order_relaxed) >= tail_.load(std::memory_order_relaxed);
+        }
+
+      private:
+        struct cell {
+            std::atomic<std::size_t> sequence;
+            alignas(T) unsigned char storage[sizeof(T)];
+        };
+        std::size_t mask_;
+        std::unique_ptr<cell[]> cells_;
+        alignas(details::cache_line_size) std::atomic<std::size_t> head_{0};
+        alignas(details::cache_line_size) std::atomic<std::size_t> tail_{0};
+    };
+
+    /**
+     * @brief Lock-free task queue of a thread pool worker, drop-in for thread_safe_queue.
+     * @details Tasks pushed by the worker that owns the queue (see bind_owner()) go to a
+     * Chase-Lev deque, tasks pushed by other threads go to a bounded lock-free inbox.
+     * The owner pops its own tasks LIFO (hot in cache) before the inbox, thieves take
+     * the oldest tasks. If the inbox is full the task goes to a mutex protected overflow
+     * list, which is only looked at while it is not empty.
+     * @tparam T The value type.
+     */
+    template <typename T>
+    class work_stealing_queue {
+      public:
+        static constexpr bool is_lock_free = true;
+
+        explicit work_stealing_queue(std::size_t capacity = 1024)
+            : local_(capacity), inbox_(capacity) {}
+
+        /// mark the calling thread as the owner of this queue
+        void bind_owner() { owner() = this; }
+
+        void push_back(T &&value) {
+            if (owner() == this) {
+                local_.push(std::move(value));
+            } else if (!inbox_.push(std::move(value))) {
+                std::scoped_lock lock(overflow_mutex_);
+                overflow_.push_back(std::move(value));
+                overflow_size_.fetch_add(1, std::memory_order_release);
+            }
+        }
+
+        [[nodiscard]] std::optional<T> pop_front() {
+            if (owner() == this) {
+                if (auto task = local_.pop()) return task;
+            }
+            return pop_shared();
+        }
+
+        [[nodiscard]] std::optional<T> steal() {
+            if (auto task = local_.steal()) return task;
+            return pop_shared();
+        }
+
+        [[nodiscard]] bool empty() const {
+            return local_.empty() && inbox_.empty() &&
+                   overflow_size_.load(std::memory_order_acquire) == 0;
+        }
+
+      private:
+        std::optional<T> pop_shared() {
+            if (auto task = inbox_.pop()) return task;
+            if (overflow_size_.load(std::memory_order_acquire) == 0) return std::nullopt;
+            std::scoped_lock lock(overflow_mutex_);
+            if (overflow_.empty()) return std::nullopt;
+            std::optional<T> task(std::move(overflow_.front()));
+            overflow_.pop_front();
+            overflow_size_.fetch_sub(1, std::memory_order_relaxed);
+            return task;
+        }
+
+        static const void *&owner() {
+            thread_local const void *queue = nullptr;
+            return queue;
+        }
+
+        chase_lev_deque<T> local_;
+        mpmc_queue<T> inbox_;
+        std::atomic<std::size_t> overflow_size_{0};
+        std::mutex overflow_mutex_;
+        std::deque<T> overflow_;
+    };
+}  // namespace dp
+
 // External dependency from: https://github.com/DeveloperPaul123/thread-pool/blob/0.6.2/
+
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <barrier>
+#include <bit>
+#include <chrono>
 #include <concepts>
+#include <condition_variable>
+#include <cstdint>
 #include <deque>
+#include <filesystem>
 #include <functional>
 #include <future>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <semaphore>
+#include <stdexcept>
+#include <string>
 #include <thread>
 #include <type_traits>
+#include <vector>
+#ifdef __linux__
+#    include <sched.h>
+#endif
 #ifdef __has_include
 #    if __has_include(<version>)
 #        include <version>
@@ -147,74 +460,245 @@ namespace dp {
 #else
         using default_function_type = std::function<void()>;
 #endif
+
+        /// cpus this process is allowed to run on
+        inline std::vector<unsigned int> allowed_cpus() {
+            std::vector<unsigned int> cpus;
+#ifdef __linux__
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+                for (unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                    if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+                }
+            }
+#endif
+            if (cpus.empty()) {
+                for (unsigned int cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency());
+                     ++cpu) {
+                    cpus.push_back(cpu);
+                }
+            }
+            return cpus;
+        }
+
+        /// NUMA node of a cpu (0 when the topology is unknown)
+        inline int numa_node(unsigned int cpu) {
+#ifdef __linux__
+            try {
+                // the node is exposed as a "nodeN" link in the cpu directory
+                for (const auto &entry : std::filesystem::directory_iterator(
+                         "/sys/devices/system/cpu/cpu" + std::to_string(cpu))) {
+                    const std::string name = entry.path().filename().string();
+                    if (name.size() > 4 && name.starts_with("node") &&
+                        name.find_first_not_of("0123456789", 4) == std::string::npos) {
+                        return std::stoi(name.substr(4));
+                    }
+                }
+            } catch (...) {
+            }
+#endif
+            return 0;
+        }
+
+        /// hint to the cpu that we are busy waiting
+        inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+            asm volatile("yield");
+#endif
+        }
+
+        /// one task every wait_sample_rate is timed from enqueue to start
+        inline constexpr unsigned int wait_sample_rate = 64;
+
+        /// pin the calling thread to a cpu, best effort
+        inline void pin_current_thread([[maybe_unused]] unsigned int cpu) {
+#ifdef __linux__
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            sched_setaffinity(0, sizeof(set), &set);
+#endif
+        }
     }  // namespace details
 
+    /**
+     * @brief Placement of the thread pool workers on the cpus.
+     * @details none leaves the scheduler free to move the workers; compact pins the workers
+     * filling one NUMA node after the other; scatter pins them round robin across the nodes.
+     * Pinning is only implemented on Linux and ignored elsewhere.
+     */
+    enum class worker_affinity { none, compact, scatter };
+
+    /**
+     * @brief How an idle worker waits for the next task.
+     * @details The worker spins (with the cpu pause instruction) for up to spin, then
+     * yields its time slice for up to yield, then parks on a semaphore. Spinning trades idle
+     * cpu time for the futex wake up and the context switch of a parked worker.
+     * The default parks immediately.
+     */
+    struct wait_strategy {
+        std::chrono::nanoseconds spin{0};
+        std::chrono::nanoseconds yield{0};
+    };
+
+    /// bounds of an elastic thread pool, see thread_pool::thread_pool(const elastic_size &)
+    struct elastic_size {
+        unsigned int min_threads = 1;
+        unsigned int max_threads = std::thread::hardware_concurrency();
+        std::chrono::milliseconds grow_after{100};     // age of a queued task that adds a worker
+        std::chrono::milliseconds idle_timeout{30000};  // idle time that stops a worker
+    };
+
+    /// how the workers found their tasks, see thread_pool::wait_stats()
+    struct wait_statistics {
+        std::uint64_t spin_hits = 0;   // woken while spinning
+        std::uint64_t yield_hits = 0;  // woken while yielding
+        std::uint64_t parks = 0;       // had to sleep
+    };
+
+    /// counters of a single worker, see thread_pool::stats()
+    struct worker_statistics {
+        bool active = false;  // a thread runs on this slot (always true unless elastic)
+        std::uint64_t executed = 0;       // tasks run, stolen ones included
+        std::uint64_t stolen = 0;         // tasks taken from other workers
+        std::uint64_t failed_steals = 0;  // steal attempts that found nothing
+        std::uint64_t spin_hits = 0;
+        std::uint64_t yield_hits = 0;
+        std::uint64_t parks = 0;
+        std::uint64_t unparks = 0;  // woken after sleeping
+        std::uint64_t busy_ns = 0;  // time spent from wake up to idle again
+    };
+
+    /**
+     * @brief Point in time view of a thread pool, see thread_pool::stats().
+     * @details Counters are read one by one while the pool runs: they are consistent
+     * individually, not with each other.
+     */
+    struct pool_statistics {
+        std::size_t size = 0;       // running workers
+        std::int64_t pending = 0;   // tasks enqueued and not started
+        std::vector<worker_statistics> workers;
+        /// sampled delays between enqueue and start, bucket i counts [2^i, 2^(i+1)) ns
+        std::array<std::uint64_t, 64> wait_histogram{};
+
+        /// upper bound (ns) of the sampled enqueue to start delay at percentile p (0-100)
+        [[nodiscard]] std::uint64_t wait_percentile(double p) const {
+            std::uint64_t total = 0;
+            for (const auto count : wait_histogram) total += count;
+            if (total == 0) return 0;
+            const auto rank = static_cast<std::uint64_t>(p / 100.0 * static_cast<double>(total));
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < wait_histogram.size(); ++i) {
+                seen += wait_histogram[i];
+                if (seen > rank || seen == total) return i >= 63 ? UINT64_MAX : (2ull << i) - 1;
+            }
+            return UINT64_MAX;
+        }
+    };
+
+    /**
+     * @brief Queue usable as per worker task queue of the thread pool.
+     * @details dp::thread_safe_queue (mutex) and dp::work_stealing_queue (lock-free) qualify.
+     */
+    template <typename Queue, typename T>
+    concept task_queue = std::default_initializable<Queue> && requires(Queue &queue, T &&task) {
+        queue.push_back(std::move(task));
+        { queue.pop_front() } -> std::same_as<std::optional<T>>;
+        { queue.steal() } -> std::same_as<std::optional<T>>;
+    };
+
     template <typename FunctionType = details::default_function_type,
-              typename ThreadType = std::jthread>
+              typename ThreadType = std::jthread,
+              typename QueueType = dp::thread_safe_queue<FunctionType>>
         requires std::invocable<FunctionType> &&
-                 std::is_same_v<void, std::invoke_result_t<FunctionType>>
+                 std::is_same_v<void, std::invoke_result_t<FunctionType>> &&
+                 task_queue<QueueType, FunctionType>
     class thread_pool {
       public:
         explicit thread_pool(
-            const unsigned int &number_of_threads = std::thread::hardware_concurrency())
-            : tasks_(number_of_threads) {
+            const unsigned int &number_of_threads = std::thread::hardware_concurrency(),
+            worker_affinity affinity = worker_affinity::none, wait_strategy wait = {})
+            : tasks_(number_of_threads), wait_(wait) {
+            placement_ = place_workers(number_of_threads, affinity);
+            affinity_ = affinity;
             std::size_t current_id = 0;
             for (std::size_t i = 0; i < number_of_threads; ++i) {
                 priority_queue_.push_back(size_t(current_id));
                 try {
-                    threads_.emplace_back([&, id = current_id](const std::stop_token &stop_tok) {
-                        do {
-                            // wait until signaled
-                            tasks_[id].signal.acquire();
-
-                            do {
-                                // invoke the task
-                                while (auto task = tasks_[id].tasks.pop_front()) {
-                                    try {
-                                        pending_tasks_.fetch_sub(1, std::memory_order_release);
-                                        std::invoke(std::move(task.value()));
-                                    } catch (...) {
-                                    }
-                                }
-
-                                // try to steal a task
-                                for (std::size_t j = 1; j < tasks_.size(); ++j) {
-                                    const std::size_t index = (id + j) % tasks_.size();
-                                    if (auto task = tasks_[index].tasks.steal()) {
-                                        // steal a task
-                                        pending_tasks_.fetch_sub(1, std::memory_order_release);
-                                        std::invoke(std::move(task.value()));
-                                        // stop stealing once we have invoked a stolen task
-                                        break;
-                                    }
-                                }
-
-                            } while (pending_tasks_.load(std::memory_order_acquire) > 0);
-
-                            priority_queue_.rotate_to_front(id);
-
-                        } while (!stop_tok.stop_requested());
-                    });
+                    threads_.push_back(make_worker(current_id));
                     // increment the thread id
                     ++current_id;
 
                 } catch (...) {
                     // catch all
 
-                    // remove one item from the tasks
-                    tasks_.pop_back();
-
                     // remove our thread from the priority queue
                     std::ignore = priority_queue_.pop_back();
                 }
             }
+            // remove the items of the threads that could not be created
+            tasks_.resize(threads_.size());
+            active_workers_.store(threads_.size(), std::memory_order_relaxed);
+            wait_until_ready(threads_.size());
+            set_steal_order();
+        }
+
+        /**
+         * @brief Create an elastic thread pool.
+         * @details The pool starts with size.min_threads workers. When a queued task waited
+         * longer than size.grow_after (for example because all the workers are blocked in
+         * their tasks) a worker is added, one per size.grow_after, up to size.max_threads.
+         * Workers idle for longer than size.idle_timeout stop, down to size.min_threads.
+         */
+        explicit thread_pool(const elastic_size &size,
+                             worker_affinity affinity = worker_affinity::none,
+                             wait_strategy wait = {})
+            : tasks_(std::max(1u, size.max_threads)),
+              wait_(wait),
+              elastic_(true),
+              min_threads_(std::clamp(size.min_threads, 1u, std::max(1u, size.max_threads))),
+              idle_timeout_(size.idle_timeout) {
+            placement_ = place_workers(tasks_.size(), affinity);
+            affinity_ = affinity;
+            threads_.resize(tasks_.size());
+            std::size_t started = 0;
+            for (std::size_t id = 0; id < tasks_.size(); ++id) {
+                if (id >= min_threads_) {
+                    // slot for a worker added later
+                    tasks_[id] = std::make_unique<task_item>();
+                    tasks_[id]->active.store(false, std::memory_order_relaxed);
+                    continue;
+                }
+                try {
+                    threads_[id] = make_worker(id);
+                    ++started;
+                } catch (...) {
+                    tasks_[id] = std::make_unique<task_item>();
+                    tasks_[id]->active.store(false, std::memory_order_relaxed);
+                }
+            }
+            active_workers_.store(started, std::memory_order_relaxed);
+            wait_until_ready(started);
+            set_steal_order();
+            supervisor_ = std::jthread(
+                [this, grow_after = size.grow_after](const std::stop_token &stop_tok) {
+                    supervise(grow_after, stop_tok);
+                });
         }
 
         ~thread_pool() {
+            if (supervisor_.joinable()) {
+                supervisor_.request_stop();
+                supervisor_.join();
+            }
             // stop all threads
             for (std::size_t i = 0; i < threads_.size(); ++i) {
+                if (!threads_[i].joinable()) continue;
                 threads_[i].request_stop();
-                tasks_[i].signal.release();
+                tasks_[i]->signal.release();
                 threads_[i].join();
             }
         }
@@ -254,7 +738,7 @@ namespace dp {
                     promise.set_exception(std::current_exception());
                 }
             };
-            enqueue_task(std::move(task));
+            enqueue_sampled(std::move(task));
             return future;
 #else
             /*
@@ -286,7 +770,7 @@ namespace dp {
             // get the future before enqueuing the task
             auto future = shared_promise->get_future();
             // enqueue the task
-            enqueue_task(std::move(task));
+            enqueue_sampled(std::move(task));
             return future;
 #endif
         }
@@ -302,7 +786,7 @@ namespace dp {
             requires std::invocable<Function, Args...> &&
                      std::is_same_v<void, std::invoke_result_t<Function &&, Args &&...>>
         void enqueue_detach(Function &&func, Args &&...args) {
-            enqueue_task(
+            enqueue_sampled(
                 std::move([f = std::forward<Function>(func),
                            ... largs = std::forward<Args>(args)]() mutable -> decltype(auto) {
                     // suppress exceptions
@@ -313,489 +797,6460 @@ namespace dp {
                 }));
         }
 
-        [[nodiscard]] auto size() const { return threads_.size(); }
+        /// number of running workers
+        [[nodiscard]] auto size() const { return active_workers_.load(std::memory_order_relaxed); }
 
-      private:
-        template <typename Function>
-        void enqueue_task(Function &&f) {
-            auto i_opt = priority_queue_.copy_front_and_rotate_to_back();
-            if (!i_opt.has_value()) {
-                // would only be a problem if there are zero threads
-                return;
+        /// how often idle workers were woken while spinning, while yielding or parked
+        [[nodiscard]] wait_statistics wait_stats() const {
+            wait_statistics stats;
+            for (const auto &item : tasks_) {
+                stats.spin_hits += item->spin_hits.load(std::memory_order_relaxed);
+                stats.yield_hits += item->yield_hits.load(std::memory_order_relaxed);
+                stats.parks += item->parks.load(std::memory_order_relaxed);
             }
-            auto i = *(i_opt);
-            pending_tasks_.fetch_add(1, std::memory_order_relaxed);
-            tasks_[i].tasks.push_back(std::forward<Function>(f));
-            tasks_[i].signal.release();
+            return stats;
+        }
+
+        /// snapshot of the per worker counters, readable while the pool runs
+        [[nodiscard]] pool_statistics stats() const {
+            pool_statistics stats;
+            stats.size = size();
+            stats.pending = pending_tasks_.load(std::memory_order_relaxed);
+            for (const auto &item : tasks_) {
+                worker_statistics worker;
+                worker.active = item->active.load(std::memory_order_relaxed);
+                worker.executed = item->executed.load(std::memory_order_relaxed);
+                worker.stolen = item->stolen.load(std::memory_order_relaxed);
+                worker.failed_steals = item->failed_steals.load(std::memory_order_relaxed);
+                worker.spin_hits = item->spin_hits.load(std::memory_order_relaxed);
+                worker.yield_hits = item->yield_hits.load(std::memory_order_relaxed);
+                worker.parks = item->parks.load(std::memory_order_relaxed);
+                worker.unparks = item->unparks.load(std::memory_order_relaxed);
+                worker.busy_ns = item->busy_ns.load(std::memory_order_relaxed);
+                stats.workers.push_back(worker);
+                for (std::size_t i = 0; i < stats.wait_histogram.size(); ++i) {
+                    stats.wait_histogram[i] += item->wait_histogram[i].load(std::memory_order_relaxed);
+                }
+            }
+            return stats;
         }
 
-        struct task_item {
-            dp::thread_safe_queue<FunctionType> tasks{};
+      private:
+        /// per worker state, on its own cache lines
+        struct alignas(details::cache_line_size) task_item {
+            QueueType tasks{};
             std::binary_semaphore signal{0};
+            std::vector<std::size_t> victims;  // steal order
+            std::atomic_bool active{true};      // a worker runs on this slot (elastic pool)
+            std::atomic_size_t users{0};        // submitters pushing to this slot (elastic pool)
+            std::atomic_bool exited{false};     // the retired worker left work(), join() won't wait
+            // written by the owner only, see bump()
+            std::atomic_uint64_t executed{0};
+            std::atomic_uint64_t stolen{0};
+            std::atomic_uint64_t failed_steals{0};
+            std::atomic_uint64_t spin_hits{0};
+            std::atomic_uint64_t yield_hits{0};
+            std::atomic_uint64_t parks{0};
+            std::atomic_uint64_t unparks{0};
+            std::atomic_uint64_t busy_ns{0};
+            std::array<std::atomic_uint64_t, 64> wait_histogram{};
         };
 
-        std::vector<ThreadType> threads_;
-        std::deque<task_item> tasks_;
-        dp::thread_safe_queue<std::size_t> priority_queue_;
-        std::atomic_int_fast64_t pending_tasks_{};
-    };
+        /// single writer counter increment: no read-modify-write needed
+        static void bump(std::atomic_uint64_t &counter, std::uint64_t n = 1) {
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
 
-    /**
-     * @example mandelbrot/source/main.cpp
-     * Example showing how to use thread pool with tasks that return a value. Outputs a PPM image of
-     * a mandelbrot.
-     */
-}  // namespace dp
+        /// wrap one task every wait_sample_rate to time its enqueue to start delay
+        template <typename Function>
+        void enqueue_sampled(Function &&f) {
+            thread_local unsigned int tick = 0;
+            if (++tick % details::wait_sample_rate != 0) {
+                enqueue_task(std::forward<Function>(f));
+                return;
+            }
+            enqueue_task([this, f = std::forward<Function>(f),
+                          enqueued = std::chrono::steady_clock::now()]() mutable {
+                const auto delay = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                       std::chrono::steady_clock::now() - enqueued)
+                                       .count();
+                const auto bucket = std::bit_width(static_cast<std::uint64_t>(std::max<std::int64_t>(delay, 1))) - 1;
+                bump(tasks_[current_worker().second]->wait_histogram[bucket]);
+                std::invoke(f);
+            });
+        }
 
+        static constexpr bool lock_free_submission = requires { QueueType::is_lock_free; };
 
+        /// pool and index of the worker running on the calling thread, if any
+        static std::pair<const thread_pool *, std::size_t> &current_worker() {
+            thread_local std::pair<const thread_pool *, std::size_t> worker{nullptr, 0};
+            return worker;
+        }
 
-#include <string_view>
-#include <map>
-#include <format>
-#include <ranges>
-#include <string>
-#include <iostream>
-#include <algorithm>
-#define PROTO_HTTP1 "HTTP/1.1"
+        template <typename Function>
+        void enqueue_task(Function &&f) {
+            if (elastic_) {
+                enqueue_elastic(std::forward<Function>(f));
+            } else if constexpr (lock_free_submission) {
+                if (tasks_.empty()) {
+                    return;
+                }
+                const std::size_t wake =
+                    next_worker_.fetch_add(1, std::memory_order_relaxed) % tasks_.size();
+                // tasks submitted by one of our workers stay in its own deque, the woken
+                // worker steals them from there
+                const std::size_t i =
+                    current_worker().first == this ? current_worker().second : wake;
+                pending_tasks_.fetch_add(1, std::memory_order_relaxed);
+                tasks_[i]->tasks.push_back(std::forward<Function>(f));
+                tasks_[wake]->signal.release();
+            } else {
+                auto i_opt = priority_queue_.copy_front_and_rotate_to_back();
+                if (!i_opt.has_value()) {
+                    // would only be a problem if there are zero threads
+                    return;
+                }
+                auto i = *(i_opt);
+                pending_tasks_.fetch_add(1, std::memory_order_relaxed);
+                tasks_[i]->tasks.push_back(std::forward<Function>(f));
+                tasks_[i]->signal.release();
+            }
+        }
 
-namespace http {
+        /**
+         * @brief Round robin over the running workers of an elastic pool.
+         * @details A submitter announces itself on the slot (users) before checking that the
+         * worker is still active, a retiring worker clears active and then waits for the
+         * users to leave: a task is never pushed to a queue that nobody drains.
+         * Throws std::runtime_error if no worker runs (none could be started).
+         */
+        template <typename Function>
+        void enqueue_elastic(Function &&f) {
+            pending_tasks_.fetch_add(1, std::memory_order_relaxed);
+            enqueued_tasks_.fetch_add(1, std::memory_order_relaxed);
+            const bool local = lock_free_submission && current_worker().first == this;
+            if (local) {
+                // submitted by a running worker, which cannot retire before running the task;
+                // still wake another worker to steal it
+                tasks_[current_worker().second]->tasks.push_back(std::forward<Function>(f));
+            }
+            for (std::size_t tried = 1;; ++tried) {
+                task_item &item =
+                    *tasks_[next_worker_.fetch_add(1, std::memory_order_relaxed) % tasks_.size()];
+                if (!item.active.load(std::memory_order_relaxed)) {
+                    // a worker sets active before it is counted, so no active slot and no
+                    // worker counted means there is nobody to run the task
+                    if ((tried % tasks_.size() == 0) &&
+                        (active_workers_.load(std::memory_order_acquire) == 0)) {
+                        pending_tasks_.fetch_sub(1, std::memory_order_relaxed);
+                        enqueued_tasks_.fetch_sub(1, std::memory_order_relaxed);
+                        throw std::runtime_error("thread_pool: no worker is running");
+                    }
+                    continue;
+                }
+                item.users.fetch_add(1, std::memory_order_seq_cst);
+                if (item.active.load(std::memory_order_seq_cst)) {
+                    if (!local) {
+                        item.tasks.push_back(std::forward<Function>(f));
+                    }
+                    item.signal.release();
+                    item.users.fetch_sub(1, std::memory_order_release);
+                    return;
+                }
+                item.users.fetch_sub(1, std::memory_order_release);
+            }
+        }
 
-// Common http message (could be request or response)
-class Message { // base class
-public:
-    std::string proto;
-    std::map<std::string,std::string> headers;
-    std::string body;
-    bool is_json = false;
-    size_t content_length = 0;
-    Message() {}
-    void parseHeaders(const std::string& headerstr);
-};
+        ThreadType make_worker(std::size_t id) {
+            return ThreadType([this, id](const std::stop_token &stop_tok) { work(id, stop_tok); });
+        }
 
+        void work(const std::size_t id, const std::stop_token &stop_tok) {
+            if (affinity_ != worker_affinity::none) {
+                details::pin_current_thread(placement_[id].first);
+            }
+            if (tasks_[id] == nullptr) {
+                // allocated by the worker itself, so that the memory is local to its node
+                tasks_[id] = std::make_unique<task_item>();
+                ready_.fetch_add(1, std::memory_order_release);
+                ready_.notify_all();
+            }
+            task_item &item = *tasks_[id];
 
-class Request : public Message {
-public:
-    std::string method;
-    std::string uri;
-    Request() {}
-    Request(std::string &head, std::string &body);
-    Request(std::string method, std::string uri, std::string proto, std::map<std::string,std::string> headers, bool is_json, size_t content_length, std::string body = "");
-    Request(const Request& hr);
-    std::string toString(bool carriage_return = true);
-    Request& operator=(const Request& other);
-};
+            current_worker() = {this, id};
+            if constexpr (requires { item.tasks.bind_owner(); }) {
+                // tasks enqueued by this worker go to its own lock-free deque
+                item.tasks.bind_owner();
+            }
+            do {
+                // wait until signaled
+                if (!wait_for_task(item)) {
+                    // idle for too long
+                    if (retire(item)) {
+                        item.exited.store(true, std::memory_order_release);
+                        return;
+                    }
+                    continue;
+                }
 
-class Response : public Message {
-public:
-    short code;
-    std::string message;
-    Response() {}
-    Response(std::string &head, std::string &body);
-    Response(short code, std::string message, std::string proto, std::map<std::string,std::string> headers, bool is_json, size_t content_length, std::string body = "");
-    Response(const Response& r);
-    std::string toString(bool carriage_return = true);
-    Response& operator=(const Response& other);
-};
+                const auto busy_since = std::chrono::steady_clock::now();
+                do {
+                    // invoke the task
+                    while (auto task = item.tasks.pop_front()) {
+                        try {
+                            pending_tasks_.fetch_sub(1, std::memory_order_release);
+                            bump(item.executed);
+                            std::invoke(std::move(task.value()));
+                        } catch (...) {
+                        }
+                    }
 
-};
+                    // try to steal a task
+                    for (const std::size_t index : item.victims) {
+                        if (!tasks_[index]->active.load(std::memory_order_relaxed)) continue;
+                        if (auto task = tasks_[index]->tasks.steal()) {
+                            // steal a task
+                            pending_tasks_.fetch_sub(1, std::memory_order_release);
+                            bump(item.executed);
+                            bump(item.stolen);
+                            std::invoke(std::move(task.value()));
+                            // stop stealing once we have invoked a stolen task
+                            break;
+                        }
+                        bump(item.failed_steals);
+                    }
 
-#include <set>
-#include <functional>
-#include <string_view>
-#include <iostream>
-#include <regex>
+                } while (pending_tasks_.load(std::memory_order_acquire) > 0);
+                bump(item.busy_ns, static_cast<std::uint64_t>(
+                                       std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                           std::chrono::steady_clock::now() - busy_since)
+                                           .count()));
 
-class Route {
-    /*
-    * This class handle a single request calling the specified callback function.
-    * Supports authentication token passed through "Authentication" header.
-    * Doesn't support parameter parsing.
-    */
-private:
-    std::function<http::Response(const http::Request &req)> func;
+                if constexpr (!lock_free_submission) {
+                    if (!elastic_) {
+                        priority_queue_.rotate_to_front(id);
+                    }
+                }
+
+            } while (!stop_tok.stop_requested());
+        }
+
+        /// stop an idle worker of an elastic pool if there are more than the minimum
+        bool retire(task_item &item) {
+            auto active = active_workers_.load(std::memory_order_relaxed);
+            do {
+                if (active <= min_threads_) return false;
+            } while (!active_workers_.compare_exchange_weak(active, active - 1,
+                                                            std::memory_order_relaxed));
+            item.active.store(false, std::memory_order_seq_cst);
+            while (item.users.load(std::memory_order_seq_cst) > 0) {
+                details::cpu_relax();
+            }
+            // run what was pushed before we left
+            while (auto task = item.tasks.pop_front()) {
+                try {
+                    pending_tasks_.fetch_sub(1, std::memory_order_release);
+                    bump(item.executed);
+                    std::invoke(std::move(task.value()));
+                } catch (...) {
+                }
+            }
+            return true;
+        }
+
+        /**
+         * @brief Add workers to an elastic pool while queued tasks wait too long.
+         * @details Tasks are not time stamped: when the tasks started since a mark do not
+         * cover the tasks that were enqueued before it, one of those is older than the mark.
+         */
+        void supervise(std::chrono::milliseconds grow_after, const std::stop_token &stop_tok) {
+            using clock = std::chrono::steady_clock;
+            const auto tick = std::max(std::chrono::milliseconds(1), grow_after / 4);
+            std::mutex mutex;
+            std::condition_variable_any sleep;
+            auto mark_time = clock::now();
+            auto mark_enqueued = enqueued_tasks_.load(std::memory_order_relaxed);
+            while (!stop_tok.stop_requested()) {
+                {
+                    std::unique_lock lock(mutex);
+                    sleep.wait_for(lock, stop_tok, tick, [] { return false; });
+                }
+                const auto enqueued = enqueued_tasks_.load(std::memory_order_relaxed);
+                const auto started =
+                    enqueued - static_cast<std::uint64_t>(
+                                   std::max<std::int_fast64_t>(0, pending_tasks_.load()));
+                if (started >= mark_enqueued) {
+                    mark_time = clock::now();
+                    mark_enqueued = enqueued;
+                } else if (clock::now() - mark_time >= grow_after) {
+                    // one worker per grow_after: the new one needs time to drain the backlog
+                    if (grow()) {
+                        mark_time = clock::now();
+                    }
+                }
+            }
+        }
+
+        /// start a worker in a free slot of an elastic pool, false if none could be started
+        bool grow() {
+            for (std::size_t id = 0; id < tasks_.size(); ++id) {
+                task_item &item = *tasks_[id];
+                if (item.active.load(std::memory_order_acquire)) continue;
+                if (threads_[id].joinable()) {
+                    // retired: the slot is reused once the thread has drained its queue and
+                    // left, the supervisor never waits for the tasks it is running
+                    if (!item.exited.load(std::memory_order_acquire)) continue;
+                    threads_[id].join();
+                }
+                item.exited.store(false, std::memory_order_relaxed);
+                item.active.store(true, std::memory_order_seq_cst);
+                active_workers_.fetch_add(1, std::memory_order_relaxed);
+                try {
+                    threads_[id] = make_worker(id);
+                } catch (...) {
+                    item.active.store(false, std::memory_order_seq_cst);
+                    active_workers_.fetch_sub(1, std::memory_order_relaxed);
+                    return false;
+                }
+                // wake it at once: the waiting tasks are in the queues of the busy workers,
+                // it steals them instead of waiting for new submissions
+                item.signal.release();
+                return true;
+            }
+            return false;
+        }
+
+        void wait_until_ready(std::size_t workers) {
+            // wait for the workers to allocate their items
+            for (auto ready = ready_.load(std::memory_order_acquire); ready < workers;
+                 ready = ready_.load(std::memory_order_acquire)) {
+                ready_.wait(ready, std::memory_order_acquire);
+            }
+        }
+
+        void set_steal_order() {
+            // steal from the workers of the same NUMA node first
+            for (std::size_t id = 0; id < tasks_.size(); ++id) {
+                tasks_[id]->victims.clear();
+                for (int same_node = 1; same_node >= 0; --same_node) {
+                    for (std::size_t j = 1; j < tasks_.size(); ++j) {
+                        const std::size_t index = (id + j) % tasks_.size();
+                        if ((placement_[index].second == placement_[id].second) ==
+                            bool(same_node)) {
+                            tasks_[id]->victims.push_back(index);
+                        }
+                    }
+                }
+            }
+        }
+
+        /// cpu and NUMA node of every worker
+        static std::vector<std::pair<unsigned int, int>> place_workers(std::size_t count,
+                                                                        worker_affinity affinity) {
+            std::vector<std::pair<unsigned int, int>> placement(count, {0, 0});
+            if (affinity == worker_affinity::none || count == 0) {
+                return placement;
+            }
+            std::map<int, std::vector<unsigned int>> nodes;
+            for (const unsigned int cpu : details::allowed_cpus()) {
+                nodes[details::numa_node(cpu)].push_back(cpu);
+            }
+            std::vector<std::pair<unsigned int, int>> cpus;  // in placement order
+            if (affinity == worker_affinity::compact) {
+                for (const auto &[node, node_cpus] : nodes) {
+                    for (const unsigned int cpu : node_cpus) cpus.emplace_back(cpu, node);
+                }
+            } else {
+                for (std::size_t i = 0; cpus.size() < count; ++i) {
+                    for (const auto &[node, node_cpus] : nodes) {
+                        if (cpus.size() < count) {
+                            cpus.emplace_back(node_cpus[i % node_cpus.size()], node);
+                        }
+                    }
+                }
+            }
+            for (std::size_t i = 0; i < count; ++i) {
+                placement[i] = cpus[i % cpus.size()];
+            }
+            return placement;
+        }
+
+        /**
+         * @brief Spin, then yield, then park until the worker is signaled.
+         * @return false if a worker of an elastic pool stayed idle for the idle timeout.
+         */
+        bool wait_for_task(task_item &item) {
+            using clock = std::chrono::steady_clock;
+            const auto count = [](std::atomic_uint64_t &counter) { bump(counter); };
+            if (wait_.spin.count() > 0 || wait_.yield.count() > 0) {
+                const auto start = clock::now();
+                // reading the clock is slower than a pause, look at it every 64 rounds
+                for (unsigned int round = 1;; ++round) {
+                    if (item.signal.try_acquire()) {
+                        count(item.spin_hits);
+                        return true;
+                    }
+                    details::cpu_relax();
+                    if (round % 64 == 0 && clock::now() - start >= wait_.spin) break;
+                }
+                while (clock::now() - start < wait_.spin + wait_.yield) {
+                    if (item.signal.try_acquire()) {
+                        count(item.yield_hits);
+                        return true;
+                    }
+                    std::this_thread::yield();
+                }
+            }
+            count(item.parks);
+            if (elastic_) {
+                if (!item.signal.try_acquire_for(idle_timeout_)) return false;
+            } else {
+                item.signal.acquire();
+            }
+            count(item.unparks);
+            return true;
+        }
+
+        std::vector<ThreadType> threads_;
+        std::vector<std::unique_ptr<task_item>> tasks_;
+        dp::thread_safe_queue<std::size_t> priority_queue_;
+        std::atomic_size_t ready_{};  // workers that allocated their task item
+        wait_strategy wait_;
+        bool elastic_ = false;
+        std::size_t min_threads_ = 0;
+        std::chrono::milliseconds idle_timeout_{0};
+        std::vector<std::pair<unsigned int, int>> placement_;
+        worker_affinity affinity_ = worker_affinity::none;
+        std::atomic_size_t active_workers_{};
+        std::jthread supervisor_;  // grows the elastic pool
+        alignas(details::cache_line_size) std::atomic_uint64_t enqueued_tasks_{};
+        // round robin submission of the lock-free pool
+        alignas(details::cache_line_size) std::atomic_size_t next_worker_{};
+        alignas(details::cache_line_size) std::atomic_int_fast64_t pending_tasks_{};
+    };
+
+    /**
+     * @brief Thread pool with lock-free task submission, execution and stealing.
+     * @details Workers own a Chase-Lev deque for the tasks they enqueue themselves and a
+     * bounded lock-free inbox for tasks coming from other threads, which are assigned
+     * round robin with an atomic counter.
+     */
+    template <typename FunctionType = details::default_function_type,
+              typename ThreadType = std::jthread>
+    using lock_free_thread_pool =
+        thread_pool<FunctionType, ThreadType, work_stealing_queue<FunctionType>>;
+
+    /**
+     * @example mandelbrot/source/main.cpp
+     * Example showing how to use thread pool with tasks that return a value. Outputs a PPM image of
+     * a mandelbrot.
+     */
+}  // namespace dp
+
+#include <string>
+#include <string_view>
+#include <chrono>
+#include <ranges>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdlib>
+#include <cerrno>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#endif
+
+#define NICEHTTP_SPLICE_SIZE 65536 // bytes moved by each splice() call (default pipe capacity)
+
+// Thrown by the client when a deadline expires
+class TimeoutError : public std::runtime_error {
 public:
-    std::string_view method;
-    std::string_view uri;
-    std::string_view auth;
-    Route(const std::string_view &method, const std::string_view &uri, const std::function<http::Response(const http::Request &req)> &func, std::string_view auth = "") {
-        this->method = method;
-        this->uri = uri;
-        this->func = func;
-        this->auth = auth;
+    using std::runtime_error::runtime_error;
+};
+
+// Portable socket helpers shared by the client, the server and the proxy
+namespace net {
+
+    inline void close_socket(int fd) {
+        #ifdef _WIN32
+        closesocket(fd);
+        #else
+        close(fd);
+        #endif
     }
-    Route(const Route& route) {
-        method = route.method;
-        uri = route.uri;
-        func = route.func;
-        auth = route.auth;
+
+    inline int poll_socket(struct pollfd *fds, int n, int timeout) {
+        #ifdef _WIN32
+        return WSAPoll(fds, n, timeout);
+        #else
+        // poll is never restarted after a signal handler (e.g. the profiler SIGPROF): wait for the time left
+        auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        while (true) {
+            int rc = poll(fds, n, timeout);
+            if ((rc >= 0) || (errno != EINTR)) {
+                return rc;
+            }
+            if (timeout > 0) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now());
+                timeout = std::max(0, static_cast<int>(left.count()));
+            }
+        }
+        #endif
     }
-    friend bool operator<(const Route& l, const Route& r) {
-        return std::tie(l.method, l.uri) < std::tie(r.method, r.uri);
+
+    inline void set_nonblocking(int fd) {
+        #ifdef _WIN32
+        u_long mode = 1;
+        ioctlsocket(fd, FIONBIO, &mode);
+        #else
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        #endif
+    }
+
+    inline bool connect_in_progress() {
+        #ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+        #else
+        return errno == EINPROGRESS;
+        #endif
     }
-    http::Response handle(const http::Request &req);
+
+    inline bool would_block() {
+        #ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+        #else
+        return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+        #endif
+    }
+
+    inline int timeout_left(std::chrono::steady_clock::time_point deadline) {
+        // milliseconds until deadline in the format expected by poll (-1 = infinite)
+        if (deadline == std::chrono::steady_clock::time_point::max()) {
+            return -1;
+        }
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        return (left > 0) ? static_cast<int>(left) : 0;
+    }
+
+    inline std::chrono::steady_clock::time_point deadline_after(int ms, std::chrono::steady_clock::time_point limit) {
+        if (ms <= 0) {
+            return limit;
+        }
+        return std::min(limit, std::chrono::steady_clock::now() + std::chrono::milliseconds(ms));
+    }
+
+    inline void send_all(int fd, const std::string& data, std::chrono::steady_clock::time_point deadline) {
+        // send all data, on non blocking sockets waits for buffer space until the deadline
+        size_t sent = 0;
+        while (sent < data.length()) {
+            #ifdef MSG_NOSIGNAL
+            int n = send(fd, data.c_str() + sent, data.length() - sent, MSG_NOSIGNAL);
+            #else
+            int n = send(fd, data.c_str() + sent, data.length() - sent, 0);
+            #endif
+            if (n > 0) {
+                sent += n;
+                continue;
+            }
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            int rc = poll_socket(&pfd, 1, timeout_left(deadline));
+            if (rc == 0) {
+                throw TimeoutError("Timeout sending the request");
+            } else if ((rc < 0) || (pfd.revents & (POLLERR | POLLHUP))) {
+                throw std::runtime_error("Connection closed while sending the request");
+            }
+        }
+    }
+
+    inline std::string header_value(std::string_view head, std::string_view name) {
+        // Value of the header name (lowercase) in a raw http head, empty if missing
+        for (const auto line : std::views::split(head, std::string_view("\r\n"))) {
+            std::string_view l(line);
+            size_t i = l.find(':');
+            if ((i != name.length()) || !std::ranges::equal(l.substr(0, i), name, [](char a, char b) { return std::tolower((unsigned char)a) == b; })) {
+                continue;
+            }
+            std::string_view v = l.substr(i + 1);
+            while (!v.empty() && (v.front() == ' ')) v.remove_prefix(1);
+            while (!v.empty() && (v.back() == ' ')) v.remove_suffix(1);
+            return std::string(v);
+        }
+        return "";
+    }
+
+    inline bool decode_chunked(std::string_view data, std::string& out) {
+        // Decode a chunked body, returns false if the last chunk wasn't received yet
+        out = "";
+        size_t pos = 0;
+        while (true) {
+            size_t eol = data.find("\r\n", pos);
+            if (eol == std::string::npos) {
+                return false;
+            }
+            size_t len = strtoul(std::string(data.substr(pos, eol - pos)).c_str(), nullptr, 16);
+            pos = eol + 2;
+            if (len == 0) {
+                // skip the trailers up to the final empty line
+                while ((eol = data.find("\r\n", pos)) != std::string::npos) {
+                    if (eol == pos) {
+                        return true;
+                    }
+                    pos = eol + 2;
+                }
+                return false;
+            }
+            if (data.length() < pos + len + 2) {
+                return false;
+            }
+            out += data.substr(pos, len);
+            pos += len + 2;
+        }
+    }
+
+    inline bool wait_socket(int fd, short events, std::chrono::steady_clock::time_point deadline) {
+        // wait until fd is ready for events, false on timeout or error
+        struct pollfd pfd = {fd, events, 0};
+        return (poll_socket(&pfd, 1, timeout_left(deadline)) > 0) && !(pfd.revents & POLLNVAL);
+    }
+
+    #ifdef __linux__
+    struct Pipe {
+        // Per thread pipe used as kernel buffer by relay()
+        int fds[2] = {-1, -1};
+        Pipe() { this->open(); }
+        ~Pipe() { this->close(); }
+        void open() {
+            if (pipe2(this->fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+                this->fds[0] = this->fds[1] = -1;
+            }
+        }
+        void close() {
+            for (int& fd : this->fds) {
+                if (fd != -1) ::close(fd);
+                fd = -1;
+            }
+        }
+        void reset() { // drop data left in the pipe after an error
+            this->close();
+            this->open();
+        }
+    };
+    #endif
+
+    inline bool relay(int from, int to, size_t len, std::chrono::steady_clock::time_point deadline) {
+        /* Move len bytes (std::string::npos = until EOF) from socket from to socket to.
+        * On Linux the data goes through a pipe with splice(), never reaching user space.
+        * Returns false on errors or timeout.
+        */
+        #ifdef __linux__
+        thread_local Pipe pipe;
+        if (pipe.fds[0] != -1) {
+            while (len > 0) {
+                ssize_t n = splice(from, nullptr, pipe.fds[1], nullptr, std::min<size_t>(len, NICEHTTP_SPLICE_SIZE), SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+                if ((n < 0) && (errno == EAGAIN)) {
+                    // the pipe is empty here, so the socket has no data yet
+                    if (!wait_socket(from, POLLIN, deadline)) return false;
+                    continue;
+                }
+                if (n <= 0) {
+                    return (n == 0) && (len == std::string::npos);
+                }
+                if (len != std::string::npos) {
+                    len -= n;
+                }
+                while (n > 0) {
+                    ssize_t m = splice(pipe.fds[0], nullptr, to, nullptr, n, SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+                    if ((m < 0) && (errno == EAGAIN) && wait_socket(to, POLLOUT, deadline)) {
+                        continue;
+                    }
+                    if (m <= 0) {
+                        pipe.reset();
+                        return false;
+                    }
+                    n -= m;
+                }
+            }
+            return true;
+        }
+        #endif
+        // copy through user space
+        char buff[NICEHTTP_SPLICE_SIZE / 4];
+        while (len > 0) {
+            int n = recv(from, buff, std::min<size_t>(len, sizeof(buff)), 0);
+            if ((n < 0) && would_block()) {
+                if (!wait_socket(from, POLLIN, deadline)) return false;
+                continue;
+            }
+            if (n <= 0) {
+                return (n == 0) && (len == std::string::npos);
+            }
+            if (len != std::string::npos) {
+                len -= n;
+            }
+            try {
+                send_all(to, std::string(buff, n), deadline);
+            } catch (const std::runtime_error&) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+}
+
+#include <array>
+#include <concepts>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <memory_resource>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define NICEHTTP_JSON_MAX_DEPTH 1024 // nesting of arrays and objects accepted by the parser and the writer
+// -D NICEHTTP_JSON_NO_SIMD indexes the documents one byte at a time (no SSE2/AVX2)
+
+namespace json {
+
+/* JSON bodies without an external library.
+ * Document::parse runs in two passes, as simdjson does: the first one finds the
+ * positions of all the structural characters ({}[]:, the opening quotes and the
+ * first character of the other values) 64 bytes at a time with SSE2/AVX2, the
+ * second one checks the grammar on the positions only and links every [ and { to
+ * its closing bracket. Values are then read on demand from the positions, without
+ * building a tree: strings without escapes and numbers are views of the text.
+ * The structure, the literals, the numbers and the UTF-8 encoding of the text are
+ * validated when parsing (the blocks with non-ASCII bytes only), escapes in strings
+ * when they are read.
+ */
+class Error : public std::runtime_error {
+public:
+    explicit Error(const std::string& message) : std::runtime_error(message) {}
 };
 
-class Router {
-    /* This class is a container for a list of Routes */
+enum class Type { Null, Bool, Number, String, Array, Object, Missing };
+
+class Document;
+
+class Value {
+    /* A value of a Document, cheap to copy, valid as long as the document and its text.
+     * Looking up a key that is not there gives a Missing value (false when tested),
+     * the getters throw json::Error when the value has another type.
+     */
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Value;
+        using difference_type = std::ptrdiff_t;
+        Iterator() = default;
+        Iterator(const Document* doc, uint32_t index) : doc(doc), index(index) {}
+        Value operator*() const;
+        Iterator& operator++();
+        Iterator operator++(int) { Iterator it = *this; ++*this; return it; }
+        bool operator==(const Iterator& other) const { return this->index == other.index; }
+    private:
+        const Document* doc = nullptr;
+        uint32_t index = 0; // structural of the element (the key in objects)
+    };
+    Value() = default;
+    Value(const Document* doc, uint32_t index) : doc(doc), index(index) {}
+    Type type() const;
+    explicit operator bool() const { return this->type() != Type::Missing; }
+    bool isNull() const { return this->type() == Type::Null; }
+    bool isInt() const; // a number without fraction and exponent that fits int64_t
+    bool getBool() const;
+    int64_t getInt() const; // throws if the number has a fraction or doesn't fit
+    double getDouble() const;
+    std::string_view getString() const; // unescaped, kept in the document when it had escapes
+    std::string_view key() const; // name of a member of an object
+    std::string_view raw() const; // text of the value, e.g. to copy it in a Writer
+    Value operator[](std::string_view key) const; // member of an object (linear search), Missing if not there
+    Value operator[](size_t i) const; // element of an array (linear search), Missing if not there
+    size_t size() const; // elements of an array or members of an object
+    Iterator begin() const; // elements of an array or members of an object (see key())
+    Iterator end() const;
 private:
-    std::set<Route> routes;
+    const Document* doc = nullptr;
+    uint32_t index = UINT32_MAX; // position in the structural index
+    uint32_t position() const; // in the text
+    void expect(Type t) const;
+};
+
+class Document {
+    /* Structural index of a JSON text. The text is not copied and must outlive the
+     * document; memory comes from the allocator (the request arena on the server).
+     */
 public:
-    void add(const Route &route); // add route
-    void del(const Route &route); // delete route
-    http::Response handle(const http::Request &req); // find the Route and call the callback function
-    Router() {}
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+    explicit Document(allocator_type alloc = {}) : structurals(alloc), jumps(alloc), strings(alloc) {}
+    void parse(std::string_view text); // throws json::Error if text is not valid JSON
+    Value root() const { return Value(this, 0); }
+    std::string_view source() const { return this->text; }
+private:
+    friend class Value;
+    std::string_view text;
+    std::pmr::vector<uint32_t> structurals; // positions in text
+    std::pmr::vector<uint32_t> jumps; // for every [ and {, the structural of its closing bracket
+    mutable std::pmr::deque<std::pmr::string> strings; // unescaped strings
+    uint32_t skip(uint32_t index) const; // structural following the value at index
 };
 
-#include <iostream>
-#include <cstring>
-#include <unistd.h>
-#include <thread>
-#include <string_view>
-#include <map>
-#include <exception>
+class Writer {
+    /* Streaming serializer appending to a string (the body of a message, see
+     * Message::writeJson), without an intermediate tree: commas and colons are added
+     * as needed, strings escaped. When length is given, it is set to the size of out
+     * every time the top level value is complete.
+     */
+public:
+    explicit Writer(std::pmr::string& out, size_t* length = nullptr) : out(out), length(length) {}
+    Writer& beginObject();
+    Writer& endObject();
+    Writer& beginArray();
+    Writer& endArray();
+    Writer& key(std::string_view name);
+    Writer& null();
+    Writer& value(bool b);
+    Writer& value(double d); // null for NaN and infinities
+    Writer& value(std::string_view s);
+    Writer& value(const char* s) { return this->value(std::string_view(s)); }
+    Writer& value(const Value& v) { return this->raw(v.raw()); }
+    template <std::integral T> requires (!std::same_as<T, bool>)
+    Writer& value(T n);
+    Writer& raw(std::string_view json); // already serialized value, written as it is
+private:
+    std::pmr::string& out;
+    size_t* length;
+    uint32_t depth = 0;
+    bool after_key = false;
+    std::array<uint64_t, NICEHTTP_JSON_MAX_DEPTH / 64> nonempty {}; // a value was written at this depth
+    void separate(); // comma before the next value
+    void done(); // a value was written
+    void appendInt(int64_t n);
+    void appendUint(uint64_t n);
+};
+
+template <std::integral T> requires (!std::same_as<T, bool>)
+Writer& Writer::value(T n) {
+    this->separate();
+    if constexpr (std::is_signed_v<T>) {
+        this->appendInt(n);
+    } else {
+        this->appendUint(n);
+    }
+    this->done();
+    return *this;
+}
+
+} // namespace json
+
+#include <concepts>
+#include <cstdint>
+#include <deque>
 #include <iterator>
-#include <sstream>
-#ifdef _WIN32
-#include <winsock2.h>
-#else
-#include <iomanip>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <sys/poll.h>
-#endif
-#include <signal.h>
+#include <memory_resource>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#define NICEHTTP_CBOR_MAX_DEPTH 1024 // nesting of arrays, maps and strings in chunks accepted by the parser
+
+namespace cbor {
+
+/* CBOR (RFC 8949) bodies, application/cbor: the binary counterpart of the json
+ * namespace, with the same interface, so that a handler can read and write both
+ * formats with the same code (see http::BodyWriter). Values are read in place:
+ * strings and byte strings are views of the body, nothing is decoded until asked.
+ * The whole item is checked to be well formed when parsing; text strings are not
+ * checked to be valid UTF-8.
+ */
+class Error : public std::runtime_error {
+public:
+    explicit Error(const std::string& message) : std::runtime_error(message) {}
+};
+
+using Type = json::Type; // byte strings are strings too, tags are skipped
+
+class Document;
+
+class Value {
+    /* An item of a Document, cheap to copy, valid as long as the document and its data.
+     * As json::Value: Missing when a key is not there, the getters throw cbor::Error
+     * when the item has another type.
+     */
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Value;
+        using difference_type = std::ptrdiff_t;
+        Iterator() = default;
+        Iterator(const Document* doc, uint32_t offset, uint64_t remaining, bool map) : doc(doc), offset(offset), remaining(remaining), map(map) {}
+        Value operator*() const;
+        Iterator& operator++();
+        Iterator operator++(int) { Iterator it = *this; ++*this; return it; }
+        bool operator==(const Iterator& other) const;
+    private:
+        const Document* doc = nullptr;
+        uint32_t offset = 0; // of the element (the key in maps)
+        uint64_t remaining = 0; // elements, UINT64_MAX in indefinite containers (up to the break)
+        bool map = false;
+        bool atEnd() const;
+    };
+    Value() = default;
+    Value(const Document* doc, uint32_t offset, uint32_t key_offset = UINT32_MAX) : doc(doc), offset(offset), key_offset(key_offset) {}
+    Type type() const;
+    explicit operator bool() const { return this->type() != Type::Missing; }
+    bool isNull() const { return this->type() == Type::Null; }
+    bool isInt() const; // an integer that fits int64_t
+    bool getBool() const;
+    int64_t getInt() const; // throws for floats and integers that don't fit
+    double getDouble() const;
+    std::string_view getString() const; // text or byte string, copied in the document only if sent in chunks
+    std::string_view key() const; // of a member of a map, text keys only
+    std::string_view raw() const; // encoded item, e.g. to copy it in a Writer
+    Value operator[](std::string_view key) const; // member of a map (linear search), Missing if not there
+    Value operator[](size_t i) const; // element of an array (linear search), Missing if not there
+    size_t size() const; // elements of an array or members of a map
+    Iterator begin() const; // elements of an array or members of a map (see key())
+    Iterator end() const;
+private:
+    const Document* doc = nullptr;
+    uint32_t offset = 0; // of the item, after its tags
+    uint32_t key_offset = UINT32_MAX;
+    void expect(Type t) const;
+};
+
+class Document {
+    /* A CBOR item in a buffer (the body), not copied: the buffer must outlive the
+     * document. Strings sent in chunks are joined in memory from the allocator.
+     */
+public:
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+    explicit Document(allocator_type alloc = {}) : strings(alloc) {}
+    void parse(std::string_view data); // throws cbor::Error if data is not one well formed item
+    Value root() const;
+    std::string_view source() const { return this->data; }
+private:
+    friend class Value;
+    std::string_view data;
+    mutable std::pmr::deque<std::pmr::string> strings; // strings in chunks, joined
+    uint32_t skip(uint32_t offset) const; // offset following the item at offset
+    uint32_t untag(uint32_t offset) const; // offset of the item after the tags
+};
+
+class Writer {
+    /* Streaming encoder appending to a string (the body of a message, see
+     * Message::writeCbor), same interface as json::Writer. Arrays and maps are written
+     * with indefinite length, so nothing has to be counted or moved; integers and
+     * lengths take the shortest form, doubles are written as floats when exact.
+     */
+public:
+    explicit Writer(std::pmr::string& out, size_t* length = nullptr) : out(out), length(length) {}
+    Writer& beginObject();
+    Writer& endObject();
+    Writer& beginArray();
+    Writer& endArray();
+    Writer& key(std::string_view name);
+    Writer& null();
+    Writer& value(bool b);
+    Writer& value(double d);
+    Writer& value(std::string_view s); // text string
+    Writer& value(const char* s) { return this->value(std::string_view(s)); }
+    Writer& value(const Value& v) { return this->raw(v.raw()); }
+    template <std::integral T> requires (!std::same_as<T, bool>)
+    Writer& value(T n);
+    Writer& bytes(std::string_view data); // byte string
+    Writer& raw(std::string_view item); // already encoded item, written as it is
+private:
+    std::pmr::string& out;
+    size_t* length;
+    uint32_t depth = 0;
+    void head(uint8_t major, uint64_t value);
+    void done(); // an item was written
+};
+
+template <std::integral T> requires (!std::same_as<T, bool>)
+Writer& Writer::value(T n) {
+    if constexpr (std::is_signed_v<T>) {
+        // negative integers are -1 - n
+        this->head((n < 0) ? 1 : 0, (n < 0) ? ~static_cast<uint64_t>(static_cast<int64_t>(n)) : static_cast<uint64_t>(n));
+    } else {
+        this->head(0, n);
+    }
+    this->done();
+    return *this;
+}
+
+// Write a json::Value or a cbor::Value with a json::Writer or a cbor::Writer, converting the format
+template <typename Writer, typename Value>
+void transcode(Writer& w, const Value& v) {
+    switch (v.type()) {
+        case Type::Object:
+            w.beginObject();
+            for (Value member : v) {
+                w.key(member.key());
+                transcode(w, member);
+            }
+            w.endObject();
+            break;
+        case Type::Array:
+            w.beginArray();
+            for (Value element : v) {
+                transcode(w, element);
+            }
+            w.endArray();
+            break;
+        case Type::String:
+            w.value(v.getString());
+            break;
+        case Type::Bool:
+            w.value(v.getBool());
+            break;
+        case Type::Number:
+            if (v.isInt()) {
+                w.value(v.getInt());
+            } else {
+                w.value(v.getDouble());
+            }
+            break;
+        case Type::Null:
+            w.null();
+            break;
+        case Type::Missing:
+            throw Error("Missing value");
+    }
+}
+
+} // namespace cbor
+
+#include <string_view>
+#include <map>
+#include <memory_resource>
+#include <charconv>
+#include <ranges>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <optional>
+#include <variant>
+#define PROTO_HTTP1 "HTTP/1.1"
+
+namespace http {
+
+// Common http message (could be request or response)
+// Strings and headers are allocator-aware: a message built with a memory resource
+// (e.g. the arena of a server connection) keeps all its data there, default
+// constructed messages use the heap. Copies always go to the heap.
+class Message { // base class
+public:
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+    std::pmr::string proto;
+    std::pmr::map<std::pmr::string,std::pmr::string> headers;
+    std::pmr::string body;
+    bool is_json = false;
+    bool is_cbor = false; // Content-Type: application/cbor
+    size_t content_length = 0;
+    Message() {}
+    explicit Message(allocator_type alloc) : proto(alloc), headers(alloc), body(alloc) {}
+    allocator_type get_allocator() const { return this->body.get_allocator(); }
+    void parseHeaders(std::string_view headerstr);
+    // The body as JSON, parsed on the first call (again if the body is replaced), throws json::Error
+    ::json::Value json() const;
+    // Clears the body and returns a writer serializing into it, Content-Length follows the writer
+    ::json::Writer writeJson();
+    // The body as CBOR, read in place, parsed on the first call as json(), throws cbor::Error
+    ::cbor::Value cbor() const;
+    // Clears the body and returns a CBOR encoder writing into it, as writeJson()
+    ::cbor::Writer writeCbor();
+protected:
+    // bodies parsed by json() and cbor(), in the message allocator
+    mutable std::optional<::json::Document> json_document;
+    mutable std::optional<::cbor::Document> cbor_document;
+};
+
+enum class Format { Json, Cbor };
+
+// CBOR if the Accept header lists application/cbor with a q not lower than JSON's, otherwise JSON
+Format negotiateFormat(std::string_view accept);
+
+class BodyWriter {
+    /* The json::Writer or cbor::Writer chosen by Response::writeBody, with their
+     * interface: a handler writes its value once and the client gets the format it
+     * accepts. Values read from a body of the other format are converted.
+     */
+public:
+    explicit BodyWriter(::json::Writer w) : writer(std::in_place_type<::json::Writer>, w) {}
+    explicit BodyWriter(::cbor::Writer w) : writer(std::in_place_type<::cbor::Writer>, w) {}
+    Format format() const { return (this->writer.index() == 0) ? Format::Json : Format::Cbor; }
+    BodyWriter& beginObject() { std::visit([](auto& w) { w.beginObject(); }, this->writer); return *this; }
+    BodyWriter& endObject() { std::visit([](auto& w) { w.endObject(); }, this->writer); return *this; }
+    BodyWriter& beginArray() { std::visit([](auto& w) { w.beginArray(); }, this->writer); return *this; }
+    BodyWriter& endArray() { std::visit([](auto& w) { w.endArray(); }, this->writer); return *this; }
+    BodyWriter& key(std::string_view name) { std::visit([name](auto& w) { w.key(name); }, this->writer); return *this; }
+    BodyWriter& null() { std::visit([](auto& w) { w.null(); }, this->writer); return *this; }
+    template <typename T>
+    BodyWriter& value(const T& v) {
+        std::visit([&v](auto& w) {
+            if constexpr (requires { w.value(v); }) {
+                w.value(v);
+            } else {
+                ::cbor::transcode(w, v); // a json::Value in CBOR or the other way round
+            }
+        }, this->writer);
+        return *this;
+    }
+private:
+    std::variant<::json::Writer, ::cbor::Writer> writer;
+};
+
+class Request : public Message {
+public:
+    std::pmr::string method;
+    std::pmr::string uri;
+    Request() {}
+    explicit Request(allocator_type alloc) : Message(alloc), method(alloc), uri(alloc) {}
+    Request(std::string_view head, std::string_view body);
+    Request(std::string method, std::string uri, std::string proto, std::map<std::string,std::string> headers, bool is_json, size_t content_length, std::string body = "");
+    Request(const Request& hr);
+    Request(Request&& hr) = default;
+    void parseHead(std::string_view head); // request line and headers, without the body
+    void setBody(std::string_view body); // body matching the parsed Content-Length
+    std::string toString(bool carriage_return = true);
+    Request& operator=(const Request& other);
+    Request& operator=(Request&& other) = default;
+};
+
+class Response : public Message {
+public:
+    short code;
+    std::pmr::string message;
+    Response() {}
+    explicit Response(allocator_type alloc) : Message(alloc), message(alloc) {}
+    Response(std::string_view head, std::string_view body);
+    Response(short code, std::string message, std::string proto, std::map<std::string,std::string> headers, bool is_json, size_t content_length, std::string body = "");
+    Response(const Response& r);
+    Response(Response&& r) = default;
+    std::string toString(bool carriage_return = true);
+    void serialize(std::pmr::string& out) const; // append the raw response to out
+    // Clears the body and returns a writer in the format negotiated with the Accept header of req
+    BodyWriter writeBody(const Request& req);
+    Response& operator=(const Response& other);
+    Response& operator=(Response&& other) = default;
+};
+
+};
+
+#include <set>
+#include <functional>
+#include <string_view>
+#include <iostream>
+#include <regex>
+
+#define NICEHTTP_INLINE_EXECUTOR "inline" // routes handled on the thread that read the request, no handoff
+
+class UpstreamGroup;
+
+class Route {
+    /*
+    * This class handle a single request calling the specified callback function.
+    * Supports authentication token passed through "Authentication" header.
+    * Doesn't support parameter parsing.
+    * A proxy route has no callback: NiceHTTP streams the request to an
+    * endpoint of the upstream group and the response back to the client.
+    * executor names the NiceHTTP executor (bulkhead) running the route, see
+    * NiceHTTP::addExecutor; by default the route runs inline.
+    * With NICEHTTP_COMPRESSION the responses are compressed as the client accepts,
+    * unless compress is false; cache_compressed keeps the compressed bodies for
+    * routes that send the same bodies again (static files, cached documents).
+    * GET responses (200) of a route with cache_ttl (ms) are kept in the server
+    * response cache, varying on the request headers listed in cache_vary
+    * (comma separated, e.g. "authorization, accept-language"); the auth token is
+    * checked before the cache is, and is part of the key.
+    * With coalesce, identical concurrent authorized GETs (same key as the cache)
+    * wait for the first one and share its 2xx response instead of calling the
+    * handler again.
+    */
+private:
+    std::function<http::Response(const http::Request &req)> func;
+    std::regex pattern; // uri compiled once, not at every match
+public:
+    std::string_view method;
+    std::string_view uri;
+    std::string_view auth;
+    UpstreamGroup *upstream = nullptr;
+    std::string_view executor = NICEHTTP_INLINE_EXECUTOR;
+    bool compress = true;
+    bool cache_compressed = false;
+    int cache_ttl = 0;
+    std::string_view cache_vary;
+    bool coalesce = false;
+    Route(const std::string_view &method, const std::string_view &uri, const std::function<http::Response(const http::Request &req)> &func, std::string_view auth = "") {
+        this->method = method;
+        this->uri = uri;
+        this->pattern = std::regex(uri.begin(), uri.end());
+        this->func = func;
+        this->auth = auth;
+    }
+    Route(const std::string_view &method, const std::string_view &uri, UpstreamGroup &upstream, std::string_view auth = "") {
+        this->method = method;
+        this->uri = uri;
+        this->pattern = std::regex(uri.begin(), uri.end());
+        this->upstream = &upstream;
+        this->auth = auth;
+    }
+    Route(const Route& route) {
+        method = route.method;
+        uri = route.uri;
+        func = route.func;
+        pattern = route.pattern;
+        auth = route.auth;
+        upstream = route.upstream;
+        executor = route.executor;
+        compress = route.compress;
+        cache_compressed = route.cache_compressed;
+        cache_ttl = route.cache_ttl;
+        cache_vary = route.cache_vary;
+        coalesce = route.coalesce;
+    }
+    friend bool operator<(const Route& l, const Route& r) {
+        return std::tie(l.method, l.uri) < std::tie(r.method, r.uri);
+    }
+    bool isProxy() const { return this->upstream != nullptr; }
+    bool matches(const http::Request &req) const; // method and uri
+    bool authorized(const http::Request &req) const;
+    http::Response handle(const http::Request &req) const;
+};
+
+class Router {
+    /* This class is a container for a list of Routes */
+private:
+    std::set<Route> routes;
+public:
+    void add(const Route &route); // add route
+    void del(const Route &route); // delete route
+    const Route* match(const http::Request &req) const; // find the Route, nullptr if none
+    http::Response handle(const http::Request &req); // find the Route and call the callback function
+    http::Response handle(const http::Request &req, const Route *route); // call the callback of a matched Route (404 if nullptr)
+    Router() {}
+};
+
+#include <string>
+#include <vector>
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
+#include <cstring>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+#define NICEHTTP_DNS_TTL 60         // seconds a resolved host stays cached
+#define NICEHTTP_DNS_NEGATIVE_TTL 5 // seconds a failed lookup stays cached
+#define NICEHTTP_DNS_SHARDS 16      // number of independently locked cache buckets
+
+// A resolved socket address (IPv4 or IPv6) ready to be passed to connect()
+struct Address {
+    sockaddr_storage addr;
+    socklen_t len = 0;
+    int family = AF_UNSPEC;
+    void setPort(short port);
+    std::string toString() const;
+};
+
+class Resolver {
+    /* Thread-safe name resolution based on getaddrinfo.
+     * Every A/AAAA record of a host is returned, so callers can fall back
+     * to the next address when connect() fails.
+     * Lookups are cached for NICEHTTP_DNS_TTL seconds, failures for
+     * NICEHTTP_DNS_NEGATIVE_TTL seconds. When an entry expires a single
+     * thread refreshes it while the others keep using the stale addresses,
+     * so a slow resolver doesn't stall every request.
+     * The cache is striped over NICEHTTP_DNS_SHARDS mutexes.
+     */
+public:
+    static Resolver& getInstance(); // process wide cache shared by all NiceHTTP instances
+    std::vector<Address> resolve(const std::string& host, short port);
+    void clear(); // drop every cached entry
+private:
+    struct Entry {
+        std::vector<Address> addresses; // empty means negative entry
+        std::chrono::steady_clock::time_point expires;
+        bool refreshing = false;
+    };
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+    };
+    std::array<Shard, NICEHTTP_DNS_SHARDS> shards;
+    Shard& getShard(const std::string& host);
+    std::vector<Address> lookup(const std::string& host);
+};
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <sys/poll.h>
+#endif
+
+#define NICEHTTP_POOL_MAX_IDLE 32     // idle connections kept for each host:port
+#define NICEHTTP_POOL_IDLE_TIMEOUT 30 // seconds an idle connection is kept open
+
+class ConnectionPool {
+    /* Idle keep-alive client connections grouped by host:port.
+     * Connections are reused LIFO (the most recently used socket is the most
+     * likely to still be open and warm) and checked before being handed out:
+     * a socket that became readable while idle was closed by the peer.
+     */
+public:
+    ~ConnectionPool();
+    int get(const std::string& host, short port); // -1 if there is no usable idle connection
+    void put(const std::string& host, short port, int fd);
+    void clear(); // close every idle connection
+private:
+    struct Idle {
+        int fd;
+        std::chrono::steady_clock::time_point since;
+    };
+    std::mutex mutex;
+    std::unordered_map<std::string, std::vector<Idle>> idle;
+    static std::string key(const std::string& host, short port);
+    static void close_fd(int fd);
+};
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+
+#define NICEHTTP_BREAKER_WINDOW 10000    // ms of the window used to compute the error rate
+#define NICEHTTP_BREAKER_MIN_REQUESTS 20 // requests in the window before the breaker can open
+#define NICEHTTP_BREAKER_ERROR_RATE 50   // % of failed requests that opens the breaker
+#define NICEHTTP_BREAKER_OPEN_TIME 5000  // ms the breaker stays open before letting probes through
+#define NICEHTTP_BREAKER_PROBES 3        // probe requests allowed while half open
+
+struct BreakerOptions {
+    int window = NICEHTTP_BREAKER_WINDOW;
+    int min_requests = NICEHTTP_BREAKER_MIN_REQUESTS;
+    int error_rate = NICEHTTP_BREAKER_ERROR_RATE;
+    int slow_call = 0; // ms, slower requests count as failures (0 = disabled)
+    int open_time = NICEHTTP_BREAKER_OPEN_TIME;
+    int probes = NICEHTTP_BREAKER_PROBES;
+};
+
+// Thrown by NiceHTTP::request when the circuit breaker of the endpoint is open
+class CircuitOpenError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class CircuitBreaker {
+    /* Per endpoint circuit breaker.
+     * Closed: requests flow, failures and slow calls are counted over a window;
+     * when the error rate passes the threshold the breaker opens.
+     * Open: requests fail immediately, without touching the network.
+     * Half open: after open_time, a few probe requests go through; if they all
+     * succeed the breaker closes, a single failure opens it again.
+     * allow() returns a Permit that is given back to record(): only the outcomes
+     * of the probes of the current half open round count while half open, the
+     * requests allowed before the breaker opened are ignored when they finish.
+     * Only atomics are used, calling allow()/record() on every request is cheap.
+     */
+public:
+    enum State { Closed, Open, HalfOpen };
+    struct Permit {
+        bool allowed = false;
+        uint32_t probe = 0; // half open round of a probe request, 0 for other requests
+        explicit operator bool() const { return this->allowed; }
+    };
+    CircuitBreaker(const BreakerOptions& opts = {});
+    Permit allow(); // false if the request must fail fast
+    void record(const Permit& permit, bool success, std::chrono::microseconds latency); // outcome of an allowed request
+    State state() const;
+    bool isOpen() const; // open and not yet ready to probe
+private:
+    BreakerOptions opts;
+    std::atomic<int> current{Closed};
+    std::atomic<int64_t> opened_at{0};    // steady clock ms
+    std::atomic<int64_t> window_start{0}; // steady clock ms
+    std::atomic<uint64_t> counts{0};      // requests in the high 32 bits, failures in the low ones
+    std::atomic<int> probes{0};           // probes in flight, of any round
+    std::atomic<int> probe_successes{0};  // in the current round
+    std::atomic<uint32_t> round{0};       // half open periods so far
+    static int64_t now();
+    void trip(int64_t t);
+};
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdexcept>
+
+#define NICEHTTP_EJECT_FAILURES 5 // consecutive failures that eject an endpoint
+#define NICEHTTP_EJECT_TIME 5000  // base ejection time (ms), multiplied by the number of ejections
+#define NICEHTTP_HASH_VNODES 100  // points of every endpoint on the consistent hashing ring
+
+struct Endpoint {
+    std::string host;
+    short port;
+};
+
+enum class Balancing {
+    RoundRobin,
+    LeastOutstanding,  // endpoint with the fewest requests in flight
+    PowerOfTwoChoices, // best of two random endpoints, by in flight requests and latency
+    ConsistentHash     // same request key goes to the same endpoint (cache affinity)
+};
+
+class UpstreamGroup {
+    /* Replicas of the same service, used by NiceHTTP::request to pick
+     * the destination of each call.
+     * For every endpoint it tracks the requests in flight, an EWMA of the latency
+     * and the consecutive failures: after NICEHTTP_EJECT_FAILURES failures in a row
+     * the endpoint is ejected for a while. If every endpoint is ejected they are
+     * all used again, better than failing everything.
+     * Each endpoint also has a CircuitBreaker: endpoints with an open breaker,
+     * or half open with every probe in flight, are skipped, and requests fail
+     * fast if no endpoint is left.
+     * The bookkeeping uses only atomics, a group can be shared by many threads.
+     */
+public:
+    UpstreamGroup(const std::vector<Endpoint>& endpoints, Balancing policy = Balancing::RoundRobin, const BreakerOptions& breaker = {});
+    size_t pick(std::string_view key = ""); // index of the endpoint for the next request
+    // As pick(), admitted by the breaker of the endpoint: endpoints refusing it are left out and
+    // another one is picked, permit is false only if every endpoint refused
+    size_t pick(std::string_view key, CircuitBreaker::Permit& permit);
+    void begin(size_t i); // a request is sent to endpoint i
+    void end(size_t i, const CircuitBreaker::Permit& permit, bool success, std::chrono::microseconds latency); // the request allowed by permit completed
+    const Endpoint& endpoint(size_t i) const;
+    CircuitBreaker& breaker(size_t i);
+    size_t size() const;
+    int outstanding(size_t i) const;
+    std::chrono::microseconds latency(size_t i) const;
+    bool isEjected(size_t i) const;
+private:
+    struct alignas(64) State { // one cache line each, endpoints are updated by different threads
+        State(const BreakerOptions& opts) : breaker(opts) {}
+        Endpoint endpoint;
+        CircuitBreaker breaker;
+        std::atomic<int> outstanding{0};
+        std::atomic<int64_t> ewma{0}; // microseconds
+        std::atomic<int> failures{0};
+        std::atomic<int> ejections{0};
+        std::atomic<int64_t> ejected_until{0}; // steady clock nanoseconds
+    };
+    Balancing policy;
+    std::vector<std::unique_ptr<State>> states;
+    std::vector<std::pair<uint64_t, size_t>> ring; // consistent hashing ring: (hash, endpoint index)
+    std::atomic<size_t> next{0};
+    bool available(size_t i, int64_t now) const;
+    size_t choose(std::string_view key, const std::vector<bool>& skipped); // pick() without the skipped endpoints
+    static int64_t now();
+    static uint64_t hash(std::string_view s);
+};
+
+#include <atomic>
+#include <functional>
+
+class Executor {
+    /* Bulkhead for the routes assigned to it (Route::executor).
+     * The server hands their requests off to this thread pool, so slow routes
+     * can only use up their own workers and never the ones of the other routes.
+     * At most threads requests run and max_queue wait: when the executor is
+     * full submit() fails and the server answers 503 at once.
+     */
+public:
+    Executor(unsigned int threads, unsigned int max_queue = 0);
+    bool submit(std::function<void()> task); // false if the executor is full
+    int load() const; // requests running or waiting
+    unsigned int capacity() const;
+    dp::pool_statistics stats() const; // worker counters and queueing delay of the pool
+private:
+    std::atomic<int> inflight{0};
+    unsigned int limit;
+    dp::thread_pool<> pool; // last member: its workers stop before the counters go away
+};
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define NICEHTTP_LOG_BUFFER 65536       // bytes of the log buffer of each thread (records are dropped when full)
+#define NICEHTTP_LOG_FLUSH 10           // ms between two writes of the background thread
+#define NICEHTTP_LOG_ERRORS_PER_SEC 20  // error messages logged per second, the others are counted and dropped
+
+class Logger {
+    /* Asynchronous logger.
+     * The calling threads append binary records to their own lock-free ring
+     * (single producer, single consumer) and never wait: when a ring is full
+     * the record is dropped and counted. A background thread drains the rings
+     * every NICEHTTP_LOG_FLUSH ms, formats the records and writes them in
+     * batches: access log lines to the access log (stdout by default),
+     * debug and error messages to the error log (stderr by default).
+     * Error messages are limited to NICEHTTP_LOG_ERRORS_PER_SEC.
+     */
+public:
+    enum Level : uint8_t { Debug, Error };
+    static Logger& getInstance();
+    ~Logger();
+    bool openAccessLog(const std::string& path); // append to a file instead of stdout
+    bool openErrorLog(const std::string& path);  // append to a file instead of stderr
+    void setAccessLog(bool enabled);
+    bool accessLogEnabled() const { return this->access_enabled.load(std::memory_order_relaxed); }
+    // request line, status, response body bytes and duration, written in the combined log format
+    void access(std::string_view peer, std::string_view method, std::string_view uri, std::string_view proto, int status, size_t bytes, std::chrono::steady_clock::duration latency);
+    void log(Level level, std::string_view message);
+    void error(std::string_view message) { this->log(Error, message); }
+    void flush(); // write everything logged so far
+    static std::ostringstream& stream(); // cleared per thread stream used by NLOG
+private:
+    enum Kind : uint8_t { Text, Access };
+    struct Header {
+        uint32_t size; // payload bytes
+        Kind kind;
+        Level level;
+        uint16_t status;
+        int64_t time;  // system clock ns
+        uint64_t bytes;
+        uint64_t latency; // us
+        uint16_t lengths[4]; // of the access log strings: peer, method, uri, proto
+    };
+    struct Ring {
+        std::unique_ptr<char[]> data{new char[NICEHTTP_LOG_BUFFER]};
+        std::atomic<uint64_t> head{0}; // written by the producer
+        std::atomic<uint64_t> tail{0}; // written by the consumer
+    };
+    struct Handle {
+        Ring* ring = nullptr;
+        ~Handle();
+    };
+    Logger();
+    std::mutex registry; // thread start and exit, and draining
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::vector<Ring*> free_rings;
+    std::mutex drain_mutex;
+    FILE* access_out = stdout;
+    FILE* error_out = stderr;
+    std::atomic<bool> access_enabled{false};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<int64_t> error_second{0};
+    std::atomic<int> error_count{0};
+    std::atomic<uint64_t> suppressed{0};
+    std::jthread writer;
+    Ring& local();
+    void push(const Header& header, std::initializer_list<std::string_view> parts);
+    void drain();
+};
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define NICEHTTP_CAPTURE_MAGIC "NHCAP001" // first 8 bytes of a capture file
+#define NICEHTTP_CAPTURE_BUFFER (1 << 20) // bytes buffered before writing to the file
+#define NICEHTTP_CAPTURE_FLUSH 1000 // ms between flushes of the buffered records to the file
+
+class Capture {
+    /* Records the raw requests received by the server with their arrival time,
+     * to replay the production traffic against a server (bench/replay) or to
+     * benchmark the parser on it.
+     * File format (host byte order): the magic, the capture start time
+     * (system clock ns) and one record per request: arrival offset from the
+     * start (ns, uint64), length (uint32) and the raw request bytes.
+     * Records are appended in completion order, load() sorts them by arrival.
+     */
+public:
+    struct Record {
+        uint64_t offset; // ns since the capture start
+        std::string data; // request head and body as received
+    };
+    Capture() {}
+    ~Capture();
+    bool open(const std::string& path, uint64_t max_bytes = 0); // max_bytes 0: no limit
+    bool active() const { return this->capturing.load(std::memory_order_relaxed); }
+    void record(std::chrono::steady_clock::time_point arrival, std::string_view head, std::string_view body);
+    void close();
+    static std::vector<Record> load(const std::string& path); // throws std::runtime_error if not a capture
+private:
+    std::mutex mutex;
+    FILE* file = nullptr;
+    std::atomic<bool> capturing{false};
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point flushed;
+    uint64_t written = 0;
+    uint64_t max_bytes = 0;
+};
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#define NICEHTTP_COMPRESSION_MIN 1024 // bytes, smaller response bodies are sent as they are
+#define NICEHTTP_COMPRESSION_LEVEL 5 // zlib level of the responses compressed at every request
+#define NICEHTTP_COMPRESSION_CACHED_LEVEL 9 // zlib level of the bodies kept in the cache, compressed once
+#define NICEHTTP_COMPRESSION_CACHE (16 << 20) // bytes of compressed bodies cached by NiceHTTP
+#define NICEHTTP_MAX_INFLATED (16 << 20) // bytes a compressed request body can inflate to
+
+namespace compression {
+
+/* gzip and deflate (zlib format) bodies, Content-Encoding and Accept-Encoding.
+ * The functions are there with NICEHTTP_COMPRESSION only (link with zlib), the
+ * encodings are parsed in any case.
+ */
+enum class Encoding { Identity, Gzip, Deflate, Unsupported };
+
+class Error : public std::runtime_error {
+public:
+    explicit Error(const std::string& message) : std::runtime_error(message) {}
+};
+
+Encoding parse(std::string_view content_encoding); // value of a Content-Encoding header
+Encoding negotiate(std::string_view accept_encoding); // best encoding accepted, gzip first
+const char* name(Encoding encoding); // token for Content-Encoding
+
+#ifdef NICEHTTP_COMPRESSION
+// append data compressed to out, throws compression::Error
+void compress(std::string_view data, Encoding encoding, std::pmr::string& out, int level = NICEHTTP_COMPRESSION_LEVEL);
+// append data inflated to out, false if it is longer than max_size; throws compression::Error if data is corrupt
+bool decompress(std::string_view data, Encoding encoding, std::pmr::string& out, size_t max_size = NICEHTTP_MAX_INFLATED);
+
+class Cache {
+    /* Compressed versions of the bodies that repeat (static files, cached documents),
+     * so they are compressed once, at the best level, and then only copied.
+     * Keyed by two independent 64 bit hashes of the body and the encoding; when over
+     * max_bytes the oldest entries are evicted.
+     */
+public:
+    explicit Cache(size_t max_bytes = NICEHTTP_COMPRESSION_CACHE) : max_bytes(max_bytes) {}
+    void compress(std::string_view data, Encoding encoding, std::pmr::string& out); // append to out
+    size_t bytes();
+private:
+    struct Key {
+        uint64_t hash;
+        uint64_t check;
+        Encoding encoding;
+        bool operator==(const Key&) const = default;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const { return key.hash ^ static_cast<size_t>(key.encoding); }
+    };
+    std::mutex mutex;
+    std::unordered_map<Key, std::shared_ptr<const std::pmr::string>, KeyHash> entries;
+    std::deque<Key> order; // insertion order, for the eviction
+    size_t size = 0;
+    size_t max_bytes;
+};
+#endif
+
+} // namespace compression
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#define NICEHTTP_CACHE_SIZE (64 << 20) // bytes of responses kept by the server response cache
+#define NICEHTTP_CACHE_SHARDS 16 // independently locked parts of the cache, each with 1/16 of the bytes
+#define NICEHTTP_CACHE_SKETCH 4096 // counters per row of the frequency sketch of a shard
+
+class ResponseCache {
+    /* Serialized responses of the routes with Route::cache_ttl, keyed by method, uri,
+     * negotiated encoding and the request headers named in Route::cache_vary.
+     * Sharded by the hash of the key, every shard has its own lock, LRU list and byte budget.
+     * Admission is TinyLFU: a count-min sketch estimates how often every key is
+     * requested and, when the shard is full, a new response replaces the least recently
+     * used one only if its key is requested at least as often, so one-off requests
+     * (crawlers, scans) don't flush the popular responses.
+     */
+public:
+    struct Entry {
+        std::pmr::string raw; // response as sent, without the Connection header
+        size_t split = 0; // offset of the empty line ending the head, the Connection header goes there
+        size_t body_size = 0;
+        short code = 200; // status of the response
+        std::string etag; // quoted, as in the ETag header
+        std::string not_modified; // head of the 304 answer, without the Connection header and the empty line
+        std::chrono::steady_clock::time_point expires;
+    };
+    explicit ResponseCache(size_t max_bytes = NICEHTTP_CACHE_SIZE);
+    std::shared_ptr<const Entry> get(std::string_view key); // nullptr if missing or expired
+    void put(std::string_view key, std::shared_ptr<const Entry> entry);
+    void clear();
+    size_t bytes();
+    std::string metrics(); // Prometheus text
+private:
+    class Sketch {
+        /* 4 rows of 4 bit counters (one per byte, saturating at 15), halved every
+         * 10 * NICEHTTP_CACHE_SKETCH increments so old popularity fades away.
+         */
+    public:
+        void increment(uint64_t hash);
+        uint8_t estimate(uint64_t hash) const;
+    private:
+        std::array<std::array<uint8_t, NICEHTTP_CACHE_SKETCH>, 4> rows{};
+        uint32_t additions = 0;
+        static size_t slot(uint64_t hash, int row);
+    };
+    struct Node {
+        std::string key;
+        uint64_t hash;
+        std::shared_ptr<const Entry> entry;
+    };
+    struct Shard {
+        std::mutex mutex;
+        std::list<Node> lru; // most recently used first
+        std::unordered_map<std::string_view, std::list<Node>::iterator> index; // views of Node::key
+        Sketch sketch;
+        size_t bytes = 0;
+    };
+    static size_t cost(const Node& node);
+    void erase(Shard& shard, std::list<Node>::iterator node);
+    std::array<Shard, NICEHTTP_CACHE_SHARDS> shards;
+    size_t shard_bytes;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> rejections{0}; // not admitted by the sketch or too big
+};
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+
+#define NICEHTTP_COALESCE_SHARDS 16 // independently locked parts of the in flight requests
+#define NICEHTTP_COALESCE_TIMEOUT 10000 // ms a request waits for an identical one, then runs the handler itself
+
+class SingleFlight {
+    /* Identical concurrent requests of the routes with Route::coalesce: the first one
+     * (leader) runs the handler, the others wait for its serialized response and send
+     * it too, so a burst of requests for the same key costs one handler call.
+     * Keys are the same as the response cache ones.
+     */
+public:
+    class Call {
+        friend class SingleFlight;
+        std::mutex mutex;
+        std::condition_variable done_cv;
+        bool done = false;
+        std::shared_ptr<const ResponseCache::Entry> result;
+    };
+    class Leader {
+        /* Returned by join() to the request that must run the handler, the waiting
+         * requests are released by complete() or, if the handler throws, by the destructor.
+         */
+    public:
+        Leader(SingleFlight* flights, std::string_view key, std::shared_ptr<Call> call) : flights(flights), key(key), call(std::move(call)) {}
+        Leader(Leader&& other) = default;
+        ~Leader() { this->complete(nullptr); }
+        void complete(std::shared_ptr<const ResponseCache::Entry> result); // nullptr: the others run the handler
+    private:
+        SingleFlight* flights;
+        std::string key;
+        std::shared_ptr<Call> call;
+    };
+    // a Leader if no identical request is running, otherwise the call to wait for
+    std::variant<Leader, std::shared_ptr<Call>> join(std::string_view key);
+    // the response of the leader, nullptr if it couldn't be shared or after the timeout
+    std::shared_ptr<const ResponseCache::Entry> wait(Call& call, std::chrono::milliseconds timeout = std::chrono::milliseconds(NICEHTTP_COALESCE_TIMEOUT));
+    std::string metrics(); // Prometheus text
+private:
+    struct KeyHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view key) const { return std::hash<std::string_view>{}(key); }
+    };
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<Call>, KeyHash, std::equal_to<>> calls;
+    };
+    Shard& shard(std::string_view key) { return this->shards[KeyHash{}(key) % NICEHTTP_COALESCE_SHARDS]; }
+    std::array<Shard, NICEHTTP_COALESCE_SHARDS> shards;
+    std::atomic<uint64_t> leaders{0};
+    std::atomic<uint64_t> coalesced{0}; // requests answered with the response of a leader
+};
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#define NICEHTTP_PROFILE_HZ 99          // samples per second of CPU time (not a multiple of the usual timer ticks)
+#define NICEHTTP_PROFILE_MAX 60         // longest profile, in seconds
+#define NICEHTTP_PROFILE_SAMPLES 16384  // samples kept per profile, the others are counted as dropped
+#define NICEHTTP_PROFILE_DEPTH 64       // frames kept per sample
+
+class ProfilerBusy : public std::runtime_error {
+public:
+    explicit ProfilerBusy(const std::string& what) : std::runtime_error(what) {}
+};
+
+class Profiler {
+    /* Sampling CPU profiler (Linux).
+     * While profiling, an ITIMER_PROF timer sends SIGPROF every 1/hz seconds of
+     * CPU time consumed by the process, to the thread that was running: busy
+     * threads get sampled in proportion to the CPU they use. The handler only
+     * unwinds the stack (backtrace, loaded before the timer starts) into a
+     * buffer allocated beforehand, no locks and no allocations.
+     * When the profile ends the stacks are symbolized (dladdr, so link the
+     * executable with -rdynamic to see its own functions) and returned as
+     * folded stacks, "root;caller;leaf count" per line, the input of
+     * flamegraph.pl, speedscope and most flame graph tools.
+     * When not profiling no timer is armed and nothing runs.
+     */
+public:
+    static Profiler& getInstance();
+    // Blocks for duration, throws ProfilerBusy if a profile is already running
+    std::string profile(std::chrono::seconds duration, int hz = NICEHTTP_PROFILE_HZ);
+private:
+    struct Sample {
+        int depth;
+        void* frames[NICEHTTP_PROFILE_DEPTH];
+    };
+    Profiler() {}
+    static void onSignal(int);
+    std::string fold(size_t samples, uint64_t dropped);
+    std::atomic<bool> running{false};
+    std::unique_ptr<Sample[]> samples;
+    std::atomic<size_t> next{0};     // next free sample
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<int> in_handler{0};  // handlers still writing when the timer is stopped
+    std::atomic<bool> sampling{false};
+};
+
+#include <cstddef>
+#include <cstdint>
+
+#define NICEHTTP_ALLOC_PHASES 16 // phases that can be accounted (trace::Phase::Count at most)
+
+namespace alloc_stats {
+
+/* Heap allocation accounting, compiled in with -D NICEHTTP_ALLOC_STATS.
+ * The global operator new and delete are replaced to count the allocations
+ * of each thread, and trace::RequestTrace adds the allocations made during
+ * each phase of a request to process wide totals, exported by Metrics.
+ * Replacing the global allocator is a whole program decision: build the
+ * library with the flag only in the binaries being measured.
+ */
+struct Usage {
+    uint64_t count = 0; // allocations
+    uint64_t bytes = 0; // bytes requested
+};
+
+#ifdef NICEHTTP_ALLOC_STATS
+Usage current(); // allocations made by this thread so far
+void account(size_t phase, const Usage& before, const Usage& after); // add the difference to the total of phase
+Usage total(size_t phase); // of all the requests so far
+#endif
+
+} // namespace alloc_stats
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define NICEHTTP_METRICS_SERIES 256    // route/status series per thread, the next ones are counted as route "other"
+#define NICEHTTP_HISTOGRAM_BUCKETS 544 // exact up to 16us, then 16 buckets per power of two up to 2^37us
+
+class Route;
+
+class LatencyHistogram {
+    /* HDR style log-linear histogram of microseconds: values below 16 have their
+     * own bucket, larger ones fall in one of the 16 buckets of their power of two,
+     * so the relative error is below 6.25% at any magnitude.
+     * Single writer: record() is only called by the thread owning the histogram,
+     * count() can be read from any thread at any time.
+     */
+public:
+    void record(uint64_t us);
+    uint64_t count(size_t bucket) const;
+    static size_t bucket(uint64_t us);
+    static uint64_t upper(size_t bucket); // largest value of the bucket
+private:
+    std::array<std::atomic<uint64_t>, NICEHTTP_HISTOGRAM_BUCKETS> buckets{};
+};
+
+class Metrics {
+    /* Process wide server metrics, exported in Prometheus text format.
+     * Every thread writes to its own block of counters and histograms, one
+     * series per route and status code, so the request path takes no lock and
+     * no contended atomic: render() merges the blocks at scrape time.
+     * Blocks of exited threads are reused by the next threads, counts included.
+     */
+public:
+    static Metrics& getInstance();
+    void request(const Route* route, int status, size_t bytes_in, size_t bytes_out, std::chrono::steady_clock::duration latency);
+    void accepted();   // connection accepted
+    void closed();     // connection closed
+    void parseError(); // malformed request
+    void unauthorized();
+    void notFound();
+    std::string render(); // Prometheus text format
+private:
+    struct Series {
+        const Route* route; // only compared, the route may be deleted before the next scrape
+        std::string method; // labels copied from the route when the series is created
+        std::string uri;
+        int status;
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> bytes_in{0};
+        std::atomic<uint64_t> bytes_out{0};
+        std::atomic<uint64_t> latency_sum{0}; // us
+        LatencyHistogram latency{};
+    };
+    struct ThreadMetrics {
+        std::array<std::atomic<Series*>, NICEHTTP_METRICS_SERIES> series{};
+        std::vector<std::unique_ptr<Series>> owned; // owner thread only
+        Series other{nullptr, "", "", 0};           // used when the table is full
+        std::atomic<uint64_t> accepted{0};
+        std::atomic<uint64_t> closed{0};
+        std::atomic<uint64_t> parse_errors{0};
+        std::atomic<uint64_t> unauthorized{0};
+        std::atomic<uint64_t> not_found{0};
+    };
+    struct Handle {
+        ThreadMetrics* block = nullptr;
+        ~Handle();
+    };
+    std::mutex registry; // taken when a thread starts or stops, and by render()
+    std::vector<std::unique_ptr<ThreadMetrics>> blocks;
+    std::vector<ThreadMetrics*> free_blocks;
+    ThreadMetrics& local();
+    Series& series(ThreadMetrics& block, const Route* route, int status);
+    static void bump(std::atomic<uint64_t>& counter, uint64_t n = 1);
+};
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define NICEHTTP_TRACE_EVENTS 4096 // phase events kept per thread (ring buffer)
+#define NICEHTTP_TRACE_SLOW 100    // ms, slower requests are logged with their phase breakdown
+
+namespace trace {
+
+// Phases of a server request, each one ends when the next begins
+enum class Phase : uint8_t {
+    Queue,    // accepted, waiting for a worker
+    Recv,     // reading the request head
+    Parse,    // parsing request line and headers
+    Route,    // matching the route
+    Executor, // waiting in the route executor
+    Body,     // reading the request body
+    Handler,  // route callback
+    Compress, // compressing the response body (NICEHTTP_COMPRESSION)
+    Serialize,// Response::toString
+    Send,     // writing the response
+    Proxy,    // forwarding to the upstream and streaming the response back
+    Request,  // whole request, from accept to the end
+    Count
+};
+
+const char* phaseName(Phase phase);
+
+class AllocationMeter {
+    /* Heap allocations made in each phase of a request, accounted in
+     * alloc_stats when compiled with NICEHTTP_ALLOC_STATS, nothing otherwise.
+     * A phase ending on another thread than the previous one (executor
+     * handoff) is not accounted.
+     */
+#ifdef NICEHTTP_ALLOC_STATS
+public:
+    void mark(Phase phase) {
+        alloc_stats::Usage now = alloc_stats::current();
+        if (this->thread == std::this_thread::get_id()) {
+            alloc_stats::account(static_cast<size_t>(phase), this->last, now);
+        }
+        this->thread = std::this_thread::get_id();
+        this->last = alloc_stats::current(); // without the accounting itself
+    }
+private:
+    std::thread::id thread;
+    alloc_stats::Usage last;
+#else
+public:
+    void mark(Phase) {}
+#endif
+};
+
+#ifdef NICEHTTP_TRACE
+
+class RequestTrace {
+    /* Timestamps of the phases of one request, kept on the stack (or in the
+     * task handed to an executor) and written to the ring of the thread that
+     * finishes the request.
+     */
+public:
+    RequestTrace();
+    void mark(Phase phase); // phase ended now
+    int64_t start() const { return this->begin; }
+    int64_t elapsed() const; // ns since start
+private:
+    friend class Tracer;
+    int64_t begin;
+    uint8_t count = 0;
+    std::array<Phase, 12> phases;
+    std::array<int64_t, 12> ends;
+    [[no_unique_address]] AllocationMeter allocations;
+};
+
+class Tracer {
+    /* Per thread lock-free rings of the last NICEHTTP_TRACE_EVENTS phase events.
+     * Only the owner thread writes a ring; readers copy it at any time, using
+     * the per slot sequence number to skip the events being overwritten.
+     */
+public:
+    static Tracer& getInstance();
+    static int64_t now(); // CLOCK_MONOTONIC ns
+    void record(RequestTrace& trace, std::string_view method, std::string_view uri);
+    std::string chromeTrace(); // trace event JSON, load it in chrome://tracing or Perfetto
+private:
+    struct Event {
+        std::atomic<uint64_t> seq{0}; // odd while being written
+        std::atomic<uint64_t> request{0};
+        std::atomic<uint64_t> phase{0};
+        std::atomic<int64_t> begin{0};
+        std::atomic<int64_t> end{0};
+    };
+    struct Ring {
+        size_t index; // tid in the trace
+        std::atomic<uint64_t> head{0};
+        uint64_t requests = 0; // owner only
+        std::array<Event, NICEHTTP_TRACE_EVENTS> events;
+    };
+    struct Handle {
+        Ring* ring = nullptr;
+        ~Handle();
+    };
+    std::mutex registry;
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::vector<Ring*> free_rings;
+    Ring& local();
+    void write(Ring& ring, uint64_t request, Phase phase, int64_t begin, int64_t end);
+};
+
+#else
+
+// Tracing disabled: every call compiles to nothing (but the allocation accounting, if enabled)
+class RequestTrace {
+public:
+    void mark(Phase phase) { this->allocations.mark(phase); }
+private:
+    [[no_unique_address]] AllocationMeter allocations;
+};
+
+class Tracer {
+public:
+    static Tracer& getInstance() {
+        static Tracer tracer;
+        return tracer;
+    }
+    void record(RequestTrace&, std::string_view, std::string_view) {}
+    std::string chromeTrace() { return "{\"traceEvents\":[]}"; }
+};
+
+#endif
+
+} // namespace trace
+
+#include <iostream>
+#include <cstring>
+#include <unistd.h>
+#include <thread>
+#include <string_view>
+#include <map>
+#include <exception>
+#include <iterator>
+#include <sstream>
+#include <chrono>
+#include <atomic>
+#include <array>
+#include <random>
+#include <stdexcept>
+#include <set>
+#include <mutex>
+#include <optional>
+#include <memory_resource>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <iomanip>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/poll.h>
+#endif
+#include <signal.h>
+
+#define NICEHTTP_THREADS 10 // thread pool size
+#define NICEHTTP_MAX_THREADS 10 // the pool grows up to this size when requests wait (elastic if > NICEHTTP_THREADS)
+#define NICEHTTP_GROW_AFTER 100 // ms a request can wait in the queue before a worker is added
+#define NICEHTTP_IDLE_TIMEOUT 30000 // ms after which an idle worker over NICEHTTP_THREADS stops
+#define NICEHTTP_AFFINITY dp::worker_affinity::none // pin the server workers to cpus: none, compact or scatter (NUMA nodes)
+#define NICEHTTP_SPIN_TIME 0 // µs an idle server worker spins, then as long yields, before sleeping
+#define PKT_BLOCK_SIZE 4096 // Block size (in byte) read from tcp socket
+#define NICEHTTP_RETRY_RATIO 10 // retries allowed every 100 client requests (retry budget)
+#define NICEHTTP_RETRY_BURST 10 // retries that can be spent at once when the budget is full
+#define NICEHTTP_LATENCY_SAMPLES 128 // client latencies kept to compute the hedging delay
+#define NICEHTTP_PROXY_TIMEOUT 30000 // ms to forward a request to the upstream and its response back
+#define NICEHTTP_KEEPALIVE_TIMEOUT 5000 // ms an idle keep-alive connection is kept open by the server
+#define NICEHTTP_KEEPALIVE_REQUESTS 1000 // requests served on a connection before closing it
+#define NICEHTTP_ARENA_SIZE 8192 // bytes of the per connection arena allocated with the connection
+
+#ifdef NICEHTTP_VERBOSE
+#define NLOG(x)  { std::ostringstream& nlog = Logger::stream(); nlog << x; Logger::getInstance().log(Logger::Debug, nlog.str()); }
+#else
+#define NLOG(X)
+#endif
+
+struct RequestOptions {
+    /* Client limits of a single NiceHTTP::request call.
+     * Timeouts are in milliseconds, 0 means no limit.
+     */
+    int connect_timeout = 0;    // TCP handshake, for each address of the host
+    int first_byte_timeout = 0; // from request sent to the first byte of the response
+    int total_timeout = 0;      // whole call, retries and backoff included
+    int max_retries = 0;        // attempts after the first one, bounded by the retry budget
+    int backoff = 50;           // base backoff, doubled at each attempt and fully jittered
+    int max_backoff = 1000;
+    bool hedge = false;         // send a second copy of an idempotent request when the first one is slow
+    int hedge_delay = 0;        // wait before hedging, 0 uses the p95 latency of previous requests
+    bool keep_alive = false;    // reuse pooled connections instead of closing them after the response
+    bool compressed = false;    // ask for a gzip/deflate response and inflate it (NICEHTTP_COMPRESSION)
+    CircuitBreaker *breaker = nullptr; // breaker of the destination host (upstream groups have their own)
+};
+
+class RetryBudget {
+    /* Process wide token bucket shared by all the clients.
+     * Every request deposits NICEHTTP_RETRY_RATIO hundredths of a token and every
+     * retry withdraws a whole token, so when a backend goes down the retries
+     * can't multiply the load sent to it.
+     */
+public:
+    static void deposit();
+    static bool withdraw(); // true if a retry is allowed
+private:
+    inline static std::atomic<int> tokens{NICEHTTP_RETRY_BURST * 100};
+};
+
+class NiceHTTP {
+    /* Implements HTTP REST API server and client.
+     * The server keeps HTTP/1.1 connections alive (Linux) and parses every request into
+     * the arena of its connection, released before the next request.
+     * Implemented mainly to exchange json messages: handlers read the payload with
+     * Message::json() or Message::cbor() and answer with Response::writeBody(),
+     * which writes JSON or CBOR as the client accepts.
+     * The server is multi-threaded.
+     */
+public:
+    NiceHTTP();
+    ~NiceHTTP();
+    void start(std::string iface, short port); //Start the server
+    http::Response request(http::Request req, std::string host, short port, const RequestOptions& opts = {}); //Start the client
+    http::Response request(http::Request req, UpstreamGroup& upstream, const RequestOptions& opts = {}, std::string_view key = ""); //Client balancing over replicas
+    Router& getRouter();
+    ResponseCache& getCache(); // responses of the routes with Route::cache_ttl, clear() to invalidate them
+    void addExecutor(const std::string& name, unsigned int threads, unsigned int max_queue = 0); //Bulkhead for the routes with Route::executor = name (call before start)
+    void enableMetrics(std::string_view uri = "/metrics"); //Prometheus metrics route
+    void enableTracing(std::string_view uri = "/debug/trace"); //Chrome trace of the last requests (needs NICEHTTP_TRACE)
+    void enableAccessLog(const std::string& path = ""); //Log every request to path (stdout if empty)
+    void enableProfiling(std::string_view uri = "/debug/profile"); //CPU profile of ?seconds=N as folded stacks (Linux)
+    bool enableCapture(const std::string& path, uint64_t max_bytes = 0); //Record the received requests for bench/replay (max_bytes 0: no limit)
+private:
+    Router router;
+    int server_socket = -1;
+    ConnectionPool connections; // idle keep-alive client connections
+    Capture capture; // received requests, when enabled
+    ResponseCache cache;
+    SingleFlight flights; // requests of the routes with Route::coalesce running the handler
+    #ifdef NICEHTTP_COMPRESSION
+    compression::Cache compressed; // bodies of the routes with Route::cache_compressed
+    void compress(const http::Request& r, http::Response& resp, const Route* route);
+    #endif
+    std::string profile_uri; // pattern of the profiling route, query string included
+    std::array<std::atomic<int>, NICEHTTP_LATENCY_SAMPLES> latencies{}; // last client latencies (ms)
+    std::atomic<size_t> latency_count{0};
+    std::atomic<dp::thread_pool<>*> server_pool{nullptr}; // while the server runs, for the metrics
+    struct Connection {
+        /* Accepted client connection, owned by the thread serving it or by the idle set.
+         * Requests and responses are allocated in the arena, the first NICEHTTP_ARENA_SIZE
+         * bytes with the connection itself, and the arena is released before the next request.
+         */
+        int fd;
+        std::string pending; // bytes received after the last request (pipelining)
+        unsigned int requests = 0;
+        std::chrono::steady_clock::time_point idle_since;
+        alignas(std::max_align_t) std::byte buffer[NICEHTTP_ARENA_SIZE];
+        std::pmr::monotonic_buffer_resource arena{this->buffer, sizeof(this->buffer)};
+        explicit Connection(int fd) : fd(fd) {}
+    };
+    std::mutex idle_mutex;
+    std::vector<Connection*> idle; // keep-alive connections waiting for the next request, polled by start()
+    int wake[2] = {-1, -1}; // pipe waking up start() when a connection becomes idle
+    bool server_setup(const std::string& iface, const short& port);
+    int client_connect(const std::string& host, const short& port, int timeout, std::chrono::steady_clock::time_point deadline, size_t first_address = 0);
+    http::Response client_attempt(const std::string& raw_req, const std::string& host, const short& port, const RequestOptions& opts, std::chrono::steady_clock::time_point deadline, bool idempotent, bool reuse, bool& sent);
+    void backoff(int attempt, const RequestOptions& opts, std::chrono::steady_clock::time_point deadline);
+    template <typename String>
+    bool recv_head(const int& socket, String& head, String& rest, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+    template <typename String>
+    bool recv_body(const int& socket, std::string_view head, String& body, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max(), String* excess = nullptr);
+    template <typename String>
+    bool recv_http(const int& socket, String& head, String& body, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+    void record_latency(int ms);
+    int hedge_delay(const RequestOptions& opts);
+    void serve(Connection* conn, trace::RequestTrace trace);
+    bool parsereq(Connection* conn, trace::RequestTrace& trace);
+    bool respond(Connection* conn, http::Request& r, std::string_view head, std::pmr::string& rest, bool complete, const Route* route, std::chrono::steady_clock::time_point start, trace::RequestTrace& trace);
+    bool finish(Connection* conn, const http::Request& r, const Route* route, short code, size_t bytes_in, size_t bytes_out, std::chrono::steady_clock::time_point start, trace::RequestTrace& trace, bool keep = false);
+    void park(Connection* conn);
+    short send_cached(Connection* conn, const http::Request& r, const ResponseCache::Entry& entry, bool keep);
+    void close_idle();
+    short proxyreq(const int& client_fd, const http::Request& req, std::string_view head, std::string_view body, const Route& route, bool& keep);
+    short reply(const int& client_fd, short code, const std::string& message);
+    std::string poolMetrics();
+    void cleanup();
+    std::map<std::string, std::unique_ptr<Executor>, std::less<>> executors; // last member: stopped first
+};
+
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#if !defined(NICEHTTP_JSON_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#include <immintrin.h>
+#endif
+
+// characters of a 64 byte block, one bit each
+struct JsonBlock {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op; // {}[]:,
+    uint64_t space;
+    uint64_t high; // bytes >= 0x80, parts of UTF-8 sequences
+};
+
+static JsonBlock json_classify(const char* p) {
+    JsonBlock b;
+#if !defined(NICEHTTP_JSON_NO_SIMD) && defined(__AVX2__)
+    auto mask = [](__m256i v) { return static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(v))); };
+    __m256i chunks[2] = {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32))};
+    b = {0, 0, 0, 0, 0};
+    for (int i = 0; i < 2; i++) {
+        __m256i c = chunks[i];
+        b.high |= mask(c) << (32 * i);
+        __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20)); // [ -> {, ] -> }
+        b.quote |= mask(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('"'))) << (32 * i);
+        b.backslash |= mask(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\\'))) << (32 * i);
+        b.op |= mask(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))),
+                                     _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(':')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8(','))))) << (32 * i);
+        b.space |= mask(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\t'))),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\r'))))) << (32 * i);
+    }
+#elif !defined(NICEHTTP_JSON_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+    auto mask = [](__m128i v) { return static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(v))); };
+    b = {0, 0, 0, 0, 0};
+    for (int i = 0; i < 4; i++) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i));
+        b.high |= mask(c) << (16 * i);
+        __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+        b.quote |= mask(_mm_cmpeq_epi8(c, _mm_set1_epi8('"'))) << (16 * i);
+        b.backslash |= mask(_mm_cmpeq_epi8(c, _mm_set1_epi8('\\'))) << (16 * i);
+        b.op |= mask(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')), _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+                                  _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(':')), _mm_cmpeq_epi8(c, _mm_set1_epi8(','))))) << (16 * i);
+        b.space |= mask(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\t'))),
+                                     _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\r'))))) << (16 * i);
+    }
+#else
+    b = {0, 0, 0, 0, 0};
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = uint64_t(1) << i;
+        if (static_cast<unsigned char>(p[i]) >= 0x80) {
+            b.high |= bit;
+        }
+        switch (p[i]) {
+            case '"': b.quote |= bit; break;
+            case '\\': b.backslash |= bit; break;
+            case '{': case '}': case '[': case ']': case ':': case ',': b.op |= bit; break;
+            case ' ': case '\t': case '\n': case '\r': b.space |= bit; break;
+            default: break;
+        }
+    }
+#endif
+    return b;
+}
+
+static uint64_t json_prefix_xor(uint64_t x) {
+    // bit i = xor of the bits 0..i: 1 from an opening quote to the character before the closing one
+#if !defined(NICEHTTP_JSON_NO_SIMD) && defined(__PCLMUL__)
+    return static_cast<uint64_t>(_mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_set_epi64x(0, static_cast<int64_t>(x)), _mm_set1_epi8(-1), 0)));
+#else
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+#endif
+}
+
+static uint64_t json_escaped(uint64_t backslash, uint64_t& carry) {
+    // characters after an odd number of backslashes, carry: the previous block ended with one
+    const uint64_t even = 0x5555555555555555ULL, odd = ~even;
+    uint64_t starts = backslash & ~(backslash << 1);
+    uint64_t even_start_mask = even ^ carry;
+    uint64_t even_starts = starts & even_start_mask;
+    uint64_t odd_starts = starts & ~even_start_mask;
+    uint64_t even_carries = backslash + even_starts;
+    uint64_t odd_carries = backslash + odd_starts;
+    bool overflow = odd_carries < backslash;
+    odd_carries |= carry;
+    carry = overflow ? 1 : 0;
+    uint64_t even_carry_ends = even_carries & ~backslash;
+    uint64_t odd_carry_ends = odd_carries & ~backslash;
+    return (even_carry_ends & odd) | (odd_carry_ends & even);
+}
+
+// UTF-8 sequence carried from a block to the next one
+struct JsonUtf8 {
+    unsigned need = 0; // continuation bytes still expected
+    unsigned char low = 0x80, high = 0xbf; // range of the next one (no overlongs, surrogates or code points > 10FFFF)
+};
+
+static int json_utf8(const char* p, JsonUtf8& s) {
+    // validate the UTF-8 of a 64 byte block, returns the offset of the first invalid byte or -1
+    for (int i = 0; i < 64; i++) {
+        unsigned char c = static_cast<unsigned char>(p[i]);
+        if (s.need > 0) {
+            if ((c < s.low) || (c > s.high)) {
+                return i;
+            }
+            s.low = 0x80;
+            s.high = 0xbf;
+            s.need--;
+        } else if (c >= 0x80) {
+            if ((c >= 0xc2) && (c <= 0xdf)) {
+                s.need = 1;
+            } else if ((c >= 0xe0) && (c <= 0xef)) {
+                s.need = 2;
+                s.low = (c == 0xe0) ? 0xa0 : 0x80;
+                s.high = (c == 0xed) ? 0x9f : 0xbf;
+            } else if ((c >= 0xf0) && (c <= 0xf4)) {
+                s.need = 3;
+                s.low = (c == 0xf0) ? 0x90 : 0x80;
+                s.high = (c == 0xf4) ? 0x8f : 0xbf;
+            } else {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+static void json_index(std::string_view text, std::pmr::vector<uint32_t>& out) {
+    // stage 1: positions of the structural characters, the opening quotes and the first character of the other values,
+    // and UTF-8 validation of the blocks that aren't ASCII
+    uint64_t escape_carry = 0, in_string_carry = 0, scalar_carry = 0;
+    JsonUtf8 utf8;
+    char tail[64];
+    size_t n = out.size();
+    for (size_t base = 0; base < text.size(); base += 64) {
+        const char* p = text.data() + base;
+        if (text.size() - base < 64) {
+            std::memset(tail, ' ', sizeof(tail));
+            std::memcpy(tail, p, text.size() - base);
+            p = tail;
+        }
+        JsonBlock b = json_classify(p);
+        if ((b.high != 0) || (utf8.need != 0)) {
+            // the padding of the last block is ASCII, a sequence truncated at the end fails there
+            if (int invalid = json_utf8(p, utf8); invalid >= 0) {
+                throw json::Error("Invalid UTF-8 at " + std::to_string(std::min(base + invalid, text.size())));
+            }
+        }
+        uint64_t quotes = b.quote & ~json_escaped(b.backslash, escape_carry);
+        uint64_t in_string = json_prefix_xor(quotes) ^ in_string_carry;
+        in_string_carry = static_cast<uint64_t>(static_cast<int64_t>(in_string) >> 63);
+        uint64_t scalar = ~(b.op | b.space | quotes | in_string);
+        uint64_t starts = scalar & ~((scalar << 1) | scalar_carry);
+        scalar_carry = scalar >> 63;
+        uint64_t structural = (b.op & ~in_string) | (quotes & in_string) | starts;
+        // room for a whole block, the positions are written 8 at a time (as simdjson does) and the size fixed afterwards
+        if (out.size() < n + 64) {
+            out.resize(std::max(out.size() * 2, n + 64));
+        }
+        uint32_t* w = out.data() + n;
+        n += std::popcount(structural);
+        while (structural != 0) {
+            for (int i = 0; i < 8; i++) {
+                w[i] = static_cast<uint32_t>(base + std::countr_zero(structural));
+                structural &= structural - 1;
+            }
+            w += 8;
+        }
+    }
+    out.resize(n);
+    if (utf8.need != 0) {
+        throw json::Error("Invalid UTF-8 at " + std::to_string(text.size())); // truncated at the end of a 64 byte block
+    }
+    if (in_string_carry != 0) {
+        throw json::Error("Unterminated string");
+    }
+}
+
+static bool json_scalar_char(char c) {
+    switch (c) {
+        case '{': case '}': case '[': case ']': case ':': case ',': case '"':
+        case ' ': case '\t': case '\n': case '\r':
+            return false;
+        default:
+            return true;
+    }
+}
+
+static std::string_view json_scalar(std::string_view text, uint32_t pos) {
+    // the literal or number starting at pos
+    size_t end = pos;
+    while ((end < text.size()) && json_scalar_char(text[end])) end++;
+    return text.substr(pos, end - pos);
+}
+
+static size_t json_number(std::string_view s) {
+    // length of -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)? at the start of s, 0 if there is no number
+    size_t i = 0;
+    auto digits = [&s, &i] {
+        size_t start = i;
+        while ((i < s.size()) && (s[i] >= '0') && (s[i] <= '9')) i++;
+        return i > start;
+    };
+    if ((i < s.size()) && (s[i] == '-')) i++;
+    if ((i < s.size()) && (s[i] == '0')) {
+        i++;
+    } else if (!digits()) {
+        return 0;
+    }
+    if ((i < s.size()) && (s[i] == '.')) {
+        i++;
+        if (!digits()) return 0;
+    }
+    if ((i < s.size()) && ((s[i] == 'e') || (s[i] == 'E'))) {
+        i++;
+        if ((i < s.size()) && ((s[i] == '+') || (s[i] == '-'))) i++;
+        if (!digits()) return 0;
+    }
+    return i;
+}
+
+static bool json_valid_scalar(std::string_view text, uint32_t pos) {
+    // a literal or a number, followed by a structural character, a space or the end
+    std::string_view s = text.substr(pos);
+    size_t length;
+    switch (s[0]) {
+        case 't': length = s.starts_with("true") ? 4 : 0; break;
+        case 'f': length = s.starts_with("false") ? 5 : 0; break;
+        case 'n': length = s.starts_with("null") ? 4 : 0; break;
+        default: length = json_number(s); break;
+    }
+    return (length > 0) && ((length == s.size()) || !json_scalar_char(s[length]));
+}
+
+static size_t json_special(const char* p, size_t n) {
+    // first ", \ or control character, n if there is none
+    size_t i = 0;
+#if !defined(NICEHTTP_JSON_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+    for (; i + 16 <= n; i += 16) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('"')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\\'))),
+                                       _mm_cmpeq_epi8(_mm_max_epu8(c, _mm_set1_epi8(0x1f)), _mm_set1_epi8(0x1f)));
+        if (int mask = _mm_movemask_epi8(special)) {
+            return i + std::countr_zero(static_cast<unsigned>(mask));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned char c = static_cast<unsigned char>(p[i]);
+        if ((c == '"') || (c == '\\') || (c < 0x20)) return i;
+    }
+    return n;
+}
+
+void json::Document::parse(std::string_view text) {
+    // stage 2: check the grammar on the structural positions and link the brackets
+    this->text = {};
+    this->structurals.clear();
+    this->strings.clear();
+    if (text.size() >= UINT32_MAX) {
+        throw Error("Document too large");
+    }
+    json_index(text, this->structurals);
+    const std::pmr::vector<uint32_t>& s = this->structurals;
+    if (s.empty()) {
+        throw Error("Empty document");
+    }
+    this->jumps.assign(s.size(), 0);
+    std::pmr::vector<uint32_t> open(this->structurals.get_allocator());
+    enum class State { Value, FirstElement, FirstKey, Key, Colon, AfterValue } state = State::Value;
+    for (uint32_t i = 0; i < s.size(); i++) {
+        char c = text[s[i]];
+        bool close = false;
+        switch (state) {
+            case State::FirstElement:
+                if (c == ']') {
+                    close = true;
+                    break;
+                }
+                [[fallthrough]];
+            case State::Value:
+                if ((c == '{') || (c == '[')) {
+                    if (open.size() >= NICEHTTP_JSON_MAX_DEPTH) {
+                        throw Error("Document too deep");
+                    }
+                    open.push_back(i);
+                    state = (c == '{') ? State::FirstKey : State::FirstElement;
+                } else if (c == '"') {
+                    state = State::AfterValue;
+                } else {
+                    if (!json_valid_scalar(text, s[i])) {
+                        std::string_view scalar = json_scalar(text, s[i]);
+                        throw Error("Unexpected '" + std::string(scalar.empty() ? std::string_view(&text[s[i]], 1) : scalar.substr(0, 16)) + "' at " + std::to_string(s[i]));
+                    }
+                    state = State::AfterValue;
+                }
+                break;
+            case State::FirstKey:
+                if (c == '}') {
+                    close = true;
+                    break;
+                }
+                [[fallthrough]];
+            case State::Key:
+                if (c != '"') {
+                    throw Error("Expected a key at " + std::to_string(s[i]));
+                }
+                state = State::Colon;
+                break;
+            case State::Colon:
+                if (c != ':') {
+                    throw Error("Expected ':' at " + std::to_string(s[i]));
+                }
+                state = State::Value;
+                break;
+            case State::AfterValue:
+                if (open.empty()) {
+                    throw Error("Unexpected text after the value at " + std::to_string(s[i]));
+                }
+                if (c == ',') {
+                    state = (text[s[open.back()]] == '{') ? State::Key : State::Value;
+                } else if ((c == '}' || c == ']') && (text[s[open.back()]] == c - 2)) { // {} and [] are 2 apart
+                    close = true;
+                } else {
+                    throw Error("Expected ',' or a closing bracket at " + std::to_string(s[i]));
+                }
+                break;
+        }
+        if (close) {
+            this->jumps[open.back()] = i;
+            open.pop_back();
+            state = State::AfterValue;
+        }
+    }
+    if ((state != State::AfterValue) || !open.empty()) {
+        throw Error("Unexpected end of the document");
+    }
+    this->text = text;
+}
+
+uint32_t json::Document::skip(uint32_t index) const {
+    char c = this->text[this->structurals[index]];
+    return ((c == '{') || (c == '[')) ? this->jumps[index] + 1 : index + 1;
+}
+
+static const char* json_type_name(json::Type t) {
+    switch (t) {
+        case json::Type::Null: return "null";
+        case json::Type::Bool: return "bool";
+        case json::Type::Number: return "number";
+        case json::Type::String: return "string";
+        case json::Type::Array: return "array";
+        case json::Type::Object: return "object";
+        default: return "missing";
+    }
+}
+
+json::Type json::Value::type() const {
+    if ((this->doc == nullptr) || (this->index == UINT32_MAX)) {
+        return Type::Missing;
+    }
+    switch (this->doc->text[this->position()]) {
+        case '{': return Type::Object;
+        case '[': return Type::Array;
+        case '"': return Type::String;
+        case 't': case 'f': return Type::Bool;
+        case 'n': return Type::Null;
+        default: return Type::Number;
+    }
+}
+
+uint32_t json::Value::position() const {
+    return this->doc->structurals[this->index];
+}
+
+void json::Value::expect(Type t) const {
+    Type actual = this->type();
+    if (actual != t) {
+        throw Error(std::string("Expected ") + json_type_name(t) + ", the value is " + json_type_name(actual));
+    }
+}
+
+bool json::Value::getBool() const {
+    this->expect(Type::Bool);
+    return this->doc->text[this->position()] == 't';
+}
+
+bool json::Value::isInt() const {
+    if (this->type() != Type::Number) {
+        return false;
+    }
+    std::string_view s = json_scalar(this->doc->text, this->position());
+    int64_t n = 0;
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+    return (ec == std::errc()) && (end == s.data() + s.size());
+}
+
+int64_t json::Value::getInt() const {
+    this->expect(Type::Number);
+    std::string_view s = json_scalar(this->doc->text, this->position());
+    int64_t n = 0;
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+    if ((ec != std::errc()) || (end != s.data() + s.size())) {
+        throw Error("Not an integer: " + std::string(s));
+    }
+    return n;
+}
+
+double json::Value::getDouble() const {
+    this->expect(Type::Number);
+    std::string_view s = json_scalar(this->doc->text, this->position());
+    double d = 0;
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), d);
+    if (ec == std::errc::result_out_of_range) {
+        return (s[0] == '-') ? -HUGE_VAL : HUGE_VAL; // too small numbers are 0 already
+    }
+    return d;
+}
+
+static unsigned json_hex4(const char*& p, const char* end) {
+    unsigned v = 0;
+    if (end - p < 4) {
+        throw json::Error("Truncated \\u escape");
+    }
+    auto [next, ec] = std::from_chars(p, p + 4, v, 16);
+    if ((ec != std::errc()) || (next != p + 4)) {
+        throw json::Error("Invalid \\u escape");
+    }
+    p += 4;
+    return v;
+}
+
+static void json_append_utf8(std::pmr::string& out, unsigned cp) {
+    if (cp < 0x80) {
+        out.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+        out.push_back(static_cast<char>(0xc0 | (cp >> 6)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+        out.push_back(static_cast<char>(0xe0 | (cp >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    } else {
+        out.push_back(static_cast<char>(0xf0 | (cp >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    }
+}
+
+std::string_view json::Value::getString() const {
+    this->expect(Type::String);
+    const char* p = this->doc->text.data() + this->position() + 1;
+    const char* end = this->doc->text.data() + this->doc->text.size();
+    size_t n = json_special(p, end - p);
+    if ((p + n < end) && (p[n] == '"')) {
+        return std::string_view(p, n); // no escapes
+    }
+    std::pmr::string& out = this->doc->strings.emplace_back();
+    while (true) {
+        n = json_special(p, end - p);
+        out.append(p, n);
+        p += n;
+        if ((p == end) || (static_cast<unsigned char>(*p) < 0x20)) {
+            throw Error("Control character in a string");
+        }
+        if (*p == '"') {
+            return out;
+        }
+        if (++p == end) {
+            throw Error("Truncated escape");
+        }
+        switch (*p++) {
+            case '"': out.push_back('"'); break;
+            case '\\': out.push_back('\\'); break;
+            case '/': out.push_back('/'); break;
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'u': {
+                unsigned cp = json_hex4(p, end);
+                if ((cp >= 0xd800) && (cp < 0xdc00)) {
+                    // high surrogate, the low one must follow
+                    if ((end - p < 2) || (p[0] != '\\') || (p[1] != 'u')) {
+                        throw Error("Unpaired surrogate in a string");
+                    }
+                    p += 2;
+                    unsigned low = json_hex4(p, end);
+                    if ((low < 0xdc00) || (low >= 0xe000)) {
+                        throw Error("Unpaired surrogate in a string");
+                    }
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                } else if ((cp >= 0xdc00) && (cp < 0xe000)) {
+                    throw Error("Unpaired surrogate in a string");
+                }
+                json_append_utf8(out, cp);
+                break;
+            }
+            default:
+                throw Error("Invalid escape in a string");
+        }
+    }
+}
+
+std::string_view json::Value::key() const {
+    const Document* d = this->doc;
+    if ((this->type() == Type::Missing) || (this->index < 2) || (d->text[d->structurals[this->index - 1]] != ':')) {
+        throw Error("Not a member of an object");
+    }
+    return Value(d, this->index - 2).getString();
+}
+
+std::string_view json::Value::raw() const {
+    Type t = this->type();
+    if (t == Type::Missing) {
+        throw Error("Missing value");
+    }
+    std::string_view text = this->doc->text;
+    uint32_t pos = this->position();
+    if ((t == Type::Object) || (t == Type::Array)) {
+        return text.substr(pos, this->doc->structurals[this->doc->jumps[this->index]] + 1 - pos);
+    } else if (t == Type::String) {
+        size_t i = pos + 1;
+        while (true) {
+            i += json_special(text.data() + i, text.size() - i);
+            if (text[i] == '"') break; // stage 1 found the closing quote
+            i += (text[i] == '\\') ? 2 : 1;
+        }
+        return text.substr(pos, i + 1 - pos);
+    }
+    return json_scalar(text, pos);
+}
+
+json::Value json::Value::operator[](std::string_view key) const {
+    if (this->type() == Type::Missing) {
+        return Value(); // so that lookups can be chained
+    }
+    this->expect(Type::Object);
+    const Document* d = this->doc;
+    for (uint32_t i = this->index + 1; i < d->jumps[this->index]; i = d->skip(i + 2) + 1) { // "key" : value ,
+        if (Value(d, i).getString() == key) {
+            return Value(d, i + 2);
+        }
+    }
+    return Value();
+}
+
+json::Value json::Value::operator[](size_t i) const {
+    if (this->type() == Type::Missing) {
+        return Value();
+    }
+    this->expect(Type::Array);
+    for (Value element : *this) {
+        if (i-- == 0) {
+            return element;
+        }
+    }
+    return Value();
+}
+
+size_t json::Value::size() const {
+    return std::distance(this->begin(), this->end());
+}
+
+json::Value::Iterator json::Value::begin() const {
+    Type t = this->type();
+    if ((t != Type::Array) && (t != Type::Object)) {
+        throw Error(std::string("Expected array or object, the value is ") + json_type_name(t));
+    }
+    return Iterator(this->doc, this->index + 1);
+}
+
+json::Value::Iterator json::Value::end() const {
+    Type t = this->type();
+    if ((t != Type::Array) && (t != Type::Object)) {
+        throw Error(std::string("Expected array or object, the value is ") + json_type_name(t));
+    }
+    return Iterator(this->doc, this->doc->jumps[this->index]);
+}
+
+json::Value json::Value::Iterator::operator*() const {
+    // members of objects are "key" : value
+    bool member = this->doc->text[this->doc->structurals[this->index + 1]] == ':';
+    return Value(this->doc, member ? this->index + 2 : this->index);
+}
+
+json::Value::Iterator& json::Value::Iterator::operator++() {
+    uint32_t next = this->doc->skip((**this).index);
+    // a comma or the closing bracket (the end)
+    this->index = (this->doc->text[this->doc->structurals[next]] == ',') ? next + 1 : next;
+    return *this;
+}
+
+void json::Writer::separate() {
+    if (this->after_key) {
+        this->after_key = false;
+        return;
+    }
+    uint64_t bit = uint64_t(1) << (this->depth % 64);
+    uint64_t& word = this->nonempty[this->depth / 64];
+    if (word & bit) {
+        this->out.push_back(',');
+    } else {
+        word |= bit;
+    }
+}
+
+void json::Writer::done() {
+    if ((this->depth == 0) && (this->length != nullptr)) {
+        *this->length = this->out.size();
+    }
+}
+
+json::Writer& json::Writer::beginObject() {
+    this->separate();
+    if (this->depth + 1 >= NICEHTTP_JSON_MAX_DEPTH) {
+        throw Error("Document too deep");
+    }
+    this->out.push_back('{');
+    this->depth++;
+    this->nonempty[this->depth / 64] &= ~(uint64_t(1) << (this->depth % 64));
+    return *this;
+}
+
+json::Writer& json::Writer::endObject() {
+    if (this->depth == 0) {
+        throw Error("endObject without beginObject");
+    }
+    this->out.push_back('}');
+    this->depth--;
+    this->done();
+    return *this;
+}
+
+json::Writer& json::Writer::beginArray() {
+    this->separate();
+    if (this->depth + 1 >= NICEHTTP_JSON_MAX_DEPTH) {
+        throw Error("Document too deep");
+    }
+    this->out.push_back('[');
+    this->depth++;
+    this->nonempty[this->depth / 64] &= ~(uint64_t(1) << (this->depth % 64));
+    return *this;
+}
+
+json::Writer& json::Writer::endArray() {
+    if (this->depth == 0) {
+        throw Error("endArray without beginArray");
+    }
+    this->out.push_back(']');
+    this->depth--;
+    this->done();
+    return *this;
+}
+
+static void json_append_string(std::pmr::string& out, std::string_view s) {
+    static const char hex[] = "0123456789abcdef";
+    out.reserve(out.size() + s.size() + 2);
+    out.push_back('"');
+    while (true) {
+        size_t n = json_special(s.data(), s.size());
+        out.append(s.data(), n);
+        if (n == s.size()) break;
+        unsigned char c = static_cast<unsigned char>(s[n]);
+        switch (c) {
+            case '"': out.append("\\\""); break;
+            case '\\': out.append("\\\\"); break;
+            case '\n': out.append("\\n"); break;
+            case '\r': out.append("\\r"); break;
+            case '\t': out.append("\\t"); break;
+            case '\b': out.append("\\b"); break;
+            case '\f': out.append("\\f"); break;
+            default: {
+                char u[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                out.append(u, sizeof(u));
+            }
+        }
+        s.remove_prefix(n + 1);
+    }
+    out.push_back('"');
+}
+
+json::Writer& json::Writer::key(std::string_view name) {
+    this->separate();
+    json_append_string(this->out, name);
+    this->out.push_back(':');
+    this->after_key = true;
+    return *this;
+}
+
+json::Writer& json::Writer::null() {
+    this->separate();
+    this->out.append("null");
+    this->done();
+    return *this;
+}
+
+json::Writer& json::Writer::value(bool b) {
+    this->separate();
+    this->out.append(b ? "true" : "false");
+    this->done();
+    return *this;
+}
+
+json::Writer& json::Writer::value(double d) {
+    this->separate();
+    if (std::isfinite(d)) {
+        char digits[32];
+        auto end = std::to_chars(digits, digits + sizeof(digits), d).ptr; // shortest round trip
+        this->out.append(digits, end - digits);
+    } else {
+        this->out.append("null");
+    }
+    this->done();
+    return *this;
+}
+
+json::Writer& json::Writer::value(std::string_view s) {
+    this->separate();
+    json_append_string(this->out, s);
+    this->done();
+    return *this;
+}
+
+json::Writer& json::Writer::raw(std::string_view json) {
+    this->separate();
+    this->out.append(json);
+    this->done();
+    return *this;
+}
+
+void json::Writer::appendInt(int64_t n) {
+    char digits[24];
+    auto end = std::to_chars(digits, digits + sizeof(digits), n).ptr;
+    this->out.append(digits, end - digits);
+}
+
+void json::Writer::appendUint(uint64_t n) {
+    char digits[24];
+    auto end = std::to_chars(digits, digits + sizeof(digits), n).ptr;
+    this->out.append(digits, end - digits);
+}
+
+#include <bit>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+// initial byte and argument of an item
+struct CborHead {
+    uint8_t major;
+    uint8_t info; // 31: indefinite length (or break)
+    uint64_t value; // integer, length, count, tag, simple value or float bits
+    uint32_t size; // bytes of the head
+};
+
+static bool cbor_head(std::string_view data, size_t offset, CborHead& h) {
+    // false if truncated or malformed
+    if (offset >= data.size()) {
+        return false;
+    }
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data()) + offset;
+    h.major = p[0] >> 5;
+    h.info = p[0] & 0x1f;
+    if (h.info < 24) {
+        h.value = h.info;
+        h.size = 1;
+        return true;
+    } else if (h.info == 31) {
+        h.value = 0;
+        h.size = 1;
+        return (h.major >= 2) && (h.major != 6); // indefinite strings, arrays, maps and the break
+    } else if (h.info > 27) {
+        return false;
+    }
+    uint32_t bytes = 1u << (h.info - 24);
+    if (data.size() - offset - 1 < bytes) {
+        return false;
+    }
+    h.value = 0;
+    for (uint32_t i = 1; i <= bytes; i++) {
+        h.value = (h.value << 8) | p[i];
+    }
+    h.size = 1 + bytes;
+    return true;
+}
+
+static CborHead cbor_read_head(std::string_view data, size_t offset) {
+    // in a parsed document, well formed: no checks
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data()) + offset;
+    CborHead h {static_cast<uint8_t>(p[0] >> 5), static_cast<uint8_t>(p[0] & 0x1f), 0, 1};
+    switch (h.info) {
+        case 24: h.value = p[1]; h.size = 2; break;
+        case 25: h.value = (uint64_t(p[1]) << 8) | p[2]; h.size = 3; break;
+        case 26: {
+            uint32_t v;
+            std::memcpy(&v, p + 1, 4);
+            h.value = (std::endian::native == std::endian::little) ? std::byteswap(v) : v;
+            h.size = 5;
+            break;
+        }
+        case 27:
+            std::memcpy(&h.value, p + 1, 8);
+            h.value = (std::endian::native == std::endian::little) ? std::byteswap(h.value) : h.value;
+            h.size = 9;
+            break;
+        default:
+            h.value = (h.info < 24) ? h.info : 0;
+            break;
+    }
+    return h;
+}
+
+static double cbor_half(uint16_t half) {
+    int exponent = (half >> 10) & 0x1f;
+    double mantissa = half & 0x3ff;
+    double value;
+    if (exponent == 0) {
+        value = std::ldexp(mantissa, -24);
+    } else if (exponent != 31) {
+        value = std::ldexp(mantissa + 1024, exponent - 25);
+    } else {
+        value = (mantissa == 0) ? INFINITY : NAN;
+    }
+    return (half & 0x8000) ? -value : value;
+}
+
+void cbor::Document::parse(std::string_view data) {
+    // walk the whole item once to check it is well formed, so that reading it doesn't need to
+    this->data = {};
+    this->strings.clear();
+    if (data.size() >= UINT32_MAX) {
+        throw Error("Item too large");
+    }
+    struct Frame {
+        uint64_t expected; // items of a definite array or map
+        uint64_t count;
+        bool indefinite;
+        bool map;
+        int chunks; // major type of the chunks of an indefinite string, -1 for arrays and maps
+    };
+    std::pmr::vector<Frame> stack(this->strings.get_allocator());
+    size_t offset = 0;
+    bool tagged = false;
+    bool complete = false;
+    auto item_done = [&stack, &complete] {
+        // the item completes its container, that completes its own, and so on
+        while (!stack.empty()) {
+            Frame& f = stack.back();
+            f.count++;
+            if (f.indefinite || (f.count < f.expected)) {
+                return;
+            }
+            stack.pop_back();
+        }
+        complete = true;
+    };
+    while (!complete) {
+        CborHead h;
+        if (!cbor_head(data, offset, h)) {
+            throw Error((offset >= data.size() ? "Truncated item at " : "Malformed item at ") + std::to_string(offset));
+        }
+        if ((h.major == 7) && (h.info == 31)) {
+            if (stack.empty() || !stack.back().indefinite || tagged) {
+                throw Error("Unexpected break at " + std::to_string(offset));
+            }
+            if (stack.back().map && (stack.back().count % 2 != 0)) {
+                throw Error("Map without the last value at " + std::to_string(offset));
+            }
+            stack.pop_back();
+            offset += h.size;
+            item_done();
+            continue;
+        }
+        if (!stack.empty() && (stack.back().chunks >= 0) && ((h.major != stack.back().chunks) || (h.info == 31))) {
+            throw Error("Invalid chunk of a string at " + std::to_string(offset));
+        }
+        offset += h.size;
+        tagged = h.major == 6;
+        switch (h.major) {
+            case 2:
+            case 3:
+                if (h.info == 31) {
+                    stack.push_back({0, 0, true, false, h.major});
+                    break;
+                }
+                if (h.value > data.size() - offset) {
+                    throw Error("Truncated string at " + std::to_string(offset));
+                }
+                offset += h.value;
+                item_done();
+                break;
+            case 4:
+            case 5:
+                if ((h.info != 31) && (h.value > data.size() - offset)) {
+                    // every item takes one byte at least
+                    throw Error("Truncated container at " + std::to_string(offset));
+                }
+                if (h.info == 31) {
+                    stack.push_back({0, 0, true, h.major == 5, -1});
+                } else if (h.value > 0) {
+                    stack.push_back({(h.major == 5) ? h.value * 2 : h.value, 0, false, h.major == 5, -1});
+                } else {
+                    item_done();
+                }
+                break;
+            case 6:
+                break; // the tagged item follows
+            case 7:
+                if ((h.info == 24) && (h.value < 32)) {
+                    throw Error("Invalid simple value at " + std::to_string(offset));
+                }
+                item_done();
+                break;
+            default:
+                item_done();
+                break;
+        }
+        if (stack.size() > NICEHTTP_CBOR_MAX_DEPTH) {
+            throw Error("Item too deep");
+        }
+    }
+    if (offset != data.size()) {
+        throw Error("Unexpected data after the item at " + std::to_string(offset));
+    }
+    this->data = data;
+}
+
+cbor::Value cbor::Document::root() const {
+    return Value(this, this->untag(0));
+}
+
+uint32_t cbor::Document::untag(uint32_t offset) const {
+    for (CborHead h = cbor_read_head(this->data, offset); h.major == 6; h = cbor_read_head(this->data, offset)) {
+        offset += h.size;
+    }
+    return offset;
+}
+
+uint32_t cbor::Document::skip(uint32_t offset) const {
+    offset = this->untag(offset);
+    CborHead h = cbor_read_head(this->data, offset);
+    offset += h.size;
+    switch (h.major) {
+        case 2:
+        case 3:
+            if (h.info != 31) {
+                return offset + static_cast<uint32_t>(h.value);
+            }
+            [[fallthrough]];
+        case 4:
+        case 5:
+            for (uint64_t i = 0; (h.info == 31) || (i < ((h.major == 5) ? h.value * 2 : h.value)); i++) {
+                unsigned char c = static_cast<unsigned char>(this->data[offset]);
+                if (c == 0xff) {
+                    return offset + 1; // break of an indefinite length item
+                } else if (((c & 0x1f) < 24) && ((c < 0x40) || (c >= 0xe0))) {
+                    offset++; // small integers, false, true, null
+                } else {
+                    offset = this->skip(offset);
+                }
+            }
+            return offset;
+        default:
+            return offset; // floats are in the head
+    }
+}
+
+static const char* cbor_type_name(cbor::Type t) {
+    switch (t) {
+        case cbor::Type::Null: return "null";
+        case cbor::Type::Bool: return "bool";
+        case cbor::Type::Number: return "number";
+        case cbor::Type::String: return "string";
+        case cbor::Type::Array: return "array";
+        case cbor::Type::Object: return "map";
+        default: return "missing";
+    }
+}
+
+cbor::Type cbor::Value::type() const {
+    if (this->doc == nullptr) {
+        return Type::Missing;
+    }
+    CborHead h = cbor_read_head(this->doc->data, this->offset);
+    switch (h.major) {
+        case 0: case 1: return Type::Number;
+        case 2: case 3: return Type::String;
+        case 4: return Type::Array;
+        case 5: return Type::Object;
+        default:
+            // 7: false, true, null, undefined, floats, other simple values (null)
+            if ((h.info == 20) || (h.info == 21)) {
+                return Type::Bool;
+            }
+            return ((h.info >= 25) && (h.info <= 27)) ? Type::Number : Type::Null;
+    }
+}
+
+void cbor::Value::expect(Type t) const {
+    Type actual = this->type();
+    if (actual != t) {
+        throw Error(std::string("Expected ") + cbor_type_name(t) + ", the item is " + cbor_type_name(actual));
+    }
+}
+
+bool cbor::Value::isInt() const {
+    if (this->doc == nullptr) {
+        return false;
+    }
+    CborHead h = cbor_read_head(this->doc->data, this->offset);
+    return (h.major <= 1) && (h.value <= static_cast<uint64_t>(INT64_MAX));
+}
+
+bool cbor::Value::getBool() const {
+    this->expect(Type::Bool);
+    return cbor_read_head(this->doc->data, this->offset).info == 21;
+}
+
+int64_t cbor::Value::getInt() const {
+    this->expect(Type::Number);
+    CborHead h = cbor_read_head(this->doc->data, this->offset);
+    if ((h.major > 1) || (h.value > static_cast<uint64_t>(INT64_MAX))) {
+        throw Error("Not an integer that fits int64_t");
+    }
+    return (h.major == 0) ? static_cast<int64_t>(h.value) : -1 - static_cast<int64_t>(h.value);
+}
+
+double cbor::Value::getDouble() const {
+    this->expect(Type::Number);
+    CborHead h = cbor_read_head(this->doc->data, this->offset);
+    switch (h.major) {
+        case 0: return static_cast<double>(h.value);
+        case 1: return -1.0 - static_cast<double>(h.value);
+        default:
+            if (h.info == 25) {
+                return cbor_half(static_cast<uint16_t>(h.value));
+            } else if (h.info == 26) {
+                return std::bit_cast<float>(static_cast<uint32_t>(h.value));
+            }
+            return std::bit_cast<double>(h.value);
+    }
+}
+
+std::string_view cbor::Value::getString() const {
+    this->expect(Type::String);
+    CborHead h = cbor_read_head(this->doc->data, this->offset);
+    uint32_t offset = this->offset + h.size;
+    if (h.info != 31) {
+        return this->doc->data.substr(offset, h.value); // in place
+    }
+    std::pmr::string& out = this->doc->strings.emplace_back();
+    while (static_cast<unsigned char>(this->doc->data[offset]) != 0xff) {
+        CborHead chunk = cbor_read_head(this->doc->data, offset);
+        out.append(this->doc->data.substr(offset + chunk.size, chunk.value));
+        offset += chunk.size + static_cast<uint32_t>(chunk.value);
+    }
+    return out;
+}
+
+std::string_view cbor::Value::key() const {
+    if ((this->doc == nullptr) || (this->key_offset == UINT32_MAX)) {
+        throw Error("Not a member of a map");
+    }
+    Value k(this->doc, this->key_offset);
+    if (cbor_read_head(this->doc->data, this->key_offset).major != 3) {
+        throw Error("The key is not a text string");
+    }
+    return k.getString();
+}
+
+std::string_view cbor::Value::raw() const {
+    if (this->doc == nullptr) {
+        throw Error("Missing value");
+    }
+    return this->doc->data.substr(this->offset, this->doc->skip(this->offset) - this->offset);
+}
+
+cbor::Value cbor::Value::operator[](std::string_view key) const {
+    if (this->doc == nullptr) {
+        return Value(); // so that lookups can be chained
+    }
+    this->expect(Type::Object);
+    const Document* d = this->doc;
+    CborHead h = cbor_read_head(d->data, this->offset);
+    uint32_t offset = this->offset + h.size;
+    // members until the count of a definite map or the break (0xff can't start an item)
+    for (uint64_t i = 0; ((h.info == 31) || (i < h.value)) && (static_cast<unsigned char>(d->data[offset]) != 0xff); i++) {
+        uint32_t k = d->untag(offset);
+        CborHead kh = cbor_read_head(d->data, k);
+        uint32_t v = d->skip(k);
+        if ((kh.major == 3) && ((kh.info != 31) ? (d->data.substr(k + kh.size, kh.value) == key) : (Value(d, k).getString() == key))) {
+            return Value(d, d->untag(v), k);
+        }
+        offset = d->skip(v);
+    }
+    return Value();
+}
+
+cbor::Value cbor::Value::operator[](size_t i) const {
+    if (this->doc == nullptr) {
+        return Value();
+    }
+    this->expect(Type::Array);
+    for (Value element : *this) {
+        if (i-- == 0) {
+            return element;
+        }
+    }
+    return Value();
+}
+
+size_t cbor::Value::size() const {
+    if (this->doc != nullptr) {
+        CborHead h = cbor_read_head(this->doc->data, this->offset);
+        if (((h.major == 4) || (h.major == 5)) && (h.info != 31)) {
+            return h.value;
+        }
+    }
+    return std::distance(this->begin(), this->end());
+}
+
+cbor::Value::Iterator cbor::Value::begin() const {
+    Type t = this->type();
+    if ((t != Type::Array) && (t != Type::Object)) {
+        throw Error(std::string("Expected array or map, the item is ") + cbor_type_name(t));
+    }
+    CborHead h = cbor_read_head(this->doc->data, this->offset);
+    return Iterator(this->doc, this->offset + h.size, (h.info == 31) ? UINT64_MAX : h.value, t == Type::Object);
+}
+
+cbor::Value::Iterator cbor::Value::end() const {
+    Type t = this->type();
+    if ((t != Type::Array) && (t != Type::Object)) {
+        throw Error(std::string("Expected array or map, the item is ") + cbor_type_name(t));
+    }
+    return Iterator(this->doc, 0, 0, t == Type::Object);
+}
+
+bool cbor::Value::Iterator::atEnd() const {
+    return (this->remaining == 0) || ((this->remaining == UINT64_MAX) && (static_cast<unsigned char>(this->doc->data[this->offset]) == 0xff));
+}
+
+bool cbor::Value::Iterator::operator==(const Iterator& other) const {
+    bool end = this->atEnd();
+    return (end == other.atEnd()) && (end || (this->offset == other.offset));
+}
+
+cbor::Value cbor::Value::Iterator::operator*() const {
+    if (this->map) {
+        return Value(this->doc, this->doc->untag(this->doc->skip(this->offset)), this->doc->untag(this->offset));
+    }
+    return Value(this->doc, this->doc->untag(this->offset));
+}
+
+cbor::Value::Iterator& cbor::Value::Iterator::operator++() {
+    this->offset = this->doc->skip(this->offset);
+    if (this->map) {
+        this->offset = this->doc->skip(this->offset);
+    }
+    if (this->remaining != UINT64_MAX) {
+        this->remaining--;
+    }
+    return *this;
+}
+
+void cbor::Writer::head(uint8_t major, uint64_t value) {
+    // shortest form of the argument, big endian
+    char bytes[9];
+    uint32_t n;
+    if (value < 24) {
+        bytes[0] = static_cast<char>((major << 5) | value);
+        n = 0;
+    } else if (value <= 0xff) {
+        bytes[0] = static_cast<char>((major << 5) | 24);
+        n = 1;
+    } else if (value <= 0xffff) {
+        bytes[0] = static_cast<char>((major << 5) | 25);
+        n = 2;
+    } else if (value <= 0xffffffff) {
+        bytes[0] = static_cast<char>((major << 5) | 26);
+        n = 4;
+    } else {
+        bytes[0] = static_cast<char>((major << 5) | 27);
+        n = 8;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        bytes[n - i] = static_cast<char>(value >> (8 * i));
+    }
+    this->out.append(bytes, n + 1);
+}
+
+void cbor::Writer::done() {
+    if ((this->depth == 0) && (this->length != nullptr)) {
+        *this->length = this->out.size();
+    }
+}
+
+cbor::Writer& cbor::Writer::beginObject() {
+    this->out.push_back(static_cast<char>(0xbf));
+    this->depth++;
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::endObject() {
+    if (this->depth == 0) {
+        throw Error("endObject without beginObject");
+    }
+    this->out.push_back(static_cast<char>(0xff));
+    this->depth--;
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::beginArray() {
+    this->out.push_back(static_cast<char>(0x9f));
+    this->depth++;
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::endArray() {
+    if (this->depth == 0) {
+        throw Error("endArray without beginArray");
+    }
+    this->out.push_back(static_cast<char>(0xff));
+    this->depth--;
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::key(std::string_view name) {
+    this->head(3, name.size());
+    this->out.append(name);
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::null() {
+    this->out.push_back(static_cast<char>(0xf6));
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::value(bool b) {
+    this->out.push_back(static_cast<char>(b ? 0xf5 : 0xf4));
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::value(double d) {
+    if (std::isnan(d)) {
+        this->out.append("\xf9\x7e\x00", 3); // half precision NaN
+    } else if ((std::isinf(d) || (std::fabs(d) <= FLT_MAX)) && (static_cast<double>(static_cast<float>(d)) == d)) {
+        uint32_t bits = std::bit_cast<uint32_t>(static_cast<float>(d));
+        char bytes[5] = {static_cast<char>(0xfa), static_cast<char>(bits >> 24), static_cast<char>(bits >> 16), static_cast<char>(bits >> 8), static_cast<char>(bits)};
+        this->out.append(bytes, sizeof(bytes));
+    } else {
+        uint64_t bits = std::bit_cast<uint64_t>(d);
+        char bytes[9] = {static_cast<char>(0xfb)};
+        for (int i = 0; i < 8; i++) {
+            bytes[8 - i] = static_cast<char>(bits >> (8 * i));
+        }
+        this->out.append(bytes, sizeof(bytes));
+    }
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::value(std::string_view s) {
+    this->head(3, s.size());
+    this->out.append(s);
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::bytes(std::string_view data) {
+    this->head(2, data.size());
+    this->out.append(data);
+    this->done();
+    return *this;
+}
+
+cbor::Writer& cbor::Writer::raw(std::string_view item) {
+    this->out.append(item);
+    this->done();
+    return *this;
+}
+
+void http::Message::parseHeaders(std::string_view headerstr) {
+    for (const auto h : std::views::split(headerstr, '\n')) {
+        std::string_view header(h);
+        size_t i = header.find(": ");
+        if (i == std::string::npos) {
+            //invalid header, skip it..
+            continue;
+        }
+        std::pmr::string key(header.substr(0, i), this->get_allocator());
+        std::string_view val(header.substr(i+2, header.length()-i-3));
+        std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c){ return std::tolower(c); });
+        if (key == "content-length") {
+            //The request has a payload
+            std::from_chars(val.data(), val.data() + val.size(), this->content_length);
+        } else if (( key == "content-type") && (val == "application/json")) {
+            this->is_json = true;
+        } else if (( key == "content-type") && (val == "application/cbor")) {
+            this->is_cbor = true;
+        } else {
+            this->headers.emplace(std::move(key), val);
+        }
+    }
+}
+
+json::Value http::Message::json() const {
+    // the document refers to the body, parse it again if the body moved or changed size
+    if (!this->json_document || (this->json_document->source().data() != this->body.data()) || (this->json_document->source().size() != this->body.size())) {
+        if (!this->json_document) {
+            this->json_document.emplace(this->get_allocator());
+        }
+        this->json_document->parse(this->body);
+    }
+    return this->json_document->root();
+}
+
+json::Writer http::Message::writeJson() {
+    this->body.clear();
+    this->content_length = 0;
+    this->is_json = true;
+    this->is_cbor = false;
+    return ::json::Writer(this->body, &this->content_length);
+}
+
+cbor::Value http::Message::cbor() const {
+    if (!this->cbor_document || (this->cbor_document->source().data() != this->body.data()) || (this->cbor_document->source().size() != this->body.size())) {
+        if (!this->cbor_document) {
+            this->cbor_document.emplace(this->get_allocator());
+        }
+        this->cbor_document->parse(this->body);
+    }
+    return this->cbor_document->root();
+}
+
+cbor::Writer http::Message::writeCbor() {
+    this->body.clear();
+    this->content_length = 0;
+    this->is_json = false;
+    this->is_cbor = true;
+    return ::cbor::Writer(this->body, &this->content_length);
+}
+
+static bool media_is(std::string_view type, std::string_view name) {
+    return std::ranges::equal(type, name, [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; });
+}
+
+http::Format http::negotiateFormat(std::string_view accept) {
+    // Accept: application/cbor, application/json;q=0.5 -> CBOR; */* alone or no Accept -> JSON
+    double cbor = 0, json = -1, any = -1;
+    for (const auto part : std::views::split(accept, ',')) {
+        std::string_view item(part);
+        size_t semicolon = item.find(';');
+        std::string_view type = item.substr(0, semicolon);
+        while (!type.empty() && ((type.front() == ' ') || (type.front() == '\t'))) type.remove_prefix(1);
+        while (!type.empty() && ((type.back() == ' ') || (type.back() == '\t'))) type.remove_suffix(1);
+        double q = 1;
+        if (semicolon != std::string::npos) {
+            size_t i = item.find("q=", semicolon);
+            if (i != std::string::npos) {
+                std::from_chars(item.data() + i + 2, item.data() + item.size(), q);
+            }
+        }
+        if (media_is(type, "application/cbor")) {
+            cbor = q;
+        } else if (media_is(type, "application/json")) {
+            json = q;
+        } else if ((type == "*/*") || media_is(type, "application/*")) {
+            any = std::max(any, q);
+        }
+    }
+    json = (json < 0) ? any : json;
+    return ((cbor > 0) && (cbor >= json)) ? Format::Cbor : Format::Json;
+}
+
+http::Request::Request(std::string method, std::string uri, std::string proto, std::map<std::string,std::string> headers, bool is_json, size_t content_length, std::string body) {
+    this->method = method;
+    this->uri = uri;
+    this->proto = proto;
+    this->content_length = content_length;
+    this->body = body;
+    this->headers.insert(headers.begin(), headers.end());
+    this->is_json = is_json;
+}
+
+http::Request::Request(std::string_view head, std::string_view body) {
+    this->parseHead(head);
+    this->setBody(body);
+}
+
+void http::Request::parseHead(std::string_view head) {
+    // Parse the request line and the headers
+    size_t i = head.find("\r\n");
+    if (i != std::string::npos) {
+        std::string_view line = head.substr(0, i);
+        short j = 0;
+        for (const auto word : std::views::split(line, ' ')) {
+            switch (j) {
+                case 0:
+                    this->method = std::string_view(word);
+                    break;
+                case 1:
+                    this->uri = std::string_view(word);
+                    break;
+                case 2:
+                    this->proto = std::string_view(word);
+                    break;
+                default:
+                    break;
+            }
+            j++;
+        }
+        if (this->proto != PROTO_HTTP1) {
+            Logger::getInstance().error("Protocol not supported");
+        }
+        this->parseHeaders(head.substr(i+2));
+    } else {
+        Logger::getInstance().error("Malformed request");
+    }
+}
+
+void http::Request::setBody(std::string_view body) {
+    if ((this->content_length > 0) && (body.length() != this->content_length)){
+        Logger::getInstance().error("Error in body parsing! Content length " + std::to_string(this->content_length) + " != body length " + std::to_string(body.length()));
+    } else {
+        this->body = body;
+    }
+}
+
+http::Request::Request(const Request& hr) : Message() {
+    method = hr.method;
+    uri = hr.uri;
+    proto = hr.proto;
+    content_length = hr.content_length;
+    body = hr.body;
+    headers = hr.headers;
+    is_json = hr.is_json;
+    is_cbor = hr.is_cbor;
+}
+
+template <typename String>
+static void append_message(String& out, std::string_view first, std::string_view second, std::string_view third, const http::Message& m, bool length, std::string_view endline) {
+    // start line, headers, Content-Length and Content-Type, body
+    out.append(first).append(" ").append(second).append(" ").append(third).append(endline);
+    for (const auto& h : m.headers) {
+        out.append(h.first).append(": ").append(h.second).append(endline);
+    }
+    if (length) {
+        char digits[24];
+        auto end = std::to_chars(digits, digits + sizeof(digits), m.content_length).ptr;
+        out.append("Content-Length: ").append(std::string_view(digits, end - digits)).append(endline);
+        if (m.is_json && (m.content_length != 0)) {
+            out.append("Content-Type: application/json").append(endline);
+        } else if (m.is_cbor && (m.content_length != 0)) {
+            out.append("Content-Type: application/cbor").append(endline);
+        }
+    }
+    out.append(endline);
+    if (m.content_length != 0) {
+        out.append(m.body);
+    }
+}
+
+std::string http::Request::toString(bool carriage_return) {
+    std::string req;
+    req.reserve(this->method.size() + this->uri.size() + 64 + this->headers.size() * 32 + this->body.size());
+    append_message(req, this->method, this->uri, this->proto, *this, this->content_length != 0, carriage_return ? "\r\n" : "\n");
+    return req;
+}
+
+http::Response::Response(short code, std::string message, std::string proto, std::map<std::string,std::string> headers, bool is_json, size_t content_length, std::string body) {
+    this->message = message;
+    this->code = code;
+    this->proto = proto;
+    this->content_length = content_length;
+    this->body = body;
+    this->headers.insert(headers.begin(), headers.end());
+    this->is_json = is_json;
+}
+
+http::Response::Response(std::string_view head, std::string_view body) {
+    size_t i = head.find("\r\n");
+    if (i != std::string::npos) {
+        std::string_view line = head.substr(0, i);
+        short j = 0;
+        int digits = 0;
+        for (const auto word : std::views::split(line, ' ')) {
+            std::string_view w(word);
+            switch (j) {
+                case 0:
+                    this->proto = std::string_view(w);
+                    break;
+                case 1:
+                    digits = w.length();
+                    this->code = atoi(w.data());
+                    break;
+                default:
+                    break;
+            }
+            j++;
+        }
+        // All the rest of the line is the message
+        this->message = line.substr(this->proto.length()+digits+2);
+        if (this->proto != PROTO_HTTP1) {
+            Logger::getInstance().error("Protocol not supported");
+        }
+        this->parseHeaders(head.substr(i+2));
+        if ((this->content_length > 0) && (body.length() != this->content_length)){
+            Logger::getInstance().error("Error in body parsing! Content length " + std::to_string(this->content_length) + " != body length " + std::to_string(body.length()));
+        } else {
+            this->body = body;
+        }
+    } else {
+        Logger::getInstance().error("Malformed request");
+    }
+}
+
+http::Response::Response(const Response& r) : Message() {
+    message = r.message;
+    code = r.code;
+    proto = r.proto;
+    content_length = r.content_length;
+    body = r.body;
+    headers = r.headers;
+    is_json = r.is_json;
+    is_cbor = r.is_cbor;
+}
+
+static bool has_body(short code) {
+    // responses that can't have a body, so no Content-Length either
+    return (code >= 200) && (code != 204) && (code != 304);
+}
+
+std::string http::Response::toString(bool carriage_return) {
+    std::string res;
+    res.reserve(this->message.size() + 64 + this->headers.size() * 32 + this->body.size());
+    char digits[8];
+    auto end = std::to_chars(digits, digits + sizeof(digits), this->code).ptr;
+    // Content-Length is always sent, even when 0, so the response is delimited on a kept alive connection
+    append_message(res, this->proto, std::string_view(digits, end - digits), this->message, *this, has_body(this->code), carriage_return ? "\r\n" : "\n");
+    return res;
+}
+
+http::BodyWriter http::Response::writeBody(const Request& req) {
+    this->headers.emplace("Vary", "Accept");
+    auto accept = req.headers.find("accept");
+    if ((accept != req.headers.end()) && (negotiateFormat(accept->second) == Format::Cbor)) {
+        return BodyWriter(this->writeCbor());
+    }
+    return BodyWriter(this->writeJson());
+}
+
+void http::Response::serialize(std::pmr::string& out) const {
+    out.reserve(out.size() + this->message.size() + 64 + this->headers.size() * 32 + this->body.size());
+    char digits[8];
+    auto end = std::to_chars(digits, digits + sizeof(digits), this->code).ptr;
+    append_message(out, this->proto, std::string_view(digits, end - digits), this->message, *this, has_body(this->code), "\r\n");
+}
+
+http::Request& http::Request::operator=(const Request& other) {
+    // Guard self assignment
+    if (this == &other)
+        return *this;
+ 
+    this->method = other.method;
+    this->uri = other.uri;
+    this->proto = other.proto;
+    this->content_length = other.content_length;
+    this->body = other.body;
+    this->headers = other.headers;
+    this->is_json = other.is_json;
+    this->is_cbor = other.is_cbor;
+    this->json_document.reset();
+    this->cbor_document.reset();
+
+    return *this;
+}
+
+http::Response& http::Response::operator=(const Response& other) {
+    // Guard self assignment
+    if (this == &other)
+        return *this;
+ 
+    this->message = other.message;
+    this->code = other.code;
+    this->proto = other.proto;
+    this->content_length = other.content_length;
+    this->body = other.body;
+    this->headers = other.headers;
+    this->is_json = other.is_json;
+    this->is_cbor = other.is_cbor;
+    this->json_document.reset();
+    this->cbor_document.reset();
+
+    return *this;
+}
+
+void Address::setPort(short port) {
+    if (this->family == AF_INET6) {
+        reinterpret_cast<sockaddr_in6*>(&this->addr)->sin6_port = htons(port);
+    } else {
+        reinterpret_cast<sockaddr_in*>(&this->addr)->sin_port = htons(port);
+    }
+}
+
+std::string Address::toString() const {
+    char host[NI_MAXHOST] = {0,};
+    if (getnameinfo(reinterpret_cast<const sockaddr*>(&this->addr), this->len, host, sizeof(host), nullptr, 0, NI_NUMERICHOST) != 0) {
+        return "";
+    }
+    return host;
+}
+
+Resolver& Resolver::getInstance() {
+    static Resolver resolver;
+    return resolver;
+}
+
+Resolver::Shard& Resolver::getShard(const std::string& host) {
+    return this->shards[std::hash<std::string>{}(host) % NICEHTTP_DNS_SHARDS];
+}
+
+std::vector<Address> Resolver::lookup(const std::string& host) {
+    // Blocking query, must be called without holding any shard lock
+    std::vector<Address> addresses;
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_ADDRCONFIG;
+    addrinfo *res = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &res) != 0) {
+        return addresses;
+    }
+    for (addrinfo *ai = res; ai != nullptr; ai = ai->ai_next) {
+        if ((ai->ai_family != AF_INET) && (ai->ai_family != AF_INET6)) {
+            continue;
+        }
+        Address a;
+        memset(&a.addr, 0, sizeof(a.addr));
+        memcpy(&a.addr, ai->ai_addr, ai->ai_addrlen);
+        a.len = static_cast<socklen_t>(ai->ai_addrlen);
+        a.family = ai->ai_family;
+        addresses.push_back(a);
+    }
+    freeaddrinfo(res);
+    return addresses;
+}
+
+std::vector<Address> Resolver::resolve(const std::string& host, short port) {
+    std::vector<Address> addresses;
+    bool cached = false;
+    Shard& shard = this->getShard(host);
+    {
+        std::scoped_lock lock(shard.mutex);
+        auto it = shard.entries.find(host);
+        if (it != shard.entries.end()) {
+            Entry& e = it->second;
+            if ((std::chrono::steady_clock::now() < e.expires) || (e.refreshing && !e.addresses.empty())) {
+                // valid entry (positive or negative), or another thread is already refreshing it
+                addresses = e.addresses;
+                cached = true;
+            } else {
+                e.refreshing = true;
+            }
+        }
+    }
+    if (!cached) {
+        addresses = this->lookup(host);
+        Entry e;
+        e.addresses = addresses;
+        e.expires = std::chrono::steady_clock::now() + std::chrono::seconds(addresses.empty() ? NICEHTTP_DNS_NEGATIVE_TTL : NICEHTTP_DNS_TTL);
+        std::scoped_lock lock(shard.mutex);
+        auto it = shard.entries.find(host);
+        if (addresses.empty() && (it != shard.entries.end()) && !it->second.addresses.empty()) {
+            // resolver failure on refresh: keep the last known addresses for a while
+            it->second.expires = e.expires;
+            it->second.refreshing = false;
+            addresses = it->second.addresses;
+        } else {
+            shard.entries.insert_or_assign(host, e);
+        }
+    }
+    for (Address& a : addresses) {
+        a.setPort(port);
+    }
+    return addresses;
+}
+
+void Resolver::clear() {
+    for (Shard& shard : this->shards) {
+        std::scoped_lock lock(shard.mutex);
+        shard.entries.clear();
+    }
+}
+
+ConnectionPool::~ConnectionPool() {
+    this->clear();
+}
+
+std::string ConnectionPool::key(const std::string& host, short port) {
+    return host + ":" + std::to_string(port);
+}
+
+void ConnectionPool::close_fd(int fd) {
+    #ifdef _WIN32
+    closesocket(fd);
+    #else
+    close(fd);
+    #endif
+}
+
+int ConnectionPool::get(const std::string& host, short port) {
+    auto expired = std::chrono::steady_clock::now() - std::chrono::seconds(NICEHTTP_POOL_IDLE_TIMEOUT);
+    while (true) {
+        Idle conn;
+        {
+            std::scoped_lock lock(this->mutex);
+            auto it = this->idle.find(key(host, port));
+            if ((it == this->idle.end()) || it->second.empty()) {
+                return -1;
+            }
+            conn = it->second.back();
+            it->second.pop_back();
+        }
+        // An idle socket must have nothing to read: data or EOF means the peer closed it
+        struct pollfd pfd = {conn.fd, POLLIN, 0};
+        #ifdef _WIN32
+        int rc = WSAPoll(&pfd, 1, 0);
+        #else
+        int rc = poll(&pfd, 1, 0);
+        #endif
+        if ((rc == 0) && (conn.since > expired)) {
+            return conn.fd;
+        }
+        close_fd(conn.fd);
+    }
+}
+
+void ConnectionPool::put(const std::string& host, short port, int fd) {
+    {
+        std::scoped_lock lock(this->mutex);
+        std::vector<Idle>& conns = this->idle[key(host, port)];
+        if (conns.size() < NICEHTTP_POOL_MAX_IDLE) {
+            conns.push_back({fd, std::chrono::steady_clock::now()});
+            return;
+        }
+    }
+    close_fd(fd);
+}
+
+void ConnectionPool::clear() {
+    std::scoped_lock lock(this->mutex);
+    for (auto& entry : this->idle) {
+        for (const Idle& conn : entry.second) {
+            close_fd(conn.fd);
+        }
+    }
+    this->idle.clear();
+}
+
+CircuitBreaker::CircuitBreaker(const BreakerOptions& opts) {
+    this->opts = opts;
+    this->window_start.store(now(), std::memory_order_relaxed);
+}
+
+int64_t CircuitBreaker::now() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CircuitBreaker::trip(int64_t t) {
+    this->opened_at.store(t, std::memory_order_relaxed);
+    this->current.store(Open, std::memory_order_release);
+}
+
+CircuitBreaker::State CircuitBreaker::state() const {
+    return static_cast<State>(this->current.load(std::memory_order_acquire));
+}
+
+bool CircuitBreaker::isOpen() const {
+    return (this->state() == Open) && (now() < this->opened_at.load(std::memory_order_relaxed) + this->opts.open_time);
+}
+
+CircuitBreaker::Permit CircuitBreaker::allow() {
+    int s = this->current.load(std::memory_order_acquire);
+    if (s == Closed) {
+        return {true, 0};
+    }
+    if (s == Open) {
+        if (now() < this->opened_at.load(std::memory_order_relaxed) + this->opts.open_time) {
+            return {};
+        }
+        // open time elapsed: the first thread starts a half open round
+        if (this->current.compare_exchange_strong(s, HalfOpen, std::memory_order_acq_rel)) {
+            this->probe_successes.store(0, std::memory_order_relaxed);
+            this->round.fetch_add(1, std::memory_order_acq_rel);
+        } else if (s != HalfOpen) {
+            return {s == Closed, 0};
+        }
+    }
+    // half open: limited number of probes in flight (probes of an earlier round still hold their slot)
+    if (this->probes.fetch_add(1, std::memory_order_acq_rel) < this->opts.probes) {
+        uint32_t r = this->round.load(std::memory_order_acquire);
+        return {true, (r == 0) ? 1 : r}; // 0 while the first round is starting, probes are never 0
+    }
+    this->probes.fetch_sub(1, std::memory_order_relaxed);
+    return {};
+}
+
+void CircuitBreaker::record(const Permit& permit, bool success, std::chrono::microseconds latency) {
+    if (!permit) {
+        return;
+    }
+    if ((this->opts.slow_call > 0) && (latency.count() > int64_t(this->opts.slow_call) * 1000)) {
+        success = false;
+    }
+    int64_t t = now();
+    int s = this->current.load(std::memory_order_acquire);
+    if (permit.probe != 0) {
+        this->probes.fetch_sub(1, std::memory_order_relaxed);
+        if ((s != HalfOpen) || (permit.probe != this->round.load(std::memory_order_acquire))) {
+            return; // probe of an earlier round
+        }
+        if (!success) {
+            this->trip(t);
+        } else if (this->probe_successes.fetch_add(1, std::memory_order_acq_rel) + 1 >= this->opts.probes) {
+            this->counts.store(0, std::memory_order_relaxed);
+            this->window_start.store(t, std::memory_order_relaxed);
+            this->current.store(Closed, std::memory_order_release);
+        }
+        return;
+    }
+    if (s != Closed) {
+        return; // allowed before the breaker opened
+    }
+    int64_t start = this->window_start.load(std::memory_order_relaxed);
+    if ((t - start > this->opts.window) && this->window_start.compare_exchange_strong(start, t, std::memory_order_relaxed)) {
+        // new window (a few concurrent updates may land in the old one)
+        this->counts.store(0, std::memory_order_relaxed);
+    }
+    uint64_t c = this->counts.fetch_add((uint64_t(1) << 32) | (success ? 0 : 1), std::memory_order_relaxed) + ((uint64_t(1) << 32) | (success ? 0 : 1));
+    uint64_t requests = c >> 32;
+    uint64_t failures = c & 0xffffffff;
+    if (!success && (requests >= uint64_t(this->opts.min_requests)) && (failures * 100 >= requests * this->opts.error_rate)) {
+        int expected = Closed;
+        this->opened_at.store(t, std::memory_order_relaxed);
+        this->current.compare_exchange_strong(expected, Open, std::memory_order_acq_rel);
+    }
+}
+
+UpstreamGroup::UpstreamGroup(const std::vector<Endpoint>& endpoints, Balancing policy, const BreakerOptions& breaker) {
+    this->policy = policy;
+    for (size_t i = 0; i < endpoints.size(); i++) {
+        this->states.push_back(std::make_unique<State>(breaker));
+        this->states.back()->endpoint = endpoints[i];
+        if (policy == Balancing::ConsistentHash) {
+            std::string name = endpoints[i].host + ":" + std::to_string(endpoints[i].port);
+            for (int v = 0; v < NICEHTTP_HASH_VNODES; v++) {
+                this->ring.push_back({hash(name + "#" + std::to_string(v)), i});
+            }
+        }
+    }
+    std::sort(this->ring.begin(), this->ring.end());
+}
+
+int64_t UpstreamGroup::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t UpstreamGroup::hash(std::string_view s) {
+    // FNV-1a followed by a murmur finalizer to spread the ring points
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : s) {
+        h = (h ^ c) * 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+bool UpstreamGroup::available(size_t i, int64_t now) const {
+    return (this->states[i]->ejected_until.load(std::memory_order_relaxed) <= now) && !this->states[i]->breaker.isOpen();
+}
+
+size_t UpstreamGroup::pick(std::string_view key) {
+    return this->choose(key, {});
+}
+
+size_t UpstreamGroup::pick(std::string_view key, CircuitBreaker::Permit& permit) {
+    std::vector<bool> refused; // sized at the first refusal, breakers rarely refuse
+    for (;;) {
+        size_t i = this->choose(key, refused);
+        if (!refused.empty() && refused[i]) {
+            permit = {}; // every endpoint left refused
+            return i;
+        }
+        if ((permit = this->states[i]->breaker.allow())) {
+            return i;
+        }
+        refused.resize(this->states.size());
+        refused[i] = true;
+    }
+}
+
+size_t UpstreamGroup::choose(std::string_view key, const std::vector<bool>& skipped) {
+    size_t n = this->states.size();
+    if (n == 0) {
+        throw std::runtime_error("Empty upstream group");
+    }
+    int64_t t = now();
+    auto usable = [&](size_t i) { return skipped.empty() || !skipped[i]; };
+    bool all_ejected = true;
+    for (size_t i = 0; i < n; i++) {
+        if (usable(i) && this->available(i, t)) {
+            all_ejected = false;
+            break;
+        }
+    }
+    auto ok = [&](size_t i) { return usable(i) && (all_ejected || this->available(i, t)); };
+
+    switch (this->policy) {
+        case Balancing::LeastOutstanding: {
+            // start from a rotating offset so ties are spread evenly
+            size_t start = this->next.fetch_add(1, std::memory_order_relaxed);
+            size_t best = n;
+            for (size_t k = 0; k < n; k++) {
+                size_t i = (start + k) % n;
+                if (ok(i) && ((best == n) || (this->outstanding(i) < this->outstanding(best)))) {
+                    best = i;
+                }
+            }
+            // no endpoint left if the breakers or ejections changed since all_ejected was computed
+            return (best == n) ? start % n : best;
+        }
+        case Balancing::PowerOfTwoChoices: {
+            if (n == 1) {
+                return 0;
+            }
+            thread_local std::minstd_rand rng(std::random_device{}());
+            size_t a = rng() % n;
+            size_t b = (a + 1 + rng() % (n - 1)) % n;
+            if (!ok(a) || !ok(b)) {
+                // some endpoint is ejected: first available one starting from a
+                for (size_t k = 0; k < n; k++) {
+                    if (ok((a + k) % n)) {
+                        return (a + k) % n;
+                    }
+                }
+            }
+            // expected wait: latency multiplied by the requests queued in front of us
+            auto cost = [this](size_t i) {
+                return (this->outstanding(i) + 1) * std::max<int64_t>(this->states[i]->ewma.load(std::memory_order_relaxed), 1);
+            };
+            return (cost(a) <= cost(b)) ? a : b;
+        }
+        case Balancing::ConsistentHash: {
+            auto it = std::lower_bound(this->ring.begin(), this->ring.end(), std::make_pair(hash(key), size_t(0)));
+            for (size_t k = 0; k < this->ring.size(); k++, it++) {
+                if (it == this->ring.end()) {
+                    it = this->ring.begin();
+                }
+                if (ok(it->second)) {
+                    return it->second;
+                }
+            }
+            return 0;
+        }
+        case Balancing::RoundRobin:
+        default:
+            for (size_t k = 0; k < n; k++) {
+                size_t i = this->next.fetch_add(1, std::memory_order_relaxed) % n;
+                if (ok(i)) {
+                    return i;
+                }
+            }
+            return 0;
+    }
+}
+
+void UpstreamGroup::begin(size_t i) {
+    this->states[i]->outstanding.fetch_add(1, std::memory_order_relaxed);
+}
+
+void UpstreamGroup::end(size_t i, const CircuitBreaker::Permit& permit, bool success, std::chrono::microseconds latency) {
+    State& s = *this->states[i];
+    s.outstanding.fetch_sub(1, std::memory_order_relaxed);
+    s.breaker.record(permit, success, latency);
+    if (success) {
+        // EWMA with alpha = 1/8, concurrent updates may drop a sample which is fine
+        int64_t old = s.ewma.load(std::memory_order_relaxed);
+        int64_t sample = latency.count();
+        s.ewma.store((old == 0) ? sample : old + (sample - old) / 8, std::memory_order_relaxed);
+        s.failures.store(0, std::memory_order_relaxed);
+        s.ejections.store(0, std::memory_order_relaxed);
+        return;
+    }
+    if (s.failures.fetch_add(1, std::memory_order_relaxed) + 1 >= NICEHTTP_EJECT_FAILURES) {
+        s.failures.store(0, std::memory_order_relaxed);
+        int ejections = std::min(s.ejections.fetch_add(1, std::memory_order_relaxed) + 1, 10);
+        s.ejected_until.store(now() + int64_t(NICEHTTP_EJECT_TIME) * ejections * 1000000, std::memory_order_relaxed);
+    }
+}
+
+const Endpoint& UpstreamGroup::endpoint(size_t i) const {
+    return this->states[i]->endpoint;
+}
+
+CircuitBreaker& UpstreamGroup::breaker(size_t i) {
+    return this->states[i]->breaker;
+}
+
+size_t UpstreamGroup::size() const {
+    return this->states.size();
+}
+
+int UpstreamGroup::outstanding(size_t i) const {
+    return this->states[i]->outstanding.load(std::memory_order_relaxed);
+}
+
+std::chrono::microseconds UpstreamGroup::latency(size_t i) const {
+    return std::chrono::microseconds(this->states[i]->ewma.load(std::memory_order_relaxed));
+}
+
+bool UpstreamGroup::isEjected(size_t i) const {
+    return !this->available(i, now());
+}
+
+Executor::Executor(unsigned int threads, unsigned int max_queue) : pool(threads) {
+    this->limit = threads + max_queue;
+}
+
+bool Executor::submit(std::function<void()> task) {
+    if (this->inflight.fetch_add(1, std::memory_order_acq_rel) >= static_cast<int>(this->limit)) {
+        this->inflight.fetch_sub(1, std::memory_order_release);
+        return false;
+    }
+    this->pool.enqueue_detach([this, task = std::move(task)]() {
+        try {
+            task();
+        } catch (...) {
+        }
+        this->inflight.fetch_sub(1, std::memory_order_release);
+    });
+    return true;
+}
+
+int Executor::load() const {
+    return this->inflight.load(std::memory_order_relaxed);
+}
+
+unsigned int Executor::capacity() const {
+    return this->limit;
+}
+
+dp::pool_statistics Executor::stats() const {
+    return this->pool.stats();
+}
+
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+
+Logger& Logger::getInstance() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() {
+    this->writer = std::jthread([this](std::stop_token stop) {
+        std::mutex m;
+        std::condition_variable_any cv;
+        while (!stop.stop_requested()) {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait_for(lock, stop, std::chrono::milliseconds(NICEHTTP_LOG_FLUSH), [] { return false; });
+            lock.unlock();
+            this->drain();
+        }
+    });
+}
+
+Logger::~Logger() {
+    this->writer.request_stop();
+    this->writer.join();
+    this->drain();
+    if (this->access_out != stdout) fclose(this->access_out);
+    if (this->error_out != stderr) fclose(this->error_out);
+}
+
+bool Logger::openAccessLog(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "a");
+    if (f == nullptr) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(this->drain_mutex);
+    if (this->access_out != stdout) fclose(this->access_out);
+    this->access_out = f;
+    return true;
+}
+
+bool Logger::openErrorLog(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "a");
+    if (f == nullptr) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(this->drain_mutex);
+    if (this->error_out != stderr) fclose(this->error_out);
+    this->error_out = f;
+    return true;
+}
+
+void Logger::setAccessLog(bool enabled) {
+    this->access_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+std::ostringstream& Logger::stream() {
+    thread_local std::ostringstream s;
+    s.str("");
+    return s;
+}
+
+Logger::Handle::~Handle() {
+    if (this->ring != nullptr) {
+        Logger& logger = Logger::getInstance();
+        std::lock_guard<std::mutex> lock(logger.registry);
+        logger.free_rings.push_back(this->ring);
+    }
+}
+
+Logger::Ring& Logger::local() {
+    thread_local Handle handle;
+    if (handle.ring == nullptr) {
+        std::lock_guard<std::mutex> lock(this->registry);
+        if (!this->free_rings.empty()) {
+            handle.ring = this->free_rings.back();
+            this->free_rings.pop_back();
+        } else {
+            this->rings.push_back(std::make_unique<Ring>());
+            handle.ring = this->rings.back().get();
+        }
+    }
+    return *handle.ring;
+}
+
+static void ring_copy(char* ring, uint64_t pos, const char* src, size_t len) {
+    // copy into the ring buffer, wrapping at the end
+    size_t at = pos % NICEHTTP_LOG_BUFFER;
+    size_t first = std::min(len, static_cast<size_t>(NICEHTTP_LOG_BUFFER) - at);
+    memcpy(ring + at, src, first);
+    memcpy(ring, src + first, len - first);
+}
+
+static void ring_read(const char* ring, uint64_t pos, char* dst, size_t len) {
+    size_t at = pos % NICEHTTP_LOG_BUFFER;
+    size_t first = std::min(len, static_cast<size_t>(NICEHTTP_LOG_BUFFER) - at);
+    memcpy(dst, ring + at, first);
+    memcpy(dst + first, ring, len - first);
+}
+
+void Logger::push(const Header& header, std::initializer_list<std::string_view> parts) {
+    Ring& ring = this->local();
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    uint64_t tail = ring.tail.load(std::memory_order_acquire);
+    if (head - tail + sizeof(Header) + header.size > NICEHTTP_LOG_BUFFER) {
+        this->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    ring_copy(ring.data.get(), head, reinterpret_cast<const char*>(&header), sizeof(Header));
+    uint64_t pos = head + sizeof(Header);
+    for (std::string_view part : parts) {
+        ring_copy(ring.data.get(), pos, part.data(), part.size());
+        pos += part.size();
+    }
+    ring.head.store(pos, std::memory_order_release);
+}
+
+void Logger::access(std::string_view peer, std::string_view method, std::string_view uri, std::string_view proto, int status, size_t bytes, std::chrono::steady_clock::duration latency) {
+    auto clip = [](std::string_view s) { return s.substr(0, 1024); };
+    peer = clip(peer);
+    method = clip(method);
+    uri = clip(uri);
+    proto = clip(proto);
+    Header header {};
+    header.kind = Access;
+    header.status = static_cast<uint16_t>(status);
+    header.time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    header.bytes = bytes;
+    header.latency = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    header.lengths[0] = static_cast<uint16_t>(peer.size());
+    header.lengths[1] = static_cast<uint16_t>(method.size());
+    header.lengths[2] = static_cast<uint16_t>(uri.size());
+    header.lengths[3] = static_cast<uint16_t>(proto.size());
+    header.size = static_cast<uint32_t>(peer.size() + method.size() + uri.size() + proto.size());
+    this->push(header, {peer, method, uri, proto});
+}
+
+void Logger::log(Level level, std::string_view message) {
+    if (level == Error) {
+        // at most NICEHTTP_LOG_ERRORS_PER_SEC per second
+        int64_t second = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t current = this->error_second.load(std::memory_order_relaxed);
+        if ((current != second) && this->error_second.compare_exchange_strong(current, second, std::memory_order_relaxed)) {
+            this->error_count.store(0, std::memory_order_relaxed);
+        }
+        if (this->error_count.fetch_add(1, std::memory_order_relaxed) >= NICEHTTP_LOG_ERRORS_PER_SEC) {
+            this->suppressed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    message = message.substr(0, NICEHTTP_LOG_BUFFER / 4);
+    Header header {};
+    header.kind = Text;
+    header.level = level;
+    header.time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    header.size = static_cast<uint32_t>(message.size());
+    this->push(header, {message});
+}
+
+void Logger::flush() {
+    this->drain();
+}
+
+static void format_time(std::string& out, int64_t ns, bool access) {
+    // [18/Oct/2026:10:20:30 +0000] for the access log, 2026-10-18T10:20:30.123Z for the error log
+    time_t seconds = static_cast<time_t>(ns / 1000000000);
+    tm t;
+    #ifdef _WIN32
+    gmtime_s(&t, &seconds);
+    #else
+    gmtime_r(&seconds, &t);
+    #endif
+    char buf[64];
+    if (access) {
+        strftime(buf, sizeof(buf), "[%d/%b/%Y:%H:%M:%S +0000]", &t);
+        out += buf;
+    } else {
+        strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &t);
+        out += buf;
+        snprintf(buf, sizeof(buf), ".%03dZ", static_cast<int>((ns / 1000000) % 1000));
+        out += buf;
+    }
+}
+
+void Logger::drain() {
+    std::lock_guard<std::mutex> drain_lock(this->drain_mutex);
+    std::string access_batch, error_batch;
+    std::vector<char> payload;
+    {
+        std::lock_guard<std::mutex> lock(this->registry);
+        for (const auto& ring : this->rings) {
+            uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            while (tail < head) {
+                Header header;
+                ring_read(ring->data.get(), tail, reinterpret_cast<char*>(&header), sizeof(Header));
+                payload.resize(header.size);
+                ring_read(ring->data.get(), tail + sizeof(Header), payload.data(), header.size);
+                tail += sizeof(Header) + header.size;
+                std::string_view text(payload.data(), payload.size());
+                if (header.kind == Access) {
+                    std::string_view peer = text.substr(0, header.lengths[0]);
+                    std::string_view method = text.substr(header.lengths[0], header.lengths[1]);
+                    std::string_view uri = text.substr(header.lengths[0] + header.lengths[1], header.lengths[2]);
+                    std::string_view proto = text.substr(header.lengths[0] + header.lengths[1] + header.lengths[2], header.lengths[3]);
+                    access_batch += peer.empty() ? "-" : std::string(peer);
+                    access_batch += " - - ";
+                    format_time(access_batch, header.time, true);
+                    access_batch += " \"" + std::string(method) + " " + std::string(uri) + " " + std::string(proto) + "\" ";
+                    access_batch += std::to_string(header.status) + " " + std::to_string(header.bytes) + " ";
+                    access_batch += std::to_string(header.latency) + "us\n";
+                } else {
+                    format_time(error_batch, header.time, false);
+                    error_batch += (header.level == Error) ? " ERROR " : " DEBUG ";
+                    error_batch += text;
+                    error_batch += "\n";
+                }
+            }
+            ring->tail.store(tail, std::memory_order_release);
+        }
+    }
+    if (uint64_t n = this->suppressed.exchange(0, std::memory_order_relaxed)) {
+        error_batch += std::to_string(n) + " error messages suppressed by the rate limit\n";
+    }
+    if (uint64_t n = this->dropped.exchange(0, std::memory_order_relaxed)) {
+        error_batch += std::to_string(n) + " log records dropped, buffer full\n";
+    }
+    if (!access_batch.empty()) {
+        fwrite(access_batch.data(), 1, access_batch.size(), this->access_out);
+        fflush(this->access_out);
+    }
+    if (!error_batch.empty()) {
+        fwrite(error_batch.data(), 1, error_batch.size(), this->error_out);
+        fflush(this->error_out);
+    }
+}
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+Capture::~Capture() {
+    this->close();
+}
+
+bool Capture::open(const std::string& path, uint64_t max_bytes) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->file != nullptr) {
+        fclose(this->file);
+    }
+    this->file = fopen(path.c_str(), "wb");
+    if (this->file == nullptr) {
+        return false;
+    }
+    setvbuf(this->file, nullptr, _IOFBF, NICEHTTP_CAPTURE_BUFFER);
+    this->start = std::chrono::steady_clock::now();
+    this->flushed = this->start;
+    int64_t epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    fwrite(NICEHTTP_CAPTURE_MAGIC, 1, 8, this->file);
+    fwrite(&epoch, sizeof(epoch), 1, this->file);
+    this->written = 16;
+    this->max_bytes = max_bytes;
+    this->capturing.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+void Capture::record(std::chrono::steady_clock::time_point arrival, std::string_view head, std::string_view body) {
+    uint32_t length = static_cast<uint32_t>(head.size() + body.size());
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->file == nullptr) {
+        return;
+    }
+    if ((this->max_bytes > 0) && (this->written + 12 + length > this->max_bytes)) {
+        // full, stop capturing
+        fclose(this->file);
+        this->file = nullptr;
+        this->capturing.store(false, std::memory_order_relaxed);
+        return;
+    }
+    uint64_t offset = std::chrono::duration_cast<std::chrono::nanoseconds>(arrival - this->start).count();
+    fwrite(&offset, sizeof(offset), 1, this->file);
+    fwrite(&length, sizeof(length), 1, this->file);
+    fwrite(head.data(), 1, head.size(), this->file);
+    fwrite(body.data(), 1, body.size(), this->file);
+    this->written += 12 + length;
+    if (arrival - this->flushed >= std::chrono::milliseconds(NICEHTTP_CAPTURE_FLUSH)) {
+        // a server killed loses at most the last second
+        fflush(this->file);
+        this->flushed = arrival;
+    }
+}
+
+void Capture::close() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->file != nullptr) {
+        fclose(this->file);
+        this->file = nullptr;
+    }
+    this->capturing.store(false, std::memory_order_relaxed);
+}
+
+std::vector<Capture::Record> Capture::load(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == nullptr) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    char magic[8];
+    int64_t epoch;
+    if ((fread(magic, 1, 8, f) != 8) || (memcmp(magic, NICEHTTP_CAPTURE_MAGIC, 8) != 0) || (fread(&epoch, sizeof(epoch), 1, f) != 1)) {
+        fclose(f);
+        throw std::runtime_error(path + " is not a capture file");
+    }
+    std::vector<Record> records;
+    uint64_t offset;
+    uint32_t length;
+    while ((fread(&offset, sizeof(offset), 1, f) == 1) && (fread(&length, sizeof(length), 1, f) == 1)) {
+        Record r {offset, std::string(length, '\0')};
+        if (fread(r.data.data(), 1, length, f) != length) {
+            break; // truncated by a server that didn't stop cleanly
+        }
+        records.push_back(std::move(r));
+    }
+    fclose(f);
+    std::stable_sort(records.begin(), records.end(), [](const Record& a, const Record& b) { return a.offset < b.offset; });
+    return records;
+}
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <ranges>
+#ifdef NICEHTTP_COMPRESSION
+#include <zlib.h>
+#endif
+
+static std::string_view encoding_token(std::string_view s) {
+    // without the spaces around it
+    while (!s.empty() && ((s.front() == ' ') || (s.front() == '\t'))) s.remove_prefix(1);
+    while (!s.empty() && ((s.back() == ' ') || (s.back() == '\t'))) s.remove_suffix(1);
+    return s;
+}
+
+static bool token_is(std::string_view token, std::string_view name) {
+    return std::ranges::equal(token, name, [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; });
+}
+
+compression::Encoding compression::parse(std::string_view content_encoding) {
+    std::string_view token = encoding_token(content_encoding);
+    if (token.empty() || token_is(token, "identity")) {
+        return Encoding::Identity;
+    } else if (token_is(token, "gzip") || token_is(token, "x-gzip")) {
+        return Encoding::Gzip;
+    } else if (token_is(token, "deflate")) {
+        return Encoding::Deflate;
+    }
+    return Encoding::Unsupported; // br, zstd, several encodings in a row...
+}
+
+compression::Encoding compression::negotiate(std::string_view accept_encoding) {
+    // Accept-Encoding: gzip;q=0.8, deflate, *;q=0 -> the highest q, gzip when equal
+    double gzip = -1, deflate = -1, any = -1;
+    for (const auto part : std::views::split(accept_encoding, ',')) {
+        std::string_view item(part);
+        size_t semicolon = item.find(';');
+        std::string_view token = encoding_token(item.substr(0, semicolon));
+        double q = 1;
+        if (semicolon != std::string::npos) {
+            size_t i = item.find("q=", semicolon);
+            if (i != std::string::npos) {
+                std::from_chars(item.data() + i + 2, item.data() + item.size(), q);
+            }
+        }
+        if (token_is(token, "gzip") || token_is(token, "x-gzip")) {
+            gzip = q;
+        } else if (token_is(token, "deflate")) {
+            deflate = q;
+        } else if (token == "*") {
+            any = q;
+        }
+    }
+    gzip = (gzip < 0) ? any : gzip;
+    deflate = (deflate < 0) ? any : deflate;
+    if ((gzip > 0) && (gzip >= deflate)) {
+        return Encoding::Gzip;
+    } else if (deflate > 0) {
+        return Encoding::Deflate;
+    }
+    return Encoding::Identity;
+}
+
+const char* compression::name(Encoding encoding) {
+    switch (encoding) {
+        case Encoding::Identity: return "identity";
+        case Encoding::Gzip: return "gzip";
+        case Encoding::Deflate: return "deflate";
+        default: return "unsupported";
+    }
+}
+
+#ifdef NICEHTTP_COMPRESSION
+
+struct ZStreams {
+    /* zlib streams of a thread, reset after every body instead of allocated
+     * (a deflate stream is a few hundred KB).
+     */
+    z_stream deflaters[2] = {}; // gzip, zlib format
+    int levels[2] = {-1, -1};   // -1 not initialized
+    z_stream inflaters[2] = {}; // gzip or zlib header (detected), raw deflate
+    bool inflating[2] = {false, false};
+    ~ZStreams() {
+        for (int i = 0; i < 2; i++) {
+            if (this->levels[i] != -1) deflateEnd(&this->deflaters[i]);
+            if (this->inflating[i]) inflateEnd(&this->inflaters[i]);
+        }
+    }
+    z_stream& deflater(compression::Encoding encoding, int level) {
+        int i = (encoding == compression::Encoding::Gzip) ? 0 : 1;
+        if (this->levels[i] == -1) {
+            if (deflateInit2(&this->deflaters[i], level, Z_DEFLATED, (i == 0) ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw compression::Error("Cannot initialize zlib");
+            }
+        } else if (this->levels[i] != level) {
+            deflateParams(&this->deflaters[i], level, Z_DEFAULT_STRATEGY);
+        }
+        this->levels[i] = level;
+        return this->deflaters[i];
+    }
+    z_stream& inflater(bool raw) {
+        int i = raw ? 1 : 0;
+        if (!this->inflating[i]) {
+            if (inflateInit2(&this->inflaters[i], raw ? -15 : 15 + 32) != Z_OK) {
+                throw compression::Error("Cannot initialize zlib");
+            }
+            this->inflating[i] = true;
+        }
+        return this->inflaters[i];
+    }
+};
+
+static thread_local ZStreams zstreams;
+
+void compression::compress(std::string_view data, Encoding encoding, std::pmr::string& out, int level) {
+    if ((encoding != Encoding::Gzip) && (encoding != Encoding::Deflate)) {
+        throw Error(std::string("Cannot compress to ") + name(encoding));
+    }
+    z_stream& z = zstreams.deflater(encoding, level);
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    z.avail_in = static_cast<uInt>(data.size());
+    size_t from = out.size();
+    size_t bound = deflateBound(&z, data.size());
+    int rc = Z_OK;
+    // no zero filling of the output, zlib writes it
+    out.resize_and_overwrite(from + bound, [&](char* p, size_t n) {
+        z.next_out = reinterpret_cast<Bytef*>(p + from);
+        z.avail_out = static_cast<uInt>(bound);
+        rc = deflate(&z, Z_FINISH);
+        return (rc == Z_STREAM_END) ? n - z.avail_out : from;
+    });
+    deflateReset(&z);
+    if (rc != Z_STREAM_END) {
+        throw Error("deflate failed");
+    }
+}
+
+static int inflate_into(z_stream& z, std::string_view data, std::pmr::string& out, size_t max_size, bool& too_large) {
+    // inflate data appending it to out, returns the last zlib result
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    z.avail_in = static_cast<uInt>(data.size());
+    size_t from = out.size();
+    size_t chunk = std::max<size_t>(data.size() * 4, 4096);
+    int rc = Z_OK;
+    while (rc == Z_OK) {
+        size_t used = out.size() - from;
+        if (used >= max_size) {
+            too_large = true;
+            break;
+        }
+        size_t grow = std::min(chunk, max_size - used);
+        out.resize_and_overwrite(out.size() + grow, [&](char* p, size_t n) {
+            z.next_out = reinterpret_cast<Bytef*>(p + n - grow);
+            z.avail_out = static_cast<uInt>(grow);
+            rc = inflate(&z, Z_NO_FLUSH);
+            return n - z.avail_out;
+        });
+        chunk *= 2;
+    }
+    if ((rc == Z_STREAM_END) && (z.avail_in != 0)) {
+        rc = Z_DATA_ERROR; // trailing garbage
+    }
+    inflateReset(&z);
+    return rc;
+}
+
+bool compression::decompress(std::string_view data, Encoding encoding, std::pmr::string& out, size_t max_size) {
+    if (encoding == Encoding::Identity) {
+        if (data.size() > max_size) {
+            return false;
+        }
+        out.append(data);
+        return true;
+    }
+    if ((encoding != Encoding::Gzip) && (encoding != Encoding::Deflate)) {
+        throw Error(std::string("Cannot decompress ") + name(encoding));
+    }
+    size_t from = out.size();
+    bool too_large = false;
+    int rc = inflate_into(zstreams.inflater(false), data, out, max_size, too_large);
+    if ((rc == Z_DATA_ERROR) && (encoding == Encoding::Deflate) && !too_large) {
+        // some clients send deflate without the zlib header
+        out.resize(from);
+        rc = inflate_into(zstreams.inflater(true), data, out, max_size, too_large);
+    }
+    if (too_large) {
+        out.resize(from);
+        return false;
+    }
+    if (rc != Z_STREAM_END) {
+        out.resize(from);
+        throw Error(std::string("Corrupt ") + name(encoding) + " data");
+    }
+    return true;
+}
+
+static uint64_t body_check(std::string_view data) {
+    // second hash of a cached body (FNV-1a over 8 byte words), independent of std::hash
+    uint64_t hash = 14695981039346656037ull ^ data.size();
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word;
+        memcpy(&word, data.data() + i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; i < data.size(); i++) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    }
+    return hash ^ (hash >> 29);
+}
+
+void compression::Cache::compress(std::string_view data, Encoding encoding, std::pmr::string& out) {
+    Key key {std::hash<std::string_view>{}(data), body_check(data), encoding};
+    std::shared_ptr<const std::pmr::string> entry;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto it = this->entries.find(key);
+        if (it != this->entries.end()) {
+            entry = it->second;
+        }
+    }
+    if (!entry) {
+        // compressed out of the lock, two threads may do it for the same body at worst
+        auto compressed = std::make_shared<std::pmr::string>();
+        compression::compress(data, encoding, *compressed, NICEHTTP_COMPRESSION_CACHED_LEVEL);
+        entry = compressed;
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if ((entry->size() <= this->max_bytes) && this->entries.emplace(key, entry).second) {
+            this->order.push_back(key);
+            this->size += entry->size();
+            while (this->size > this->max_bytes) {
+                auto oldest = this->entries.find(this->order.front());
+                this->size -= oldest->second->size();
+                this->entries.erase(oldest);
+                this->order.pop_front();
+            }
+        }
+    }
+    out.append(*entry);
+}
+
+size_t compression::Cache::bytes() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->size;
+}
+
+#endif
+
+#include <functional>
+
+size_t ResponseCache::Sketch::slot(uint64_t hash, int row) {
+    // a different 64 bit mix of the hash for every row
+    uint64_t h = (hash + row) * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 32;
+    return h % NICEHTTP_CACHE_SKETCH;
+}
+
+void ResponseCache::Sketch::increment(uint64_t hash) {
+    for (int row = 0; row < 4; row++) {
+        uint8_t& counter = this->rows[row][slot(hash, row)];
+        if (counter < 15) {
+            counter++;
+        }
+    }
+    if (++this->additions >= 10 * NICEHTTP_CACHE_SKETCH) {
+        // aging
+        for (auto& row : this->rows) {
+            for (uint8_t& counter : row) {
+                counter >>= 1;
+            }
+        }
+        this->additions /= 2;
+    }
+}
+
+uint8_t ResponseCache::Sketch::estimate(uint64_t hash) const {
+    uint8_t min = 15;
+    for (int row = 0; row < 4; row++) {
+        min = std::min(min, this->rows[row][slot(hash, row)]);
+    }
+    return min;
+}
+
+ResponseCache::ResponseCache(size_t max_bytes) {
+    this->shard_bytes = max_bytes / NICEHTTP_CACHE_SHARDS;
+}
+
+size_t ResponseCache::cost(const Node& node) {
+    // bytes accounted for an entry, bookkeeping included
+    return node.key.size() + node.entry->raw.size() + node.entry->etag.size() + node.entry->not_modified.size() + 128;
+}
+
+void ResponseCache::erase(Shard& shard, std::list<Node>::iterator node) {
+    shard.bytes -= cost(*node);
+    shard.index.erase(node->key);
+    shard.lru.erase(node);
+}
+
+std::shared_ptr<const ResponseCache::Entry> ResponseCache::get(std::string_view key) {
+    uint64_t hash = std::hash<std::string_view>{}(key);
+    Shard& shard = this->shards[hash % NICEHTTP_CACHE_SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.sketch.increment(hash);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+        this->misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    if (it->second->entry->expires <= std::chrono::steady_clock::now()) {
+        this->erase(shard, it->second);
+        this->misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    this->hits.fetch_add(1, std::memory_order_relaxed);
+    return it->second->entry;
+}
+
+void ResponseCache::put(std::string_view key, std::shared_ptr<const Entry> entry) {
+    uint64_t hash = std::hash<std::string_view>{}(key);
+    Shard& shard = this->shards[hash % NICEHTTP_CACHE_SHARDS];
+    Node node {std::string(key), hash, std::move(entry)};
+    size_t size = cost(node);
+    if (size > this->shard_bytes / 8) {
+        this->rejections.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto old = shard.index.find(key);
+    if (old != shard.index.end()) {
+        this->erase(shard, old->second);
+    }
+    // TinyLFU admission: the victims must be requested less often than the new key
+    uint8_t frequency = shard.sketch.estimate(hash);
+    size_t freed = 0;
+    auto victim = shard.lru.end();
+    while ((shard.bytes - freed + size > this->shard_bytes) && (victim != shard.lru.begin())) {
+        --victim;
+        if (shard.sketch.estimate(victim->hash) > frequency) {
+            this->rejections.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        freed += cost(*victim);
+    }
+    while (shard.bytes + size > this->shard_bytes) {
+        this->erase(shard, std::prev(shard.lru.end()));
+        this->evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    shard.lru.push_front(std::move(node));
+    shard.index.emplace(shard.lru.front().key, shard.lru.begin());
+    shard.bytes += size;
+}
+
+void ResponseCache::clear() {
+    for (Shard& shard : this->shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.index.clear();
+        shard.lru.clear();
+        shard.bytes = 0;
+    }
+}
+
+size_t ResponseCache::bytes() {
+    size_t total = 0;
+    for (Shard& shard : this->shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        total += shard.bytes;
+    }
+    return total;
+}
+
+std::string ResponseCache::metrics() {
+    std::string out;
+    auto family = [&out](const char* name, const char* type, const char* help, uint64_t value) {
+        out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n" +
+               name + " " + std::to_string(value) + "\n";
+    };
+    family("nicehttp_response_cache_hits_total", "counter", "Responses sent from the cache.", this->hits.load(std::memory_order_relaxed));
+    family("nicehttp_response_cache_misses_total", "counter", "Cacheable requests that ran the handler.", this->misses.load(std::memory_order_relaxed));
+    family("nicehttp_response_cache_evictions_total", "counter", "Responses evicted to make room.", this->evictions.load(std::memory_order_relaxed));
+    family("nicehttp_response_cache_rejections_total", "counter", "Responses not admitted (rarer than the victims or too big).",
+           this->rejections.load(std::memory_order_relaxed));
+    family("nicehttp_response_cache_bytes", "gauge", "Bytes of cached responses.", this->bytes());
+    return out;
+}
+
+std::variant<SingleFlight::Leader, std::shared_ptr<SingleFlight::Call>> SingleFlight::join(std::string_view key) {
+    Shard& shard = this->shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto running = shard.calls.find(key);
+    if (running != shard.calls.end()) {
+        return running->second;
+    }
+    auto call = std::make_shared<Call>();
+    shard.calls.emplace(key, call);
+    this->leaders.fetch_add(1, std::memory_order_relaxed);
+    return Leader(this, key, std::move(call));
+}
+
+void SingleFlight::Leader::complete(std::shared_ptr<const ResponseCache::Entry> result) {
+    if (!this->call) {
+        return; // completed already, or moved
+    }
+    {
+        // requests arriving from now on run their own handler (or find the response cached)
+        Shard& shard = this->flights->shard(this->key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.calls.erase(this->key);
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->call->mutex);
+        this->call->result = std::move(result);
+        this->call->done = true;
+    }
+    this->call->done_cv.notify_all();
+    this->call.reset();
+}
+
+std::shared_ptr<const ResponseCache::Entry> SingleFlight::wait(Call& call, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(call.mutex);
+    if (!call.done_cv.wait_for(lock, timeout, [&call] { return call.done; }) || !call.result) {
+        return nullptr;
+    }
+    this->coalesced.fetch_add(1, std::memory_order_relaxed);
+    return call.result;
+}
+
+std::string SingleFlight::metrics() {
+    return "# HELP nicehttp_coalesce_leaders_total Requests that ran the handler for identical concurrent requests.\n"
+           "# TYPE nicehttp_coalesce_leaders_total counter\n"
+           "nicehttp_coalesce_leaders_total " + std::to_string(this->leaders.load(std::memory_order_relaxed)) + "\n"
+           "# HELP nicehttp_coalesced_requests_total Requests answered with the response of an identical one.\n"
+           "# TYPE nicehttp_coalesced_requests_total counter\n"
+           "nicehttp_coalesced_requests_total " + std::to_string(this->coalesced.load(std::memory_order_relaxed)) + "\n";
+}
+
+#include <algorithm>
+#include <cerrno>
+#include <map>
+#include <thread>
+
+#if defined(__linux__)
+#include <csignal>
+#include <cstdio>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/time.h>
+#endif
+
+Profiler& Profiler::getInstance() {
+    static Profiler profiler;
+    return profiler;
+}
+
+#if defined(__linux__)
+
+void Profiler::onSignal(int) {
+    // async signal safe: atomics, backtrace (already loaded) and the preallocated buffer only
+    Profiler& p = Profiler::getInstance();
+    int saved_errno = errno;
+    // store then load, as in profile(): seq_cst so that profile() can't see in_handler == 0
+    // while this handler still sees sampling == true
+    p.in_handler.fetch_add(1, std::memory_order_seq_cst);
+    if (p.sampling.load(std::memory_order_seq_cst)) {
+        size_t i = p.next.fetch_add(1, std::memory_order_relaxed);
+        if (i < NICEHTTP_PROFILE_SAMPLES) {
+            Sample& s = p.samples[i];
+            s.depth = backtrace(s.frames, NICEHTTP_PROFILE_DEPTH);
+        } else {
+            p.dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    p.in_handler.fetch_sub(1, std::memory_order_release);
+    errno = saved_errno;
+}
+
+std::string Profiler::profile(std::chrono::seconds duration, int hz) {
+    if (this->running.exchange(true)) {
+        throw ProfilerBusy("A profile is already running");
+    }
+    duration = std::clamp(duration, std::chrono::seconds(1), std::chrono::seconds(NICEHTTP_PROFILE_MAX));
+    hz = std::clamp(hz, 1, 1000);
+    if (!this->samples) {
+        this->samples.reset(new Sample[NICEHTTP_PROFILE_SAMPLES]);
+    }
+    this->next.store(0, std::memory_order_relaxed);
+    this->dropped.store(0, std::memory_order_relaxed);
+    void* warmup[1];
+    backtrace(warmup, 1); // the first call loads libgcc, which is not signal safe
+
+    // the handler stays installed: a SIGPROF still pending when the timer is
+    // stopped would kill the process with the default action
+    struct sigaction action = {};
+    action.sa_handler = Profiler::onSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+    this->sampling.store(true, std::memory_order_release);
+    itimerval timer = {}, stopped = {};
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+
+    std::this_thread::sleep_for(duration);
+
+    setitimer(ITIMER_PROF, &stopped, nullptr);
+    // seq_cst store then load, paired with onSignal(): once in_handler is 0 no handler writes a sample
+    this->sampling.store(false, std::memory_order_seq_cst);
+    while (this->in_handler.load(std::memory_order_seq_cst) > 0) {
+        std::this_thread::yield();
+    }
+    size_t count = std::min<size_t>(this->next.load(std::memory_order_acquire), NICEHTTP_PROFILE_SAMPLES);
+    std::string folded = this->fold(count, this->dropped.load(std::memory_order_relaxed));
+    this->running.store(false);
+    return folded;
+}
+
+static std::string profiler_symbol(void* address, std::map<void*, std::string>& cache) {
+    // function name of a return address, demangled, or module+offset without symbols
+    auto cached = cache.find(address);
+    if (cached != cache.end()) {
+        return cached->second;
+    }
+    std::string name;
+    Dl_info info{};
+    bool found = dladdr(address, &info) != 0;
+    if (found && (info.dli_sname != nullptr)) {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        name = (status == 0) ? demangled : info.dli_sname;
+        free(demangled);
+    } else if (found && (info.dli_fname != nullptr)) {
+        std::string module = info.dli_fname;
+        char offset[32];
+        snprintf(offset, sizeof(offset), "+0x%zx", static_cast<size_t>(static_cast<char*>(address) - static_cast<char*>(info.dli_fbase)));
+        name = module.substr(module.rfind('/') + 1) + offset;
+    } else {
+        char raw[32];
+        snprintf(raw, sizeof(raw), "%p", address);
+        name = raw;
+    }
+    // ';' separates the frames and ' ' the count in the folded format
+    for (char& c : name) {
+        if ((c == ';') || (c == '\n')) c = ':';
+    }
+    cache.emplace(address, name);
+    return name;
+}
+
+std::string Profiler::fold(size_t count, uint64_t dropped) {
+    std::map<void*, std::string> symbols;
+    std::map<std::string, uint64_t> stacks;
+    for (size_t i = 0; i < count; i++) {
+        const Sample& s = this->samples[i];
+        std::string stack;
+        // frames[0] is the handler, frames[1] the signal trampoline
+        for (int f = s.depth - 1; f >= 2; f--) {
+            if (!stack.empty()) stack += ';';
+            stack += profiler_symbol(s.frames[f], symbols);
+        }
+        if (!stack.empty()) {
+            stacks[stack]++;
+        }
+    }
+    std::string out;
+    for (const auto& [stack, n] : stacks) {
+        out += stack + " " + std::to_string(n) + "\n";
+    }
+    if (dropped > 0) {
+        out += "[dropped] " + std::to_string(dropped) + "\n";
+    }
+    return out;
+}
+
+#else
+
+std::string Profiler::profile(std::chrono::seconds, int) {
+    throw std::runtime_error("The profiler is supported on Linux only");
+}
+
+#endif
+
+#ifdef NICEHTTP_ALLOC_STATS
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static thread_local alloc_stats::Usage thread_usage; // trivial type: no dynamic initialization inside operator new
+
+struct AllocPhaseTotal {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> bytes{0};
+};
+static std::array<AllocPhaseTotal, NICEHTTP_ALLOC_PHASES> phase_totals;
+
+static void* counted_alloc(size_t size, size_t alignment) {
+    thread_usage.count++;
+    thread_usage.bytes += size;
+    if (size == 0) {
+        size = 1;
+    }
+    void* p;
+    if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        p = std::malloc(size);
+    } else {
+        #ifdef _WIN32
+        p = _aligned_malloc(size, alignment);
+        #else
+        p = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+        #endif
+    }
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+static void counted_free(void* p, size_t alignment) {
+    #ifdef _WIN32
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        _aligned_free(p);
+        return;
+    }
+    #else
+    (void)alignment;
+    #endif
+    std::free(p);
+}
+
+alloc_stats::Usage alloc_stats::current() {
+    return thread_usage;
+}
+
+void alloc_stats::account(size_t phase, const Usage& before, const Usage& after) {
+    if (phase < NICEHTTP_ALLOC_PHASES) {
+        phase_totals[phase].count.fetch_add(after.count - before.count, std::memory_order_relaxed);
+        phase_totals[phase].bytes.fetch_add(after.bytes - before.bytes, std::memory_order_relaxed);
+    }
+}
+
+alloc_stats::Usage alloc_stats::total(size_t phase) {
+    if (phase >= NICEHTTP_ALLOC_PHASES) {
+        return {};
+    }
+    return {phase_totals[phase].count.load(std::memory_order_relaxed), phase_totals[phase].bytes.load(std::memory_order_relaxed)};
+}
+
+void* operator new(size_t size) { return counted_alloc(size, 0); }
+void* operator new[](size_t size) { return counted_alloc(size, 0); }
+void* operator new(size_t size, std::align_val_t al) { return counted_alloc(size, static_cast<size_t>(al)); }
+void* operator new[](size_t size, std::align_val_t al) { return counted_alloc(size, static_cast<size_t>(al)); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try { return counted_alloc(size, 0); } catch (...) { return nullptr; }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    try { return counted_alloc(size, 0); } catch (...) { return nullptr; }
+}
+void operator delete(void* p) noexcept { counted_free(p, 0); }
+void operator delete[](void* p) noexcept { counted_free(p, 0); }
+void operator delete(void* p, size_t) noexcept { counted_free(p, 0); }
+void operator delete[](void* p, size_t) noexcept { counted_free(p, 0); }
+void operator delete(void* p, std::align_val_t al) noexcept { counted_free(p, static_cast<size_t>(al)); }
+void operator delete[](void* p, std::align_val_t al) noexcept { counted_free(p, static_cast<size_t>(al)); }
+void operator delete(void* p, size_t, std::align_val_t al) noexcept { counted_free(p, static_cast<size_t>(al)); }
+void operator delete[](void* p, size_t, std::align_val_t al) noexcept { counted_free(p, static_cast<size_t>(al)); }
+
+#endif
+
+#include <bit>
+#include <map>
+#include <tuple>
+
+void LatencyHistogram::record(uint64_t us) {
+    auto& counter = this->buckets[bucket(us)];
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count(size_t bucket) const {
+    return this->buckets[bucket].load(std::memory_order_relaxed);
+}
+
+size_t LatencyHistogram::bucket(uint64_t us) {
+    if (us < 16) {
+        return us;
+    }
+    // keep the 5 most significant bits: the first one gives the power of two, the other 4 the sub bucket
+    size_t shift = std::bit_width(us) - 5;
+    size_t i = 16 + shift * 16 + ((us >> shift) - 16);
+    return std::min(i, static_cast<size_t>(NICEHTTP_HISTOGRAM_BUCKETS - 1));
+}
+
+uint64_t LatencyHistogram::upper(size_t bucket) {
+    if (bucket < 16) {
+        return bucket;
+    }
+    size_t shift = (bucket - 16) / 16;
+    return ((17 + (bucket - 16) % 16) << shift) - 1;
+}
+
+Metrics& Metrics::getInstance() {
+    static Metrics metrics;
+    return metrics;
+}
+
+void Metrics::bump(std::atomic<uint64_t>& counter, uint64_t n) {
+    // only the owner thread writes, a plain load and store is enough
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+Metrics::Handle::~Handle() {
+    if (this->block != nullptr) {
+        Metrics& metrics = Metrics::getInstance();
+        std::lock_guard<std::mutex> lock(metrics.registry);
+        metrics.free_blocks.push_back(this->block);
+    }
+}
+
+Metrics::ThreadMetrics& Metrics::local() {
+    thread_local Handle handle;
+    if (handle.block == nullptr) {
+        std::lock_guard<std::mutex> lock(this->registry);
+        if (!this->free_blocks.empty()) {
+            handle.block = this->free_blocks.back();
+            this->free_blocks.pop_back();
+        } else {
+            this->blocks.push_back(std::make_unique<ThreadMetrics>());
+            handle.block = this->blocks.back().get();
+        }
+    }
+    return *handle.block;
+}
+
+Metrics::Series& Metrics::series(ThreadMetrics& block, const Route* route, int status) {
+    // open addressing on (route, status), slots are only filled by the owner thread
+    size_t h = (reinterpret_cast<uintptr_t>(route) >> 4) * 31 + static_cast<size_t>(status);
+    for (size_t probe = 0; probe < NICEHTTP_METRICS_SERIES; probe++) {
+        auto& slot = block.series[(h + probe) % NICEHTTP_METRICS_SERIES];
+        Series* s = slot.load(std::memory_order_relaxed);
+        if (s == nullptr) {
+            std::string method = (route != nullptr) ? std::string(route->method) : "";
+            std::string uri = (route != nullptr) ? std::string(route->uri) : "";
+            block.owned.push_back(std::make_unique<Series>(route, std::move(method), std::move(uri), status));
+            s = block.owned.back().get();
+            slot.store(s, std::memory_order_release);
+            return *s;
+        }
+        // a route allocated where a deleted one was doesn't take its series, unless it has the same labels
+        if ((s->route == route) && (s->status == status) && ((route == nullptr) || ((s->method == route->method) && (s->uri == route->uri)))) {
+            return *s;
+        }
+    }
+    return block.other;
+}
+
+void Metrics::request(const Route* route, int status, size_t bytes_in, size_t bytes_out, std::chrono::steady_clock::duration latency) {
+    ThreadMetrics& block = this->local();
+    Series& s = this->series(block, route, status);
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    bump(s.requests);
+    bump(s.bytes_in, bytes_in);
+    bump(s.bytes_out, bytes_out);
+    bump(s.latency_sum, us);
+    s.latency.record(us);
+}
+
+void Metrics::accepted() {
+    bump(this->local().accepted);
+}
+
+void Metrics::closed() {
+    bump(this->local().closed);
+}
+
+void Metrics::parseError() {
+    bump(this->local().parse_errors);
+}
+
+void Metrics::unauthorized() {
+    bump(this->local().unauthorized);
+}
+
+void Metrics::notFound() {
+    bump(this->local().not_found);
+}
+
+static std::string prometheus_label(std::string_view value) {
+    // escape a Prometheus label value
+    std::string out;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+std::string Metrics::render() {
+    // upper bounds (us) of the exported buckets, the fine buckets are merged into them
+    static const std::array<uint64_t, 16> bounds = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+                                                    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+    struct Total {
+        uint64_t requests = 0, bytes_in = 0, bytes_out = 0, latency_sum = 0;
+        std::array<uint64_t, 16> buckets{};
+    };
+    std::map<std::tuple<std::string, std::string, int>, Total> totals;
+    uint64_t accepted = 0, closed = 0, parse_errors = 0, unauthorized = 0, not_found = 0;
+    {
+        std::lock_guard<std::mutex> lock(this->registry);
+        for (const auto& block : this->blocks) {
+            accepted += block->accepted.load(std::memory_order_relaxed);
+            closed += block->closed.load(std::memory_order_relaxed);
+            parse_errors += block->parse_errors.load(std::memory_order_relaxed);
+            unauthorized += block->unauthorized.load(std::memory_order_relaxed);
+            not_found += block->not_found.load(std::memory_order_relaxed);
+            auto add = [&totals](const Series& s) {
+                uint64_t requests = s.requests.load(std::memory_order_relaxed);
+                if (requests == 0) {
+                    return;
+                }
+                std::string route = (s.route != nullptr) ? s.uri : ((s.status == 0) ? "other" : "none");
+                Total& t = totals[{s.method, route, s.status}];
+                t.requests += requests;
+                t.bytes_in += s.bytes_in.load(std::memory_order_relaxed);
+                t.bytes_out += s.bytes_out.load(std::memory_order_relaxed);
+                t.latency_sum += s.latency_sum.load(std::memory_order_relaxed);
+                for (size_t i = 0; i < NICEHTTP_HISTOGRAM_BUCKETS; i++) {
+                    uint64_t count = s.latency.count(i);
+                    if (count == 0) {
+                        continue;
+                    }
+                    auto b = std::ranges::lower_bound(bounds, LatencyHistogram::upper(i));
+                    if (b != bounds.end()) {
+                        t.buckets[b - bounds.begin()] += count;
+                    }
+                }
+            };
+            for (const auto& slot : block->series) {
+                if (const Series* s = slot.load(std::memory_order_acquire)) {
+                    add(*s);
+                }
+            }
+            add(block->other);
+        }
+    }
+
+    std::string out;
+    auto family = [&out](const char* name, const char* type, const char* help) {
+        out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+    };
+    auto labels = [](const auto& key) {
+        return "method=\"" + prometheus_label(std::get<0>(key)) + "\",route=\"" + prometheus_label(std::get<1>(key)) +
+               "\",code=\"" + std::to_string(std::get<2>(key)) + "\"";
+    };
+    family("nicehttp_requests_total", "counter", "Requests handled, by route and status code.");
+    for (const auto& [key, t] : totals) {
+        out += "nicehttp_requests_total{" + labels(key) + "} " + std::to_string(t.requests) + "\n";
+    }
+    family("nicehttp_request_bytes_total", "counter", "Bytes received in requests.");
+    for (const auto& [key, t] : totals) {
+        out += "nicehttp_request_bytes_total{" + labels(key) + "} " + std::to_string(t.bytes_in) + "\n";
+    }
+    family("nicehttp_response_bytes_total", "counter", "Bytes sent in responses (heads only for proxied responses).");
+    for (const auto& [key, t] : totals) {
+        out += "nicehttp_response_bytes_total{" + labels(key) + "} " + std::to_string(t.bytes_out) + "\n";
+    }
+    family("nicehttp_request_duration_seconds", "histogram", "Time from the request head to the end of the response.");
+    for (const auto& [key, t] : totals) {
+        std::string l = labels(key);
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < bounds.size(); i++) {
+            cumulative += t.buckets[i];
+            out += "nicehttp_request_duration_seconds_bucket{" + l + ",le=\"" + std::to_string(bounds[i] / 1e6) + "\"} " + std::to_string(cumulative) + "\n";
+        }
+        out += "nicehttp_request_duration_seconds_bucket{" + l + ",le=\"+Inf\"} " + std::to_string(t.requests) + "\n";
+        out += "nicehttp_request_duration_seconds_sum{" + l + "} " + std::to_string(t.latency_sum / 1e6) + "\n";
+        out += "nicehttp_request_duration_seconds_count{" + l + "} " + std::to_string(t.requests) + "\n";
+    }
+    family("nicehttp_connections_active", "gauge", "Connections accepted and not yet closed.");
+    out += "nicehttp_connections_active " + std::to_string(static_cast<int64_t>(accepted - closed)) + "\n";
+    family("nicehttp_connections_accepted_total", "counter", "Connections accepted.");
+    out += "nicehttp_connections_accepted_total " + std::to_string(accepted) + "\n";
+    family("nicehttp_parse_errors_total", "counter", "Malformed requests.");
+    out += "nicehttp_parse_errors_total " + std::to_string(parse_errors) + "\n";
+    family("nicehttp_unauthorized_total", "counter", "Requests rejected by the route authentication.");
+    out += "nicehttp_unauthorized_total " + std::to_string(unauthorized) + "\n";
+    family("nicehttp_not_found_total", "counter", "Requests matching no route.");
+    out += "nicehttp_not_found_total " + std::to_string(not_found) + "\n";
+    #ifdef NICEHTTP_ALLOC_STATS
+    family("nicehttp_phase_allocations_total", "counter", "Heap allocations made in each phase of the requests.");
+    for (size_t p = 0; p < static_cast<size_t>(trace::Phase::Count); p++) {
+        out += std::string("nicehttp_phase_allocations_total{phase=\"") + trace::phaseName(static_cast<trace::Phase>(p)) + "\"} " + std::to_string(alloc_stats::total(p).count) + "\n";
+    }
+    family("nicehttp_phase_allocated_bytes_total", "counter", "Heap bytes allocated in each phase of the requests.");
+    for (size_t p = 0; p < static_cast<size_t>(trace::Phase::Count); p++) {
+        out += std::string("nicehttp_phase_allocated_bytes_total{phase=\"") + trace::phaseName(static_cast<trace::Phase>(p)) + "\"} " + std::to_string(alloc_stats::total(p).bytes) + "\n";
+    }
+    #endif
+    return out;
+}
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <time.h>
+
+const char* trace::phaseName(Phase phase) {
+    static const char* names[] = {"queue", "recv", "parse", "route", "executor", "body",
+                                  "handler", "compress", "serialize", "send", "proxy", "request"};
+    return (phase < Phase::Count) ? names[static_cast<size_t>(phase)] : "unknown";
+}
+
+#ifdef NICEHTTP_TRACE
+
+trace::RequestTrace::RequestTrace() {
+    this->begin = Tracer::now();
+}
+
+void trace::RequestTrace::mark(Phase phase) {
+    this->allocations.mark(phase);
+    if (this->count < this->phases.size()) {
+        this->phases[this->count] = phase;
+        this->ends[this->count] = Tracer::now();
+        this->count++;
+    }
+}
+
+int64_t trace::RequestTrace::elapsed() const {
+    return Tracer::now() - this->begin;
+}
+
+trace::Tracer& trace::Tracer::getInstance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+int64_t trace::Tracer::now() {
+    #ifdef _WIN32
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    #else
+    // vDSO call, no system call
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    #endif
+}
+
+trace::Tracer::Handle::~Handle() {
+    if (this->ring != nullptr) {
+        Tracer& tracer = Tracer::getInstance();
+        std::lock_guard<std::mutex> lock(tracer.registry);
+        tracer.free_rings.push_back(this->ring);
+    }
+}
+
+trace::Tracer::Ring& trace::Tracer::local() {
+    thread_local Handle handle;
+    if (handle.ring == nullptr) {
+        std::lock_guard<std::mutex> lock(this->registry);
+        if (!this->free_rings.empty()) {
+            handle.ring = this->free_rings.back();
+            this->free_rings.pop_back();
+        } else {
+            this->rings.push_back(std::make_unique<Ring>());
+            handle.ring = this->rings.back().get();
+            handle.ring->index = this->rings.size();
+        }
+    }
+    return *handle.ring;
+}
+
+void trace::Tracer::write(Ring& ring, uint64_t request, Phase phase, int64_t begin, int64_t end) {
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    Event& e = ring.events[head % NICEHTTP_TRACE_EVENTS];
+    uint64_t seq = e.seq.load(std::memory_order_relaxed);
+    e.seq.store(seq + 1, std::memory_order_relaxed); // odd: being written
+    std::atomic_thread_fence(std::memory_order_release);
+    e.request.store(request, std::memory_order_relaxed);
+    e.phase.store(static_cast<uint64_t>(phase), std::memory_order_relaxed);
+    e.begin.store(begin, std::memory_order_relaxed);
+    e.end.store(end, std::memory_order_relaxed);
+    e.seq.store(seq + 2, std::memory_order_release);
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+void trace::Tracer::record(RequestTrace& trace, std::string_view method, std::string_view uri) {
+    int64_t end = now();
+    Ring& ring = this->local();
+    uint64_t request = (static_cast<uint64_t>(ring.index) << 40) | ++ring.requests;
+    int64_t begin = trace.begin;
+    for (uint8_t i = 0; i < trace.count; i++) {
+        this->write(ring, request, trace.phases[i], begin, trace.ends[i]);
+        begin = trace.ends[i];
+    }
+    this->write(ring, request, Phase::Request, trace.begin, end);
+    if (end - trace.begin >= static_cast<int64_t>(NICEHTTP_TRACE_SLOW) * 1000000) {
+        std::ostringstream line;
+        line << std::fixed << std::setprecision(3) << "Slow request " << method << " " << uri << " "
+             << (end - trace.begin) / 1e6 << "ms:";
+        begin = trace.begin;
+        for (uint8_t i = 0; i < trace.count; i++) {
+            line << " " << phaseName(trace.phases[i]) << "=" << (trace.ends[i] - begin) / 1e6;
+            begin = trace.ends[i];
+        }
+        Logger::getInstance().error(line.str());
+    }
+}
+
+std::string trace::Tracer::chromeTrace() {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+    bool first = true;
+    std::lock_guard<std::mutex> lock(this->registry);
+    for (const auto& ring : this->rings) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t from = (head > NICEHTTP_TRACE_EVENTS) ? head - NICEHTTP_TRACE_EVENTS : 0;
+        for (uint64_t i = from; i < head; i++) {
+            const Event& e = ring->events[i % NICEHTTP_TRACE_EVENTS];
+            uint64_t seq = e.seq.load(std::memory_order_acquire);
+            uint64_t request = e.request.load(std::memory_order_relaxed);
+            auto phase = static_cast<Phase>(e.phase.load(std::memory_order_relaxed));
+            int64_t begin = e.begin.load(std::memory_order_relaxed);
+            int64_t end = e.end.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if ((seq % 2 != 0) || (e.seq.load(std::memory_order_relaxed) != seq)) {
+                continue; // overwritten while we were reading it
+            }
+            out << (first ? "" : ",") << "{\"name\":\"" << phaseName(phase) << "\",\"cat\":\"http\",\"ph\":\"X\",\"ts\":"
+                << begin / 1e3 << ",\"dur\":" << (end - begin) / 1e3 << ",\"pid\":1,\"tid\":" << ring->index
+                << ",\"args\":{\"request\":" << request << "}}";
+            first = false;
+        }
+    }
+    out << "]}";
+    return out.str();
+}
+
+#endif
+
+void RetryBudget::deposit() {
+    int t = tokens.load(std::memory_order_relaxed);
+    while ((t < NICEHTTP_RETRY_BURST * 100) &&
+           !tokens.compare_exchange_weak(t, std::min(t + NICEHTTP_RETRY_RATIO, NICEHTTP_RETRY_BURST * 100), std::memory_order_relaxed)) {
+    }
+}
+
+bool RetryBudget::withdraw() {
+    int t = tokens.load(std::memory_order_relaxed);
+    while (t >= 100) {
+        if (tokens.compare_exchange_weak(t, t - 100, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+NiceHTTP::NiceHTTP() {
+}
+
+void NiceHTTP::cleanup() {
+    if (this->server_socket != -1) {
+        #ifdef _WIN32
+        WSACleanup();
+        closesocket(this->server_socket);
+        #else
+        close(this->server_socket);
+        #endif
+        this->server_socket = -1;
+    }
+    #ifndef _WIN32
+    this->close_idle();
+    for (int& fd : this->wake) {
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    #endif
+}
 
-#define NICEHTTP_THREADS 10 // thread pool size
-#define PKT_BLOCK_SIZE 4096 // Block size (in byte) read from tcp socket
+NiceHTTP::~NiceHTTP() {
+    this->cleanup();
+}
 
-#ifdef NICEHTTP_VERBOSE
-#define NLOG(x)  std::cout << x << std::endl;
-#else
-#define NLOG(X)
-#endif
+Router& NiceHTTP::getRouter() {
+    return this->router;
+}
 
-class NiceHTTP {
-    /* Implements HTTP REST API server and client.
-     * Connections are closed after each response.
-     * Implemented mainly to exchange json messages,
-     * you must parse the json payload using external libraries.
-     * The server is multi-threaded.
-     */
-public:
-    NiceHTTP();
-    ~NiceHTTP();
-    void start(std::string iface, short port); //Start the server
-    http::Response request(http::Request req, std::string host, short port); //Start the client
-    Router& getRouter();
-private:
-    Router router;
-    int server_socket = -1;
-    int client_socket = -1;
-    bool server_setup(const std::string& iface, const short& port);
-    bool client_setup(const std::string& host, const short& port);
-    void recv_http(const int& socket, std::string& head, std::string& body);
-    bool is_ipaddr(const std::string& host);
-    void parsereq(const int& client_fd);
-    static void signalHandler(int signum);
-    void cleanup();
-};
+ResponseCache& NiceHTTP::getCache() {
+    return this->cache;
+}
 
+void NiceHTTP::addExecutor(const std::string& name, unsigned int threads, unsigned int max_queue) {
+    this->executors[name] = std::make_unique<Executor>(threads, max_queue);
+}
 
+template <typename String>
+bool NiceHTTP::recv_head(const int& socket, String& head, String& rest, std::chrono::steady_clock::time_point deadline) {
+    /* Read up to the end of the headers (\r\n\r\n).
+    * rest holds the bytes received after the head (start of the body); bytes
+    * already in rest when called are parsed before reading from the socket.
+    * Returns false if the connection was closed before a complete head.
+    * On non blocking sockets waits for data until the deadline, then throws TimeoutError
+    * Strings keep their allocator (std::pmr::string: the arena of the connection).
+    */
+    head.clear();
+    String data(std::move(rest));
+    rest.clear();
+    int n;
+    char buff[PKT_BLOCK_SIZE];
+    size_t header_end = data.find("\r\n\r\n");
+    if (header_end != std::string::npos) {
+        head.assign(data, 0, header_end + 4);
+        rest.assign(data, header_end + 4);
+        return true;
+    }
+    while (true)
+    {
+        n = recv(socket, buff, sizeof(buff), 0);
+        if ((n < 0) && net::would_block()) {
+            struct pollfd pfd = {socket, POLLIN, 0};
+            if (net::poll_socket(&pfd, 1, net::timeout_left(deadline)) == 0) {
+                throw TimeoutError("Timeout receiving the response");
+            }
+            continue;
+        }
+        if (n <= 0) {
+            head = std::move(data);
+            return false;
+        }
+        size_t from = (data.length() > 3) ? data.length() - 3 : 0;
+        data.append(buff, n);
+        header_end = data.find("\r\n\r\n", from);
+        if (header_end != std::string::npos) {
+            head.assign(data, 0, header_end + 4);
+            rest.assign(data, header_end + 4);
+            return true;
+        }
+    }
+}
 
-void http::Message::parseHeaders(const std::string& headerstr) {
-    for (const auto h : std::views::split(headerstr, '\n')) {
-        std::string_view header(h);
-        size_t i = header.find(": ");
-        if (i == std::string::npos) {
-            //invalid header, skip it..
+template <typename String>
+bool NiceHTTP::recv_body(const int& socket, std::string_view head, String& body, std::chrono::steady_clock::time_point deadline, String* excess) {
+    /* Read the rest of the body of the message with the given head.
+    * body must contain the bytes already received after the head.
+    * The body is delimited by Content-Length or by chunked encoding, responses
+    * without them are read until the connection is closed.
+    * Bytes received after a Content-Length body go to excess, if given (next pipelined request).
+    * Returns true if the message was delimited, i.e. the connection can be reused.
+    */
+    size_t length = std::string::npos;
+    bool chunked = false;
+    std::string cl = net::header_value(head, "content-length");
+    if (cl != "") {
+        length = strtoul(cl.c_str(), nullptr, 10);
+    } else if (net::header_value(head, "transfer-encoding").find("chunked") != std::string::npos) {
+        chunked = true;
+    } else if (!head.starts_with("HTTP/") || head.starts_with("HTTP/1.1 204") || head.starts_with("HTTP/1.1 304")) {
+        length = 0; // requests and these responses have no body
+    }
+    String data(std::move(body));
+    body.clear();
+    int n;
+    char buff[PKT_BLOCK_SIZE];
+    std::string decoded;
+    while (true)
+    {
+        if (chunked && net::decode_chunked(data, decoded)) {
+            body.assign(decoded);
+            return true;
+        }
+        if ((length != std::string::npos) && (data.length() >= length)) {
+            if (excess != nullptr) {
+                excess->assign(data, length);
+            }
+            data.resize(length);
+            body = std::move(data);
+            return true;
+        }
+        n = recv(socket, buff, sizeof(buff), 0);
+        if ((n < 0) && net::would_block()) {
+            struct pollfd pfd = {socket, POLLIN, 0};
+            if (net::poll_socket(&pfd, 1, net::timeout_left(deadline)) == 0) {
+                throw TimeoutError("Timeout receiving the response");
+            }
             continue;
         }
-        std::string key(header.substr(0, i));
-        std::string val(header.substr(i+2, header.length()-i-3));
-        std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c){ return std::tolower(c); });
-        if (key == "content-length") {
-            //The request has a payload
-            this->content_length = strtoul(std::string(val).c_str(), nullptr, 0);
-        } else if (( key == "content-type") && (val == "application/json")) {
-            this->is_json = true;
-        } else {
-            this->headers.insert({key, val});
+        if (n <= 0) {
+            // connection closed by the peer
+            if (!chunked) {
+                body = std::move(data);
+            }
+            return false;
         }
+        data.append(buff, n);
     }
 }
 
-http::Request::Request(std::string method, std::string uri, std::string proto, std::map<std::string,std::string> headers, bool is_json, size_t content_length, std::string body) {
-    this->method = method;
-    this->uri = uri;
-    this->proto = proto;
-    this->content_length = content_length;
-    this->body = body;
-    this->headers = headers;
-    this->is_json = is_json;
+template <typename String>
+bool NiceHTTP::recv_http(const int& socket, String& head, String& body, std::chrono::steady_clock::time_point deadline) {
+    /* Parse basic http structure
+    *  <header>\r\n\r\n<body>
+    * head , body of request are the return values
+    * Returns true if the message was delimited, i.e. the connection can be reused.
+    */
+    if (!this->recv_head(socket, head, body, deadline)) {
+        return false;
+    }
+    return this->recv_body(socket, head, body, deadline);
 }
 
-http::Request::Request(std::string &head, std::string& body) {
-    size_t i = head.find("\r\n");
-    if (i != std::string::npos) {
-        std::string line = head.substr(0, i);
-        short j = 0;
-        for (const auto word : std::views::split(line, ' ')) {
-            switch (j) {
-                case 0:
-                    this->method = std::string_view(word);
-                    break;
-                case 1:
-                    this->uri = std::string_view(word);
-                    break;
-                case 2:
-                    this->proto = std::string_view(word);
-                    break;
-                default:
-                    break;
-            }
-            j++;
+static bool keep_alive(const http::Request& r) {
+    // HTTP/1.1 keeps the connection unless the client asks to close it, HTTP/1.0 only if asked to keep it
+    #ifdef _WIN32
+    return false; // no wake up pipe for the idle connections
+    #else
+    auto conn = r.headers.find("connection");
+    auto is = [&conn](std::string_view value) {
+        return std::ranges::equal(conn->second, value, [](char a, char b) { return std::tolower(a) == b; });
+    };
+    if (r.proto == "HTTP/1.0") {
+        return (conn != r.headers.end()) && is("keep-alive");
+    }
+    return (r.proto == PROTO_HTTP1) && ((conn == r.headers.end()) || !is("close"));
+    #endif
+}
+
+static bool header_is(std::string_view name, std::string_view lowercase) {
+    return std::ranges::equal(name, lowercase, [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; });
+}
+
+static std::string_view header_token(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ')) s.remove_suffix(1);
+    return s;
+}
+
+static void cache_key(const http::Request& r, const Route& route, std::pmr::string& key) {
+    // method, uri, Authorization (routes with auth), negotiated encoding and the values of the cache_vary headers
+    key.append(r.method).append(" ").append(r.uri);
+    if (!route.auth.empty()) {
+        auto authorization = r.headers.find("authorization");
+        key.append("\n").append((authorization == r.headers.end()) ? "" : authorization->second);
+    }
+    #ifdef NICEHTTP_COMPRESSION
+    if (route.compress) {
+        auto accept = r.headers.find("accept-encoding");
+        key.append("\n").append(compression::name((accept == r.headers.end()) ? compression::Encoding::Identity : compression::negotiate(accept->second)));
+    }
+    #endif
+    std::pmr::string name(key.get_allocator());
+    for (const auto part : std::views::split(route.cache_vary, ',')) {
+        name = header_token(std::string_view(part));
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+        auto value = r.headers.find(name);
+        key.append("\n").append((value == r.headers.end()) ? "" : value->second);
+    }
+}
+
+static bool storable(const http::Response& resp) {
+    // 200 responses without cookies or directives against caching
+    if (resp.code != 200) {
+        return false;
+    }
+    for (const auto& [name, value] : resp.headers) {
+        if (header_is(name, "set-cookie") || (header_is(name, "cache-control") &&
+            ((value.find("no-store") != std::string::npos) || (value.find("private") != std::string::npos) || (value.find("no-cache") != std::string::npos)))) {
+            return false;
         }
-        if (this->proto != PROTO_HTTP1) {
-            std::cerr << "Protocol not supported" << std::endl;
+    }
+    return true;
+}
+
+static bool shareable(const http::Response& resp) {
+    // a successful response that can go to other clients sending the same request
+    if ((resp.code < 200) || (resp.code >= 300)) {
+        return false;
+    }
+    for (const auto& [name, value] : resp.headers) {
+        if (header_is(name, "set-cookie") || (header_is(name, "cache-control") && (value.find("private") != std::string::npos))) {
+            return false;
         }
-        std::string headerstr = head.substr(i+2);
-        this->parseHeaders(headerstr);
-        if ((this->content_length > 0) && (body.length() != this->content_length)){
-            std::cout << "Error in body parsing! Content length " << this->content_length << " != body length " << body.length() << std::endl;
-        } else {
-            this->body = body;
+    }
+    return true;
+}
+
+static std::shared_ptr<const ResponseCache::Entry> cache_entry(http::Response& resp, int ttl) {
+    // Serialize resp (without Connection) for the cache, with an ETag of the body (200) if the handler didn't set one
+    auto entry = std::make_shared<ResponseCache::Entry>();
+    entry->code = resp.code;
+    auto etag = std::ranges::find_if(resp.headers, [](const auto& h) { return header_is(h.first, "etag"); });
+    if ((etag == resp.headers.end()) && (resp.code == 200)) {
+        char tag[24];
+        snprintf(tag, sizeof(tag), "\"%016llx\"", static_cast<unsigned long long>(std::hash<std::string_view>{}(resp.body)));
+        etag = resp.headers.emplace("ETag", tag).first;
+    }
+    if (etag != resp.headers.end()) {
+        entry->etag = etag->second;
+    }
+    resp.serialize(entry->raw);
+    entry->split = entry->raw.find("\r\n\r\n") + 2;
+    entry->body_size = entry->raw.size() - entry->split - 2;
+    entry->not_modified = "HTTP/1.1 304 Not Modified\r\n";
+    for (const auto& [name, value] : resp.headers) {
+        for (std::string_view validator : {"etag", "vary", "cache-control", "expires", "date", "server"}) {
+            if (header_is(name, validator)) {
+                entry->not_modified.append(name).append(": ").append(value).append("\r\n");
+            }
         }
-    } else {
-        std::cerr << "Malformed request" << std::endl;
     }
+    entry->expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(ttl);
+    return entry;
 }
 
-http::Request::Request(const Request& hr) {
-    method = hr.method;
-    uri = hr.uri;
-    proto = hr.proto;
-    content_length = hr.content_length;
-    body = hr.body;
-    headers = hr.headers;
-    is_json = hr.is_json;
+static bool etag_matches(std::string_view if_none_match, std::string_view etag) {
+    // If-None-Match: "a", W/"b" or *, weak comparison
+    for (const auto part : std::views::split(if_none_match, ',')) {
+        std::string_view tag = header_token(std::string_view(part));
+        if (tag.starts_with("W/")) {
+            tag.remove_prefix(2);
+        }
+        if ((tag == "*") || (tag == (etag.starts_with("W/") ? etag.substr(2) : etag))) {
+            return true;
+        }
+    }
+    return false;
 }
 
-std::string http::Request::toString(bool carriage_return) {
-    std::string endline;
-    carriage_return ? endline = "\r\n" : endline = "\n";
-    std::string req { std::format("{} {} {}{}", this->method, this->uri, this->proto, endline) };
-    for (const auto& h : this->headers) {
-        req += std::format("{}: {}{}", h.first, h.second, endline);
-    }
-    if (this->content_length != 0) {
-        req += std::format("Content-Length: {}{}", this->content_length, endline);
-        if (this->is_json) {
-            req += "Content-Type: application/json" + endline;
-        }
-        req += endline;
-        req += this->body;
+short NiceHTTP::send_cached(Connection* conn, const http::Request& r, const ResponseCache::Entry& entry, bool keep) {
+    // Send a cached response, or 304 if the client has it already, returns the status sent
+    std::string_view connection = keep ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    std::pmr::string raw(&conn->arena);
+    short code = entry.code;
+    auto inm = r.headers.find("if-none-match");
+    if ((code == 200) && (inm != r.headers.end()) && !entry.etag.empty() && etag_matches(inm->second, entry.etag)) {
+        raw.append(entry.not_modified).append(connection).append("\r\n");
+        code = 304;
     } else {
-        req += endline;
+        raw.reserve(entry.raw.size() + connection.size());
+        raw.append(entry.raw, 0, entry.split).append(connection).append(entry.raw, entry.split);
     }
-    return req;
+    send(conn->fd, raw.c_str(), raw.length(), 0);
+    return code;
 }
 
-http::Response::Response(short code, std::string message, std::string proto, std::map<std::string,std::string> headers, bool is_json, size_t content_length, std::string body) {
-    this->message = message;
-    this->code = code;
-    this->proto = proto;
-    this->content_length = content_length;
-    this->body = body;
-    this->headers = headers;
-    this->is_json = is_json;
+#ifdef NICEHTTP_COMPRESSION
+
+static bool compressible(std::string_view type) {
+    // media types not compressed already
+    if (type.starts_with("image/")) {
+        return type.starts_with("image/svg");
+    }
+    return !type.starts_with("video/") && !type.starts_with("audio/") && !type.starts_with("application/zip") &&
+           !type.starts_with("application/gzip") && !type.starts_with("application/octet-stream");
 }
 
-http::Response::Response(std::string &head, std::string &body) {
-    size_t i = head.find("\r\n");
-    if (i != std::string::npos) {
-        std::string line = head.substr(0, i);
-        short j = 0;
-        int digits = 0;
-        for (const auto word : std::views::split(line, ' ')) {
-            std::string_view w(word);
-            switch (j) {
-                case 0:
-                    this->proto = std::string_view(w);
-                    break;
-                case 1:
-                    digits = w.length();
-                    this->code = atoi(w.data());
-                    break;
-                default:
-                    break;
+static short inflate_body(http::Message& m) {
+    // Replace a gzip/deflate body (parsed message) with the inflated one, returns 0 or the status of the error
+    auto encoding = m.headers.find(std::pmr::string("content-encoding", m.get_allocator())); // too long for the SSO, in the arena
+    if (encoding == m.headers.end()) {
+        return 0;
+    }
+    compression::Encoding e = compression::parse(encoding->second);
+    if (e == compression::Encoding::Unsupported) {
+        return 415;
+    }
+    if (e != compression::Encoding::Identity) {
+        std::pmr::string body(m.get_allocator());
+        try {
+            if (!compression::decompress(m.body, e, body)) {
+                return 413;
             }
-            j++;
+        } catch (const compression::Error& err) {
+            Logger::getInstance().error(err.what());
+            return 400;
         }
-        // All the rest of the line is the message
-        this->message = line.substr(this->proto.length()+digits+2);
-        if (this->proto != PROTO_HTTP1) {
-            std::cerr << "Protocol not supported" << std::endl;
+        m.body = std::move(body);
+        m.content_length = m.body.size();
+    }
+    m.headers.erase(encoding);
+    return 0;
+}
+
+void NiceHTTP::compress(const http::Request& r, http::Response& resp, const Route* route) {
+    // Compress the body as accepted by the client, unless small, already encoded or of a compressed media type
+    if ((route == nullptr) || !route->compress || (resp.body.size() < NICEHTTP_COMPRESSION_MIN) ||
+        (resp.code < 200) || (resp.code == 204) || (resp.code == 304)) {
+        return;
+    }
+    for (const auto& [name, value] : resp.headers) {
+        if (header_is(name, "content-encoding") || (header_is(name, "content-type") && !compressible(value))) {
+            return;
         }
-        std::string headerstr = head.substr(i+2);
-        this->parseHeaders(headerstr);
-        if ((this->content_length > 0) && (body.length() != this->content_length)){
-            std::cout << "Error in body parsing! Content length " << this->content_length << " != body length " << body.length() << std::endl;
+    }
+    resp.headers.emplace("Vary", "Accept-Encoding");
+    auto accept = r.headers.find("accept-encoding");
+    compression::Encoding e = (accept == r.headers.end()) ? compression::Encoding::Identity : compression::negotiate(accept->second);
+    if (e == compression::Encoding::Identity) {
+        return;
+    }
+    std::pmr::string body(resp.get_allocator());
+    try {
+        if (route->cache_compressed) {
+            this->compressed.compress(resp.body, e, body);
         } else {
-            this->body = body;
+            compression::compress(resp.body, e, body);
         }
-    } else {
-        std::cerr << "Malformed request" << std::endl;
+    } catch (const compression::Error& err) {
+        Logger::getInstance().error(err.what());
+        return;
+    }
+    if (body.size() >= resp.body.size()) {
+        return; // not compressible
     }
+    resp.body = std::move(body);
+    resp.content_length = resp.body.size();
+    resp.headers.emplace("Content-Encoding", compression::name(e));
 }
+#endif
 
-http::Response::Response(const Response& r) {
-    message = r.message;
-    code = r.code;
-    proto = r.proto;
-    content_length = r.content_length;
-    body = r.body;
-    headers = r.headers;
-    is_json = r.is_json;
+void NiceHTTP::serve(Connection* conn, trace::RequestTrace trace) {
+    /* Serve the requests of a connection on this thread while the next one is already
+    * there, then park the connection in the idle set polled by start().
+    */
+    while (this->parsereq(conn, trace)) {
+        if (conn->fd == -1) {
+            delete conn;
+            return;
+        }
+        if ((conn->pending.find("\r\n\r\n") == std::string::npos) && !net::wait_socket(conn->fd, POLLIN, std::chrono::steady_clock::now())) {
+            return this->park(conn);
+        }
+        trace = trace::RequestTrace();
+    }
+    // handed to an executor
 }
 
-std::string http::Response::toString(bool carriage_return) {
-    std::string endline;
-    carriage_return ? endline = "\r\n" : endline = "\n";
-    std::string res { std::format("{} {} {}{}", this->proto, this->code, this->message, endline) };
-    for (const auto& h : this->headers) {
-        res += std::format("{}: {}{}", h.first, h.second, endline);
-    }
-    if (this->content_length != 0) {
-        res += std::format("Content-Length: {}{}", this->content_length, endline);
-        if (this->is_json) {
-            res += "Content-Type: application/json" + endline;
-        }
-        res += endline;
-        res += this->body;
-    } else {
-        res += endline;
+void NiceHTTP::park(Connection* conn) {
+    conn->idle_since = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(this->idle_mutex);
+        this->idle.push_back(conn);
+    }
+    char c = 0;
+    if (write(this->wake[1], &c, 1) < 0) {
+        // the pipe is full, start() is going to poll the idle set anyway
     }
-    return res;
 }
 
-http::Request& http::Request::operator=(const Request& other) {
-    // Guard self assignment
-    if (this == &other)
-        return *this;
- 
-    this->method = other.method;
-    this->uri = other.uri;
-    this->proto = other.proto;
-    this->content_length = other.content_length;
-    this->body = other.body;
-    this->headers = other.headers;
-    this->is_json = other.is_json;
-
-    return *this;
+void NiceHTTP::close_idle() {
+    std::lock_guard<std::mutex> lock(this->idle_mutex);
+    for (Connection* conn : this->idle) {
+        net::close_socket(conn->fd);
+        Metrics::getInstance().closed();
+        delete conn;
+    }
+    this->idle.clear();
 }
 
-http::Response& http::Response::operator=(const Response& other) {
-    // Guard self assignment
-    if (this == &other)
-        return *this;
- 
-    this->message = other.message;
-    this->code = other.code;
-    this->proto = other.proto;
-    this->content_length = other.content_length;
-    this->body = other.body;
-    this->headers = other.headers;
-    this->is_json = other.is_json;
+bool NiceHTTP::parsereq(Connection* conn, trace::RequestTrace& trace) {
+    /* Read, parse and serve one request of conn.
+    * Returns false if the request was handed to an executor, which owns conn from now on.
+    * Otherwise conn->fd is -1 if the connection was closed.
+    */
+    NLOG("Current Thread ID " << std::this_thread::get_id())
+    trace.mark(trace::Phase::Queue);
+    // nothing of the previous request is alive anymore
+    conn->arena.release();
+    // Receive request head from client
+    std::pmr::string req(&conn->arena), body(conn->pending, &conn->arena);
+    conn->pending.clear();
+    bool complete = this->recv_head(conn->fd, req, body);
+    trace.mark(trace::Phase::Recv);
+    if (!complete && req.empty()) {
+        net::close_socket(conn->fd);
+        conn->fd = -1;
+        Metrics::getInstance().closed();
+        return true;
+    }
+    auto start = std::chrono::steady_clock::now();
+    http::Request r(&conn->arena);
+    r.parseHead(req);
+    trace.mark(trace::Phase::Parse);
+    NLOG(r.method << " " << r.uri)
+    if (r.method.empty() || r.uri.empty() || !r.proto.starts_with("HTTP/")) {
+        Metrics::getInstance().parseError();
+        if (this->capture.active()) {
+            this->capture.record(start, req, body);
+        }
+        return this->finish(conn, r, nullptr, this->reply(conn->fd, 400, "Bad Request"), 0, 0, start, trace), true;
+    }
+    const Route* route = this->router.match(r);
+    trace.mark(trace::Phase::Route);
+    if ((route != nullptr) && (route->executor != NICEHTTP_INLINE_EXECUTOR)) {
+        auto executor = this->executors.find(route->executor);
+        if (executor == this->executors.end()) {
+            Logger::getInstance().error("Unknown executor " + std::string(route->executor));
+            return this->finish(conn, r, route, this->reply(conn->fd, 500, "Internal Server Error"), 0, 0, start, trace), true;
+        }
+        // hand the rest of the request to the route bulkhead, this thread goes back to new connections
+        auto task = [this, conn, r = std::move(r), req = std::move(req), body = std::move(body), complete, route, start, trace]() mutable {
+            trace.mark(trace::Phase::Executor);
+            bool keep;
+            {
+                // the arena strings must be gone before the connection is reused or deleted
+                http::Request request = std::move(r);
+                std::pmr::string head = std::move(req), rest = std::move(body);
+                keep = this->respond(conn, request, head, rest, complete, route, start, trace);
+            }
+            if (keep) {
+                this->park(conn);
+            } else {
+                delete conn;
+            }
+        };
+        if (!executor->second->submit(std::move(task))) {
+            NLOG("Executor " << route->executor << " full")
+            // the request moved into the rejected task
+            this->finish(conn, http::Request(), route, this->reply(conn->fd, 503, "Service Unavailable"), 0, 0, start, trace);
+            delete conn;
+        }
+        return false;
+    }
+    this->respond(conn, r, req, body, complete, route, start, trace);
+    return true;
+}
 
-    return *this;
+bool NiceHTTP::respond(Connection* conn, http::Request& r, std::string_view head, std::pmr::string& rest, bool complete, const Route* route, std::chrono::steady_clock::time_point start, trace::RequestTrace& trace) {
+    // Handle a request whose head has been read, rest is the start of the body. Returns true if the connection is kept
+    if ((route != nullptr) && route->isProxy()) {
+        // stream the request to the upstream, body included
+        std::string_view body(rest);
+        bool keep = complete && keep_alive(r) && (++conn->requests < NICEHTTP_KEEPALIVE_REQUESTS);
+        if (body.size() > r.content_length) {
+            // pipelined requests stay on the client connection, they must not reach the upstream one
+            if (keep) {
+                conn->pending.assign(body.substr(r.content_length));
+            }
+            body = body.substr(0, r.content_length);
+        }
+        if (this->capture.active()) {
+            this->capture.record(start, head, body); // the body received with the head only
+        }
+        short code = this->proxyreq(conn->fd, r, head, body, *route, keep);
+        trace.mark(trace::Phase::Proxy);
+        if (!keep) {
+            conn->pending.clear();
+        }
+        NLOG("Exiting thread")
+        return this->finish(conn, r, route, code, r.content_length, 0, start, trace, keep);
+    }
+    std::pmr::string excess(&conn->arena);
+    if (complete) {
+        complete = this->recv_body(conn->fd, head, rest, std::chrono::steady_clock::time_point::max(), &excess);
+    }
+    if (this->capture.active()) {
+        this->capture.record(start, head, rest);
+    }
+    r.setBody(rest);
+    #ifdef NICEHTTP_COMPRESSION
+    if (short error = inflate_body(r)) {
+        const char* message = (error == 415) ? "Unsupported Media Type" : (error == 413) ? "Payload Too Large" : "Bad Request";
+        return this->finish(conn, r, route, this->reply(conn->fd, error, message), r.body.size(), 0, start, trace);
+    }
+    #endif
+    trace.mark(trace::Phase::Body);
+    bool keep = complete && keep_alive(r) && (++conn->requests < NICEHTTP_KEEPALIVE_REQUESTS);
+    if (keep) {
+        conn->pending.assign(excess);
+    }
+    // the cache and the flights are used after the auth check of the route, unauthorized requests get their 401 from the router
+    bool cacheable = (route != nullptr) && (route->cache_ttl > 0) && (r.method == "GET") && route->authorized(r);
+    bool coalesce = (route != nullptr) && route->coalesce && (r.method == "GET") && route->authorized(r);
+    std::pmr::string key(&conn->arena);
+    std::optional<SingleFlight::Leader> leader;
+    if (cacheable || coalesce) {
+        cache_key(r, *route, key);
+        std::shared_ptr<const ResponseCache::Entry> entry = cacheable ? this->cache.get(key) : nullptr;
+        if (!entry && coalesce) {
+            auto flight = this->flights.join(key);
+            if (auto* call = std::get_if<std::shared_ptr<SingleFlight::Call>>(&flight)) {
+                // an identical request is running the handler, wait for its response
+                entry = this->flights.wait(**call);
+            } else {
+                leader.emplace(std::move(std::get<SingleFlight::Leader>(flight)));
+            }
+        }
+        if (entry) {
+            short code = this->send_cached(conn, r, *entry, keep);
+            trace.mark(trace::Phase::Send);
+            return this->finish(conn, r, route, code, r.body.size(), (code == 304) ? 0 : entry->body_size, start, trace, keep);
+        }
+    }
+    http::Response resp = this->router.handle(r, route);
+    trace.mark(trace::Phase::Handler);
+    #ifdef NICEHTTP_COMPRESSION
+    this->compress(r, resp, route);
+    trace.mark(trace::Phase::Compress);
+    #endif
+    resp.headers.emplace("Server", "NiceHTTP");
+    if ((cacheable && storable(resp)) || (leader && shareable(resp))) {
+        auto entry = cache_entry(resp, route->cache_ttl);
+        if (cacheable && storable(resp)) {
+            this->cache.put(key, entry);
+        }
+        if (leader) {
+            leader->complete(entry);
+        }
+        trace.mark(trace::Phase::Serialize);
+        short code = this->send_cached(conn, r, *entry, keep);
+        trace.mark(trace::Phase::Send);
+        return this->finish(conn, r, route, code, r.body.size(), (code == 304) ? 0 : entry->body_size, start, trace, keep);
+    }
+    leader.reset(); // the identical requests waiting run their own handler
+    resp.headers.emplace("Connection", keep ? "keep-alive" : "close");
+    std::pmr::string raw_resp(&conn->arena);
+    resp.serialize(raw_resp);
+    trace.mark(trace::Phase::Serialize);
+    NLOG(resp.proto << " " << resp.code << " " << resp.message)
+    //Send response to client
+    send(conn->fd, raw_resp.c_str(), raw_resp.length(), 0);
+    trace.mark(trace::Phase::Send);
+    NLOG("Exiting thread")
+    return this->finish(conn, r, route, resp.code, r.body.size(), resp.body.size(), start, trace, keep);
 }
 
-NiceHTTP::NiceHTTP() {
+bool NiceHTTP::finish(Connection* conn, const http::Request& r, const Route* route, short code, size_t bytes_in, size_t bytes_out, std::chrono::steady_clock::time_point start, trace::RequestTrace& trace, bool keep) {
+    // Account the request and close the connection unless kept alive (conn->fd is then -1, the owner deletes conn)
+    Logger& logger = Logger::getInstance();
+    char peer[INET6_ADDRSTRLEN] = "";
+    if (logger.accessLogEnabled()) {
+        sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        if (getpeername(conn->fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0) {
+            if (addr.ss_family == AF_INET) {
+                inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(&addr)->sin_addr, peer, sizeof(peer));
+            } else if (addr.ss_family == AF_INET6) {
+                inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6*>(&addr)->sin6_addr, peer, sizeof(peer));
+            }
+        }
+    }
+    if (!keep) {
+        net::close_socket(conn->fd);
+        conn->fd = -1;
+    }
+    auto latency = std::chrono::steady_clock::now() - start;
+    Metrics& metrics = Metrics::getInstance();
+    metrics.request(route, code, bytes_in, bytes_out, latency);
+    if (!keep) {
+        metrics.closed();
+    }
+    trace::Tracer::getInstance().record(trace, r.method, r.uri);
+    if (logger.accessLogEnabled()) {
+        logger.access(peer, r.method, r.uri, r.proto, code, bytes_out, latency);
+    }
+    return keep;
 }
 
-void NiceHTTP::cleanup() {
-    if (this->server_socket != -1) {
-        #ifdef _WIN32
-        WSACleanup();
-        closesocket(this->server_socket);
-        #else
-        close(this->server_socket);
-        #endif
-        this->server_socket = -1;
+bool NiceHTTP::enableCapture(const std::string& path, uint64_t max_bytes) {
+    if (!this->capture.open(path, max_bytes)) {
+        Logger::getInstance().error("Cannot open the capture file " + path);
+        return false;
     }
-    if (this->client_socket != -1) {
-        #ifdef _WIN32
-        WSACleanup();
-        closesocket(this->client_socket);
-        #else
-        close(this->client_socket);
-        #endif
-        this->client_socket = -1;
+    return true;
+}
+
+void NiceHTTP::enableAccessLog(const std::string& path) {
+    Logger& logger = Logger::getInstance();
+    if (!path.empty() && !logger.openAccessLog(path)) {
+        logger.error("Cannot open the access log " + path);
+        return;
     }
+    logger.setAccessLog(true);
 }
 
-NiceHTTP::~NiceHTTP() {
-    this->cleanup();
+void NiceHTTP::enableTracing(std::string_view uri) {
+    Route route {"GET", uri, [](const http::Request&) {
+        std::string body = trace::Tracer::getInstance().chromeTrace();
+        std::map<std::string,std::string> headers;
+        return http::Response(200, "OK", PROTO_HTTP1, headers, true, body.length(), body);
+    }};
+    this->router.add(route);
 }
 
-Router& NiceHTTP::getRouter() {
-    return this->router;
+void NiceHTTP::enableProfiling(std::string_view uri) {
+    this->profile_uri = std::string(uri) + "(\\?.*)?";
+    Route route {"GET", this->profile_uri, [](const http::Request& req) {
+        // /debug/profile?seconds=N, 10 seconds by default
+        int seconds = 10;
+        size_t param = req.uri.find("seconds=");
+        if (param != std::string::npos) {
+            seconds = atoi(req.uri.c_str() + param + 8);
+        }
+        std::map<std::string,std::string> headers {{"Content-Type", "text/plain"}};
+        try {
+            std::string body = Profiler::getInstance().profile(std::chrono::seconds(seconds));
+            return http::Response(200, "OK", PROTO_HTTP1, headers, false, body.length(), body);
+        } catch (const ProfilerBusy& e) {
+            std::string body = std::string(e.what()) + "\n";
+            return http::Response(409, "Conflict", PROTO_HTTP1, headers, false, body.length(), body);
+        } catch (const std::runtime_error& e) {
+            std::string body = std::string(e.what()) + "\n";
+            return http::Response(501, "Not Implemented", PROTO_HTTP1, headers, false, body.length(), body);
+        }
+    }};
+    this->router.add(route);
 }
 
-void NiceHTTP::recv_http(const int& socket, std::string& head, std::string& body) {
-    /* Parse basic http structure
-    *  <header>\r\n\r\n<body>
-    * head , body of request are the return values
-    */
-    head = "";
-    body = "";
-    int n;
-    char buff[PKT_BLOCK_SIZE] = {0,};
-    while ((n = recv(socket, buff, sizeof(buff), 0)))
-    {
-        std::string_view b(buff);
-        // if we were processing body, continute to put data into body
-        if (body != "") {
-            body += b;
-        } else { //else we process the headers
-            size_t header_end = b.find("\r\n\r\n");
-            if (header_end != std::string::npos) {
-                head += b.substr(0, header_end+4);
-                body += b.substr(header_end+4);
-            } else {
-                head += b;
+void NiceHTTP::enableMetrics(std::string_view uri) {
+    Route route {"GET", uri, [this](const http::Request&) {
+        std::string body = Metrics::getInstance().render() + this->poolMetrics() + this->cache.metrics() + this->flights.metrics();
+        std::map<std::string,std::string> headers {{"Content-Type", "text/plain; version=0.0.4"}};
+        return http::Response(200, "OK", PROTO_HTTP1, headers, false, body.length(), body);
+    }};
+    this->router.add(route);
+}
+
+std::string NiceHTTP::poolMetrics() {
+    // Prometheus families of the server pool and of the executors
+    std::vector<std::pair<std::string, dp::pool_statistics>> pools;
+    if (dp::thread_pool<>* pool = this->server_pool.load(std::memory_order_acquire)) {
+        pools.emplace_back("server", pool->stats());
+    }
+    for (const auto& [name, executor] : this->executors) {
+        pools.emplace_back(name, executor->stats());
+    }
+    std::string out;
+    auto family = [&out, &pools](const std::string& name, const std::string& type, const std::string& help, auto value) {
+        out += "# HELP " + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+        for (const auto& [pool, stats] : pools) {
+            uint64_t total = 0;
+            for (const auto& worker : stats.workers) {
+                total += value(stats, worker);
             }
+            out += name + "{pool=\"" + pool + "\"} " + std::to_string(total) + "\n";
         }
-        // if the end of buff is null we assume to have read all data (not true for binary data)
-        if (buff[PKT_BLOCK_SIZE-1] == 0) {
-            break;
+    };
+    using Stats = const dp::pool_statistics&;
+    using Worker = const dp::worker_statistics&;
+    family("nicehttp_pool_workers", "gauge", "Running workers.", [](Stats, Worker w) -> uint64_t { return w.active; });
+    family("nicehttp_pool_pending_tasks", "gauge", "Tasks waiting for a worker.",
+           [](Stats s, Worker w) -> uint64_t { return (&w == &s.workers.front()) ? std::max<int64_t>(s.pending, 0) : 0; });
+    family("nicehttp_pool_tasks_total", "counter", "Tasks executed.", [](Stats, Worker w) { return w.executed; });
+    family("nicehttp_pool_steals_total", "counter", "Tasks stolen from another worker.", [](Stats, Worker w) { return w.stolen; });
+    family("nicehttp_pool_failed_steals_total", "counter", "Steal attempts that found nothing.", [](Stats, Worker w) { return w.failed_steals; });
+    family("nicehttp_pool_parks_total", "counter", "Times an idle worker went to sleep.", [](Stats, Worker w) { return w.parks; });
+    family("nicehttp_pool_busy_microseconds_total", "counter", "Time the workers spent running tasks.",
+           [](Stats, Worker w) { return w.busy_ns / 1000; });
+    out += "# HELP nicehttp_pool_queue_wait_seconds Sampled delay between enqueue and start of a task (upper bound).\n";
+    out += "# TYPE nicehttp_pool_queue_wait_seconds gauge\n";
+    for (const auto& [pool, stats] : pools) {
+        for (const auto& [q, label] : {std::pair{50.0, "0.5"}, std::pair{99.0, "0.99"}}) {
+            out += "nicehttp_pool_queue_wait_seconds{pool=\"" + pool + "\",quantile=\"" + label +
+                   "\"} " + std::to_string(stats.wait_percentile(q) / 1e9) + "\n";
         }
-        memset(buff, 0, sizeof(buff));
     }
-}
-
-void NiceHTTP::parsereq(const int& client_fd) {
-    NLOG("Current Thread ID " << std::this_thread::get_id())
-    // Receive request from client
-    std::string req, body;
-    this->recv_http(client_fd, req, body);
-    http::Request r(req, body);
-    NLOG(r.method << " " << r.uri)
-    http::Response resp = this->router.handle(r);
-    resp.headers.insert({"Server", "NiceHTTP"});
-    resp.headers.insert({"Connection", "close"});
-    std::string raw_resp = resp.toString();
-    NLOG(resp.proto << " " << resp.code << " " << resp.message)
-    //Send response to client
-    send(client_fd, raw_resp.c_str(), raw_resp.length(), 0);
-    NLOG("Exiting thread")
-    #ifdef _WIN32
-    closesocket(client_fd);
-    #else
-    close(client_fd);
-    #endif
+    return out;
 }
 
 bool NiceHTTP::server_setup(const std::string& iface, const short& port) {
@@ -809,7 +7264,7 @@ bool NiceHTTP::server_setup(const std::string& iface, const short& port) {
     this->server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (this->server_socket == -1)
     {
-        std::cerr << "Error creating the socket" << std::endl;
+        Logger::getInstance().error("Error creating the socket");
         return false;
     }
 
@@ -828,7 +7283,7 @@ bool NiceHTTP::server_setup(const std::string& iface, const short& port) {
 
     if (bind(this->server_socket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1)
     {
-        std::cerr << "Error binding the socket" << std::endl;
+        Logger::getInstance().error("Error binding the socket");
         this->cleanup();
         return false;
     }
@@ -842,13 +7297,34 @@ void NiceHTTP::start(std::string iface, short port) {
         return;
     }
 
-    if (listen(this->server_socket, 1) == -1) {
-        std::cerr << "listen(): Error listening on socket" << std::endl;
+    if (listen(this->server_socket, SOMAXCONN) == -1) {
+        Logger::getInstance().error("listen(): Error listening on socket");
+        this->cleanup();
+        return;
+    }
+
+    #ifndef _WIN32
+    // a client closing the connection must not kill the server while we write to it
+    signal(SIGPIPE, SIG_IGN);
+    if (pipe(this->wake) == -1) {
+        Logger::getInstance().error("Error creating the wake up pipe");
         this->cleanup();
         return;
     }
+    fcntl(this->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(this->wake[1], F_SETFL, O_NONBLOCK);
+    #endif
 
-    dp::thread_pool pool(NICEHTTP_THREADS);
+    const dp::wait_strategy wait {std::chrono::microseconds(NICEHTTP_SPIN_TIME),
+                                  std::chrono::microseconds(NICEHTTP_SPIN_TIME)};
+    // elastic when it may grow over the base size
+    auto pool = NICEHTTP_MAX_THREADS > NICEHTTP_THREADS
+        ? std::make_unique<dp::thread_pool<>>(dp::elastic_size{NICEHTTP_THREADS, NICEHTTP_MAX_THREADS,
+                                                               std::chrono::milliseconds(NICEHTTP_GROW_AFTER),
+                                                               std::chrono::milliseconds(NICEHTTP_IDLE_TIMEOUT)},
+                                              NICEHTTP_AFFINITY, wait)
+        : std::make_unique<dp::thread_pool<>>(NICEHTTP_THREADS, NICEHTTP_AFFINITY, wait);
+    this->server_pool.store(pool.get(), std::memory_order_release);
     int timeout = 1 * 60 * 1000; // wait 1 minute
     struct pollfd fds[1] = {0};
     fds[0].fd = this->server_socket;
@@ -862,114 +7338,603 @@ void NiceHTTP::start(std::string iface, short port) {
             client_socket = accept(this->server_socket, NULL, NULL);
             if (client_socket > 0) {
                 //Client accepted
-                pool.enqueue_detach([this, &client_socket]() { this->parsereq(client_socket); });
+                Metrics::getInstance().accepted();
+                trace::RequestTrace trace;
+                pool->enqueue_detach([this, conn = new Connection(client_socket), trace]() mutable { this->serve(conn, trace); });
             } else {
-                std::cerr << "Failed to accept incoming connection" << std::endl;
+                Logger::getInstance().error("Failed to accept incoming connection");
             }
         } else if (rc < 0) {
-            return;
+            break;
         }
     }
     #else
-    while(int rc = poll(fds, 1, timeout)) { // query socket status
-        if (rc > 0) { //accept the incoming connection
+    // polled: the server socket, the wake up pipe and the idle keep-alive connections
+    std::vector<struct pollfd> pfds;
+    std::vector<Connection*> watched;
+    while (true) {
+        pfds.assign(fds, fds + 1);
+        pfds.push_back({this->wake[0], POLLIN, 0});
+        auto now = std::chrono::steady_clock::now();
+        auto expiry = std::chrono::steady_clock::time_point::max();
+        {
+            std::lock_guard<std::mutex> lock(this->idle_mutex);
+            watched = this->idle;
+        }
+        for (Connection* conn : watched) {
+            pfds.push_back({conn->fd, POLLIN, 0});
+            expiry = std::min(expiry, conn->idle_since + std::chrono::milliseconds(NICEHTTP_KEEPALIVE_TIMEOUT));
+        }
+        int wait_ms = watched.empty() ? timeout : std::max<int>(0, std::chrono::ceil<std::chrono::milliseconds>(expiry - now).count());
+        int rc = net::poll_socket(pfds.data(), pfds.size(), wait_ms);
+        if ((rc < 0) || ((rc == 0) && watched.empty())) {
+            break;
+        }
+        if (pfds[0].revents & POLLIN) { //accept the incoming connection
             client_socket = accept(this->server_socket, NULL, NULL);
             if (client_socket > 0) {
                 //Client accepted
-                pool.enqueue_detach([this, &client_socket]() { this->parsereq(client_socket); });
+                Metrics::getInstance().accepted();
+                trace::RequestTrace trace;
+                pool->enqueue_detach([this, conn = new Connection(client_socket), trace]() mutable { this->serve(conn, trace); });
             } else {
-                std::cerr << "Failed to accept incoming connection" << std::endl;
+                Logger::getInstance().error("Failed to accept incoming connection");
             }
-        } else if (rc < 0) {
-            return;
+        }
+        if (pfds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(this->wake[0], drain, sizeof(drain)) > 0) {}
+        }
+        // serve the idle connections with a new request, close the expired ones
+        now = std::chrono::steady_clock::now();
+        std::vector<Connection*> ready, expired;
+        for (size_t i = 0; i < watched.size(); i++) {
+            if (pfds[i + 2].revents != 0) {
+                ready.push_back(watched[i]);
+            } else if (now - watched[i]->idle_since >= std::chrono::milliseconds(NICEHTTP_KEEPALIVE_TIMEOUT)) {
+                expired.push_back(watched[i]);
+            }
+        }
+        if (ready.empty() && expired.empty()) {
+            continue;
+        }
+        {
+            // out of the idle set before a worker can park them again
+            std::ranges::sort(ready);
+            std::ranges::sort(expired);
+            std::lock_guard<std::mutex> lock(this->idle_mutex);
+            std::erase_if(this->idle, [&](Connection* conn) {
+                return std::ranges::binary_search(ready, conn) || std::ranges::binary_search(expired, conn);
+            });
+        }
+        for (Connection* conn : ready) {
+            trace::RequestTrace trace;
+            pool->enqueue_detach([this, conn, trace]() mutable { this->serve(conn, trace); });
+        }
+        for (Connection* conn : expired) {
+            net::close_socket(conn->fd);
+            Metrics::getInstance().closed();
+            delete conn;
         }
     }
     #endif
-
+    this->server_pool.store(nullptr, std::memory_order_release);
+    pool.reset(); // the running requests may still park their connection
+    this->close_idle();
 }
 
-bool NiceHTTP::client_setup(const std::string& host, const short& port) {
+int NiceHTTP::client_connect(const std::string& host, const short& port, int timeout, std::chrono::steady_clock::time_point deadline, size_t first_address) {
+    /* Connect to host:port trying every resolved address, starting from first_address.
+    * Returns a non blocking socket, throws if no address accepts the connection.
+    */
     #ifdef _WIN32
     // Initialize WSA variables
     WSADATA wsaData;
     int wsaerr;
     WORD wVersionRequested = MAKEWORD(2, 2);
     wsaerr = WSAStartup(wVersionRequested, &wsaData);
-    #endif  
-    this->client_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (this->client_socket == -1)
-    {
-        std::cerr << "Error creating the socket" << std::endl;
-        return false;
+    #endif
+    // Solve domain name to ip (cached)
+    std::vector<Address> addresses = Resolver::getInstance().resolve(host, port);
+    if (addresses.empty()) {
+        throw std::runtime_error("Cannot resolve domain to address");
+    }
+
+    bool timed_out = false;
+    for (size_t i = 0; i < addresses.size(); i++) {
+        const Address& addr = addresses[(first_address + i) % addresses.size()];
+        int fd = socket(addr.family, SOCK_STREAM, IPPROTO_TCP);
+        if (fd == -1)
+        {
+            throw std::runtime_error("Error creating the socket");
+        }
+        net::set_nonblocking(fd);
+        if (connect(fd, reinterpret_cast<const sockaddr*>(&addr.addr), addr.len) == 0) {
+            return fd;
+        }
+        if (net::connect_in_progress()) {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            int rc = net::poll_socket(&pfd, 1, net::timeout_left(net::deadline_after(timeout, deadline)));
+            if (rc > 0) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&err, &len);
+                if (err == 0) {
+                    return fd;
+                }
+            } else if (rc == 0) {
+                timed_out = true;
+            }
+        }
+        NLOG("Cannot connect to " << addr.toString())
+        net::close_socket(fd);
     }
 
-    std::string ip;
+    if (timed_out) {
+        throw TimeoutError("Timeout connecting to server");
+    }
+    throw std::runtime_error("Cannot connect to server");
+}
 
-    if (!is_ipaddr(host)) {
-        // Solve domain name to ip
-        try { 
-            hostent *h = gethostbyname(host.c_str());
-            if (h && (h->h_addrtype == AF_INET)) {
-                unsigned char *addr = reinterpret_cast<unsigned char *>(h->h_addr_list[0]);
-                std::stringstream ss;
-                std::copy(addr, addr+4, std::ostream_iterator<unsigned int>(ss, "."));
-                ip = ss.str();
-                ip.erase(ip.length()-1);
-            } else {
-                std::cerr << "Cannot resolve domain to address" << std::endl;
-                return false;
+void NiceHTTP::record_latency(int ms) {
+    size_t i = this->latency_count.fetch_add(1, std::memory_order_relaxed);
+    this->latencies[i % NICEHTTP_LATENCY_SAMPLES].store(ms, std::memory_order_relaxed);
+}
+
+int NiceHTTP::hedge_delay(const RequestOptions& opts) {
+    // Returns the delay (ms) before sending the hedged request, -1 to not hedge
+    if (opts.hedge_delay > 0) {
+        return opts.hedge_delay;
+    }
+    size_t n = std::min<size_t>(this->latency_count.load(std::memory_order_relaxed), NICEHTTP_LATENCY_SAMPLES);
+    if (n < 20) {
+        return -1; // not enough history to know what "slow" means
+    }
+    std::vector<int> samples(n);
+    for (size_t i = 0; i < n; i++) {
+        samples[i] = this->latencies[i].load(std::memory_order_relaxed);
+    }
+    auto p95 = samples.begin() + (n * 95) / 100;
+    std::nth_element(samples.begin(), p95, samples.end());
+    return std::max(*p95, 1);
+}
+
+http::Response NiceHTTP::client_attempt(const std::string& raw_req, const std::string& host, const short& port, const RequestOptions& opts, std::chrono::steady_clock::time_point deadline, bool idempotent, bool reuse, bool& sent) {
+    /* Single try of a request. With hedging, a second connection (to the next
+    * address of the host, if any) sends the same request once the first one
+    * is slower than the hedging delay, and the first to answer wins.
+    */
+    auto start = std::chrono::steady_clock::now();
+    int fds[2] = {-1, -1};
+    bool reused = false;
+    if (reuse) {
+        fds[0] = this->connections.get(host, port);
+        reused = (fds[0] != -1);
+    }
+    if (!reused) {
+        fds[0] = this->client_connect(host, port, opts.connect_timeout, deadline);
+    }
+    try {
+        sent = true;
+        net::send_all(fds[0], raw_req, deadline);
+    } catch (const std::runtime_error& e) {
+        net::close_socket(fds[0]);
+        if (reused) {
+            // the server closed the idle connection, nothing was processed
+            return this->client_attempt(raw_req, host, port, opts, deadline, idempotent, false, sent);
+        }
+        throw;
+    }
+
+    auto first_byte = net::deadline_after(opts.first_byte_timeout, deadline);
+    struct pollfd pfds[2] = {{fds[0], POLLIN, 0}, {-1, POLLIN, 0}};
+    int n = 1;
+    int delay = (opts.hedge && idempotent) ? this->hedge_delay(opts) : -1;
+    if (delay >= 0) {
+        int wait = net::timeout_left(first_byte);
+        if (net::poll_socket(pfds, 1, (wait < 0) ? delay : std::min(wait, delay)) == 0) {
+            try {
+                fds[1] = this->client_connect(host, port, opts.connect_timeout, first_byte, 1);
+                net::send_all(fds[1], raw_req, first_byte);
+                pfds[1].fd = fds[1];
+                n = 2;
+            } catch (const std::runtime_error& e) {
+                // keep waiting for the primary request
+                NLOG("Hedged request failed: " << e.what())
+                if (fds[1] != -1) {
+                    net::close_socket(fds[1]);
+                    fds[1] = -1;
+                }
             }
         }
-        catch (std::exception const &exc) {
-            std::cerr << exc.what() << "\n";
-            return false;
+    }
+
+    int winner = -1;
+    while (winner == -1) {
+        int rc = net::poll_socket(pfds, n, net::timeout_left(first_byte));
+        if (rc <= 0) {
+            for (int fd : fds) {
+                if (fd != -1) net::close_socket(fd);
+            }
+            if (rc == 0) {
+                throw TimeoutError("Timeout waiting for the response");
+            }
+            throw std::runtime_error("Error waiting for the response");
+        }
+        for (int i = 0; i < n; i++) {
+            if (pfds[i].revents != 0) {
+                winner = i;
+                break;
+            }
+        }
+    }
+    if (fds[1 - winner] != -1) {
+        net::close_socket(fds[1 - winner]);
+    }
+
+    std::string body;
+    std::string resp;
+    bool delimited = false;
+    try {
+        delimited = this->recv_http(fds[winner], resp, body, deadline);
+    } catch (...) {
+        net::close_socket(fds[winner]);
+        throw;
+    }
+    if (resp.empty()) {
+        net::close_socket(fds[winner]);
+        if (reused && (winner == 0) && idempotent) {
+            // stale pooled connection closed before reading our request
+            return this->client_attempt(raw_req, host, port, opts, deadline, idempotent, false, sent);
         }
+        throw std::runtime_error("Connection closed by server");
+    }
+    http::Response r(resp, body);
+    #ifdef NICEHTTP_COMPRESSION
+    if (opts.compressed && (inflate_body(r) != 0)) {
+        net::close_socket(fds[winner]);
+        throw std::runtime_error("Cannot decode the response body");
+    }
+    #endif
+    auto conn = r.headers.find("connection");
+    if (opts.keep_alive && delimited && ((conn == r.headers.end()) || (conn->second != "close"))) {
+        this->connections.put(host, port, fds[winner]);
     } else {
-        ip = host;
+        net::close_socket(fds[winner]);
     }
+    this->record_latency(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+    return r;
+}
 
-    sockaddr_in serverAddr;
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = inet_addr(ip.c_str());
-    serverAddr.sin_port = htons(port);
+static bool is_idempotent(std::string_view method) {
+    return (method == "GET") || (method == "HEAD") || (method == "OPTIONS") || (method == "PUT") || (method == "DELETE");
+}
 
-    if (connect(this->client_socket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1)
-    {
-        std::cerr << "Error binding the socket" << std::endl;
-        this->cleanup();
-        return false;
+void NiceHTTP::backoff(int attempt, const RequestOptions& opts, std::chrono::steady_clock::time_point deadline) {
+    // full jitter backoff: random wait in [0, min(max_backoff, backoff * 2^attempt)]
+    thread_local std::mt19937 rng(std::random_device{}());
+    int cap = std::min(opts.max_backoff, opts.backoff << std::min(attempt, 16));
+    std::uniform_int_distribution<int> dist(0, std::max(cap, 0));
+    auto wake = std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(dist(rng)));
+    std::this_thread::sleep_until(wake);
+    if (std::chrono::steady_clock::now() >= deadline) {
+        throw TimeoutError("Request deadline expired");
     }
+}
 
-    return true;
+http::Response NiceHTTP::request(http::Request req, std::string host, short port, const RequestOptions& opts) {
+    /* Perform generic request req to host:port */
+    auto deadline = net::deadline_after(opts.total_timeout, std::chrono::steady_clock::time_point::max());
+    // Only idempotent requests can be hedged or retried once they reached the server
+    bool idempotent = is_idempotent(req.method);
+    #ifdef NICEHTTP_COMPRESSION
+    if (opts.compressed) {
+        req.headers.emplace("Accept-Encoding", "gzip, deflate");
+    }
+    #endif
+    std::string raw_req = req.toString();
+    RetryBudget::deposit();
+
+    for (int attempt = 0; ; attempt++) {
+        bool sent = false;
+        CircuitBreaker::Permit permit;
+        if ((opts.breaker != nullptr) && !(permit = opts.breaker->allow())) {
+            throw CircuitOpenError("Circuit open for " + host + ":" + std::to_string(port));
+        }
+        auto start = std::chrono::steady_clock::now();
+        try {
+            http::Response r = this->client_attempt(raw_req, host, port, opts, deadline, idempotent, opts.keep_alive, sent);
+            if (opts.breaker != nullptr) {
+                opts.breaker->record(permit, r.code < 500, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+            }
+            return r;
+        } catch (const std::runtime_error& e) {
+            if (opts.breaker != nullptr) {
+                opts.breaker->record(permit, false, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+            }
+            if ((attempt >= opts.max_retries) || (sent && !idempotent) || !RetryBudget::withdraw()) {
+                throw;
+            }
+            NLOG("Request failed (" << e.what() << "), retrying")
+        }
+        this->backoff(attempt, opts, deadline);
+    }
+}
+
+http::Response NiceHTTP::request(http::Request req, UpstreamGroup& upstream, const RequestOptions& opts, std::string_view key) {
+    /* Perform request req to an endpoint of upstream chosen by its balancing policy.
+    * Retries go through the balancer again, so they usually reach another replica.
+    * Connection errors, timeouts and 5xx responses count as endpoint failures.
+    * Endpoints whose breaker refuses the request are skipped; throws CircuitOpenError
+    * without sending anything when every endpoint refuses it.
+    */
+    auto deadline = net::deadline_after(opts.total_timeout, std::chrono::steady_clock::time_point::max());
+    bool idempotent = is_idempotent(req.method);
+    #ifdef NICEHTTP_COMPRESSION
+    if (opts.compressed) {
+        req.headers.emplace("Accept-Encoding", "gzip, deflate");
+    }
+    #endif
+    std::string raw_req = req.toString();
+    RetryBudget::deposit();
+
+    for (int attempt = 0; ; attempt++) {
+        bool sent = false;
+        CircuitBreaker::Permit permit;
+        size_t i = upstream.pick(key, permit);
+        const Endpoint& ep = upstream.endpoint(i);
+        if (!permit) {
+            // every endpoint is open or has its probes in flight
+            throw CircuitOpenError("Circuit open for " + ep.host + ":" + std::to_string(ep.port));
+        }
+        auto start = std::chrono::steady_clock::now();
+        upstream.begin(i);
+        try {
+            http::Response r = this->client_attempt(raw_req, ep.host, ep.port, opts, deadline, idempotent, opts.keep_alive, sent);
+            upstream.end(i, permit, r.code < 500, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+            return r;
+        } catch (const std::runtime_error& e) {
+            upstream.end(i, permit, false, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+            if ((attempt >= opts.max_retries) || (sent && !idempotent) || !RetryBudget::withdraw()) {
+                throw;
+            }
+            NLOG("Request to " << ep.host << ":" << ep.port << " failed (" << e.what() << "), retrying")
+        }
+        this->backoff(attempt, opts, deadline);
+    }
+}
+
+// recv_* are used with heap strings (client, proxy) and arena strings (server)
+template bool NiceHTTP::recv_head<std::string>(const int&, std::string&, std::string&, std::chrono::steady_clock::time_point);
+template bool NiceHTTP::recv_body<std::string>(const int&, std::string_view, std::string&, std::chrono::steady_clock::time_point, std::string*);
+template bool NiceHTTP::recv_http<std::string>(const int&, std::string&, std::string&, std::chrono::steady_clock::time_point);
+template bool NiceHTTP::recv_head<std::pmr::string>(const int&, std::pmr::string&, std::pmr::string&, std::chrono::steady_clock::time_point);
+template bool NiceHTTP::recv_body<std::pmr::string>(const int&, std::string_view, std::pmr::string&, std::chrono::steady_clock::time_point, std::pmr::string*);
+
+static std::string lowercase(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c){ return std::tolower(c); });
+    return s;
+}
+
+static std::string rewrite_head(std::string_view head, const std::string& extra, std::initializer_list<std::string> also_drop = {}) {
+    /* Copy a raw http head without the hop-by-hop headers (RFC 7230 6.1):
+    * the standard ones, the ones listed in Connection and also_drop.
+    * Transfer-Encoding is kept because bodies are forwarded as they are.
+    * extra headers are appended at the end.
+    */
+    std::set<std::string> drop = {"connection", "keep-alive", "proxy-connection", "te", "trailer", "upgrade", "proxy-authorization", "proxy-authenticate"};
+    drop.insert(also_drop);
+    for (const auto token : std::views::split(lowercase(net::header_value(head, "connection")), ',')) {
+        std::string name{std::string_view(token)};
+        name.erase(0, name.find_first_not_of(' '));
+        name.erase(name.find_last_not_of(' ') + 1);
+        drop.insert(name);
+    }
+    std::string out;
+    size_t pos = head.find("\r\n");
+    out += head.substr(0, pos + 2); // request or status line
+    pos += 2;
+    size_t eol;
+    while (((eol = head.find("\r\n", pos)) != std::string::npos) && (eol != pos)) {
+        std::string_view line(head.data() + pos, eol - pos);
+        size_t i = line.find(':');
+        if ((i == std::string::npos) || !drop.contains(lowercase(std::string(line.substr(0, i))))) {
+            out += line;
+            out += "\r\n";
+        }
+        pos = eol + 2;
+    }
+    out += extra;
+    out += "\r\n";
+    return out;
 }
 
-bool NiceHTTP::is_ipaddr(const std::string& host) {
-    for (char c : host) {
-        if (!(isdigit(c) || (c == '.'))) {
+static bool relay_chunked(int from, int to, std::string& data, std::chrono::steady_clock::time_point deadline) {
+    /* Forward a chunked body as it is, parsing the chunk sizes only to find its end.
+    * data holds the bytes already received. Returns false on errors.
+    */
+    enum { Size, Data, DataEnd, Trailer } state = Size;
+    size_t left = 0;   // bytes of the current chunk
+    std::string line;  // current size or trailer line
+    char buff[PKT_BLOCK_SIZE];
+    while (true) {
+        for (size_t i = 0; i < data.length(); i++) {
+            char c = data[i];
+            if (state == Data) {
+                size_t n = std::min(left, data.length() - i);
+                left -= n;
+                i += n - 1;
+                if (left == 0) state = DataEnd;
+            } else if (c == '\n') {
+                if (state == Size) {
+                    left = strtoul(line.c_str(), nullptr, 16);
+                    state = (left == 0) ? Trailer : Data;
+                } else if (state == DataEnd) {
+                    state = Size;
+                } else if (line.empty() || (line == "\r")) {
+                    // empty line after the last chunk: end of the body
+                    net::send_all(to, data.substr(0, i + 1), deadline);
+                    return true;
+                }
+                line = "";
+            } else if (state != DataEnd) {
+                line += c;
+            }
+        }
+        net::send_all(to, data, deadline);
+        int n = recv(from, buff, sizeof(buff), 0);
+        if ((n < 0) && net::would_block() && net::wait_socket(from, POLLIN, deadline)) {
+            data = "";
+            continue;
+        }
+        if (n <= 0) {
             return false;
         }
+        data.assign(buff, n);
     }
-    return true;
 }
 
-http::Response NiceHTTP::request(http::Request req, std::string host, short port) {
-    /* Perform generic request req to host:port */
-    if (!this->client_setup(host, port) || (this->client_socket == -1)) {
-        throw std::runtime_error("Cannot connect to server");
-    } 
+short NiceHTTP::reply(const int& client_fd, short code, const std::string& message) {
+    // Send a response without body, return its code
+    std::map<std::string,std::string> headers;
+    http::Response resp(code, message, PROTO_HTTP1, headers, false, 0);
+    resp.headers.insert({"Server", "NiceHTTP"});
+    resp.headers.insert({"Connection", "close"});
+    std::string raw_resp = resp.toString();
+    send(client_fd, raw_resp.c_str(), raw_resp.length(), 0);
+    return code;
+}
 
-    std::string raw_req = req.toString();
-    //Send response to client
-    send(this->client_socket, raw_req.c_str(), raw_req.length(), 0);
+short NiceHTTP::proxyreq(const int& client_fd, const http::Request& req, std::string_view head, std::string_view body, const Route& route, bool& keep) {
+    /* Forward the request to an endpoint of the route upstream group and stream
+    * the response back. Only the heads are parsed and rewritten, bodies are
+    * moved socket to socket by net::relay (splice on Linux).
+    * body is the start of the request body, never more than Content-Length bytes.
+    * Upstream connections are kept alive in the connection pool.
+    * keep tells if the client connection can be kept alive, it is cleared unless
+    * the whole response was relayed with a known length.
+    * Returns the status code sent to the client.
+    */
+    bool keep_client = keep;
+    keep = false;
+    if (!route.authorized(req)) {
+        Metrics::getInstance().unauthorized();
+        return this->reply(client_fd, 401, "Unauthorized");
+    }
+    if (net::header_value(head, "transfer-encoding") != "") {
+        return this->reply(client_fd, 411, "Length Required");
+    }
+    UpstreamGroup& upstream = *route.upstream;
+    CircuitBreaker::Permit permit;
+    size_t i = upstream.pick(req.uri, permit);
+    const Endpoint& ep = upstream.endpoint(i);
+    if (!permit) {
+        return this->reply(client_fd, 503, "Service Unavailable");
+    }
 
-    std::string body;
-    std::string resp;
-    this->recv_http(this->client_socket, resp, body);
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::milliseconds(NICEHTTP_PROXY_TIMEOUT);
+    std::string extra = "Via: 1.1 NiceHTTP\r\n";
+    Address peer;
+    peer.len = sizeof(peer.addr);
+    if (getpeername(client_fd, reinterpret_cast<sockaddr*>(&peer.addr), &peer.len) == 0) {
+        peer.family = peer.addr.ss_family;
+        std::string xff = net::header_value(head, "x-forwarded-for");
+        extra += "X-Forwarded-For: " + (xff.empty() ? "" : xff + ", ") + peer.toString() + "\r\n";
+    }
+    // Expect is answered here, the upstream receives the whole request at once
+    std::string fwd = rewrite_head(head, extra, {"expect"});
+    size_t body_left = (req.content_length > body.length()) ? req.content_length - body.length() : 0;
+    bool expect_continue = lowercase(net::header_value(head, "expect")) == "100-continue";
 
-    http::Response r(resp, body);
-    close(this->client_socket);
+    upstream.begin(i);
+    int up = -1;
+    bool replied = false; // the response head was sent to the client
+    bool success = false;
+    short status = 0;
+    try {
+        std::string rhead, rrest;
+        for (int tries = 0; ; tries++) {
+            up = this->connections.get(ep.host, ep.port);
+            bool reused = (up != -1);
+            if (!reused) {
+                up = this->client_connect(ep.host, ep.port, 0, deadline);
+            }
+            net::send_all(up, fwd + std::string(body), deadline);
+            if (expect_continue && (body_left > 0)) {
+                net::send_all(client_fd, "HTTP/1.1 100 Continue\r\n\r\n", deadline);
+                expect_continue = false;
+            }
+            if ((body_left > 0) && !net::relay(client_fd, up, body_left, deadline)) {
+                throw std::runtime_error("Error forwarding the request body");
+            }
+            if (this->recv_head(up, rhead, rrest, deadline)) {
+                break;
+            }
+            net::close_socket(up);
+            up = -1;
+            if (!reused || (body_left > 0) || (tries > 0)) {
+                throw std::runtime_error("Connection closed by upstream");
+            }
+            // stale pooled connection, the request wasn't processed: try a new one
+        }
 
-    return r;
+        short code = static_cast<short>(atoi(rhead.c_str() + rhead.find(' ') + 1));
+        while ((code >= 100) && (code < 200) && (code != 101)) {
+            // skip interim responses (100 Continue, 103 Early Hints)
+            if (!this->recv_head(up, rhead, rrest, deadline)) {
+                throw std::runtime_error("Connection closed by upstream");
+            }
+            code = static_cast<short>(atoi(rhead.c_str() + rhead.find(' ') + 1));
+        }
+        std::string cl = net::header_value(rhead, "content-length");
+        bool chunked = net::header_value(rhead, "transfer-encoding").find("chunked") != std::string::npos;
+        bool no_body = (req.method == "HEAD") || (code == 204) || (code == 304) || ((code >= 100) && (code < 200));
+        bool keep_upstream = lowercase(net::header_value(rhead, "connection")) != "close";
+        // the client connection survives responses whose end is known, not upgrades or bodies up to the close
+        keep_client = keep_client && (code != 101) && (no_body || (cl != "") || chunked);
+        std::string out = rewrite_head(rhead, keep_client ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+        replied = true;
+        status = code;
+        net::send_all(client_fd, out, deadline);
+        if (no_body) {
+            // nothing to forward
+        } else if (cl != "") {
+            size_t length = strtoul(cl.c_str(), nullptr, 10);
+            net::send_all(client_fd, rrest.substr(0, length), deadline);
+            if ((length > rrest.length()) && !net::relay(up, client_fd, length - rrest.length(), deadline)) {
+                throw std::runtime_error("Error forwarding the response body");
+            }
+        } else if (chunked) {
+            if (!relay_chunked(up, client_fd, rrest, deadline)) {
+                throw std::runtime_error("Error forwarding the response body");
+            }
+        } else {
+            // body delimited by the end of the connection
+            keep_upstream = false;
+            net::send_all(client_fd, rrest, deadline);
+            net::relay(up, client_fd, std::string::npos, deadline);
+        }
+        success = code < 500;
+        keep = keep_client;
+        if (keep_upstream) {
+            this->connections.put(ep.host, ep.port, up);
+        } else {
+            net::close_socket(up);
+        }
+        up = -1;
+    } catch (const TimeoutError& e) {
+        NLOG("Proxy to " << ep.host << ":" << ep.port << " timed out: " << e.what())
+        if (!replied) status = this->reply(client_fd, 504, "Gateway Timeout");
+    } catch (const std::runtime_error& e) {
+        NLOG("Proxy to " << ep.host << ":" << ep.port << " failed: " << e.what())
+        if (!replied) status = this->reply(client_fd, 502, "Bad Gateway");
+    }
+    if (up != -1) {
+        net::close_socket(up);
+    }
+    upstream.end(i, permit, success, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+    return status;
 }
 
 void Router::add(const Route &route) {
@@ -980,38 +7945,59 @@ void Router::del(const Route &route) {
     this->routes.erase(route);
 }
 
+const Route* Router::match(const http::Request &req) const {
+    // find the right route for the request
+    auto match = [&req](const Route &r){ return r.matches(req); };
+    std::set<Route>::const_iterator result = std::ranges::find_if(this->routes, match);
+    if (result != this->routes.end()) {
+        return &(*result);
+    }
+    return nullptr;
+}
+
 http::Response Router::handle(const http::Request &req) {
     // handle the request finding the right route
-    auto match = [&req](const Route &r){ //match condition to find the right route
-        std::smatch m;
-        std::regex rgx(r.uri.data());
-        return ((req.method == r.method) &&
-                (std::regex_match(req.uri.begin(), req.uri.end(), m, rgx)));
-    };
-    std::set<Route>::iterator result = std::ranges::find_if(this->routes, match);
-    if (result != this->routes.end()) {
-        Route r = *result;
-        return r.handle(req);
+    return this->handle(req, this->match(req));
+}
+
+http::Response Router::handle(const http::Request &req, const Route *route) {
+    if (route != nullptr) {
+        return route->handle(req);
     }
+    Metrics::getInstance().notFound();
     std::map<std::string,std::string> headers;
     http::Response resp(404, "Not Found", PROTO_HTTP1, headers, false, 0);
     return resp;
 }
 
-http::Response Route::handle(const http::Request &req) {
-    if (auth != "") { // Authentication is set for this route
-        bool denied = true;
-        for (const auto& h : req.headers) {
-            if ((h.first == "authorization") && (h.second == auth)) {
-                denied = false;
-                break;
-            }
-        }
-        if (denied) {
-            std::map<std::string,std::string> headers;
-            http::Response resp(401, "Unauthorized", PROTO_HTTP1, headers, false, 0);
-            return resp;
+bool Route::matches(const http::Request &req) const {
+    return (req.method == this->method) && std::regex_match(req.uri.begin(), req.uri.end(), this->pattern);
+}
+
+bool Route::authorized(const http::Request &req) const {
+    if (auth == "") { // Authentication is not set for this route
+        return true;
+    }
+    for (const auto& h : req.headers) {
+        if ((h.first == "authorization") && (h.second == auth)) {
+            return true;
         }
     }
+    return false;
+}
+
+http::Response Route::handle(const http::Request &req) const {
+    if (!this->authorized(req)) {
+        Metrics::getInstance().unauthorized();
+        std::map<std::string,std::string> headers;
+        http::Response resp(401, "Unauthorized", PROTO_HTTP1, headers, false, 0);
+        return resp;
+    }
+    if (this->isProxy()) {
+        // proxy routes are streamed by NiceHTTP, they have no callback
+        std::map<std::string,std::string> headers;
+        http::Response resp(500, "Internal Server Error", PROTO_HTTP1, headers, false, 0);
+        return resp;
+    }
     return this->func(req);
-}
\ No newline at end of file
+}
@@ -0,0 +1,181 @@
+// Circuit breaker state transitions and the upstream balancer skipping the endpoints it refuses.
+
+#include <chrono>
+#include <set>
+#include <thread>
+
+#include "check.h"
+#include "upstream.h"
+
+using namespace std;
+
+static BreakerOptions options() {
+    BreakerOptions opts;
+    opts.min_requests = 4;
+    opts.error_rate = 50;
+    opts.open_time = 100;
+    opts.probes = 2;
+    return opts;
+}
+
+static void fail(CircuitBreaker& breaker, int n) {
+    for (int i = 0; i < n; i++) {
+        CircuitBreaker::Permit permit = breaker.allow();
+        breaker.record(permit, false, chrono::microseconds(0));
+    }
+}
+
+static void wait_open_time() {
+    this_thread::sleep_for(chrono::milliseconds(150));
+}
+
+static void opens_on_error_rate() {
+    CircuitBreaker breaker(options());
+    for (int i = 0; i < 10; i++) {
+        CircuitBreaker::Permit permit = breaker.allow();
+        CHECK(permit && (permit.probe == 0));
+        breaker.record(permit, true, chrono::microseconds(0));
+    }
+    fail(breaker, 9); // 9 failures out of 19 requests: under 50%
+    CHECK(breaker.state() == CircuitBreaker::Closed);
+    fail(breaker, 1);
+    CHECK(breaker.state() == CircuitBreaker::Open);
+    CHECK(breaker.isOpen() && !breaker.allow());
+}
+
+static void slow_calls_fail() {
+    BreakerOptions opts = options();
+    opts.slow_call = 5;
+    CircuitBreaker breaker(opts);
+    for (int i = 0; i < 4; i++) {
+        CircuitBreaker::Permit permit = breaker.allow();
+        breaker.record(permit, true, chrono::milliseconds(10));
+    }
+    CHECK(breaker.state() == CircuitBreaker::Open);
+}
+
+static void probes_close() {
+    CircuitBreaker breaker(options());
+    fail(breaker, 4);
+    CHECK(breaker.state() == CircuitBreaker::Open);
+    wait_open_time();
+    CHECK(!breaker.isOpen());
+    CircuitBreaker::Permit first = breaker.allow(), second = breaker.allow();
+    CHECK(breaker.state() == CircuitBreaker::HalfOpen);
+    CHECK(first && second && (first.probe != 0) && (second.probe != 0));
+    CHECK(!breaker.allow()); // opts.probes in flight
+    breaker.record(first, true, chrono::microseconds(0));
+    CHECK(breaker.state() == CircuitBreaker::HalfOpen);
+    breaker.record(second, true, chrono::microseconds(0));
+    CHECK(breaker.state() == CircuitBreaker::Closed);
+}
+
+static void probe_failure_opens() {
+    CircuitBreaker breaker(options());
+    fail(breaker, 4);
+    wait_open_time();
+    CircuitBreaker::Permit probe = breaker.allow();
+    breaker.record(probe, false, chrono::microseconds(0));
+    CHECK(breaker.state() == CircuitBreaker::Open);
+    CHECK(!breaker.allow());
+}
+
+static void late_results_ignored() {
+    // requests allowed while closed that finish while half open are not probes
+    CircuitBreaker breaker(options());
+    CircuitBreaker::Permit late = breaker.allow();
+    fail(breaker, 4);
+    wait_open_time();
+    CircuitBreaker::Permit first = breaker.allow(), second = breaker.allow();
+    breaker.record(late, true, chrono::microseconds(0));
+    breaker.record(late, false, chrono::microseconds(0));
+    CHECK(breaker.state() == CircuitBreaker::HalfOpen);
+    CHECK(!breaker.allow()); // the probe slots were not released
+    breaker.record(first, true, chrono::microseconds(0));
+    breaker.record(second, true, chrono::microseconds(0));
+    CHECK(breaker.state() == CircuitBreaker::Closed);
+}
+
+static void stale_probes_ignored() {
+    // a probe of a round that tripped doesn't count in the next round, but holds its slot until it ends
+    CircuitBreaker breaker(options());
+    fail(breaker, 4);
+    wait_open_time();
+    CircuitBreaker::Permit failed = breaker.allow(), stale = breaker.allow();
+    breaker.record(failed, false, chrono::microseconds(0));
+    wait_open_time();
+    CircuitBreaker::Permit probe = breaker.allow();
+    CHECK(probe && !breaker.allow());
+    breaker.record(stale, true, chrono::microseconds(0));
+    CHECK(breaker.state() == CircuitBreaker::HalfOpen);
+    CircuitBreaker::Permit next = breaker.allow();
+    CHECK(next);
+    breaker.record(probe, true, chrono::microseconds(0));
+    breaker.record(next, true, chrono::microseconds(0));
+    CHECK(breaker.state() == CircuitBreaker::Closed);
+}
+
+static void pick_skips_refusing_breakers() {
+    for (Balancing policy : {Balancing::RoundRobin, Balancing::LeastOutstanding, Balancing::PowerOfTwoChoices, Balancing::ConsistentHash}) {
+        BreakerOptions opts = options();
+        opts.probes = 1;
+        UpstreamGroup group({{"10.0.0.1", 80}, {"10.0.0.2", 80}, {"10.0.0.3", 80}}, policy, opts);
+        // endpoints 0 and 1 half open with their probe in flight
+        fail(group.breaker(0), 4);
+        fail(group.breaker(1), 4);
+        wait_open_time();
+        CircuitBreaker::Permit probe0 = group.breaker(0).allow(), probe1 = group.breaker(1).allow();
+        CHECK(probe0 && probe1);
+        bool all_to_2 = true;
+        for (int i = 0; i < 50; i++) {
+            CircuitBreaker::Permit permit;
+            size_t e = group.pick(to_string(i), permit);
+            all_to_2 = all_to_2 && permit && (e == 2);
+            group.breaker(e).record(permit, true, chrono::microseconds(0));
+        }
+        CHECK(all_to_2);
+        // no endpoint admits the request
+        while (group.breaker(2).state() == CircuitBreaker::Closed) fail(group.breaker(2), 1);
+        CircuitBreaker::Permit permit;
+        size_t e = group.pick("key", permit);
+        CHECK(!permit && (e < group.size()));
+    }
+}
+
+static void balancing() {
+    UpstreamGroup round_robin({{"a", 1}, {"b", 2}, {"c", 3}});
+    set<size_t> seen;
+    for (int i = 0; i < 3; i++) seen.insert(round_robin.pick());
+    CHECK(seen.size() == 3);
+
+    UpstreamGroup least({{"a", 1}, {"b", 2}}, Balancing::LeastOutstanding);
+    least.begin(0);
+    least.begin(0);
+    CHECK(least.pick() == 1);
+
+    UpstreamGroup hash({{"a", 1}, {"b", 2}, {"c", 3}}, Balancing::ConsistentHash);
+    CHECK(hash.pick("/users/42") == hash.pick("/users/42"));
+
+    // consecutive failures eject an endpoint
+    UpstreamGroup ejecting({{"a", 1}, {"b", 2}}, Balancing::RoundRobin);
+    for (int i = 0; i < NICEHTTP_EJECT_FAILURES; i++) {
+        ejecting.begin(0);
+        ejecting.end(0, CircuitBreaker::Permit{true, 0}, false, chrono::microseconds(0));
+    }
+    CHECK(ejecting.isEjected(0));
+    bool avoided = true;
+    for (int i = 0; i < 10; i++) avoided = avoided && (ejecting.pick() == 1);
+    CHECK(avoided);
+}
+
+int main() {
+    RUN(opens_on_error_rate);
+    RUN(slow_calls_fail);
+    RUN(probes_close);
+    RUN(probe_failure_opens);
+    RUN(late_results_ignored);
+    RUN(stale_probes_ignored);
+    RUN(pick_skips_refusing_breakers);
+    RUN(balancing);
+    return check::result();
+}
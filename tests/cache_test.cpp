@@ -0,0 +1,188 @@
+// Response cache admission, eviction and expiry, coalescing of identical requests and the resolver cache.
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include "check.h"
+#include "resolver.h"
+#include "response_cache.h"
+#include "single_flight.h"
+
+using namespace std;
+
+// 8192 bytes per shard, an entry of entry() costs about 740 bytes: 11 fit in a shard
+#define CACHE_BYTES (NICEHTTP_CACHE_SHARDS * 8192)
+
+static shared_ptr<const ResponseCache::Entry> entry(size_t size = 600, chrono::milliseconds ttl = chrono::seconds(60)) {
+    auto e = make_shared<ResponseCache::Entry>();
+    e->raw.assign(size, 'x');
+    e->split = 0;
+    e->body_size = size;
+    e->expires = chrono::steady_clock::now() + ttl;
+    return e;
+}
+
+// n keys falling in the same shard, so they compete for the same bytes
+static vector<string> shard_keys(size_t n) {
+    vector<string> keys;
+    for (int i = 0; keys.size() < n; i++) {
+        string key = "GET /item/" + to_string(i);
+        if (hash<string_view>{}(key) % NICEHTTP_CACHE_SHARDS == 0) {
+            keys.push_back(key);
+        }
+    }
+    return keys;
+}
+
+static void cache_hit_and_miss() {
+    ResponseCache cache(CACHE_BYTES);
+    CHECK(cache.get("GET /a") == nullptr);
+    auto e = entry();
+    cache.put("GET /a", e);
+    CHECK(cache.get("GET /a") == e);
+    CHECK(cache.get("GET /b") == nullptr);
+    CHECK(cache.bytes() > 600);
+    // a new response for the same key replaces the old one
+    auto newer = entry(100);
+    cache.put("GET /a", newer);
+    CHECK(cache.get("GET /a") == newer);
+    cache.clear();
+    CHECK((cache.get("GET /a") == nullptr) && (cache.bytes() == 0));
+}
+
+static void cache_expiry() {
+    ResponseCache cache(CACHE_BYTES);
+    cache.put("GET /short", entry(600, chrono::milliseconds(100)));
+    cache.put("GET /long", entry());
+    CHECK(cache.get("GET /short") != nullptr);
+    this_thread::sleep_for(chrono::milliseconds(150));
+    CHECK(cache.get("GET /short") == nullptr);
+    CHECK(cache.get("GET /long") != nullptr);
+    size_t bytes = cache.bytes();
+    CHECK((bytes > 600) && (bytes < 2 * 600)); // the expired entry was dropped
+}
+
+static void cache_too_big() {
+    ResponseCache cache(CACHE_BYTES);
+    cache.put("GET /big", entry(8192 / 8));
+    CHECK(cache.get("GET /big") == nullptr);
+    CHECK(cache.bytes() == 0);
+}
+
+static void cache_lru_eviction() {
+    ResponseCache cache(CACHE_BYTES);
+    vector<string> keys = shard_keys(12);
+    for (int i = 0; i < 11; i++) cache.put(keys[i], entry());
+    bool all = true;
+    for (int i = 0; i < 11; i++) all = all && (cache.get(keys[i]) != nullptr);
+    CHECK(all);
+    // every key was requested once: keys[1] is now the least recently used
+    cache.get(keys[0]);
+    cache.get(keys[11]);
+    cache.get(keys[11]);
+    cache.put(keys[11], entry());
+    CHECK(cache.get(keys[11]) != nullptr);
+    CHECK(cache.get(keys[1]) == nullptr);
+    CHECK(cache.get(keys[0]) != nullptr);
+    CHECK(cache.bytes() <= 8192);
+}
+
+static void cache_tinylfu_admission() {
+    ResponseCache cache(CACHE_BYTES);
+    vector<string> keys = shard_keys(12);
+    for (int i = 0; i < 11; i++) cache.put(keys[i], entry());
+    for (int n = 0; n < 3; n++) {
+        for (int i = 0; i < 11; i++) cache.get(keys[i]);
+    }
+    // a one-off request doesn't flush the popular responses
+    cache.put(keys[11], entry());
+    CHECK(cache.get(keys[11]) == nullptr);
+    bool kept = true;
+    for (int i = 0; i < 11; i++) kept = kept && (cache.get(keys[i]) != nullptr);
+    CHECK(kept);
+    // once requested more often than the victim, it gets in
+    for (int n = 0; n < 8; n++) cache.get(keys[11]);
+    cache.put(keys[11], entry());
+    CHECK(cache.get(keys[11]) != nullptr);
+    CHECK(cache.metrics().find("nicehttp_response_cache_rejections_total 1\n") != string::npos);
+}
+
+static void flight_leader_and_waiters() {
+    SingleFlight flights;
+    auto joined = flights.join("GET /slow");
+    CHECK(holds_alternative<SingleFlight::Leader>(joined));
+    vector<shared_ptr<const ResponseCache::Entry>> results(3);
+    vector<thread> waiters;
+    for (int i = 0; i < 3; i++) {
+        auto other = flights.join("GET /slow");
+        CHECK(holds_alternative<shared_ptr<SingleFlight::Call>>(other));
+        if (auto call = get_if<shared_ptr<SingleFlight::Call>>(&other)) {
+            waiters.emplace_back([&flights, &results, i, call = *call] { results[i] = flights.wait(*call); });
+        }
+    }
+    CHECK(holds_alternative<SingleFlight::Leader>(flights.join("GET /other")));
+    auto e = entry();
+    get<SingleFlight::Leader>(joined).complete(e);
+    for (auto& t : waiters) t.join();
+    CHECK((results[0] == e) && (results[1] == e) && (results[2] == e));
+    // the flight is over, the next request leads a new one
+    CHECK(holds_alternative<SingleFlight::Leader>(flights.join("GET /slow")));
+    CHECK(flights.metrics().find("nicehttp_coalesced_requests_total 3\n") != string::npos);
+}
+
+static void flight_leader_throws() {
+    SingleFlight flights;
+    shared_ptr<SingleFlight::Call> call;
+    {
+        auto leader = flights.join("GET /fails");
+        auto other = flights.join("GET /fails");
+        call = get<shared_ptr<SingleFlight::Call>>(other);
+        CHECK(flights.wait(*call, chrono::milliseconds(10)) == nullptr); // timeout
+    } // the leader is destroyed without complete(), as when the handler throws
+    auto start = chrono::steady_clock::now();
+    CHECK(flights.wait(*call) == nullptr);
+    CHECK(chrono::steady_clock::now() - start < chrono::seconds(1)); // released, not timed out
+    CHECK(holds_alternative<SingleFlight::Leader>(flights.join("GET /fails")));
+}
+
+static void resolver_numeric_and_cached() {
+    Resolver& resolver = Resolver::getInstance();
+    resolver.clear();
+    vector<Address> addresses = resolver.resolve("127.0.0.1", 8080);
+    CHECK(addresses.size() == 1);
+    if (addresses.size() == 1) {
+        CHECK((addresses[0].family == AF_INET) && (addresses[0].toString() == "127.0.0.1"));
+        CHECK(ntohs(reinterpret_cast<sockaddr_in*>(&addresses[0].addr)->sin_port) == 8080);
+    }
+    // the cached addresses get the port of every call
+    addresses = resolver.resolve("127.0.0.1", 9090);
+    CHECK((addresses.size() == 1) && (ntohs(reinterpret_cast<sockaddr_in*>(&addresses[0].addr)->sin_port) == 9090));
+    // concurrent lookups of the same host all get the addresses
+    vector<thread> threads;
+    atomic<int> resolved{0};
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back([&] {
+            if (!resolver.resolve("127.0.0.1", 80).empty()) resolved.fetch_add(1);
+        });
+    }
+    for (auto& t : threads) t.join();
+    CHECK(resolved.load() == 8);
+    resolver.clear();
+}
+
+int main() {
+    RUN(cache_hit_and_miss);
+    RUN(cache_expiry);
+    RUN(cache_too_big);
+    RUN(cache_lru_eviction);
+    RUN(cache_tinylfu_admission);
+    RUN(flight_leader_and_waiters);
+    RUN(flight_leader_throws);
+    RUN(resolver_numeric_and_cached);
+    return check::result();
+}
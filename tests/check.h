@@ -0,0 +1,61 @@
+// Minimal checks shared by the unit tests, without a test framework.
+//
+// CHECK records a failure and goes on, so one run reports every broken expectation.
+// A test file calls its test functions with RUN and returns check::result() from main,
+// which ctest reads as the outcome (0 = passed).
+
+#pragma once
+#include <cstdio>
+#include <exception>
+
+namespace check {
+
+inline int& failures() {
+    static int count = 0;
+    return count;
+}
+
+inline void fail(const char* file, int line, const char* what) {
+    std::fprintf(stderr, "%s:%d: %s\n", file, line, what);
+    failures()++;
+}
+
+inline int result() {
+    if (failures() > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures());
+        return 1;
+    }
+    return 0;
+}
+
+};
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) check::fail(__FILE__, __LINE__, "CHECK(" #cond ") failed"); \
+    } while (0)
+
+// expr must throw an exception of type (or derived from) type
+#define CHECK_THROWS(expr, type) \
+    do { \
+        bool thrown = false; \
+        try { \
+            (void)(expr); \
+        } catch (const type&) { \
+            thrown = true; \
+        } catch (...) { \
+        } \
+        if (!thrown) check::fail(__FILE__, __LINE__, "CHECK_THROWS(" #expr ", " #type ") failed"); \
+    } while (0)
+
+// run a test function, an exception escaping it is a failure
+#define RUN(test) \
+    do { \
+        int before = check::failures(); \
+        try { \
+            test(); \
+        } catch (const std::exception& e) { \
+            check::fail(__FILE__, __LINE__, e.what()); \
+        } \
+        std::printf("%-40s %s\n", #test, (check::failures() == before) ? "ok" : "FAILED"); \
+    } while (0)
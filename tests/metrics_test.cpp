@@ -0,0 +1,68 @@
+// Server metrics: latency histogram buckets and the per route series.
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "check.h"
+#include "metrics.h"
+#include "router.h"
+
+using namespace std;
+
+static http::Response ok(const http::Request&) {
+    return http::Response(200, "OK", PROTO_HTTP1, {}, false, 0);
+}
+
+static bool has(const string& text, const string& line) {
+    return text.find(line + "\n") != string::npos;
+}
+
+static void histogram_buckets() {
+    bool exact = true, bounded = true;
+    for (uint64_t us = 0; us < 16; us++) exact = exact && (LatencyHistogram::upper(LatencyHistogram::bucket(us)) == us);
+    for (uint64_t us = 16; us < 10000000; us = us * 3 / 2 + 1) {
+        uint64_t upper = LatencyHistogram::upper(LatencyHistogram::bucket(us));
+        bounded = bounded && (upper >= us) && (upper - us <= us / 16);
+    }
+    CHECK(exact && bounded);
+    LatencyHistogram h;
+    h.record(5);
+    h.record(5);
+    h.record(1000);
+    CHECK((h.count(LatencyHistogram::bucket(5)) == 2) && (h.count(LatencyHistogram::bucket(1000)) == 1));
+}
+
+static void series_by_route_and_status() {
+    Route route("GET", "/metrics_test/a", ok);
+    Metrics::getInstance().request(&route, 200, 10, 20, chrono::microseconds(300));
+    Metrics::getInstance().request(&route, 200, 10, 20, chrono::microseconds(300));
+    Metrics::getInstance().request(&route, 500, 10, 20, chrono::microseconds(300));
+    string text = Metrics::getInstance().render();
+    CHECK(has(text, R"(nicehttp_requests_total{method="GET",route="/metrics_test/a",code="200"} 2)"));
+    CHECK(has(text, R"(nicehttp_requests_total{method="GET",route="/metrics_test/a",code="500"} 1)"));
+    CHECK(has(text, R"(nicehttp_request_bytes_total{method="GET",route="/metrics_test/a",code="200"} 20)"));
+}
+
+static void deleted_routes() {
+    // the series keep the labels of their route: scraping after the route is deleted reads no freed memory,
+    // and a route allocated at the same address doesn't take its counts
+    for (int i = 0; i < 4; i++) {
+        string uri = "/metrics_test/deleted/" + to_string(i);
+        auto route = make_unique<Route>("POST", uri, ok);
+        Metrics::getInstance().request(route.get(), 201, 0, 0, chrono::microseconds(10));
+    }
+    string text = Metrics::getInstance().render();
+    bool separate = true;
+    for (int i = 0; i < 4; i++) {
+        separate = separate && has(text, R"(nicehttp_requests_total{method="POST",route="/metrics_test/deleted/)" + to_string(i) + R"(",code="201"} 1)");
+    }
+    CHECK(separate);
+}
+
+int main() {
+    RUN(histogram_buckets);
+    RUN(series_by_route_and_status);
+    RUN(deleted_routes);
+    return check::result();
+}
@@ -0,0 +1,268 @@
+// HTTP message parsing, JSON and CBOR parsers and writers, content negotiation.
+
+#include <cmath>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+
+#include "check.h"
+#include "http.h"
+
+using namespace std;
+
+static string hex(string_view s) {
+    string out;
+    for (unsigned char c : s) {
+        out += "0123456789abcdef"[c >> 4];
+        out += "0123456789abcdef"[c & 15];
+    }
+    return out;
+}
+
+static string unhex(string_view h) {
+    string out;
+    for (size_t i = 0; i + 1 < h.size(); i += 2) out += char(stoi(string(h.substr(i, 2)), nullptr, 16));
+    return out;
+}
+
+template <typename Document, typename Error>
+static bool rejected(string_view text) {
+    Document doc;
+    try {
+        doc.parse(text);
+    } catch (const Error&) {
+        return true;
+    }
+    return false;
+}
+
+static void request_head() {
+    http::Request r;
+    r.parseHead("POST /users?id=1 HTTP/1.1\r\nHost: example.com\r\nContent-Type: application/json\r\nContent-Length: 7\r\nX-Trace: a: b\r\n\r\n");
+    CHECK((r.method == "POST") && (r.uri == "/users?id=1") && (r.proto == "HTTP/1.1"));
+    CHECK(r.headers["host"] == "example.com"); // names are lower case
+    CHECK(r.headers["x-trace"] == "a: b");
+    CHECK(r.is_json && (r.content_length == 7));
+    r.setBody("{\"a\":1}");
+    CHECK(r.body == "{\"a\":1}");
+    // a body not matching Content-Length is refused
+    http::Request short_body;
+    short_body.parseHead("POST / HTTP/1.1\r\nContent-Length: 10\r\n\r\n");
+    short_body.setBody("abc");
+    CHECK(short_body.body.empty());
+    // malformed request line: nothing parsed, the server answers 400
+    http::Request malformed;
+    malformed.parseHead("GET");
+    CHECK(malformed.method.empty() && malformed.uri.empty());
+}
+
+static void request_in_arena() {
+    std::pmr::monotonic_buffer_resource arena;
+    http::Request r(&arena);
+    r.parseHead("GET /a HTTP/1.1\r\nAccept: application/cbor\r\n\r\n");
+    CHECK((r.get_allocator().resource() == &arena) && (r.headers.begin()->first.get_allocator().resource() == &arena));
+    CHECK(r.headers["accept"] == "application/cbor");
+    // serialized in the arena, as toString() does on the heap
+    http::Response res(200, "OK", PROTO_HTTP1, {{"x-id", "7"}}, true, 2, "{}");
+    std::pmr::string raw(&arena);
+    res.serialize(raw);
+    CHECK(string_view(raw) == res.toString());
+}
+
+static void response_round_trip() {
+    http::Response r(404, "Not Found", PROTO_HTTP1, {{"x-id", "7"}}, false, 5, "nope!");
+    string raw = r.toString();
+    size_t split = raw.find("\r\n\r\n");
+    CHECK(split != string::npos);
+    http::Response parsed(string_view(raw).substr(0, split + 4), string_view(raw).substr(split + 4));
+    CHECK((parsed.code == 404) && (parsed.message == "Not Found") && (parsed.proto == PROTO_HTTP1));
+    CHECK((parsed.headers["x-id"] == "7") && (parsed.content_length == 5) && (parsed.body == "nope!"));
+}
+
+static void json_values() {
+    string text = R"( {"name": "café \"x\"\n", "n": -12, "pi": 3.25e0, "big": 9223372036854775808,
+                       "list": [1, [2, 3], {}], "ok": true, "none": null, "plain": "abc"} )";
+    json::Document doc;
+    doc.parse(text);
+    json::Value root = doc.root();
+    CHECK((root.type() == json::Type::Object) && (root.size() == 8));
+    CHECK(root["name"].getString() == "caf\xc3\xa9 \"x\"\n");
+    CHECK(root["n"].isInt() && (root["n"].getInt() == -12));
+    CHECK(!root["pi"].isInt() && (root["pi"].getDouble() == 3.25));
+    CHECK(!root["big"].isInt() && (root["big"].getDouble() == 9223372036854775808.0));
+    CHECK_THROWS(root["big"].getInt(), json::Error);
+    CHECK((root["list"].size() == 3) && (root["list"][1][1].getInt() == 3) && (root["list"][2].size() == 0));
+    CHECK(root["ok"].getBool() && root["none"].isNull());
+    CHECK(root["plain"].getString().data() >= text.data()); // a view of the text, not a copy
+    CHECK(!root["missing"] && !root["list"][3]);
+    CHECK_THROWS(root["n"].getString(), json::Error);
+    string keys;
+    for (json::Value member : root) keys += string(member.key()) + ",";
+    CHECK(keys == "name,n,pi,big,list,ok,none,plain,");
+    CHECK(root["list"].raw() == "[1, [2, 3], {}]");
+    // surrogate pairs
+    json::Document emoji;
+    emoji.parse(R"("\ud83d\ude00")");
+    CHECK(emoji.root().getString() == "\xf0\x9f\x98\x80");
+    // the body of a message, parsed on the first call
+    http::Request req("POST / HTTP/1.1\r\nContent-Type: application/json\r\nContent-Length: 7\r\n\r\n", "{\"a\":1}");
+    CHECK(req.is_json && (req.json()["a"].getInt() == 1));
+}
+
+static void json_invalid() {
+    auto bad = rejected<json::Document, json::Error>;
+    CHECK(bad("") && bad("  ") && bad("{") && bad("[1,]") && bad("[1 2]") && bad("{\"a\" 1}") && bad("{\"a\":}"));
+    CHECK(bad("01") && bad("1.") && bad("-") && bad("1e") && bad("tru") && bad("nul") && bad("\"abc") && bad("[1] x"));
+    CHECK(bad(string(2000, '[') + string(2000, ']')));
+    CHECK(!bad(string(100, '[') + string(100, ']')));
+    // invalid escapes and unescaped control characters are found when the string is read
+    json::Document doc;
+    doc.parse("[\"\\x\", \"\\ud800\", \"tab\there\"]");
+    CHECK_THROWS(doc.root()[0].getString(), json::Error);
+    CHECK_THROWS(doc.root()[1].getString(), json::Error);
+    CHECK_THROWS(doc.root()[2].getString(), json::Error);
+}
+
+static void json_utf8() {
+    auto bad = rejected<json::Document, json::Error>;
+    CHECK(!bad("\"h\xc3\xa9llo \xe2\x82\xac \xf0\x9f\x98\x80\""));
+    CHECK(bad("\"\xc3\x28\""));         // missing continuation byte
+    CHECK(bad("\"\x80\""));             // lone continuation byte
+    CHECK(bad("\"\xc0\xaf\""));         // overlong
+    CHECK(bad("\"\xed\xa0\x80\""));     // surrogate
+    CHECK(bad("\"\xf4\x90\x80\x80\"")); // above U+10FFFF
+    CHECK(bad("\"\xff\""));
+    // sequences across the 64 byte blocks of the first pass
+    string across = "\"" + string(62, 'a') + "\xc3\xa9" + string(70, 'b') + "\"";
+    CHECK(!bad(across));
+    string cut = "\"" + string(62, 'a') + "\xe2\x82" + string(70, 'b') + "\"";
+    CHECK(bad(cut));
+    CHECK(bad("[\"" + string(61, 'a') + "\"\xc3")); // the text ends in the middle of a sequence
+}
+
+static void json_writer() {
+    std::pmr::string out;
+    size_t length = 0;
+    json::Writer w(out, &length);
+    w.beginObject().key("a").value(1).key("b").beginArray().value(true).null().value("x\"y\n\x01").endArray()
+     .key("c").value(1.5).key("d").value(NAN).key("e").value(uint64_t(18446744073709551615ull)).key("f").beginObject().endObject().endObject();
+    CHECK(out == R"({"a":1,"b":[true,null,"x\"y\n\u0001"],"c":1.5,"d":null,"e":18446744073709551615,"f":{}})");
+    CHECK(length == out.size());
+    json::Document doc;
+    doc.parse(out);
+    CHECK(doc.root()["b"][2].getString() == "x\"y\n\x01");
+}
+
+static void cbor_rfc8949_vectors() {
+    // Appendix A of RFC 8949
+    struct { const char* hex; int64_t n; } ints[] = {
+        {"00", 0}, {"01", 1}, {"17", 23}, {"1818", 24}, {"1903e8", 1000}, {"1a000f4240", 1000000},
+        {"1b000000e8d4a51000", 1000000000000}, {"20", -1}, {"3863", -100}, {"3903e7", -1000},
+    };
+    for (auto& v : ints) {
+        cbor::Document doc;
+        string data = unhex(v.hex);
+        doc.parse(data);
+        CHECK(doc.root().isInt() && (doc.root().getInt() == v.n));
+        std::pmr::string out;
+        cbor::Writer(out).value(v.n);
+        CHECK(hex(out) == v.hex); // shortest form
+    }
+    struct { const char* hex; double d; } doubles[] = {
+        {"f93e00", 1.5}, {"f97bff", 65504.0}, {"fa47c35000", 100000.0}, {"fb3ff199999999999a", 1.1}, {"fbc010666666666666", -4.1},
+        {"f90001", 5.960464477539063e-8}, {"1bffffffffffffffff", 18446744073709551615.0},
+    };
+    for (auto& v : doubles) {
+        cbor::Document doc;
+        string data = unhex(v.hex);
+        doc.parse(data);
+        CHECK(!doc.root().isInt() && (doc.root().getDouble() == v.d));
+    }
+    cbor::Document doc;
+    string data = unhex("a26161016162820203"); // {"a": 1, "b": [2, 3]}
+    doc.parse(data);
+    CHECK((doc.root().size() == 2) && (doc.root()["a"].getInt() == 1) && (doc.root()["b"][1].getInt() == 3));
+    data = unhex("bf61610161629f0203ffff"); // {_ "a": 1, "b": [_ 2, 3]}
+    doc.parse(data);
+    CHECK((doc.root().size() == 2) && (doc.root()["b"].size() == 2) && (doc.root()["b"][0].getInt() == 2));
+    data = unhex("7f657374726561646d696e67ff"); // (_ "strea", "ming")
+    doc.parse(data);
+    CHECK(doc.root().getString() == "streaming");
+    data = unhex("c074323031332d30332d32315432303a30343a30305a"); // 0("2013-03-21T20:04:00Z")
+    doc.parse(data);
+    CHECK(doc.root().getString() == "2013-03-21T20:04:00Z");
+    data = unhex("83f4f5f6"); // [false, true, null]
+    doc.parse(data);
+    CHECK(!doc.root()[0].getBool() && doc.root()[1].getBool() && doc.root()[2].isNull());
+    CHECK_THROWS(doc.root()[0].getInt(), cbor::Error);
+}
+
+static void cbor_malformed() {
+    auto bad = [](string_view h) { return rejected<cbor::Document, cbor::Error>(unhex(h)); };
+    CHECK(bad("") && bad("18") && bad("1a0000") && bad("ff") && bad("81") && bad("a101"));
+    CHECK(bad("0101"));         // data after the item
+    CHECK(bad("1c"));           // reserved additional information
+    CHECK(bad("5f01ff"));       // chunk of another type in an indefinite string
+    CHECK(bad("9f01"));         // missing break
+    CHECK(bad("6461"));         // string longer than the data
+    CHECK(bad(string(2200, '8') + "1")); // nesting deeper than the limit
+}
+
+static void cbor_writer_and_transcode() {
+    std::pmr::string out;
+    size_t length = 0;
+    cbor::Writer w(out, &length);
+    w.beginObject().key("id").value(-7).key("tags").beginArray().value("x").value(2.5).null().endArray()
+     .key("raw").bytes("\x01\x02").key("ok").value(false).endObject();
+    CHECK(length == out.size());
+    cbor::Document doc;
+    doc.parse(out);
+    cbor::Value root = doc.root();
+    CHECK((root["id"].getInt() == -7) && (root["tags"][0].getString() == "x") && (root["tags"][1].getDouble() == 2.5));
+    CHECK(root["tags"][2].isNull() && (root["raw"].getString() == "\x01\x02") && !root["ok"].getBool());
+    // JSON -> CBOR -> JSON keeps the value
+    string text = R"({"a":[1,-2,3.5,"sé",true,null],"b":{"c":{}},"d":[]})";
+    json::Document json_doc;
+    json_doc.parse(text);
+    std::pmr::string encoded;
+    cbor::Writer to_cbor(encoded);
+    cbor::transcode(to_cbor, json_doc.root());
+    cbor::Document cbor_doc;
+    cbor_doc.parse(encoded);
+    std::pmr::string decoded;
+    json::Writer to_json(decoded);
+    cbor::transcode(to_json, cbor_doc.root());
+    CHECK(decoded == R"({"a":[1,-2,3.5,"s)" "\xc3\xa9" R"(",true,null],"b":{"c":{}},"d":[]})");
+}
+
+static void negotiation() {
+    CHECK(http::negotiateFormat("") == http::Format::Json);
+    CHECK(http::negotiateFormat("*/*") == http::Format::Json);
+    CHECK(http::negotiateFormat("application/cbor") == http::Format::Cbor);
+    CHECK(http::negotiateFormat("application/json, application/cbor") == http::Format::Cbor);
+    CHECK(http::negotiateFormat("application/json, application/cbor;q=0.5") == http::Format::Json);
+    CHECK(http::negotiateFormat("application/cbor;q=0.8, */*;q=0.5") == http::Format::Cbor);
+    CHECK(http::negotiateFormat("application/cbor;q=0") == http::Format::Json);
+    // Response::writeBody follows the Accept header of the request
+    http::Request req;
+    req.parseHead("GET / HTTP/1.1\r\nAccept: application/cbor\r\n\r\n");
+    http::Response res;
+    http::BodyWriter body = res.writeBody(req);
+    body.beginArray().value(1).endArray();
+    CHECK((body.format() == http::Format::Cbor) && res.is_cbor && (res.cbor()[0].getInt() == 1));
+}
+
+int main() {
+    RUN(request_head);
+    RUN(request_in_arena);
+    RUN(response_round_trip);
+    RUN(json_values);
+    RUN(json_invalid);
+    RUN(json_utf8);
+    RUN(json_writer);
+    RUN(cbor_rfc8949_vectors);
+    RUN(cbor_malformed);
+    RUN(cbor_writer_and_transcode);
+    RUN(negotiation);
+    return check::result();
+}
@@ -0,0 +1,62 @@
+// Sampling profiler: folded stacks of busy threads, one profile at a time.
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "profiler.h"
+
+using namespace std;
+
+#if defined(__linux__)
+
+static atomic<bool> spinning{true};
+
+static void spin() {
+    volatile uint64_t n = 0;
+    while (spinning.load(memory_order_relaxed)) n = n + 1;
+}
+
+static void folded_stacks() {
+    spinning = true;
+    vector<thread> threads;
+    for (int i = 0; i < 2; i++) threads.emplace_back(spin);
+    thread second([&] {
+        // started while the first profile runs
+        this_thread::sleep_for(chrono::milliseconds(300));
+        CHECK_THROWS(Profiler::getInstance().profile(chrono::seconds(1)), ProfilerBusy);
+    });
+    string folded = Profiler::getInstance().profile(chrono::seconds(1), 250);
+    second.join();
+    spinning = false;
+    for (auto& t : threads) t.join();
+    // "frame;frame;frame count" per line
+    size_t lines = 0, samples = 0;
+    bool formatted = true;
+    for (size_t start = 0, end; (end = folded.find('\n', start)) != string::npos; start = end + 1) {
+        string line = folded.substr(start, end - start);
+        size_t space = line.rfind(' ');
+        formatted = formatted && (space != string::npos) && (space > 0) && (line.find_first_not_of("0123456789", space + 1) == string::npos);
+        if (formatted) samples += stoull(line.substr(space + 1));
+        lines++;
+    }
+    CHECK(formatted && (lines > 0) && (samples > 10));
+    // the profiler can run again
+    spinning = true;
+    thread busy(spin);
+    CHECK(!Profiler::getInstance().profile(chrono::seconds(1), 250).empty());
+    spinning = false;
+    busy.join();
+}
+
+#endif
+
+int main() {
+#if defined(__linux__)
+    RUN(folded_stacks);
+#endif
+    return check::result();
+}
@@ -0,0 +1,172 @@
+// Lock-free queues of the thread pool (Chase-Lev deque, bounded MPMC inbox, the worker queue
+// combining them) and the thread pools built on them: no task is lost or run twice.
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+#define ITEMS 200000
+#define THIEVES 3
+
+static void deque_order() {
+    dp::chase_lev_deque<int> deque(4);
+    CHECK(deque.empty());
+    for (int i = 0; i < 100; i++) deque.push(int(i)); // grows past the initial capacity
+    CHECK(deque.steal() == 0); // thieves take the oldest
+    CHECK(deque.pop() == 99);  // the owner the newest
+    int expected = 98;
+    bool ordered = true;
+    while (auto v = deque.pop()) ordered = ordered && (*v == expected--);
+    CHECK(ordered && (expected == 0));
+    CHECK(deque.empty() && !deque.steal() && !deque.pop());
+}
+
+static void deque_concurrent_steals() {
+    // the owner pushes and pops while thieves steal: every item is taken exactly once
+    dp::chase_lev_deque<int> deque(64);
+    vector<atomic<int>> taken(ITEMS);
+    atomic<bool> done{false};
+    vector<thread> thieves;
+    for (int t = 0; t < THIEVES; t++) {
+        thieves.emplace_back([&] {
+            while (!done.load(memory_order_acquire) || !deque.empty()) {
+                if (auto v = deque.steal()) taken[*v].fetch_add(1, memory_order_relaxed);
+            }
+        });
+    }
+    for (int i = 0; i < ITEMS; i++) {
+        deque.push(int(i));
+        if ((i % 3 == 0)) {
+            if (auto v = deque.pop()) taken[*v].fetch_add(1, memory_order_relaxed);
+        }
+    }
+    while (auto v = deque.pop()) taken[*v].fetch_add(1, memory_order_relaxed);
+    done.store(true, memory_order_release);
+    for (auto& t : thieves) t.join();
+    int wrong = 0;
+    for (auto& n : taken) wrong += (n.load() != 1);
+    CHECK(wrong == 0);
+}
+
+static void mpmc_bounded_fifo() {
+    dp::mpmc_queue<int> queue(8);
+    for (int i = 0; i < 8; i++) CHECK(queue.push(int(i)));
+    int extra = 8;
+    CHECK(!queue.push(std::move(extra))); // full
+    CHECK(extra == 8);                    // left untouched
+    for (int i = 0; i < 8; i++) CHECK(queue.pop() == i);
+    CHECK(!queue.pop() && queue.empty());
+}
+
+static void mpmc_concurrent() {
+    // 4 producers and 4 consumers on a small queue: every item is popped exactly once
+    dp::mpmc_queue<int> queue(256);
+    vector<atomic<int>> taken(ITEMS);
+    atomic<int> consumed{0};
+    vector<thread> threads;
+    for (int p = 0; p < 4; p++) {
+        threads.emplace_back([&, p] {
+            for (int i = p; i < ITEMS; i += 4) {
+                int v = i;
+                while (!queue.push(std::move(v))) this_thread::yield();
+            }
+        });
+    }
+    for (int c = 0; c < 4; c++) {
+        threads.emplace_back([&] {
+            while (consumed.load(memory_order_relaxed) < ITEMS) {
+                if (auto v = queue.pop()) {
+                    taken[*v].fetch_add(1, memory_order_relaxed);
+                    consumed.fetch_add(1, memory_order_relaxed);
+                }
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    int wrong = 0;
+    for (auto& n : taken) wrong += (n.load() != 1);
+    CHECK(wrong == 0);
+}
+
+static void worker_queue_overflow() {
+    // pushes from other threads go to the inbox, then to the overflow list when it is full
+    dp::work_stealing_queue<int> queue(16);
+    thread([&] {
+        for (int i = 0; i < 100; i++) queue.push_back(int(i));
+    }).join();
+    int count = 0;
+    bool ordered = true;
+    thread([&] {
+        queue.bind_owner();
+        while (auto v = queue.pop_front()) ordered = ordered && (*v == count++);
+    }).join();
+    CHECK(ordered && (count == 100) && queue.empty());
+}
+
+template <typename Pool>
+static void pool_runs_every_task(Pool& pool) {
+    atomic<int> done{0};
+    vector<future<int>> results;
+    for (int i = 0; i < 1000; i++) {
+        results.push_back(pool.enqueue([i, &done] { done.fetch_add(1); return i * 2; }));
+    }
+    bool right = true;
+    for (int i = 0; i < 1000; i++) right = right && (results[i].get() == i * 2);
+    CHECK(right && (done.load() == 1000));
+    // tasks enqueued by the workers themselves (local deques, stolen by the others)
+    atomic<int> nested{0};
+    for (int i = 0; i < 100; i++) {
+        pool.enqueue_detach([&] {
+            for (int j = 0; j < 10; j++) pool.enqueue_detach([&] { nested.fetch_add(1); });
+        });
+    }
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    while ((nested.load() < 1000) && (chrono::steady_clock::now() < deadline)) this_thread::yield();
+    CHECK(nested.load() == 1000);
+}
+
+static void lock_free_pool() {
+    dp::lock_free_thread_pool<> pool(4);
+    pool_runs_every_task(pool);
+}
+
+static void elastic_pool() {
+    dp::thread_pool<> pool(dp::elastic_size{1, 4, chrono::milliseconds(20), chrono::milliseconds(50)});
+    CHECK(pool.size() == 1);
+    // blocked tasks: the pool grows, one worker per grow_after
+    atomic<bool> release{false};
+    atomic<int> started{0};
+    for (int i = 0; i < 4; i++) {
+        pool.enqueue_detach([&] {
+            started.fetch_add(1);
+            while (!release.load()) this_thread::sleep_for(chrono::milliseconds(1));
+        });
+    }
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(5);
+    while ((started.load() < 4) && (chrono::steady_clock::now() < deadline)) this_thread::sleep_for(chrono::milliseconds(5));
+    CHECK((started.load() == 4) && (pool.size() == 4));
+    release.store(true);
+    // idle workers retire down to the minimum
+    deadline = chrono::steady_clock::now() + chrono::seconds(5);
+    while ((pool.size() > 1) && (chrono::steady_clock::now() < deadline)) this_thread::sleep_for(chrono::milliseconds(10));
+    CHECK(pool.size() == 1);
+    pool_runs_every_task(pool);
+}
+
+int main() {
+    RUN(deque_order);
+    RUN(deque_concurrent_steals);
+    RUN(mpmc_bounded_fifo);
+    RUN(mpmc_concurrent);
+    RUN(worker_queue_overflow);
+    RUN(lock_free_pool);
+    RUN(elastic_pool);
+    return check::result();
+}